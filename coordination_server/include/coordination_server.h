@@ -33,41 +33,33 @@
 #include "parser.h"
 #include "concurrentqueue.h"
 #include "socket_send.h"
-
-#include <ctpl.h>
-
-struct AlleleGT {
-  inline bool operator()(const std::string &a, const std::string &b) const {
-    // Months ago I wrote a sorter in python. I don't remember why it works (or if it's 100% correct?)
-    // but here is the C++ implementation. Not optimized in the slightest and horrible to read - enjoy!
-    std::vector<std::string> a_split;
-    std::vector<std::string> b_split;
-    std::vector<std::string> a_split2;
-    std::vector<std::string> b_split2;
-
-    Parser::split(a_split, a, ':');
-    Parser::split(b_split, b, ':');
-    int a_loci_1 = a_split[0] == "X" ? 24 : std::stoi(a_split[0]);
-    int b_loci_1 = b_split[0] == "X" ? 24 :std::stoi(b_split[0]);
-    Parser::split(a_split2, a_split[1], '\t');
-    Parser::split(b_split2, b_split[1], '\t');
-    std::string a_loci_2 = a_split2[0];
-    std::string b_loci_2 = b_split2[0];
-
-    if (a_loci_1 == b_loci_1) {
-      if (a_loci_2.length() != b_loci_2.length()) {
-        if (a_loci_2.length() < b_loci_2.length()) {
-          return false;
-        } else {
-          return true;
-        }
-      }
-      if (a_loci_2 > b_loci_2) {
-        return true;
-      }
-      return false;
+#include "reactor.h"
+
+// Output lines are sorted on the variant key of their leading "chrom:pos\talleles",
+// parsed once per line. Region results ("chrom:start-end\tname") sort by their start.
+struct OutputLine {
+  VariantKey key;
+  std::string line;
+
+  explicit OutputLine(const std::string& _line) : key(0), line(_line) {
+    size_t end_of_locus = line.find('\t');
+    size_t colon = line.find(':');
+    if (end_of_locus == std::string::npos || colon == std::string::npos || colon > end_of_locus) return;
+    size_t end_of_alleles = line.find('\t', end_of_locus + 1);
+    if (end_of_alleles == std::string::npos) end_of_alleles = line.length();
+    if (variant_key_parse(&line[0], &line[end_of_locus], &line[end_of_locus + 1], &line[end_of_alleles], &key)) return;
+    uint64_t chrom, start;
+    size_t end_of_start = line.find_first_not_of("0123456789", colon + 1);
+    if (variant_key_parse_locus(&line[0], &line[end_of_start], &chrom, &start)) {
+      key = variant_key_pack(chrom, start, 0);
     }
-    return a_loci_1 > b_loci_1;
+  }
+};
+
+struct OutputLineGT {
+  inline bool operator()(const OutputLine& a, const OutputLine& b) const {
+    if (a.key != b.key) return a.key > b.key;
+    return a.line > b.line;
   }
 };
 
@@ -92,11 +84,9 @@ class CoordinationServer {
 
     std::vector<bool> got_msg;
 
-    moodycamel::ConcurrentQueue<int> work_queue; 
-    ctpl::thread_pool t_pool;
     bool shutdown;
 
-    std::priority_queue<std::string, std::vector<std::string>, AlleleGT > sorted_file_queue;
+    std::priority_queue<OutputLine, std::vector<OutputLine>, OutputLineGT > sorted_file_queue;
 
     std::ofstream output_file;
 
@@ -114,8 +104,8 @@ class CoordinationServer {
     // send messages to the dpi
     int send_msg(const std::string& hostname, const int port, int mtype, const std::string& msg, int connFD=-1);
 
-    // start a thread that will handle a message and exit properly if it finds an error
-    void start_thread();
+    // handles one message the reactor read, false closes its connection
+    bool handle_body(int connFD, std::string& body);
 
     void debug_eof();
 
@@ -3,7 +3,6 @@
  */
 
 #include "coordination_server.h"
-#include "ctpl.h"
 
 std::mutex cout_lock;
 std::condition_variable work_queue_condition;
@@ -33,7 +32,6 @@ void CoordinationServer::init(const std::string& config_file) {
     eof_messages_received = 0;
     first = true;
     shutdown = false;
-    t_pool.resize(std::thread::hardware_concurrency());
     got_msg.resize(enclave_node_count);
     std::fill(got_msg.begin(), got_msg.end(), false);
 
@@ -43,148 +41,29 @@ void CoordinationServer::init(const std::string& config_file) {
 void CoordinationServer::run() {
     // set up the server to do nothing when it receives a broken pipe error
     //signal(SIGPIPE, signal_handler);
-    // create a master socket to listen for requests on
-    // (1) Create socket
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-    // (2) Set the "reuse port" socket option
-	int yesval = 1;
-	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yesval, sizeof(yesval));
-
-    // (3) Create a sockaddr_in struct for the proper port and bind() to it.
-	struct sockaddr_in addr;
-    socklen_t addrSize = sizeof(addr);
-    memset(&addr, 0, addrSize);
-
-    // specify socket family (Internet)
-	addr.sin_family = AF_INET;
-
-	// specify socket hostname
-	// The socket will be a server, so it will only be listening.
-	// Let the OS map it to the correct address.
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
-
-    // bind to our given port, or randomly get one if port = 0
-	if (bind(sockfd, (struct sockaddr*) &addr, addrSize) < 0) {
-        guarded_cout("bind failure: " + std::to_string(errno), cout_lock);
-    } 
-
-    // update our member variable to the port we just assigned
-    if (getsockname(sockfd, (struct sockaddr*) &addr, &addrSize) < 0) {
-        guarded_cout("getsockname failure: " + std::to_string(errno), cout_lock);
-    }
-
-    // (4) Begin listening for incoming connections.
-	if (listen(sockfd, 4096) < 0) {
-        guarded_cout("listen: " + std::to_string(errno), cout_lock);
-    }
-
-    port = ntohs(addr.sin_port);
+    Reactor reactor(std::thread::hardware_concurrency(),
+                    [this](int connFD, Frame& frame) {
+                        std::string body = frame.str();
+                        return handle_body(connFD, body);
+                    });
+    port = reactor.listen(port);
     guarded_cout("\n Running on port " + std::to_string(port), cout_lock);
-
-
-    // Make a thread pool to listen for connections!
-    // const uint32_t num_threads = 2 * std::thread::hardware_concurrency(); // Max # of threads the system supports
-    // for (uint32_t ii = 0; ii < num_threads; ++ii) {
-    //     std::thread pool_thread = std::thread(&CoordinationServer::start_thread_wrapper, this);
-    //     pool_thread.detach();
-    // }
-    
-
-    // (5) Serve incoming connections one by one forever (a lonely fate).
-	while (true) {
-        // accept connection from dpi
-        int connFD = accept(sockfd, (struct sockaddr*) &addr, &addrSize);
-        
-        work_queue.enqueue(connFD);
-        t_pool.push(
-            [&, this](int id){ this->start_thread(); }
-        );
-
-        // spin up a new thread to handle this message
-        // boost::thread msg_thread(&CoordinationServer::start_thread, this, connFD);
-        // msg_thread.detach();
-    }
+    reactor.run();
 }
 
-void CoordinationServer::start_thread() {
-    int connFD;
-    if (!work_queue.try_dequeue(connFD)) {
-        throw std::runtime_error("should be impossible? didn't find connFD");
-    }
-    char* body_buffer = new char[MAX_MESSAGE_SIZE]();
-    // if we catch any errors we will throw an error to catch and close the connection
-    try {
-        char header_buffer[128];
-        // receive header, byte by byte until we hit deliminating char
-        memset(header_buffer, 0, sizeof(header_buffer));
-
-        int header_size = 0;
-        bool found_delim = false;
-        while (header_size < 128) {
-            // Receive exactly one byte
-            int rval = recv(connFD, header_buffer + header_size, 1, MSG_WAITALL);
-            if (rval == -1) {
-                throw std::runtime_error("Socket recv failed\n");
-            } else if (rval == 0) {
-                return;
-            }
-            // Stop if we received a deliminating character
-            if (header_buffer[header_size] == '\n') {
-                found_delim = true;
-                break;
-            }
-            header_size++;
-        }
-        if (!found_delim) {
-            throw std::runtime_error("Didn't read in a null terminating char");
-        }
-        std::string header(header_buffer, header_size);
+bool CoordinationServer::handle_body(int connFD, std::string& body) {
+    std::vector<std::string> parsed_header;
+    Parser::split(parsed_header, body, ' ', 2);
 
-        if (header.find("GET / HTTP/1.1") != std::string::npos) {
-            std::cout << "Strange get request? Ignoring for now." << std::endl;
-            delete[] body_buffer;
-            return;
-        }
-
-        unsigned int body_size;
-        try {
-            body_size = std::stoi(header);
-        } catch(const std::invalid_argument& e) {
-            std::cout << "Failed to read in body size" << std::endl;
-            std::cout << header << std::endl;
-            return;
-        }
-        
-        if (body_size != 0) {
-            // read in encrypted body
-            int rval = recv(connFD, body_buffer, body_size, MSG_WAITALL);
-            if (rval == -1) {
-                throw std::runtime_error("Error reading request body");
-            }
-        }
-        std::string body(body_buffer, body_size);
-        std::vector<std::string> parsed_header;
-        Parser::split(parsed_header, body, ' ', 2);
-
-        CoordinationServerMessageType type = static_cast<CoordinationServerMessageType>(std::stoi(parsed_header[1]));
-        // if (type != CoordinationServerMessageType::EOF_OUTPUT && type != CoordinationServerMessageType::OUTPUT) {
-        //     cout_lock.lock();
-        //     std::cout << "ID/DPI: " << parsed_header[0] 
-        //               << " Msg Type: " << parsed_header[1] << "\n";
-        //     cout_lock.unlock();
-        // }
-        //guarded_cout("\nEncrypted body:\n" + parsed_header[2], cout_lock);
-        handle_message(connFD, type, parsed_header[2], parsed_header[0]);
-    }
-    catch (const std::runtime_error& e)  {
-        guarded_cout("Exception " + std::string(e.what()) + "\n", cout_lock);
-        close(connFD);
-        return;
-    }
-    delete[] body_buffer;
-    return;
+    CoordinationServerMessageType type = static_cast<CoordinationServerMessageType>(std::stoi(parsed_header[1]));
+    // if (type != CoordinationServerMessageType::EOF_OUTPUT && type != CoordinationServerMessageType::OUTPUT) {
+    //     cout_lock.lock();
+    //     std::cout << "ID/DPI: " << parsed_header[0] 
+    //               << " Msg Type: " << parsed_header[1] << "\n";
+    //     cout_lock.unlock();
+    // }
+    //guarded_cout("\nEncrypted body:\n" + parsed_header[2], cout_lock);
+    return handle_message(connFD, type, parsed_header[2], parsed_header[0]);
 }
 
 void CoordinationServer::debug_eof() {
@@ -311,13 +190,13 @@ bool CoordinationServer::handle_message(int connFD, CoordinationServerMessageTyp
                         std::vector<std::string> split;
                         Parser::split(split, tmp, '\n');
                         for (const std::string& tmp_split : split) {
-                            sorted_file_queue.push(tmp_split);
+                            sorted_file_queue.push(OutputLine(tmp_split));
                         }
                     }
                 }
 
                 while(!sorted_file_queue.empty()) {
-                    output_file << sorted_file_queue.top() << std::endl;
+                    output_file << sorted_file_queue.top().line << std::endl;
                     sorted_file_queue.pop();
                 }
 
@@ -347,12 +226,11 @@ bool CoordinationServer::handle_message(int connFD, CoordinationServerMessageTyp
         default:
             throw std::runtime_error("Not a valid response type");
     }
-    close(connFD);
-    return false;
+    // senders keep their connections for their next messages
+    return true;
 }
 
 int CoordinationServer::send_msg(const std::string& hostname, const int port, int mtype, const std::string& msg, int connFD) {
-    std::string message = "-1rs " + std::to_string(mtype) + " ";
-    message = std::to_string(message.length() + msg.length()) + "\n" + message + msg;
-    return send_message(hostname.c_str(), port, message.c_str(), message.length(), connFD);
+    std::string header = "-1rs " + std::to_string(mtype) + " ";
+    return send_message(hostname.c_str(), port, header, msg, connFD);
 }
\ No newline at end of file
@@ -23,6 +23,7 @@
 #include "buffer_size.h"
 #include "parser.h"
 #include "socket_send.h"
+#include "reactor.h"
 #include "output.h"
 #include "aes-crypto.h"
 #include "json.hpp"
@@ -40,6 +41,7 @@ struct Phenotype {
 
 struct EncryptionBlock {
   unsigned int line_num;
+  VariantKey key;
   std::string line;
 };
 
@@ -63,6 +65,11 @@ class DPI {
 
     std::string allele_file_name;
     bool cov_work_start;
+    // allele text of the non-SNVs in the allele file, their keys only hold a hash of it
+    VariantTable non_snv_table;
+
+    // reduction tree: every row goes to the single enclave node owning this dpi, -1 otherwise
+    std::atomic<int> owner_id;
 
     std::chrono::time_point<std::chrono::high_resolution_clock> start;
     std::vector<buffer_t> evidence_list;
@@ -79,6 +86,10 @@ class DPI {
     std::atomic<int> sync_count;
     std::atomic<int> work_distributed_count;
     std::mutex xval_file_lock;
+    // DATA batches each enclave node has room for, the sender waits at 0
+    std::vector<int> data_credits;
+    std::mutex credit_lock;
+    std::condition_variable credit_cv;
     std::condition_variable start_sender_cv;
     std::condition_variable sync_cv;
     std::condition_variable queue_cv;
@@ -99,10 +110,13 @@ class DPI {
     void send_msg(const unsigned int global_id, const unsigned int mtype, const std::string& msg, int connFD=-1);
     int send_msg(const std::string& hostname, unsigned int port, unsigned int mtype, const std::string& msg, int connFD=-1);
 
-    void start_thread_wrapper();
+    // handles one message the reactor read, false closes its connection
+    bool handle_body(int connFD, std::string& body);
 
-    // start a thread that will handle a message and exit properly if it finds an error
-    bool start_thread(int connFD);
+    // streams the rows for enclave node global_id once they are ready
+    void send_data(const unsigned int global_id);
+    // takes one DATA batch credit of enclave node global_id, waits until it grants one
+    void take_credit(const unsigned int global_id);
 
     void queue_helper(const int global_id, const int num_helpers);
 
@@ -1,8 +1,12 @@
 #include "dpi.h"
+#include "hashing.h"
 #include <boost/thread.hpp>
 
 std::mutex cout_lock;
 
+// B of y or covariant ciphertext per message, well under MAX_MESSAGE_SIZE
+#define PHENOTYPE_PART_SIZE (1 << 21)
+
 void custom_set_highest_priority(std::thread& th, unsigned int subtract) {               
   sched_param sch;
   sch.sched_priority = sched_get_priority_max(SCHED_FIFO) - subtract;                      
@@ -29,6 +33,8 @@ void DPI::init(const std::string& config_file) {
 
     allele_file_name = dpi_config["allele_file"];
 
+    owner_id = -1;
+
     auto info = dpi_config["coordination_server_info"];
     send_msg(info["hostname"], info["port"], CoordinationServerMessageType::DPI_REGISTER, dpi_hostname + "\t" + std::to_string(listen_port));
 
@@ -48,126 +54,29 @@ void DPI::init(const std::string& config_file) {
 void DPI::run() {
     // set up the server to do nothing when it receives a broken pipe error
     //signal(SIGPIPE, signal_handler);
-    // create a master socket to listen for requests on
-    // (1) Create socket
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-    // (2) Set the "reuse port" socket option
-	int yesval = 1;
-	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yesval, sizeof(yesval));
-
-    // (3) Create a sockaddr_in struct for the proper port and bind() to it.
-	struct sockaddr_in addr;
-    socklen_t addrSize = sizeof(addr);
-    memset(&addr, 0, addrSize);
-
-    // specify socket family (Internet)
-	addr.sin_family = AF_INET;
-
-	// specify socket hostname
-	// The socket will be a server, so it will only be listening.
-	// Let the OS map it to the correct address.
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(listen_port);
-
-    // bind to our given port, or randomly get one if port = 0
-	if (bind(sockfd, (struct sockaddr*) &addr, addrSize) < 0) {
-        guarded_cout("bind failure " + std::to_string(errno), cout_lock);
-    } 
-
-    // update our member variable to the port we just assigned
-    if (getsockname(sockfd, (struct sockaddr*) &addr, &addrSize) < 0) {
-        guarded_cout("getsockname failure: " + std::to_string(errno), cout_lock);
-    }
-
-    // (4) Begin listening for incoming connections.
-	if (listen(sockfd, 4096) < 0) {
-        guarded_cout("listen: " + std::to_string(errno), cout_lock);
-    }
-
-    listen_port = ntohs(addr.sin_port);
+    Reactor reactor(std::thread::hardware_concurrency(),
+                    [this](int connFD, Frame& frame) {
+                        std::string body = frame.str();
+                        return handle_body(connFD, body);
+                    });
+    listen_port = reactor.listen(listen_port);
     guarded_cout("\n Running on port " + std::to_string(listen_port), cout_lock);
-
-    // (5) Serve incoming connections one by one forever (a lonely fate).
-	while (true) {
-        // accept connection from dpi
-        int connFD = accept(sockfd, (struct sockaddr*) &addr, &addrSize);
-
-        // spin up a new thread to handle this message
-        std::thread msg_thread(&DPI::start_thread, this, connFD);
-        msg_thread.detach();
-    }
+    reactor.run();
 }
 
-bool DPI::start_thread(int connFD) {
-    char* body_buffer = new char[MAX_MESSAGE_SIZE]();
-    // if we catch any errors we will throw an error to catch and close the connection
+bool DPI::handle_body(int connFD, std::string& body) {
+    std::vector<std::string> parsed_header;
+    Parser::split(parsed_header, body, ' ', 2);
+
+    // guarded_cout("ID: " + parsed_header[0] + 
+    //              " Msg Type: " + parsed_header[1], cout_lock);
+    // guarded_cout("\nEncrypted body:\n" + parsed_header[2], cout_lock);
     try {
-        char header_buffer[128];
-        // receive header, byte by byte until we hit deliminating char
-        memset(header_buffer, 0, sizeof(header_buffer));
-
-        int header_size = 0;
-        bool found_delim = false;
-        while (header_size < 128) {
-            // Receive exactly one byte
-            int rval = recv(connFD, header_buffer + header_size, 1, MSG_WAITALL);
-            if (rval == -1) {
-                throw std::runtime_error("Socket recv failed\n");
-            } else if (rval == 0) {
-                return false;
-            }
-            // Stop if we received a deliminating character
-            if (header_buffer[header_size] == '\n') {
-                found_delim = true;
-                break;
-            }
-            header_size++;
-        }
-        if (!found_delim) {
-            throw std::runtime_error("Didn't read in a null terminating char");
-        }
-        std::string header(header_buffer, header_size);
-        if (header.find("GET / HTTP/1.1") != std::string::npos) {
-            std::cout << "Strange get request? Ignoring for now." << std::endl;
-            delete[] body_buffer;
-            return true;
-        }
-        unsigned int body_size;
-        try {
-            body_size = std::stoi(header);
-        } catch (const std::invalid_argument &e) {
-            std::cout << "Failed to read body size: " << header << std::endl;
-            return true;
-        }
-        
-        if (body_size != 0) {
-            // read in encrypted body
-            int rval = recv(connFD, body_buffer, body_size, MSG_WAITALL);
-            if (rval == -1) {
-                throw std::runtime_error("Error reading request body");
-            }
-        }
-        std::string body(body_buffer, body_size);
-        std::vector<std::string> parsed_header;
-        Parser::split(parsed_header, body, ' ', 2);
-
-        // guarded_cout("ID: " + parsed_header[0] + 
-        //              " Msg Type: " + parsed_header[1], cout_lock);
-        // guarded_cout("\nEncrypted body:\n" + parsed_header[2], cout_lock);
-        try {
-            handle_message(connFD, std::stoi(parsed_header[0]), static_cast<DPIMessageType>(std::stoi(parsed_header[1])), parsed_header[2]);
-        } catch (const std::invalid_argument &e) {
-            std::cout << "Failed parse header type \n" << header << std::endl;
-            return true;
-        }
-    }
-    catch (const std::runtime_error& e)  {
-        guarded_cout("Exception " + std::string(e.what()) + "\n", cout_lock);
-        close(connFD);
-        return false;
+        handle_message(connFD, std::stoi(parsed_header[0]), static_cast<DPIMessageType>(std::stoi(parsed_header[1])), parsed_header[2]);
+    } catch (const std::invalid_argument &e) {
+        std::cout << "Failed parse header type \n" << body.substr(0, 64) << std::endl;
     }
-    delete[] body_buffer;
+    // senders keep their connections for their next messages
     return true;
 }
 
@@ -203,6 +112,10 @@ void DPI::handle_message(int connFD, const unsigned int global_id, const DPIMess
             allele_queue_list.resize(num_enclave_nodes);
             encryption_queue_list.resize(num_enclave_nodes);
             evidence_list.resize(num_enclave_nodes);
+            {
+                std::lock_guard<std::mutex> raii(credit_lock);
+                data_credits.assign(num_enclave_nodes, 0);
+            }
             // Mutexes are not movable apparently :/
             std::vector<std::mutex> tmp(num_enclave_nodes);
             encryption_queue_lock_list.swap(tmp);
@@ -280,6 +193,7 @@ void DPI::handle_message(int connFD, const unsigned int global_id, const DPIMess
             break;
         }
         case Y_AND_COV:
+        case OWNER_Y_AND_COV:
         {
             std::vector<std::string> covariants;
             Parser::split(covariants, msg);
@@ -297,69 +211,35 @@ void DPI::handle_message(int connFD, const unsigned int global_id, const DPIMess
                 }
             }
             
-            if (static_cast<unsigned int>(++y_and_cov_count) == aes_encryptor_list.size()) {
+            // in a reduction tree only the enclave node owning this dpi asks for its data
+            if (mtype == OWNER_Y_AND_COV) {
+                owner_id = global_id;
+                fill_queue();
+            } else if (static_cast<unsigned int>(++y_and_cov_count) == aes_encryptor_list.size()) {
                 fill_queue();
             }
 
             break;
         }
         case DATA_REQUEST:
-        {   
-            // Wait until all data is ready to go!
-            std::mutex useless_lock;
-            std::unique_lock<std::mutex> useless_lock_wrapper(useless_lock);
-            while (static_cast<unsigned int>(filled_count) != allele_queue_list.size()) {
-                start_sender_cv.wait(useless_lock_wrapper);
-            }
-
-            ConnectionInfo info = enclave_node_info[global_id];
-            std::queue<std::string> *allele_queue = allele_queue_list[global_id];
-
-            int blocks_sent = 0;
-            std::string block;
-            std::string lengths;
-
-            std::string line;
-            std::string line_length;
-            int data_conn = -1;
-            while (!allele_queue->empty()) {
-                line = allele_queue->front();
-                allele_queue->pop();
-                line_length = "\t" + std::to_string(line.length());
-
-                // 30 is magic number for extra padding
-                int prospective_length = block.length() + line.length() + lengths.length() + line_length.length() + 30;
-                if ((prospective_length > (1 << 16) - 1) && block.length()) {
-                    // msg format: blocks sent \t lengths (tab delimited) \n (terminating char) blocks of data w no delimiters
-                    std::string block_msg = std::to_string(blocks_sent++) + lengths + "\n" + block;
-                    data_conn = send_msg(info.hostname, info.port, EnclaveNodeMessageType::DATA, block_msg, data_conn);
-
-                    // Reset block
-                    block.clear(); 
-                    lengths.clear();
-                }
-                block += line;
-                lengths += line_length;
-            }
-            // TODO: Re-evaluate why I compare it to 10? at some point this made a lot of sense to me, not it makes none
-            // Send the leftover lines, 10 is an arbitary cut off. I assume most lines will be at least a few hundred characters
-            // and we won't be sending more than 10^10 blocks
-            if (block.length() > 10) {
-                // msg format: blocks sent \t lengths (tab delimited) \n (terminating char) blocks of data w no delimiters
-                std::string block_msg = std::to_string(blocks_sent++) + lengths + "\n" + block;
-                send_msg(info.hostname, info.port, DATA, block_msg);
+        {
+            // the request carries the batches the enclave node can take before it grants more
+            {
+                std::lock_guard<std::mutex> raii(credit_lock);
+                data_credits[global_id] += std::stoi(msg);
             }
-            // If get_block failed we have reached the end of the file, send an EOF.
-            send_msg(global_id, EOF_DATA, std::to_string(blocks_sent));
-
-
-            if (global_id == 0) {
-                std::cout << "Sending last message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << std::endl;
-
-                auto stop = std::chrono::high_resolution_clock::now();
-                auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-                std::cout << "Data send time total: " << duration.count() << std::endl;
+            // streaming this enclave node its rows takes until the end of the run, not a worker
+            std::thread sender_thread(&DPI::send_data, this, global_id);
+            sender_thread.detach();
+            break;
+        }
+        case DATA_CREDIT:
+        {
+            {
+                std::lock_guard<std::mutex> raii(credit_lock);
+                data_credits[global_id] += std::stoi(msg);
             }
+            credit_cv.notify_all();
             break;
         }
         case DPI_SYNC: 
@@ -378,22 +258,87 @@ void DPI::handle_message(int connFD, const unsigned int global_id, const DPIMess
         default:
             throw std::runtime_error("Not a valid response type");
     }
-    if (mtype != DATA_REQUEST) {
-        close(connFD);
+}
+
+void DPI::send_data(const unsigned int global_id) {
+    // Wait until all data is ready to go!
+    std::mutex useless_lock;
+    std::unique_lock<std::mutex> useless_lock_wrapper(useless_lock);
+    while (static_cast<unsigned int>(filled_count) != allele_queue_list.size()) {
+        start_sender_cv.wait(useless_lock_wrapper);
+    }
+
+    ConnectionInfo info = enclave_node_info[global_id];
+    std::queue<std::string> *allele_queue = allele_queue_list[global_id];
+
+    int blocks_sent = 0;
+    std::string block;
+    std::string lengths;
+
+    std::string line;
+    std::string line_length;
+    // the rows stream on a connection of their own, in order, while other messages use the pool
+    int data_conn = open_connection(info.hostname.c_str(), info.port);
+    while (!allele_queue->empty()) {
+        line = allele_queue->front();
+        allele_queue->pop();
+        line_length = "\t" + std::to_string(line.length());
+
+        // 30 is magic number for extra padding
+        int prospective_length = block.length() + line.length() + lengths.length() + line_length.length() + 30;
+        if ((prospective_length > (1 << 16) - 1) && block.length()) {
+            // msg format: blocks sent \t lengths (tab delimited) \n (terminating char) blocks of data w no delimiters
+            std::string block_msg = std::to_string(blocks_sent++) + lengths + "\n" + block;
+            take_credit(global_id);
+            send_msg(info.hostname, info.port, EnclaveNodeMessageType::DATA, block_msg, data_conn);
+
+            // Reset block
+            block.clear(); 
+            lengths.clear();
+        }
+        block += line;
+        lengths += line_length;
+    }
+    // TODO: Re-evaluate why I compare it to 10? at some point this made a lot of sense to me, not it makes none
+    // Send the leftover lines, 10 is an arbitary cut off. I assume most lines will be at least a few hundred characters
+    // and we won't be sending more than 10^10 blocks
+    if (block.length() > 10) {
+        // msg format: blocks sent \t lengths (tab delimited) \n (terminating char) blocks of data w no delimiters
+        std::string block_msg = std::to_string(blocks_sent++) + lengths + "\n" + block;
+        take_credit(global_id);
+        send_msg(info.hostname, info.port, DATA, block_msg, data_conn);
     }
+    // If get_block failed we have reached the end of the file, send an EOF.
+    // It takes a slot of the enclave node's reorder window like a batch
+    take_credit(global_id);
+    send_msg(global_id, EOF_DATA, std::to_string(blocks_sent), data_conn);
+    close(data_conn);
+
+
+    if (global_id == 0) {
+        std::cout << "Sending last message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << std::endl;
+
+        auto stop = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+        std::cout << "Data send time total: " << duration.count() << std::endl;
+    }
+}
+
+void DPI::take_credit(const unsigned int global_id) {
+    std::unique_lock<std::mutex> raii(credit_lock);
+    credit_cv.wait(raii, [this, global_id] { return data_credits[global_id] > 0; });
+    data_credits[global_id]--;
 }
 
 void DPI::send_msg(const unsigned int global_id, const unsigned int mtype, const std::string& msg, int connFD) {
-    std::string message = dpi_name + " " + std::to_string(mtype) + " ";
-    message = std::to_string(message.length() + msg.length()) + "\n" + message + msg;
+    std::string header = dpi_name + " " + std::to_string(mtype) + " ";
     ConnectionInfo info = enclave_node_info[global_id];
-    send_message(info.hostname.c_str(), info.port, message.data(), message.length(), connFD);
+    send_message(info.hostname.c_str(), info.port, header, msg, connFD);
 }
 
 int DPI::send_msg(const std::string& hostname, unsigned int port, unsigned int mtype, const std::string& msg, int connFD) {
-    std::string message = dpi_name + " " + std::to_string(mtype) + " ";
-    message = std::to_string(message.length() + msg.length()) + "\n" + message + msg;
-    return send_message(hostname.c_str(), port, message.data(), message.length(), connFD);
+    std::string header = dpi_name + " " + std::to_string(mtype) + " ";
+    return send_message(hostname.c_str(), port, header, msg, connFD);
 }
 
 void DPI::queue_helper(const int global_id, const int num_helpers) {
@@ -426,8 +371,9 @@ void DPI::queue_helper(const int global_id, const int num_helpers) {
 
             EncryptionBlock *block = new EncryptionBlock();
             block->line_num = line_num++;
+            block->key = Parser::parse_variant_key(line, non_snv_table);
             block->line = line;
-            unsigned int enclave_node_hash = Parser::parse_hash(block->line, aes_encryptor_list.size());
+            unsigned int enclave_node_hash = owner_id >= 0 ? owner_id.load() : hash_key(block->key, aes_encryptor_list.size(), false);
             encryption_queue_lock_list[enclave_node_hash].lock(); 
             encryption_queue_list[enclave_node_hash].push(block);
             encryption_queue_lock_list[enclave_node_hash].unlock();
@@ -466,9 +412,11 @@ void DPI::queue_helper(const int global_id, const int num_helpers) {
         EncryptionBlock *block = encryption_queue_list[global_id].top();
         encryption_queue_list[global_id].pop();
         line = block->line;
+        VariantKey key = block->key;
         delete block;
 
         Parser::parse_allele_line(line, 
+                                  key,
                                   vals, 
                                   compressed_vals, 
                                   aes_encryptor_list, 
@@ -513,10 +461,8 @@ void DPI::queue_helper(const int global_id, const int num_helpers) {
         //  std::this_thread::sleep_for(std::chrono::milliseconds(rand() % 10000));
         // Ok so this machine is finished, but we need to sync with the other dpis to help with timing accuracy
         for (ConnectionInfo info : dpi_info) {
-            std::string msg = "";
-            std::string message = "-2 " + std::to_string(DPIMessageType::DPI_SYNC) + " ";
-            message = std::to_string(message.length() + msg.length()) + "\n" + message + msg;
-            send_message(info.hostname.c_str(), info.port, message.data(), message.length());
+            std::string header = "-2 " + std::to_string(DPIMessageType::DPI_SYNC) + " ";
+            send_message(info.hostname.c_str(), info.port, header, "");
         }
         
         while (static_cast<unsigned int>(sync_count) < dpi_info.size()) {
@@ -581,13 +527,17 @@ void DPI::prepare_tsv_file(unsigned int global_id, const std::string& filename,
     // Some things are read by all threads (y values, covariants, etc.) and therefore 
     // should use the same AES key across all threads - we just thread id 0.
     data = aes_encryptor_list[global_id].front().encrypt_line((byte *)&data[0], data.length());
-    if (mtype == COVARIANT) {
-        data = filename + " " + data;
-    }
 
-    Phenotype ptype;
-    ptype.message = data;
-    ptype.mtype = mtype;
-    phenotypes_list[global_id].push_back(ptype);
+    // large cohorts don't fit one message, each part is "offset total " and its bytes
+    for (size_t offset = 0; offset < data.length(); offset += PHENOTYPE_PART_SIZE) {
+        Phenotype ptype;
+        ptype.message = std::to_string(offset) + " " + std::to_string(data.length()) + " " +
+                        data.substr(offset, PHENOTYPE_PART_SIZE);
+        if (mtype == COVARIANT) {
+            ptype.message = filename + " " + ptype.message;
+        }
+        ptype.mtype = mtype;
+        phenotypes_list[global_id].push_back(ptype);
+    }
     tsv_file.close();
 }
@@ -16,18 +16,22 @@ The Makefile will copy that header to another location for the build process.
 
 #define ENCLAVE_SMALL_BUFFER_SIZE ENCLAVE_SMALL_BUFFER * 1024
 
+#define ENCLAVE_HEAP_PAGES 130720 // NumHeapPages of the signed enclave, settcs.py copies it into gwas_enc.conf
+#define ENCLAVE_PAGE_SIZE 4096
+
 #define RSA_PUB_KEY_SIZE 512
 
 #define MAX_EVIDENCE_SIZE 20000 // Picked based on vibes - I have no idea how big the evidence can be!
 
-#define TWO_BIT_INT_ARR_SIZE 4 // compressed two bit uint8_t array size (8 bits / 2 bits per value)
+#define REDUCTION_PARENT_LINK -1 // link id of a reduction node's parent, its children are 0 to children - 1
 
-#define MAX_LOCI_ALLELE_STR_SIZE 28
+#define TWO_BIT_INT_ARR_SIZE 4 // compressed two bit uint8_t array size (8 bits / 2 bits per value)
 
 #define EOFSeperator "~EOF~" // mark end of dataset
 
 enum EncAnalysis { linear_dummy, linear, logistic, linear_oblivious, logistic_oblivious };
 enum ImputePolicy { EPACTS, Hail };
+enum QCPolicy { NoQC, SkipFailed, FlagFailed };
 
 #endif
 
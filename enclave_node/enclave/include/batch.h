@@ -38,7 +38,7 @@ class Batch {
     Batch(size_t _row_size, EncAnalysis analysis_type, ImputePolicy impute_policy, GWAS* _gwas, char *plaintxt_buffer, const std::vector<int>& sizes, int thread_id);
     ~Batch() { 
         delete row; 
-        delete plaintxt;
+        delete [] plaintxt;
     }
 
     /* status */
@@ -48,9 +48,13 @@ class Batch {
     char* load_plaintxt() { return plaintxt; }
     const char *output_buffer() { return outtxt; }
     size_t *plaintxt_size() { return &txt_size; }
+    // swap in a decrypted batch, returns the previous text buffer
+    char* exchange_plaintxt(char* txt, size_t size);
     void reset();
     Row* get_row(Buffer* buffer);  // return nullptr is reached ead of batch
+    // lines of text, as a RESULT_TEXT record
     void write(const std::string &);
+    void write(const ResultRecord& result);
 
     size_t get_out_tail();
 };
@@ -0,0 +1,49 @@
+#ifndef BATCH_TUNER_H
+#define BATCH_TUNER_H
+/* Picks how many lines an enclave thread takes per batch. A thread that runs out of rows
+   leaves the enclave to wait on the host, so a batch should keep it busy long enough for
+   that OCALL round trip to stay under BATCH_TUNE_OVERHEAD of the batch's time, and no
+   longer: small batches keep the threads evenly loaded so they finish together.
+   Both costs are measured while running, once every BATCH_TUNE_WINDOW batches since
+   reading the clock is an OCALL as well. */
+
+#include <chrono>
+
+#define BATCH_TUNE_OVERHEAD 0.02
+#define BATCH_TUNE_WINDOW 16  // batches between measurements
+#define BATCH_TUNE_MIN_LINES 8
+
+class BatchTuner {
+   public:
+    typedef std::chrono::steady_clock Clock;
+
+   private:
+    int max_lines;  // what the batch buffers hold
+    int lines;
+    Clock::time_point window_start;
+    double waited_us;  // spent waiting on the host during the window, not fitting
+    int window_batches;
+    int window_rows;
+    double ocall_us;  // cheapest OCALL round trip seen
+    double row_us;
+
+    void measure_ocall();
+    void retune(double busy_us);
+
+   public:
+    BatchTuner() : max_lines(0), lines(0), waited_us(0), window_batches(0), window_rows(0),
+                   ocall_us(0), row_us(0) {}
+
+    // starts at the most lines the batch buffers hold until the first window is measured
+    void init(int _max_lines);
+    int get_lines() const { return lines; }
+
+    // around the OCALL that blocks on the host for rows
+    Clock::time_point begin_wait() const { return Clock::now(); }
+    void end_wait(Clock::time_point start);
+
+    // a batch of num_lines was taken, true if the line count changed
+    bool add_batch(int num_lines);
+};
+
+#endif
@@ -4,7 +4,10 @@
 #include "enc_gwas.h"
 #include "crypto.h"
 #include "batch.h"
+#include "batch_ring.h"
+#include "batch_tuner.h"
 #include <fstream>
+#include <memory>
 
 #ifdef NON_OE
 #include "enclave_glue.h"
@@ -20,7 +23,9 @@ struct DPIInfo{
     size_t size;
 };
 
-void aes_decrypt_dpi(const unsigned char* crypto, unsigned char* plaintxt, const DPIInfo& dpi, const int thread_id);
+// decrypts one dpi's genotypes of the row with variant key key, encrypted under AES key key_id
+void aes_decrypt_dpi(const unsigned char* crypto, unsigned char* plaintxt, const DPIInfo& dpi,
+                     const int key_id, const VariantKey key);
 void two_bit_decompress(uint8_t* input, uint8_t* decompressed, unsigned int size);
 
 class Buffer {
@@ -28,31 +33,60 @@ class Buffer {
     size_t row_size;
     EncAnalysis analysis_type;
     size_t output_tail;
+    size_t batch_size;  // of crypttxt and the plaintext buffers, from the memory plan
 
     /* data member */
-    char* crypttxt;
-    uint8_t* plain_txt_compressed;
+    std::unique_ptr<char[]> crypttxt;
     char output_buffer[ENCLAVE_READ_BUFFER_SIZE];
     Batch* free_batch;
-    char* plaintxt_buffer;
+    char* plaintxt_buffer;  // owned by free_batch once there is one, the two swap with spare_plaintxt
     int* dpi_list;
     char** dpi_crypto_map;
     int dpi_count;
-    bool eof;
+
+    BatchRing* ring;
+    BatchTuner tuner;  // lines per pop
+    int max_lines;
+    // of each line popped into crypttxt, a line is never parsed past its own length
+    std::unique_ptr<uint32_t[]> line_lengths;
+    bool ring_eof;
+    // full output buffers are copied here and drained by the host, the thread only
+    // waits when the host has fallen a whole ring behind
+    BatchRing* output_ring;
+
+    /* the next batch is popped while the current one is fitted and decrypted
+       a line per fitted row, so its OCALL wait and AES work overlap the fits */
+    const std::vector<DPIInfo>* dpi_info;
+    char* spare_plaintxt;
+    size_t spare_size;
+    int spare_lines;  // lines popped into crypttxt, -1 at the end of the data
+    int spare_decrypted;
+    char* crypt_head;
 
     int thread_id;
 
+    // hands the output buffer to the host unless length more bytes fit
+    void reserve_output(const size_t length);
+    void flush_output();
     void output(const char* out, const size_t& length);
 
-    void decrypt_line(char* plaintxt, size_t* plaintxt_length, unsigned int num_lines, const std::vector<DPIInfo>& dpi_info_list, const int thread_id);
+    // pops the next batch into crypttxt without waiting, true if it got lines or the end of the data
+    bool fetch();
+    void decrypt_line();
 
 public:
-    Buffer(size_t _row_size, EncAnalysis type, int num_dpis, int thread_id);
+    Buffer(size_t _row_size, EncAnalysis type, int num_dpis, int thread_id, size_t _batch_size);
     ~Buffer();
     void add_gwas(GWAS* _gwas, ImputePolicy impute_policy, const std::vector<int>& sizes);
     void finish();
+    // lines of text, as a RESULT_TEXT record
+    void write(const std::string& out);
+    void write(const ResultRecord& result);
     void clean_up();
-    void mark_eof();
+    void set_batch_ring(BatchRing* _ring, int _max_lines);
+    void set_output_ring(BatchRing* _output_ring);
+    // called for every row of the current batch
+    void decrypt_ahead();
 
     Batch* launch(std::vector<DPIInfo>& dpi_info_list, const int thread_id);  // return nullptr if there is no free batches
 };
@@ -0,0 +1,85 @@
+#ifndef CONDITIONAL_H
+#define CONDITIONAL_H
+/* Conditional linear analysis: re-score a region with lead variants folded into
+   the covariate projection instead of re-running the GWAS with extra covariates */
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "enc_gwas.h"
+#include "variant_key.h"
+
+// A row from the region that arrived before every conditioning row was seen.
+struct PendingRow {
+    VariantKey key;
+    std::vector<uint8_t> data;
+};
+
+class ConditionalProjection {
+    /* region: every condition locus +/- window on a single chromosome */
+    std::vector<Loci> condition_loci;
+    int window;
+    int chrom;
+    int region_start;
+    int region_end;
+
+    int n;
+    int num_covariates;  // covariate columns of phenotype_and_covars (column 0 is y)
+    int num_threads;
+    GWAS* gwas;
+
+    /* conditioning genotypes, n x condition_loci.size(), filled as rows arrive */
+    std::vector<double> Z;
+    std::vector<bool> condition_seen;
+    int conditions_found;
+
+    /* projection over W = [covariates, Z] */
+    std::vector<std::vector<double> > WTW_inv;
+    std::vector<double> WTy;
+    double yTy;
+    int p;  // columns of W actually used
+    std::vector<int> z_columns;  // condition index for each W column past the covariates
+
+    std::mutex lock;
+    std::condition_variable ready_cv;
+    std::atomic<bool> ready;
+    int threads_finished;
+
+    void build_projection();
+    bool add_column(const std::vector<double>& w_col);
+
+   public:
+    ConditionalProjection() : window(0), n(0), num_threads(0), gwas(nullptr), conditions_found(0),
+                              p(0), ready(false), threads_finished(0) {}
+
+    // condition_loci: tab delimited "chrom:pos" list
+    void init(const std::string& condition_loci_list, int _window);
+    void setup(GWAS* _gwas, int _num_threads);
+
+    bool enabled() const { return !condition_loci.empty(); }
+    bool is_ready() const { return ready; }
+    int dim() const { return p; }
+
+    bool in_region(const Loci& loci) const;
+
+    // store the row if it is a conditioning variant, returns true if it was
+    bool add_condition(const Loci& loci, const uint8_t* data, const std::vector<int>& dpi_lengths);
+
+    // beta, se and t of the genotype conditioned on covariates + conditioning variants
+    bool score(const uint8_t* data, const std::vector<int>& dpi_lengths,
+               std::vector<double>& g, std::vector<double>& WTg, double results[3]) const;
+
+    // called once per regression thread at EOF, waits until every conditioning
+    // row is in or all threads are done reading. Returns is_ready().
+    bool finish_thread();
+};
+
+// decode packed genotypes of every dpi into doubles, NA is replaced by the called average
+void decode_genotypes(const uint8_t* data, const std::vector<int>& dpi_lengths, double* out);
+
+extern ConditionalProjection conditional;
+
+#endif
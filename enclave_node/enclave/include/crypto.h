@@ -12,6 +12,7 @@
 #include <mbedtls/ctr_drbg.h>
 #include <mbedtls/entropy.h>
 #include <mbedtls/error.h>
+#include <mbedtls/gcm.h>
 #include <mbedtls/md.h>
 #include <mbedtls/pk.h>
 #include <mbedtls/pkcs5.h>
@@ -29,6 +30,7 @@
 #include "buffer_size.h"
 
 #include <iostream>
+#include <string>
 
 inline void TRACE_ENCLAVE(const char* str) {
     std::cout << str << std::endl;
@@ -39,7 +41,10 @@ static const oe_uuid_t sgx_remote_uuid = {OE_FORMAT_UUID_SGX_ECDSA};
 struct AESData {
     mbedtls_aes_context* aes_context;
     unsigned char aes_key[AES_KEY_LENGTH];
-    unsigned char aes_iv[AES_IV_LENGTH];
+    unsigned char aes_iv[AES_IV_LENGTH];  // chained through the setup lines
+    // genotype rows: IV is AES_k(row_iv_seed ^ variant key), see AESCrypto::encrypt_row
+    mbedtls_aes_context* row_iv_context;
+    unsigned char row_iv_seed[AES_IV_LENGTH];
 };
 
 struct buffer_t {
@@ -53,6 +58,19 @@ void aes_decrypt_data(mbedtls_aes_context* aes_context,
                       int input_size, 
                       unsigned char* output_data);
 
+// size bytes from the enclave's random source
+void random_bytes(uint8_t* out, size_t size);
+
+// Seal data to the enclave's product identity (AES-GCM with a key from the seal
+// key policy). The sealed blob is key info size | key info | iv | tag | ciphertext.
+bool seal_data(const uint8_t* data, size_t data_size, std::string& sealed);
+bool unseal_data(const uint8_t* sealed, size_t sealed_size, std::string& data);
+
+// Same blob layout under a key two enclaves agreed on, used on links between
+// enclave nodes where each machine's seal key would differ.
+bool link_seal_data(const uint8_t link_key[AES_KEY_LENGTH], const uint8_t* data, size_t data_size, std::string& sealed);
+bool link_unseal_data(const uint8_t link_key[AES_KEY_LENGTH], const uint8_t* sealed, size_t sealed_size, std::string& data);
+
 class RSACrypto {
     private:
       mbedtls_ctr_drbg_context m_ctr_drbg_context;
@@ -75,6 +93,27 @@ class RSACrypto {
             uint8_t* data,
             size_t* data_size);
 
+        /**
+         * encrypt encrypts the given data to another enclave's public key (PEM, as
+         * get_pub_key returns it). encrypted_data holds 256 B.
+         */
+        bool encrypt(
+            const uint8_t pub_key[RSA_PUB_KEY_SIZE],
+            const uint8_t* data,
+            size_t data_size,
+            uint8_t* encrypted_data,
+            size_t* encrypted_data_size);
+
+        /**
+         * verify_peer_evidence checks that evidence comes from an enclave with the
+         * same identity as the one own_evidence was generated by, and that it vouches
+         * for pub_key.
+         */
+        bool verify_peer_evidence(
+            const buffer_t& own_evidence,
+            const buffer_t& evidence,
+            const uint8_t pub_key[RSA_PUB_KEY_SIZE]);
+
         /**
          * Compute the sha256 hash of given data.
          */
@@ -12,6 +12,8 @@
 
 #include "Matrix.h"
 #include "gwas.h"
+#include "result_record.h"
+#include "variant_key.h"
 /* provide Alleles & Loci */
 
 #define NA_byte 0xFF
@@ -22,6 +24,19 @@
 
 #define DOUBLE_CACHE_BLOCK (int)(64 / sizeof(double))
 
+// Decrypted batches are a sequence of row records, a RowHeader followed by the packed
+// genotypes of every dpi, padded so every record's genotypes start ROW_ALIGNMENT aligned
+#define ROW_ALIGNMENT 16
+
+struct RowHeader {
+    VariantKey key;
+    char padding[ROW_ALIGNMENT - sizeof(VariantKey)];
+};
+
+inline size_t row_record_size(int data_size) {
+    return (sizeof(RowHeader) + data_size + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+}
+
 inline int get_padded_buffer_len(int n) {
     return (((n % DOUBLE_CACHE_BLOCK) != 0) + (n / DOUBLE_CACHE_BLOCK)) * DOUBLE_CACHE_BLOCK * 4;
 }
@@ -45,6 +60,7 @@ bool read_entry_bool(std::string& entry);
 class Row {
     protected:
      /* meta data */
+     VariantKey key;
      Loci loci;
      Alleles alleles;
      int n;
@@ -58,9 +74,6 @@ class Row {
      double genotype_average;
      int it_count;
 
-     std::string loci_str;
-     std::string alleles_str;
-
      ImputePolicy impute_policy;
 
      bool impute_average;
@@ -88,21 +101,26 @@ class Row {
 
     public:
      /* return metadata */
+     VariantKey getkey() { return key; }
      Loci getloci() { return loci; }
      Alleles getalleles() { return alleles; }
      int size() { return n; }
+     const uint8_t* get_data() { return data; }
+     int get_data_size() { return read_row_len; }
+     const std::vector<int>& get_dpi_lengths() { return dpi_lengths; }
      virtual bool fit(int thread_id = -1, int max_iteration = 15, double sig = 1e-6) { std::cout << "WARNING: GENERIC FIT!?!" << std::endl; return false; }
      virtual double get_beta(int thread_id) { return -1; }
      virtual double get_t_stat(int thread_id) { return -1; }
      virtual double get_standard_error(int thread_id) { return -1; }
-     virtual void get_outputs(int thread_id, std::string& output_string) {};
+     // beta and se of the last fit, NA flagged in result if there is none
+     virtual void get_outputs(int thread_id, ResultRecord& result) {};
      int get_iterations() { return it_count; }
 
 
 
      /* setup */
      Row(int size, const std::vector<int>& sizes, int _num_dimensions, ImputePolicy _impute_policy);
-     int read(const char line[]); // return the size of line consumed
+     int read(const char record[]); // return the size of the record consumed
      void combine(Row *other);
      void append_invalid_elts(int size);
      void reset();
@@ -153,26 +171,44 @@ class Covar {
     friend class Lin_row;
     friend class Oblivious_lin_row;
     friend class Oblivious_log_row;
+    friend class ConditionalProjection;
+    friend class StatsStore;
+    friend class RegionTests;
     friend class GWAS;
-    std::vector< std::vector<double> > data;
+    friend class CovarReader;
+    // n x width, one allocation so large cohorts pay no per patient overhead
+    std::vector<double> data;
     int n;
-    int m;
-    int covar_idx;
-    std::string name_str;
+    int width;
 
    public:
-    Covar() : n(0), name_str("NA") { }
-    Covar(const char* input, int res_size = 0) { read(input, res_size); }
-    Covar(int _n, int _m) : n(_n), m(0), covar_idx(0) {data.resize(_n, std::vector<double>(_m));}
-    int read(const char* input, int res_size = 0);
-    void reserve(int total_row_size);
-    void init_1_covar(int total_row_size);
+    Covar() : n(0), width(0) { }
+    Covar(int _n, int _m) : data((size_t)_n * _m), n(_n), width(_m) {}
+    void init_1_covar(int column);
     int size() { return n; }
-    const std::string& name() { return name_str; }
-    void after_covar() {
-        m++;
-        covar_idx = 0;
-    }
+    // y then the covariates of patient i
+    const double* row(int i) const { return &data[(size_t)i * width]; }
+};
+
+/* Parses a dpi's text "name\tv1\tv2..." of one column into its patients, in chunks that
+   may split a value. Each reader owns its parse state, so readers of different columns
+   or dpis can fill the same Covar at once. */
+class CovarReader {
+    Covar& covar;
+    int column;
+    int next_row;
+    int end_row;
+    int values;
+    std::string token;
+    bool name_read;
+    void add_token();
+
+   public:
+    // res_size values expected, for the patients from first_row on
+    CovarReader(Covar& _covar, int _column, int first_row, int res_size);
+    void read_chunk(const char* chunk, size_t length);
+    // values read
+    int end_text();
 };
 
 
@@ -189,6 +225,13 @@ class GWAS {
 
     int dim() const { return m; }
     int size() const { return n; }
+
+    /* covariate products the linear rows start every fit from, dim x dim and dim long,
+       row and column 0 (the genotype's) are left 0. Filled once at setup. */
+    std::vector<double> XTX_og;
+    std::vector<double> XTY_og;
+    // adds patients [begin, end) to XTX and XTY, laid out as above
+    void add_gram(int begin, int end, double* XTX, double* XTY) const;
 #ifdef DEBUG
     void print() const;
 #endif
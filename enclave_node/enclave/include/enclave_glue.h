@@ -8,11 +8,16 @@
 #include <limits>
 
 /* ECALL */
+void setup_enclave_reduction(const int num_children, bool has_parent);
 void setup_enclave_encryption(const int num_threads);
+void setup_enclave_batch_ring(const int thread_id, void* ring, void* output_ring);
 void setup_num_patients();
+void setup_enclave_qc(enum QCPolicy qc_policy, double min_maf, double min_call_rate, double min_hwe_p);
+void setup_enclave_conditional(const char* condition_loci, const int window);
+void setup_enclave_stats(bool load_stats, bool export_stats);
+void setup_enclave_regions(const char* region_list);
 void setup_enclave_phenotypes(const int num_threads, enum EncAnalysis analysis_type, enum ImputePolicy impute_policy);
 void regression(const int thread_id, EncAnalysis analysis_type);
-void mark_eof_wrapper(const int thread_id);
 
 /* OCALLs */
 void start_timer(const char func_name[ENCLAVE_READ_BUFFER_SIZE]);
@@ -21,8 +26,6 @@ void stop_timer(const char func_name[ENCLAVE_READ_BUFFER_SIZE]);
 
 void setrsapubkey(uint8_t enc_rsa_pub_key[RSA_PUB_KEY_SIZE]);
 
-void setmaxbatchlines(int lines);
-
 void getdpinum(int* _retval);
 
 void get_num_patients(int* _retval, const int dpi_num, char num_patients_buffer[ENCLAVE_SMALL_BUFFER_SIZE]);
@@ -32,18 +35,29 @@ void getcovlist(char covlist[ENCLAVE_READ_BUFFER_SIZE]);
 void getaes(bool* _retval, const int dpi_num, const int thread_id,
                    unsigned char key[256], unsigned char iv[256]);
 
-void gety(int* _retval, const int dpi_num,
+void getreductionpeer(bool* _retval, const int link, uint8_t pub_key[RSA_PUB_KEY_SIZE],
+                      uint8_t evidence[MAX_EVIDENCE_SIZE], int* evidence_size);
+
+void sendreductionshare(const int link, unsigned char share[256]);
+
+void getreductionshare(bool* _retval, const int link, unsigned char share[256]);
+
+void gety(int* _retval, const int dpi_num, const int offset,
                  char y[ENCLAVE_READ_BUFFER_SIZE]);
 
 void getcov(int* _retval, const int dpi_num,
                    const char cov_name[MAX_DPINAME_LENGTH],
+                   const int offset,
                    char cov[ENCLAVE_READ_BUFFER_SIZE]);
 
-void getbatch(int* _retval, char batch[ENCLAVE_READ_BUFFER_SIZE],
-                     const int thread_id);
+void waitbatch(bool* _retval, const int thread_id);
+
+void readstats(int* _retval, uint8_t chunk[ENCLAVE_READ_BUFFER_SIZE]);
+
+void writestats(const uint8_t* chunk, const int size);
+
+void waitoutput(bool* _retval, const int thread_id, const int length);
 
-void writebatch(char buffer[ENCLAVE_READ_BUFFER_SIZE],
-                    const int buffer_size,
-                    const int thread_id);
+void signaloutput();
 
 #endif
\ No newline at end of file
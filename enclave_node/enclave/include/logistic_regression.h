@@ -28,7 +28,7 @@ class Log_row : public Row {
 
 
     void update_estimate();
-    inline void update_upperH_and_Grad(double y_est, double x, const std::vector<double>& patient_pnc);
+    inline void update_upperH_and_Grad(double y_est, double x, const double* patient_pnc);
     inline void update_Grad(double y_est, uint8_t x, int i);
     void init();
 
@@ -43,7 +43,7 @@ class Log_row : public Row {
     double get_beta(int thread_id);
     double get_t_stat(int thread_id);
     double get_standard_error(int thread_id);
-    void get_outputs(int thread_id, std::string& output_string);
+    void get_outputs(int thread_id, ResultRecord& result);
 };
 
 #endif
\ No newline at end of file
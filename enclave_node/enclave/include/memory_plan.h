@@ -0,0 +1,43 @@
+#ifndef MEMORY_PLAN_H
+#define MEMORY_PLAN_H
+/* Sizes the enclave's large allocations from the cohort before any of them is made.
+   The heap is fixed when the enclave is signed (ENCLAVE_HEAP_PAGES), so a cohort that
+   does not fit is reported up front with the heap it needs. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer_size.h"
+
+// left for what the plan does not size: setup buffers, conditioning and region
+// state shared by the threads, output strings, crypto contexts. A loaded stats store
+// is sized from its header against what the plan leaves of the heap, store_budget
+#define MEMORY_PLAN_HEADROOM (64 * 1024 * 1024)  // in B
+
+struct MemoryPlan {
+    size_t heap_size;       // 0 when the heap is not bounded (NON_OE)
+    size_t covariate_size;  // y and covariates, n x dim doubles
+    size_t scratch_size;    // per thread, regression state and n long vectors
+    size_t output_size;     // per thread, output buffers of the thread and its batch
+    size_t batch_size;      // per thread, each of the encrypted and two decrypted batch buffers
+    size_t total_size;
+    size_t store_budget;    // heap past total_size, SIZE_MAX when the heap is not bounded
+    // regression threads that help with setup, each with SETUP_SCRATCH_SIZE of buffers
+    // taken from where the batch buffers go once setup is done
+    int setup_workers;
+};
+
+#define SETUP_SCRATCH_SIZE (2 * ENCLAVE_READ_BUFFER_SIZE)
+
+/* n patients with dim columns of y and covariates. min_batch_size is the larger of an
+   encrypted line and a decrypted row record, thread_vectors the n long double vectors
+   each thread keeps. Batch buffers get ENCLAVE_READ_BUFFER_SIZE, less if the heap is
+   short but never less than one line. False if even that does not fit. */
+bool plan_memory(int n, int dim, int num_threads, size_t min_batch_size, int thread_vectors, MemoryPlan& plan);
+
+// NumHeapPages the plan needs
+size_t plan_heap_pages(const MemoryPlan& plan);
+
+void print_plan(const MemoryPlan& plan, int num_threads);
+
+#endif
@@ -38,7 +38,7 @@ class Oblivious_lin_row : public Row {
     // double get_beta(int thread_id);
     // double get_t_stat(int thread_id);
     // double get_standard_error(int thread_id);
-    void get_outputs(int thread_id, std::string& output_string);
+    void get_outputs(int thread_id, ResultRecord& result);
 
     int size() { return n; }
     /* reqires boost library. To avoid using boost:
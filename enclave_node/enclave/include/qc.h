@@ -0,0 +1,45 @@
+#ifndef QC_H
+#define QC_H
+/* Pre-regression quality control computed from packed genotype counts */
+
+#include <stdint.h>
+#include <vector>
+
+#include "buffer_size.h"
+#include "result_record.h"
+
+struct GenotypeCounts {
+    int hom_ref;
+    int het;
+    int hom_alt;
+    int missing;
+
+    int called() const { return hom_ref + het + hom_alt; }
+};
+
+// Count genotypes of a decrypted row. Each dpi's block holds ceil(length / 4)
+// bytes of 2 bit values, the trailing pairs of the last byte are ignored.
+void count_genotypes(const uint8_t* data, const std::vector<int>& dpi_lengths, GenotypeCounts& counts);
+
+// Exact HWE test (Wigginton et al. 2005), returns the p-value.
+double hwe_exact_p(int obs_het, int obs_hom1, int obs_hom2);
+
+class QCFilter {
+    QCPolicy policy;
+    double min_maf;
+    double min_call_rate;
+    double min_hwe_p;
+
+   public:
+    QCFilter() : policy(QCPolicy::NoQC), min_maf(0), min_call_rate(0), min_hwe_p(0) {}
+    QCFilter(QCPolicy _policy, double _min_maf, double _min_call_rate, double _min_hwe_p)
+        : policy(_policy), min_maf(_min_maf), min_call_rate(_min_call_rate), min_hwe_p(_min_hwe_p) {}
+
+    bool enabled() const { return policy != QCPolicy::NoQC; }
+    QCPolicy get_policy() const { return policy; }
+
+    // returns true if the row passes, otherwise reason is set to the first failed check
+    bool check(const uint8_t* data, const std::vector<int>& dpi_lengths, QCReason& reason) const;
+};
+
+#endif
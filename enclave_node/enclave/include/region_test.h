@@ -0,0 +1,92 @@
+#ifndef REGION_TEST_H
+#define REGION_TEST_H
+/* Gene/region aggregate tests (weighted burden and SKAT) for linear regression,
+   accumulated during the per-variant scan and reported when a region closes */
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "enc_gwas.h"
+
+// What a region keeps per variant, everything but the pairwise products
+// is computed by the thread that read the row.
+struct RegionVariant {
+    std::vector<uint8_t> data;  // packed genotypes, same layout as the row
+    std::vector<double> CTg;    // covariates^T g
+    double gr;                  // g^T r, r the null model residuals
+    double mu;                  // called average, used for missing genotypes
+    double weight;              // Beta(1, 25) density at the maf
+};
+
+struct Region {
+    int chrom;
+    int start;  // BED, 0 based half open
+    int end;
+    std::string name;
+    std::vector<RegionVariant> variants;
+    bool closed;
+};
+
+class RegionTests {
+    std::vector<Region> regions;  // sorted by chrom, start
+    std::vector<uint64_t> start_keys;
+    std::vector<uint64_t> max_end_before;  // largest end of regions[0..i]
+    std::vector<uint64_t> min_end_after;   // smallest end of regions[i..]
+
+    int n;
+    int q;  // covariate columns, column 0 of phenotype_and_covars is y
+    GWAS* gwas;
+    std::vector<double> CTC_inv;
+    std::vector<double> residuals;
+    double rTr;
+    double sigma2;
+
+    // last position read by each thread, regions ending before all of them are complete
+    std::unique_ptr<std::atomic<uint64_t>[]> thread_pos;
+    int num_threads;
+    std::atomic<uint64_t> next_close;  // smallest end of an open region
+    size_t first_open;
+    int late_variants;
+    std::mutex lock;
+
+    void close_regions(std::vector<int>& closed);
+
+   public:
+    RegionTests() : n(0), q(0), gwas(nullptr), rTr(0), sigma2(0), num_threads(0), next_close(0),
+                    first_open(0), late_variants(0) {}
+
+    // regions: newline delimited "chrom\tstart\tend\tname" in BED coordinates
+    void init(const std::string& region_list);
+    // fits the null model y ~ covariates
+    void setup(GWAS* _gwas, int _num_threads);
+
+    bool enabled() const { return !regions.empty(); }
+
+    // record that thread_id is at loci, appends the regions this completes to closed
+    void advance(int thread_id, const Loci& loci, std::vector<int>& closed);
+    // add a variant to every region covering it
+    void add(const Loci& loci, const uint8_t* data, const std::vector<int>& dpi_lengths, int data_size,
+             std::vector<double>& g);
+    // thread_id has no more rows
+    void finish_thread(int thread_id, std::vector<int>& closed);
+
+    // burden and SKAT results for a closed region, frees its variants
+    void output(int region_id, const std::vector<int>& dpi_lengths, std::string& output_string);
+};
+
+// joint counts of non reference genotype codes (1, 2, NA) of two packed rows
+void joint_genotype_counts(const uint8_t* a, const uint8_t* b, const std::vector<int>& dpi_lengths,
+                           uint32_t counts[3][3]);
+
+// P(X > x) for X ~ noncentral chi square(df, ncp)
+double noncentral_chisq_sf(double x, double df, double ncp);
+
+// SKAT p-value of Q, a mixture of chi2_1 whose weights have power sums c1..c4
+double liu_pvalue(double Q, double c1, double c2, double c3, double c4);
+
+extern RegionTests region_tests;
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef STATS_STORE_H
+#define STATS_STORE_H
+/* Additive sufficient statistics for linear regression. Every block is a sum over
+   samples, so the statistics of a union cohort are the sum of its cohorts'.
+   The same stores are streamed up a tree of enclave nodes in reduction mode,
+   where every node owns whole dpis and only the root reports results */
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "enc_gwas.h"
+
+#define STATS_STORE_ID_SIZE 16
+
+enum StatsChunkKind : uint8_t { STATS_CHUNK_HEADER, STATS_CHUNK_RECORDS };
+
+// A flag the enclave threads may set at the same time that is still copied with its record.
+struct SharedFlag {
+    std::atomic<bool> value;
+
+    SharedFlag() : value(false) {}
+    SharedFlag(const SharedFlag& other) : value(other.value.load(std::memory_order_relaxed)) {}
+    SharedFlag& operator=(const SharedFlag& other) {
+        value.store(other.value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
+    SharedFlag& operator=(bool set) {
+        value.store(set, std::memory_order_relaxed);
+        return *this;
+    }
+    operator bool() const { return value.load(std::memory_order_relaxed); }
+};
+
+// Per-variant sums over called (x) and missing samples, with c the covariates.
+// Mean imputation stays additive: an imputed sample adds mu, mu^2, mu * y, mu * c.
+struct StatsRecord {
+    uint32_t n_obs;
+    double sum_x;
+    double sum_xx;
+    double sum_xy;
+    double sum_miss_y;
+    std::vector<double> sum_xc;
+    std::vector<double> sum_miss_c;
+    SharedFlag merged;
+
+    void reset(int q);
+    void add(const StatsRecord& other);
+};
+
+// Sums that do not depend on the variant.
+struct StatsGlobal {
+    uint32_t n;
+    std::vector<double> CTC;  // q x q
+    std::vector<double> CTy;
+    std::vector<double> sum_c;
+    double yTy;
+    double sum_y;
+
+    void reset(int q);
+    void add(const StatsGlobal& other);
+};
+
+class StatsStore {
+    bool load_enabled;
+    bool export_enabled;
+
+    /* reduction mode: load one store per child node, export to the parent node, each link
+       sealed under the key its two enclaves agreed on */
+    bool reduction_enabled;
+    int num_inputs;
+    bool report;
+    std::vector<uint8_t> link_keys;  // AES_KEY_LENGTH B per child, then the parent's
+
+    GWAS* gwas;
+    int q;  // covariate columns, column 0 of phenotype_and_covars is y
+    int num_threads;
+    std::string covariate_list;
+
+    StatsGlobal new_block;  // this session's dpis
+    StatsGlobal old_block;  // loaded store
+    StatsGlobal union_block;
+    std::vector<double> CTC_inv;
+
+    std::unordered_map<std::string, StatsRecord> loaded;
+    std::vector<std::string> export_buffers;
+
+    /* every sealed chunk starts with its store's id and its index in the store. The header
+       is sealed last with the number of chunks and records, and the host hands it over
+       first, so it can't drop, repeat or mix chunks and the store is sized before loading */
+    uint8_t store_id[STATS_STORE_ID_SIZE];
+    std::atomic<uint32_t> next_chunk;
+    std::atomic<uint64_t> records_exported;
+    std::atomic<uint64_t> key_bytes_exported;
+    size_t memory_budget;  // of the heap the memory plan leaves for loaded
+
+    std::mutex lock;
+    int threads_finished;
+    int threads_flushed;
+
+    void serialize_global(const StatsGlobal& block, uint64_t num_records, uint64_t key_bytes,
+                          uint32_t num_chunks, std::string& out) const;
+    bool deserialize_global(const char* in, size_t size, StatsGlobal& block, uint64_t& num_records,
+                            uint64_t& key_bytes, uint32_t& num_chunks);
+    void serialize_record(const std::string& key, const StatsRecord& record, std::string& out) const;
+    size_t deserialize_record(const char* in, std::string& key, StatsRecord& record) const;
+    void all_missing(const StatsGlobal& block, StatsRecord& record) const;
+    void write_chunk(StatsChunkKind kind, const std::string& payload);
+    const uint8_t* link_key(int link) const;
+    // input is the child a reduction store comes from
+    bool open_chunk(const uint8_t* chunk, int chunk_size, int input, std::string& plain) const;
+    // fold a store into loaded, variants missing from either side get all missing sums
+    void merge_record(const std::string& key, const StatsRecord& record);
+    void finish_store(const StatsGlobal& block);
+    bool load();
+
+   public:
+    StatsStore() : load_enabled(false), export_enabled(false), reduction_enabled(false), num_inputs(1), report(true),
+                   gwas(nullptr), q(0), num_threads(0), next_chunk(0), records_exported(0), key_bytes_exported(0), memory_budget(SIZE_MAX),
+                   threads_finished(0), threads_flushed(0) {}
+
+    void init(bool _load, bool _export);
+    void init_reduction(int num_children, bool has_parent);
+    void set_link_key(int link, const uint8_t key[AES_KEY_LENGTH]);
+    // compute this session's global block and load the previous stores, failing if they need
+    // more than memory_budget B of heap (SIZE_MAX when the heap is not bounded)
+    void setup(GWAS* _gwas, int _num_threads, const std::string& _covariate_list, size_t _memory_budget);
+
+    bool enabled() const { return load_enabled || export_enabled || reduction_enabled; }
+    bool reduction() const { return reduction_enabled; }
+    int reduction_children() const { return num_inputs; }
+    bool reduction_has_parent() const { return export_enabled; }
+    // false on the inner nodes of a reduction, their sums are only partial
+    bool reports() const { return report; }
+
+    // sums over the dpis of this session
+    void compute(const uint8_t* data, const std::vector<int>& dpi_lengths, StatsRecord& record) const;
+    // add the loaded cohort's contribution, all missing if the variant was not in the store
+    void merge_loaded(const std::string& key, StatsRecord& record);
+    // beta, se and t on the union cohort
+    bool solve(const StatsRecord& record, double results[3]) const;
+
+    void append(int thread_id, const std::string& key, const StatsRecord& record);
+    // every thread's last call, the last one seals the store's header
+    void flush(int thread_id);
+
+    // returns true for the last thread, which also gets every loaded variant this
+    // session never saw, merged with an all missing contribution from the new dpis
+    bool finish_thread(std::vector<std::pair<std::string, StatsRecord> >& unmatched);
+};
+
+extern StatsStore stats_store;
+
+#endif
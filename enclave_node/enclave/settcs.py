@@ -1,12 +1,19 @@
 #!/usr/bin/python
 import multiprocessing
+import re
 import shutil
 import os
 
+# the enclave's memory planner budgets against the heap size in buffer_size.h
+with open('buffer_size.h', 'r') as fsize:
+    heap_pages = re.search(r'#define ENCLAVE_HEAP_PAGES (\d+)', fsize.read()).group(1)
+
 with open('gwas_enc.conf', 'r') as fread, open('gwas_enc.conf.temp', 'w') as fwrite:
     for line in fread:
         if 'NumTCS' in line:
             line = 'NumTCS=' + str(2 + multiprocessing.cpu_count()) + '\n'
+        if 'NumHeapPages' in line:
+            line = 'NumHeapPages=' + heap_pages + '\n'
         fwrite.write(line)
 
 shutil.copyfile('gwas_enc.conf.temp', 'gwas_enc.conf')
@@ -44,6 +44,14 @@ void Batch::reset() {
     out_tail = 0;
 }
 
+char* Batch::exchange_plaintxt(char* txt, size_t size) {
+    char* old = plaintxt;
+    plaintxt = txt;
+    txt_size = size;
+    batch_head = 0;
+    return old;
+}
+
 Row* Batch::get_row(Buffer* buffer) {
     if (batch_head >= txt_size) {
         st = Finished;
@@ -57,6 +65,7 @@ Row* Batch::get_row(Buffer* buffer) {
     //row->reset();
     int res = row->read(plaintxt + batch_head);
     batch_head = batch_head + res;
+    buffer->decrypt_ahead();
 // #ifdef DEBUG
 //     row->print();
 // #endif
@@ -64,10 +73,16 @@ Row* Batch::get_row(Buffer* buffer) {
 }
 
 void Batch::write(const std::string& output) {
-    strcpy(outtxt + out_tail, output.c_str());
+    write(text_result(output.size()));
+    memcpy(outtxt + out_tail, output.data(), output.size());
     out_tail += output.size();
 }
 
+void Batch::write(const ResultRecord& result) {
+    memcpy(outtxt + out_tail, &result, sizeof(ResultRecord));
+    out_tail += sizeof(ResultRecord);
+}
+
 size_t Batch::get_out_tail() {
     return out_tail;
 }
\ No newline at end of file
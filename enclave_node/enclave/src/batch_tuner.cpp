@@ -0,0 +1,53 @@
+#include "batch_tuner.h"
+
+#include <algorithm>
+#include <cmath>
+
+static double elapsed_us(BatchTuner::Clock::time_point start, BatchTuner::Clock::time_point stop) {
+    return std::chrono::duration<double, std::micro>(stop - start).count();
+}
+
+void BatchTuner::init(int _max_lines) {
+    max_lines = std::max(_max_lines, 1);
+    lines = max_lines;
+    measure_ocall();
+}
+
+void BatchTuner::measure_ocall() {
+    // in an enclave each clock read leaves it, so two back to back are one round trip apart
+    Clock::time_point first = Clock::now();
+    double round_trip = elapsed_us(first, Clock::now());
+    ocall_us = ocall_us > 0 ? std::min(ocall_us, round_trip) : round_trip;
+}
+
+void BatchTuner::end_wait(Clock::time_point start) {
+    waited_us += elapsed_us(start, Clock::now());
+}
+
+void BatchTuner::retune(double busy_us) {
+    if (window_rows <= 0 || busy_us <= 0) return;
+    row_us = busy_us / window_rows;
+    double target = std::ceil(ocall_us / (BATCH_TUNE_OVERHEAD * row_us));
+    // at most a factor 2 per window, a single noisy window should not swing the batches
+    double low = std::max(lines / 2, std::min(BATCH_TUNE_MIN_LINES, max_lines));
+    double high = std::min(lines * 2, max_lines);
+    lines = (int)std::min(std::max(target, low), high);
+}
+
+bool BatchTuner::add_batch(int num_lines) {
+    // the first window opens with the first batch, not while the enclave is set up
+    if (window_start == Clock::time_point()) {
+        window_start = Clock::now();
+        waited_us = 0;
+    }
+    window_rows += num_lines;
+    if (++window_batches < BATCH_TUNE_WINDOW) return false;
+    int old_lines = lines;
+    retune(elapsed_us(window_start, Clock::now()) - waited_us);
+    measure_ocall();
+    window_start = Clock::now();
+    waited_us = 0;
+    window_batches = 0;
+    window_rows = 0;
+    return lines != old_lines;
+}
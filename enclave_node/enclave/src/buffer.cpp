@@ -1,14 +1,27 @@
 #include "batch.h"
 #include "buffer.h"
 
+#include "hashing.h"
 #include "logistic_regression.h"
 #include "string.h"
+#include <algorithm>
 #include <map>
 #include <thread>
 
-void aes_decrypt_dpi(const unsigned char* crypto, unsigned char* plaintxt, const DPIInfo& dpi, const int thread_id) {
-    aes_decrypt_data(dpi.aes_list[thread_id].aes_context,
-                     (unsigned char *)dpi.aes_list[thread_id].aes_iv,
+// polls of an empty batch ring or a full output ring before the thread leaves the enclave to wait on the host
+#define BATCH_RING_SPINS 2000
+
+void aes_decrypt_dpi(const unsigned char* crypto, unsigned char* plaintxt, const DPIInfo& dpi,
+                     const int key_id, const VariantKey key) {
+    const AESData& aes = dpi.aes_list[key_id];
+    unsigned char row_iv[AES_IV_LENGTH];
+    memcpy(row_iv, aes.row_iv_seed, AES_IV_LENGTH);
+    for (size_t i = 0; i < sizeof(VariantKey); ++i) {
+        row_iv[i] ^= (unsigned char)(key >> (8 * i));
+    }
+    mbedtls_aes_crypt_ecb(aes.row_iv_context, MBEDTLS_AES_ENCRYPT, row_iv, row_iv);
+    aes_decrypt_data(aes.aes_context,
+                     row_iv,
                      crypto,
                      dpi.crypto_size - 1, 
                      plaintxt);
@@ -28,132 +41,200 @@ void two_bit_decompress(uint8_t* input, uint8_t* decompressed, unsigned int size
     }
 }
 
-void Buffer::decrypt_line(char* plaintxt, size_t* plaintxt_length, unsigned int num_lines, const std::vector<DPIInfo>& dpi_info_list, const int thread_id) {
-    char* crypt_head = crypttxt; 
-    char *crypt_start, *end_of_allele, *end_of_loci;
-    char* plaintxt_head = plaintxt;
-    for (int line = 0; line < num_lines; ++line) {
-        crypt_start = crypt_head;
-        end_of_allele = crypt_head;
-        end_of_loci = crypt_head;
-        while (true) {
-            if (*crypt_head == '\t') {
-                if (end_of_loci != crypt_start) {
-                    end_of_allele = crypt_head;
-                    break;
-                } else {
-                    end_of_loci = crypt_head;
-                }
-            }
-            crypt_head++;
+// the line came through the untrusted ring, nothing in it can be trusted to fit
+static void corrupt_line(int thread_id, const char* reason) {
+    std::cerr << "ERROR: corrupt line in batch ring of thread " << thread_id << ": " << reason << std::endl;
+    exit(1);
+}
+
+void Buffer::decrypt_line() {
+    const std::vector<DPIInfo>& dpi_info_list = *dpi_info;
+    const int num_dpis = dpi_info_list.size();
+    const char* line_end = crypt_head + line_lengths[spare_decrypted];
+    // the key and at least one dpi id and its delimiter
+    if (line_end - crypt_head < VARIANT_KEY_SIZE + 2) {
+        corrupt_line(thread_id, "line too short");
+    }
+    /* the record header takes the variant key as is */
+    RowHeader* header = (RowHeader*)(spare_plaintxt + spare_size);
+    header->key = variant_key_read(crypt_head);
+    crypt_head += VARIANT_KEY_SIZE;
+    if (!variant_key_is_snv(header->key)) {
+        std::string locus;
+        variant_key_locus_str(header->key, locus);
+        std::cerr << "ERROR: non-SNV variant at " << locus << " is not supported" << std::endl;
+        exit(1);
+    }
+    uint8_t* data_head = (uint8_t*)(header + 1);
+
+    /* get dpi list, each id once and below num_dpis */
+    for (int dpi = 0; dpi < num_dpis; ++dpi) {
+        dpi_crypto_map[dpi] = nullptr;
+    }
+    dpi_count = 0;
+    int id = 0;
+    bool id_digits = false;
+    while (true) {
+        if (crypt_head == line_end) {
+            corrupt_line(thread_id, "unterminated dpi list");
         }
-        /* copy allele & loci to plaintxt */
-        strncpy(plaintxt_head, crypt_start, end_of_allele - crypt_start + 1);
-        plaintxt_head += end_of_allele - crypt_start + 1;
-
-        char* tab_pos = end_of_allele;
-        dpi_count = 0;
-        /* get dpi list */
-        crypt_head++;
-        while (true) {
-            if(*crypt_head == '\t'){
-                *crypt_head = '\0';
-                int dpi = atoi(tab_pos + 1);
-                dpi_list[dpi_count++] = dpi;
-                *crypt_head = '\t';
-                tab_pos = crypt_head;
+        char c = *crypt_head++;
+        if (c >= '0' && c <= '9') {
+            id = id * 10 + (c - '0');
+            id_digits = true;
+            if (id >= num_dpis) {
+                corrupt_line(thread_id, "unknown dpi id");
             }
-            if (*crypt_head == ' ') {
-                *crypt_head = '\0';
-                int dpi = atoi(tab_pos + 1);
-                dpi_list[dpi_count++] = dpi;
-                *crypt_head = ' ';
-                crypt_head++;
-                break;
+        } else if ((c == '\t' || c == ' ') && id_digits) {
+            if (dpi_crypto_map[id]) {
+                corrupt_line(thread_id, "duplicate dpi id");
             }
-            crypt_head++;
+            // marks the id as seen until its data is found below
+            dpi_crypto_map[id] = crypt_head;
+            dpi_list[dpi_count++] = id;
+            id = 0;
+            id_digits = false;
+            if (c == ' ') break;
+        } else {
+            corrupt_line(thread_id, "malformed dpi list");
         }
-        /* decrypt data */
-        for (int i = 0; i < dpi_count; i++){
-            dpi_crypto_map[dpi_list[i]] = crypt_head;
-            crypt_head += dpi_info_list[dpi_list[i]].crypto_size;
+    }
+    /* decrypt data straight into the record, dpis in order so the padding
+       of each dpi's last AES block is overwritten by the next one */
+    for (int i = 0; i < dpi_count; i++){
+        const size_t crypto_size = dpi_info_list[dpi_list[i]].crypto_size;
+        // aes_decrypt_dpi reads crypto_size - 1 bytes
+        if ((size_t)(line_end - crypt_head) < crypto_size - 1) {
+            corrupt_line(thread_id, "data past the end of the line");
         }
-        bool dpi_found;
-        for (int dpi = 0; dpi < dpi_info_list.size(); dpi++) {
-            dpi_found = false;
-            for (int list_id = 0; list_id < dpi_count; ++list_id) {
-                if (dpi_list[list_id] == dpi) {
-                    aes_decrypt_dpi((const unsigned char*)dpi_crypto_map[list_id],
-                                       (unsigned char*)plaintxt_head,
-                                       dpi_info_list[dpi], 
-                                       thread_id);
-                    // two_bit_decompress(plain_txt_compressed, 
-                    //                    (uint8_t*)plaintxt_head, 
-                    //                    dpi_info_list[dpi].size);
-                    // memset(plain_txt_compressed, 0, ENCLAVE_READ_BUFFER_SIZE);
-                    // memset(dpi_crypto_map[list_id], 0, dpi_info_list[dpi].crypto_size);
-                    dpi_found = true;
-                }
-            }
-            if (!dpi_found) {
-                // this dpi does have target allele
-                for (int j = 0; j < dpi_info_list[dpi].size; j++) {
-                    *(plaintxt_head + j) = NA_byte; // set whole byte to 0b11111111
-                }
-            }
-            plaintxt_head += dpi_info_list[dpi].size;
+        dpi_crypto_map[dpi_list[i]] = crypt_head;
+        crypt_head += std::min(crypto_size, (size_t)(line_end - crypt_head));
+    }
+    // the next line starts where the ring said this one ends
+    crypt_head = (char*)line_end;
+    // rows are spread over the threads by load, each is decrypted with the key the DPI picked for it
+    const int key_id = hash_key(header->key, dpi_info_list.front().aes_list.size(), true);
+    bool dpi_found;
+    int data_size = 0;
+    for (int dpi = 0; dpi < num_dpis; dpi++) {
+        dpi_found = dpi_crypto_map[dpi] != nullptr;
+        if (dpi_found) {
+            aes_decrypt_dpi((const unsigned char*)dpi_crypto_map[dpi],
+                            data_head,
+                            dpi_info_list[dpi],
+                            key_id,
+                            header->key);
+        }
+        if (!dpi_found) {
+            // this dpi does have target allele
+            memset(data_head, NA_byte, dpi_info_list[dpi].size); // set whole byte to 0b11111111
         }
-        *plaintxt_head = '\n';
-        plaintxt_head++;
+        data_head += dpi_info_list[dpi].size;
+        data_size += dpi_info_list[dpi].size;
     }
-    *plaintxt_head = '\0';
-    *plaintxt_length = plaintxt_head - plaintxt;
+    spare_size += row_record_size(data_size);
+    spare_decrypted++;
 }
 
-Buffer::Buffer(size_t _row_size, EncAnalysis type, int num_dpis, int _thread_id)
-    : row_size(_row_size), analysis_type(type), thread_id(_thread_id) {
-    crypttxt = new char[ENCLAVE_READ_BUFFER_SIZE];
-    plain_txt_compressed = new uint8_t[ENCLAVE_READ_BUFFER_SIZE];
+Buffer::Buffer(size_t _row_size, EncAnalysis type, int num_dpis, int _thread_id, size_t _batch_size)
+    : row_size(_row_size), analysis_type(type), batch_size(_batch_size), thread_id(_thread_id) {
+    crypttxt.reset(new char[batch_size]);
     dpi_list = new int[num_dpis];
     dpi_crypto_map = new char* [num_dpis];
-    // I now remember why we do this! Because we do batching, we can load in ENCLAVE_READ_BUFFER_SIZE
-    // amount of data in at a time, BUT this data when decompressed can actually be up to 4 * ENCLAVE_READ_BUFFER_SIZE large
-    plaintxt_buffer = new char[ENCLAVE_READ_BUFFER_SIZE];
+    // max_batch_lines leaves room for a full record per line, the slack takes the
+    // AES padding of the last dpi of the last record
+    plaintxt_buffer = new char[batch_size + ROW_ALIGNMENT];
+    spare_plaintxt = new char[batch_size + ROW_ALIGNMENT];
     output_tail = 0;
-    eof = false;
+    free_batch = nullptr;
+    ring = nullptr;
+    ring_eof = false;
+    output_ring = nullptr;
+    dpi_info = nullptr;
+    spare_size = 0;
+    spare_lines = 0;
+    spare_decrypted = 0;
+    crypt_head = crypttxt.get();
+    max_lines = 0;
 
-    memset(crypttxt, 0, ENCLAVE_READ_BUFFER_SIZE);
-    memset(plain_txt_compressed, 0, ENCLAVE_READ_BUFFER_SIZE);
-    memset(plaintxt_buffer, 0, ENCLAVE_READ_BUFFER_SIZE);
+    memset(crypttxt.get(), 0, batch_size);
+    memset(plaintxt_buffer, 0, batch_size + ROW_ALIGNMENT);
+    memset(spare_plaintxt, 0, batch_size + ROW_ALIGNMENT);
 }
 
 Buffer::~Buffer() {
-    delete free_batch;
+    if (free_batch) {
+        delete free_batch;
+    } else {
+        delete [] plaintxt_buffer;
+    }
     delete [] dpi_list;
     delete [] dpi_crypto_map;
+    delete [] spare_plaintxt;
 }
 
-void Buffer::mark_eof() {
-    eof = true;
+void Buffer::set_batch_ring(BatchRing* _ring, int _max_lines) {
+    ring = _ring;
+    max_lines = _max_lines;
+    line_lengths.reset(new uint32_t[max_lines]);
+    tuner.init(_max_lines);
+    ring->batch_lines.store(tuner.get_lines(), std::memory_order_relaxed);
 }
 
 void Buffer::add_gwas(GWAS* _gwas, ImputePolicy impute_policy, const std::vector<int>& sizes) {
     free_batch = new Batch(row_size, analysis_type, impute_policy, _gwas, plaintxt_buffer, sizes, thread_id);
 }
 
-void Buffer::output(const char* out, const size_t& length) {
+void Buffer::set_output_ring(BatchRing* _output_ring) {
+    output_ring = _output_ring;
+}
+
+void Buffer::flush_output() {
+    int full_polls = 0;
+    while (!batch_ring_push(output_ring, output_buffer, output_tail)) {
+        if (++full_polls < BATCH_RING_SPINS) {
+            __asm("pause");
+            continue;
+        }
+        bool ready;
+        waitoutput(&ready, thread_id, output_tail);
+        full_polls = 0;
+    }
+    output_tail = 0;
+    signaloutput();
+}
+
+void Buffer::reserve_output(const size_t length) {
     if (output_tail + length >= ENCLAVE_READ_BUFFER_SIZE) {
-        writebatch(output_buffer, output_tail, thread_id);
-        memset(output_buffer, 0, ENCLAVE_READ_BUFFER_SIZE);
-        output_tail = 0;
+        flush_output();
     }
-    strcpy(output_buffer + output_tail, out);
+}
+
+void Buffer::output(const char* out, const size_t& length) {
+    reserve_output(length);
+    memcpy(output_buffer + output_tail, out, length);
     output_tail += length;
 }
 
+void Buffer::write(const std::string& out) {
+    // the record and its text have to reach the host in the same output chunk
+    ResultRecord record = text_result(out.size());
+    reserve_output(sizeof(ResultRecord) + out.size());
+    memcpy(output_buffer + output_tail, &record, sizeof(ResultRecord));
+    output_tail += sizeof(ResultRecord);
+    memcpy(output_buffer + output_tail, out.data(), out.size());
+    output_tail += out.size();
+}
+
+void Buffer::write(const ResultRecord& result) {
+    reserve_output(sizeof(ResultRecord));
+    memcpy(output_buffer + output_tail, &result, sizeof(ResultRecord));
+    output_tail += sizeof(ResultRecord);
+}
+
 void Buffer::clean_up() {
     if (output_tail > 0) {
-        writebatch(output_buffer, output_tail, thread_id);
+        flush_output();
     }
 }
 
@@ -162,23 +243,67 @@ void Buffer::finish() {
     free_batch->reset();
 }
 
+bool Buffer::fetch() {
+    if (ring_eof) {
+        spare_lines = -1;
+        return true;
+    }
+    int num_lines = batch_ring_pop(ring, crypttxt.get(), batch_size, std::min(tuner.get_lines(), max_lines),
+                                   nullptr, line_lengths.get());
+    if (num_lines == BATCH_RING_CORRUPT) {
+        std::cerr << "ERROR: batch ring of thread " << thread_id << " is corrupt" << std::endl;
+        exit(1);
+    }
+    if (num_lines == -1) {
+        ring_eof = true;
+    }
+    if (num_lines > 0 && tuner.add_batch(num_lines)) {
+        ring->batch_lines.store(tuner.get_lines(), std::memory_order_relaxed);
+    }
+    spare_lines = num_lines;
+    spare_decrypted = 0;
+    spare_size = 0;
+    crypt_head = crypttxt.get();
+    return num_lines != 0;
+}
+
+void Buffer::decrypt_ahead() {
+    // only reads the ring indices when nothing is pending
+    if (!spare_lines) {
+        fetch();
+    }
+    if (spare_decrypted < spare_lines) {
+        decrypt_line();
+    }
+}
+
 Batch* Buffer::launch(std::vector<DPIInfo>& dpi_info_list, const int thread_id) {
-    int num_lines = 0;
-    while (!num_lines) {
-        getbatch(&num_lines, crypttxt, thread_id);
-        if (eof) {
-            return nullptr;
-        }
-        if (!num_lines) {
-            std::this_thread::yield();
+    if (!free_batch) return nullptr;
+    dpi_info = &dpi_info_list;
+    int empty_polls = 0;
+    while (!spare_lines && !fetch()) {
+        // short gaps in the matcher's output are covered without an enclave exit,
+        // longer ones block on the host until rows or the end of data show up
+        if (++empty_polls < BATCH_RING_SPINS) {
+            __asm("pause");
+            continue;
         }
+        bool ready;
+        BatchTuner::Clock::time_point wait_start = tuner.begin_wait();
+        waitbatch(&ready, thread_id);
+        tuner.end_wait(wait_start);
+        empty_polls = 0;
     }
-    if (num_lines == -1) {
+    if (spare_lines == -1) {
         return nullptr;
     }
-    //if (!strcmp(crypttxt, EOFSeperator)) return nullptr;
-    if (!free_batch) return nullptr;
-    *free_batch->plaintxt_size() = 0;
-    decrypt_line(free_batch->load_plaintxt(), free_batch->plaintxt_size(), num_lines, dpi_info_list, thread_id);
+    // whatever the fits did not cover yet
+    while (spare_decrypted < spare_lines) {
+        decrypt_line();
+    }
+    spare_plaintxt = free_batch->exchange_plaintxt(spare_plaintxt, spare_size);
+    spare_lines = 0;
+    // start on the next batch if its rows are already waiting
+    fetch();
     return free_batch;
-}
\ No newline at end of file
+}
@@ -0,0 +1,252 @@
+#include "conditional.h"
+
+#include <algorithm>
+#include <climits>
+
+ConditionalProjection conditional;
+
+// relative size of the Schur complement below which a column is treated as collinear
+#define COLLINEAR_TOLERANCE 1e-8
+
+void decode_genotypes(const uint8_t* data, const std::vector<int>& dpi_lengths, double* out) {
+    double sum = 0;
+    int count = 0;
+    int idx = 0;
+    const uint8_t* dpi_data = data;
+    for (int length : dpi_lengths) {
+        for (int i = 0; i < length; ++i) {
+            uint8_t val = (dpi_data[i / 4] >> ((i % 4) * 2)) & 0b11;
+            if (is_NA_uint8(val)) {
+                out[idx++] = NA_double;
+            } else {
+                out[idx++] = val;
+                sum += val;
+                count++;
+            }
+        }
+        dpi_data += (length + 3) / 4;
+    }
+    double average = sum / (count + !count);
+    for (int i = 0; i < idx; ++i) {
+        if (out[i] == NA_double) {
+            out[i] = average;
+        }
+    }
+}
+
+void ConditionalProjection::init(const std::string& condition_loci_list, int _window) {
+    std::vector<std::string> loci_list;
+    split_delim(condition_loci_list.c_str(), loci_list);
+    window = _window;
+    region_start = INT_MAX;
+    region_end = 0;
+    for (const std::string& locus : loci_list) {
+        Loci loci(locus);
+        loci.chrom = loci.chrom_str == "X" ? LOCI_X : std::stoi(loci.chrom_str);
+        loci.loc = std::stoi(loci.loc_str);
+        if (!condition_loci.empty() && loci.chrom != chrom) {
+            std::cout << "Conditional loci must be on one chromosome, conditional mode disabled" << std::endl;
+            condition_loci.clear();
+            return;
+        }
+        chrom = loci.chrom;
+        region_start = std::min(region_start, loci.loc - window);
+        region_end = std::max(region_end, loci.loc + window);
+        condition_loci.push_back(loci);
+    }
+    condition_seen.assign(condition_loci.size(), false);
+}
+
+void ConditionalProjection::setup(GWAS* _gwas, int _num_threads) {
+    gwas = _gwas;
+    num_threads = _num_threads;
+    n = gwas->size();
+    num_covariates = gwas->dim() - 1;
+    Z.resize((size_t)n * condition_loci.size());
+
+    WTW_inv.clear();
+    WTy.clear();
+    p = 0;
+    yTy = 0;
+    for (int i = 0; i < n; ++i) {
+        double y = gwas->phenotype_and_covars.row(i)[0];
+        yTy += y * y;
+    }
+
+    // grow (W^T W)^-1 one covariate column at a time, the conditioning
+    // variants are folded in the same way once they have all arrived
+    std::vector<double> w_col(n);
+    for (int c = 0; c < num_covariates; ++c) {
+        for (int i = 0; i < n; ++i) {
+            w_col[i] = gwas->phenotype_and_covars.row(i)[c + 1];
+        }
+        if (!add_column(w_col)) {
+            std::cout << "Covariate " << c << " is collinear with the others" << std::endl;
+        }
+    }
+    std::cout << "Conditional analysis on " << condition_loci.size() << " loci, region "
+              << chrom << ":" << region_start << "-" << region_end << std::endl;
+}
+
+bool ConditionalProjection::in_region(const Loci& loci) const {
+    return loci.chrom == chrom && loci.loc >= region_start && loci.loc <= region_end;
+}
+
+// Bordered inverse update: with b = W^T w, u = A b and s = w^T w - b^T u,
+//   [W w]^T [W w] inverse = [[A + u u^T / s, -u / s], [-u^T / s, 1 / s]]
+bool ConditionalProjection::add_column(const std::vector<double>& w_col) {
+    std::vector<double> b(p, 0);
+    double d = 0;
+    double wy = 0;
+    int num_z = p - std::min(p, num_covariates);
+    for (int i = 0; i < n; ++i) {
+        const double* patient_pnc = gwas->phenotype_and_covars.row(i);
+        double w = w_col[i];
+        d += w * w;
+        wy += w * patient_pnc[0];
+        int j = 0;
+        for (; j < std::min(p, num_covariates); ++j) {
+            b[j] += patient_pnc[j + 1] * w;
+        }
+        for (int l = 0; l < num_z; ++l, ++j) {
+            b[j] += Z[(size_t)i * condition_loci.size() + z_columns[l]] * w;
+        }
+    }
+
+    std::vector<double> u(p, 0);
+    double s = d;
+    for (int j = 0; j < p; ++j) {
+        for (int k = 0; k < p; ++k) {
+            u[j] += WTW_inv[j][k] * b[k];
+        }
+        s -= b[j] * u[j];
+    }
+    if (s <= COLLINEAR_TOLERANCE * d) {
+        return false;
+    }
+
+    for (int j = 0; j < p; ++j) {
+        for (int k = 0; k < p; ++k) {
+            WTW_inv[j][k] += u[j] * u[k] / s;
+        }
+        WTW_inv[j].push_back(-u[j] / s);
+    }
+    WTW_inv.push_back(std::vector<double>(p + 1));
+    for (int k = 0; k < p; ++k) {
+        WTW_inv[p][k] = -u[k] / s;
+    }
+    WTW_inv[p][p] = 1 / s;
+    WTy.push_back(wy);
+    p++;
+    return true;
+}
+
+void ConditionalProjection::build_projection() {
+    int k = condition_loci.size();
+    std::vector<double> z_col(n);
+    for (int l = 0; l < k; ++l) {
+        if (!condition_seen[l]) {
+            std::cout << "Conditional locus " << condition_loci[l] << " not found, ignored" << std::endl;
+            continue;
+        }
+        for (int i = 0; i < n; ++i) {
+            z_col[i] = Z[(size_t)i * k + l];
+        }
+        // z_columns has to be updated after the column is folded in, add_column
+        // only reads the conditioning columns already part of W
+        if (add_column(z_col)) {
+            z_columns.push_back(l);
+        } else {
+            std::cout << "Conditional locus " << condition_loci[l] << " is collinear, ignored" << std::endl;
+        }
+    }
+    ready = true;
+    ready_cv.notify_all();
+}
+
+bool ConditionalProjection::add_condition(const Loci& loci, const uint8_t* data, const std::vector<int>& dpi_lengths) {
+    int k = condition_loci.size();
+    for (int l = 0; l < k; ++l) {
+        if (condition_loci[l] != loci) continue;
+
+        std::vector<double> z_col(n);
+        decode_genotypes(data, dpi_lengths, &z_col[0]);
+
+        std::lock_guard<std::mutex> raii(lock);
+        // multi-allelic sites share a position, the first one wins
+        if (condition_seen[l] || ready) return false;
+        for (int i = 0; i < n; ++i) {
+            Z[(size_t)i * k + l] = z_col[i];
+        }
+        condition_seen[l] = true;
+        if (++conditions_found == k) {
+            build_projection();
+        }
+        return true;
+    }
+    return false;
+}
+
+bool ConditionalProjection::score(const uint8_t* data, const std::vector<int>& dpi_lengths,
+                                  std::vector<double>& g, std::vector<double>& WTg, double results[3]) const {
+    int k = condition_loci.size();
+    g.resize(n);
+    WTg.assign(p, 0);
+    decode_genotypes(data, dpi_lengths, &g[0]);
+
+    double gTg = 0;
+    double gTy = 0;
+    for (int i = 0; i < n; ++i) {
+        const double* patient_pnc = gwas->phenotype_and_covars.row(i);
+        double x = g[i];
+        gTg += x * x;
+        gTy += x * patient_pnc[0];
+        int j = 0;
+        for (; j < num_covariates; ++j) {
+            WTg[j] += patient_pnc[j + 1] * x;
+        }
+        for (int l : z_columns) {
+            WTg[j++] += Z[(size_t)i * k + l] * x;
+        }
+    }
+
+    // g^T M g and g^T M y with M = I - W (W^T W)^-1 W^T
+    double gMg = gTg;
+    double gMy = gTy;
+    double yMy = yTy;
+    for (int j = 0; j < p; ++j) {
+        double Ag = 0;
+        double Ay = 0;
+        for (int l = 0; l < p; ++l) {
+            Ag += WTW_inv[j][l] * WTg[l];
+            Ay += WTW_inv[j][l] * WTy[l];
+        }
+        gMg -= WTg[j] * Ag;
+        gMy -= WTy[j] * Ag;
+        yMy -= WTy[j] * Ay;
+    }
+    if (gMg <= COLLINEAR_TOLERANCE * gTg) {
+        return false;
+    }
+
+    // same degrees of freedom as Lin_row, genotype + every column of W
+    double beta = gMy / gMg;
+    double sse = (yMy - beta * gMy) / (n - (p + 1) - 1);
+    double se = std::sqrt(sse / gMg);
+    results[0] = beta;
+    results[1] = se;
+    results[2] = beta / se;
+    return true;
+}
+
+bool ConditionalProjection::finish_thread() {
+    std::unique_lock<std::mutex> lk(lock);
+    if (++threads_finished == num_threads && !ready) {
+        // some conditioning rows never showed up, project out the ones we have
+        build_projection();
+    }
+    while (!ready) {
+        ready_cv.wait(lk);
+    }
+    return ready;
+}
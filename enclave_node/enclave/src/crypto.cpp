@@ -25,6 +25,166 @@ void aes_decrypt_data(mbedtls_aes_context* aes_context,
     }
 }
 
+#define SEAL_IV_LENGTH 12
+#define SEAL_TAG_LENGTH 16
+// key info of blobs sealed under a shared link key rather than the seal key
+#define LINK_KEY_INFO "LINK"
+
+#ifdef NON_OE
+#include <random>
+
+// Without an enclave there is nothing to seal to, use a fixed development key.
+static bool get_seal_key(const uint8_t* key_info, size_t key_info_size, uint8_t key[AES_KEY_LENGTH], std::string& new_key_info) {
+    memset(key, 0x5a, AES_KEY_LENGTH);
+    new_key_info = "NON_OE";
+    return true;
+}
+
+void random_bytes(uint8_t* out, size_t size) {
+    std::random_device rd;
+    for (size_t i = 0; i < size; ++i) {
+        out[i] = rd() & 0xFF;
+    }
+}
+#else
+// key_info == nullptr requests a fresh key, otherwise the key described by key_info is re-derived
+static bool get_seal_key(const uint8_t* key_info, size_t key_info_size, uint8_t key[AES_KEY_LENGTH], std::string& new_key_info) {
+    uint8_t* seal_key = nullptr;
+    size_t seal_key_size = 0;
+    uint8_t* info = nullptr;
+    size_t info_size = 0;
+    oe_result_t result;
+    if (key_info == nullptr) {
+        result = oe_get_seal_key_by_policy(OE_SEAL_POLICY_PRODUCT, &seal_key, &seal_key_size, &info, &info_size);
+    } else {
+        result = oe_get_seal_key(key_info, key_info_size, &seal_key, &seal_key_size);
+    }
+    if (result != OE_OK || seal_key_size < AES_KEY_LENGTH) {
+        std::cout << "Failed to get seal key: " << oe_result_str(result) << std::endl;
+        return false;
+    }
+    memcpy(key, seal_key, AES_KEY_LENGTH);
+    if (info) {
+        new_key_info.assign((const char*)info, info_size);
+    }
+    oe_free_seal_key(seal_key, info);
+    return true;
+}
+
+void random_bytes(uint8_t* out, size_t size) {
+    oe_random(out, size);
+}
+#endif
+
+// blob: key info size | key info | iv | tag | ciphertext
+static bool gcm_seal(uint8_t key[AES_KEY_LENGTH], const std::string& key_info,
+                     const uint8_t* data, size_t data_size, std::string& sealed) {
+    uint32_t key_info_size = key_info.size();
+    size_t header_size = sizeof(uint32_t) + key_info_size + SEAL_IV_LENGTH + SEAL_TAG_LENGTH;
+    sealed.resize(header_size + data_size);
+
+    uint8_t* head = (uint8_t*)&sealed[0];
+    memcpy(head, &key_info_size, sizeof(uint32_t));
+    memcpy(head + sizeof(uint32_t), key_info.data(), key_info_size);
+    uint8_t* iv = head + sizeof(uint32_t) + key_info_size;
+    uint8_t* tag = iv + SEAL_IV_LENGTH;
+    random_bytes(iv, SEAL_IV_LENGTH);
+
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    int ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, AES_KEY_LENGTH * 8);
+    if (ret == 0) {
+        ret = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, data_size, iv, SEAL_IV_LENGTH,
+                                        nullptr, 0, data, head + header_size, SEAL_TAG_LENGTH, tag);
+    }
+    mbedtls_gcm_free(&gcm);
+    memset(key, 0, AES_KEY_LENGTH);
+    if (ret != 0) {
+        std::cout << "Seal failed with error: " << ret << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// returns the header size, 0 if the blob is too short
+static size_t parse_sealed_header(const uint8_t* sealed, size_t sealed_size,
+                                  const uint8_t*& key_info, uint32_t& key_info_size) {
+    if (sealed_size < sizeof(uint32_t)) {
+        return 0;
+    }
+    memcpy(&key_info_size, sealed, sizeof(uint32_t));
+    size_t header_size = sizeof(uint32_t) + key_info_size + SEAL_IV_LENGTH + SEAL_TAG_LENGTH;
+    if (sealed_size < header_size) {
+        return 0;
+    }
+    key_info = sealed + sizeof(uint32_t);
+    return header_size;
+}
+
+static bool gcm_open(uint8_t key[AES_KEY_LENGTH], const uint8_t* sealed, size_t sealed_size,
+                     size_t header_size, std::string& data) {
+    const uint8_t* iv = sealed + header_size - SEAL_TAG_LENGTH - SEAL_IV_LENGTH;
+    const uint8_t* tag = iv + SEAL_IV_LENGTH;
+    data.resize(sealed_size - header_size);
+
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    int ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, AES_KEY_LENGTH * 8);
+    if (ret == 0) {
+        ret = mbedtls_gcm_auth_decrypt(&gcm, data.size(), iv, SEAL_IV_LENGTH, nullptr, 0, tag, SEAL_TAG_LENGTH,
+                                       sealed + header_size, (uint8_t*)&data[0]);
+    }
+    mbedtls_gcm_free(&gcm);
+    memset(key, 0, AES_KEY_LENGTH);
+    if (ret != 0) {
+        std::cout << "Unseal failed with error: " << ret << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool seal_data(const uint8_t* data, size_t data_size, std::string& sealed) {
+    uint8_t key[AES_KEY_LENGTH];
+    std::string key_info;
+    if (!get_seal_key(nullptr, 0, key, key_info)) {
+        return false;
+    }
+    return gcm_seal(key, key_info, data, data_size, sealed);
+}
+
+bool unseal_data(const uint8_t* sealed, size_t sealed_size, std::string& data) {
+    const uint8_t* key_info;
+    uint32_t key_info_size;
+    size_t header_size = parse_sealed_header(sealed, sealed_size, key_info, key_info_size);
+    if (!header_size) {
+        return false;
+    }
+    uint8_t key[AES_KEY_LENGTH];
+    std::string unused;
+    if (!get_seal_key(key_info, key_info_size, key, unused)) {
+        return false;
+    }
+    return gcm_open(key, sealed, sealed_size, header_size, data);
+}
+
+bool link_seal_data(const uint8_t link_key[AES_KEY_LENGTH], const uint8_t* data, size_t data_size, std::string& sealed) {
+    uint8_t key[AES_KEY_LENGTH];
+    memcpy(key, link_key, AES_KEY_LENGTH);
+    return gcm_seal(key, LINK_KEY_INFO, data, data_size, sealed);
+}
+
+bool link_unseal_data(const uint8_t link_key[AES_KEY_LENGTH], const uint8_t* sealed, size_t sealed_size, std::string& data) {
+    const uint8_t* key_info;
+    uint32_t key_info_size;
+    size_t header_size = parse_sealed_header(sealed, sealed_size, key_info, key_info_size);
+    if (!header_size || std::string((const char*)key_info, key_info_size) != LINK_KEY_INFO) {
+        return false;
+    }
+    uint8_t key[AES_KEY_LENGTH];
+    memcpy(key, link_key, AES_KEY_LENGTH);
+    return gcm_open(key, sealed, sealed_size, header_size, data);
+}
+
 RSACrypto::RSACrypto() {
     m_initialized = false;
     int res = -1;
@@ -145,6 +305,128 @@ exit:
     return ret;
 }
 
+/**
+ * encrypt the given data to another enclave's public key.
+ * Used to send data that only that enclave can read.
+ */
+bool RSACrypto::encrypt(
+    const uint8_t pub_key[RSA_PUB_KEY_SIZE],
+    const uint8_t* data,
+    size_t data_size,
+    uint8_t* encrypted_data,
+    size_t* encrypted_data_size) {
+    bool ret = false;
+    int res = 0;
+    mbedtls_pk_context peer_context;
+    mbedtls_rsa_context* rsa_context;
+
+    mbedtls_pk_init(&peer_context);
+    if (!m_initialized)
+        goto exit;
+
+    // the PEM text with its terminating null
+    res = mbedtls_pk_parse_public_key(&peer_context, pub_key, strnlen((const char*)pub_key, RSA_PUB_KEY_SIZE - 1) + 1);
+    if (res != 0 || mbedtls_pk_get_type(&peer_context) != MBEDTLS_PK_RSA) {
+        std::cout << "RSA public key parse failed with error: " << res << std::endl;
+        goto exit;
+    }
+    rsa_context = mbedtls_pk_rsa(peer_context);
+    mbedtls_rsa_set_padding(rsa_context, MBEDTLS_RSA_PKCS_V21, MBEDTLS_MD_SHA256);
+    if (*encrypted_data_size < mbedtls_rsa_get_len(rsa_context))
+        goto exit;
+
+    res = mbedtls_rsa_rsaes_oaep_encrypt(
+        rsa_context,
+        mbedtls_ctr_drbg_random,
+        &m_ctr_drbg_context,
+        MBEDTLS_RSA_PUBLIC,
+        NULL,
+        0,
+        data_size,
+        data,
+        encrypted_data);
+    if (res != 0) {
+        std::cout << "RSA encryption failed with error: " << res << std::endl;
+        goto exit;
+    }
+    *encrypted_data_size = mbedtls_rsa_get_len(rsa_context);
+    ret = true;
+
+exit:
+    mbedtls_pk_free(&peer_context);
+    return ret;
+}
+
+// the enclave identity and public key hash claimed by evidence, false if it does not verify
+static bool read_evidence_claims(const buffer_t& evidence, uint8_t unique_id[OE_UNIQUE_ID_SIZE], uint8_t pub_key_hash[32]) {
+    bool ret = false;
+    oe_claim_t* claims = nullptr;
+    size_t claims_length = 0;
+    oe_claim_t* custom_claims = nullptr;
+    size_t custom_claims_length = 0;
+    const oe_claim_t* unique_id_claim = nullptr;
+    const oe_claim_t* custom_claims_buffer = nullptr;
+
+    if (oe_verifier_initialize() != OE_OK) {
+        TRACE_ENCLAVE("oe_verifier_initialize failed");
+        return false;
+    }
+    if (oe_verify_evidence(&sgx_remote_uuid, evidence.buffer, evidence.size, nullptr, 0, nullptr, 0,
+                           &claims, &claims_length) != OE_OK) {
+        TRACE_ENCLAVE("oe_verify_evidence failed");
+        return false;
+    }
+    for (size_t i = 0; i < claims_length; ++i) {
+        if (strcmp(claims[i].name, OE_CLAIM_UNIQUE_ID) == 0) {
+            unique_id_claim = &claims[i];
+        } else if (strcmp(claims[i].name, OE_CLAIM_CUSTOM_CLAIMS_BUFFER) == 0) {
+            custom_claims_buffer = &claims[i];
+        }
+    }
+    if (!unique_id_claim || unique_id_claim->value_size != OE_UNIQUE_ID_SIZE || !custom_claims_buffer) {
+        TRACE_ENCLAVE("evidence is missing a claim");
+        goto exit;
+    }
+    // the public key hash is the only custom claim, see generate_attestation_evidence
+    if (oe_deserialize_custom_claims(custom_claims_buffer->value, custom_claims_buffer->value_size,
+                                     &custom_claims, &custom_claims_length) != OE_OK ||
+        custom_claims_length != 1 || custom_claims[0].value_size != 32) {
+        TRACE_ENCLAVE("evidence has no public key hash");
+        goto exit;
+    }
+    memcpy(unique_id, unique_id_claim->value, OE_UNIQUE_ID_SIZE);
+    memcpy(pub_key_hash, custom_claims[0].value, 32);
+    ret = true;
+
+exit:
+    if (custom_claims) {
+        oe_free_custom_claims(custom_claims, custom_claims_length);
+    }
+    oe_free_claims(claims, claims_length);
+    return ret;
+}
+
+bool RSACrypto::verify_peer_evidence(const buffer_t& own_evidence, const buffer_t& evidence,
+                                     const uint8_t pub_key[RSA_PUB_KEY_SIZE]) {
+    uint8_t own_id[OE_UNIQUE_ID_SIZE];
+    uint8_t peer_id[OE_UNIQUE_ID_SIZE];
+    uint8_t claimed_hash[32];
+    uint8_t hash[32];
+    if (!read_evidence_claims(own_evidence, own_id, hash) || !read_evidence_claims(evidence, peer_id, claimed_hash)) {
+        return false;
+    }
+    // the same enclave measurement, so the same code as this one
+    if (memcmp(own_id, peer_id, OE_UNIQUE_ID_SIZE) != 0) {
+        TRACE_ENCLAVE("peer enclave is not this enclave");
+        return false;
+    }
+    if (sha256(pub_key, RSA_PUB_KEY_SIZE, hash) != 0 || memcmp(hash, claimed_hash, sizeof(hash)) != 0) {
+        TRACE_ENCLAVE("peer public key does not match its evidence");
+        return false;
+    }
+    return true;
+}
+
 int RSACrypto::get_enclave_format_settings(const oe_uuid_t* format_id, buffer_t* format_settings) {
     uint8_t* format_settings_buffer = nullptr;
     size_t format_settings_size = 0;
@@ -1,6 +1,8 @@
 #include "enc_gwas.h"
 #include "assert.h"
 #include "float.h"
+#include "string.h"
+#include <algorithm>
 
 Row::Row(int _size, const std::vector<int>& sizes, int _num_dimensions, ImputePolicy _impute_policy) 
     : n(_size), impute_policy(_impute_policy), num_dimensions(_num_dimensions) {
@@ -22,50 +24,16 @@ void Row::reset() {
     // alleles = Alleles();
 }
 
-int Row::read(const char line[]) {
-    //std::cout << line << std::endl;
-    static int count = 0;
-    loci_str.clear();
-    alleles_str.clear();
-    int tabs_found = 0;
-    int idx = 0;
+int Row::read(const char record[]) {
+    const RowHeader* header = (const RowHeader*)record;
+    key = header->key;
+    loci.chrom = variant_key_chrom(key);
+    loci.loc = variant_key_pos(key);
+    alleles.a1 = (ALLELE)variant_key_a1(key);
+    alleles.a2 = (ALLELE)variant_key_a2(key);
+    data = (uint8_t *)(record + sizeof(RowHeader));
 
-    while(tabs_found < 2) {
-        char curr_char = line[idx++];
-        if (curr_char == '\t') {
-            tabs_found++;
-            continue;
-        }
-        if (tabs_found == 0) {
-            loci_str.push_back(curr_char);
-        } else {
-            alleles_str.push_back(curr_char);
-        }
-    }
-    try {
-        loci = Loci(loci_str);
-        if (loci.chrom_str == "X") {
-            loci.chrom = LOCI_X;
-        } else {
-            loci.chrom = std::stoi(loci.chrom_str);
-        }
-        loci.loc = std::stoi(loci.loc_str);
-        alleles.read(alleles_str);
-    } catch (ReadtsvERROR &error) {
-        std::cout << line << std::endl;
-        throw ENC_ERROR("Invalid loci/alleles " + loci_str + "\t" + alleles_str
-#ifdef DEBUG
-                        + string("(loci)") + loci_str + " (alleles)" +
-                        alleles_str
-#endif
-        );
-    } catch (const std::invalid_argument& exception) {
-        std::cout << "Invalid chrom/loc " << loci.chrom << " " << loci.loc << " " << std::endl;
-        exit(0);
-    }
-    data = (uint8_t *)(line + loci_str.size() + alleles_str.size() + 2);
-
-    return read_row_len + loci_str.size() + alleles_str.size() + 3;
+    return row_record_size(read_row_len);
 }
 void Row::combine(Row *other) {
     // /* check if loci & alleles match */
@@ -181,46 +149,62 @@ void GWAS::print() const {
 }
 #endif
 
+void GWAS::add_gram(int begin, int end, double* XTX, double* XTY) const {
+    for (int i = begin; i < end; ++i) {
+        const double* patient_pnc = phenotype_and_covars.row(i);
+        double y = patient_pnc[0];
+        for (int j = 1; j < m; ++j) {  // starting from second row
+            XTY[j] += patient_pnc[j] * y;
+            for (int k = 1; k <= j; ++k) {
+                XTX[j * m + k] += patient_pnc[j] * patient_pnc[k];
+            }
+        }
+    }
+}
+
 /////////////////////////////////////////////////////////
 ////////////////   Covar    /////////////////////////////
 /////////////////////////////////////////////////////////
-int Covar::read(const char* input, int res_size) {
-    std::vector<std::string> parts;
-    if (res_size)
-        parts.reserve(res_size + 1);
-
-    split_delim(input, parts, '\t');
-
-    if (!res_size) {
-        res_size = parts.size() - 1;
-        std::cout << "n size " << res_size << std::endl;
-    }
-
-    name_str = parts[0];
+CovarReader::CovarReader(Covar& _covar, int _column, int first_row, int res_size)
+    : covar(_covar), column(_column), next_row(first_row), values(0), name_read(false) {
+    end_row = std::min(first_row + res_size, covar.n);
+}
 
-    int read_size = 0;
-    for (int i = 1; i < res_size + 1; ++i) {
-        data[covar_idx++][m] = std::stod(parts[i]);
-        read_size++;
+void CovarReader::add_token() {
+    // empty fields are skipped, as split_delim does
+    if (token.empty()) return;
+    if (!name_read) {
+        name_read = true;
+    } else if (next_row < end_row) {
+        covar.data[(size_t)next_row++ * covar.width + column] = std::stod(token);
+        values++;
     }
+    token.clear();
+}
 
-    if (read_size != res_size || read_size != n) {
-        //std::cout << "Covar size mismatch " << n << " " << read_size << " " << read_size << std::endl;
+void CovarReader::read_chunk(const char* chunk, size_t length) {
+    // the text ends at a null byte
+    size_t text_length = strnlen(chunk, length);
+    const char* end = chunk + text_length;
+    while (chunk < end) {
+        const char* tab = (const char*)memchr(chunk, '\t', end - chunk);
+        if (!tab) {
+            token.append(chunk, end);
+            break;
+        }
+        token.append(chunk, tab);
+        add_token();
+        chunk = tab + 1;
     }
-
-    return read_size;
 }
 
-void Covar::reserve(int total_row_size) {
-    //data.reserve(total_row_size);
+int CovarReader::end_text() {
+    add_token();
+    return values;
 }
 
-void Covar::init_1_covar(int total_row_size) {
-    if (total_row_size != n) {
-        std::cout << "1 Covar size mismatch " << n << " " << total_row_size << std::endl;
-    }
-    
-    for (int i = 0; i < total_row_size; i++) {
-        data[covar_idx++][m] = 1;
+void Covar::init_1_covar(int column) {
+    for (int i = 0; i < n; i++) {
+        data[(size_t)i * width + column] = 1;
     }
 }
\ No newline at end of file
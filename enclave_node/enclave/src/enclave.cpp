@@ -3,11 +3,18 @@
 #include <map>
 #include <atomic>
 #include <condition_variable>
+#include <functional>
+#include <algorithm>
 #include <string.h>
 
 #include "buffer.h"
 #include "crypto.h"
 #include "mxcsr.h"
+#include "qc.h"
+#include "conditional.h"
+#include "stats_store.h"
+#include "region_test.h"
+#include "memory_plan.h"
 
 #ifdef NON_OE
 #include "enclave_glue.h"
@@ -16,6 +23,8 @@
 #endif
 
 std::vector<Buffer*> buffer_list;
+std::vector<BatchRing*> batch_rings;
+std::vector<BatchRing*> output_rings;
 std::vector<DPIInfo> dpi_info_list;
 std::vector<int> dpi_y_size;
 int num_dpis;
@@ -35,12 +44,82 @@ double ***XTX_og_list;
 
 int total_row_size;
 
+QCFilter qc_filter;
+
 std::condition_variable start_thread_cv;
+std::mutex start_thread_lock;  // guards start_thread and hand out of setup tasks
 volatile bool start_thread = false;
 
+/* Setup work runs on the setup thread and on the regression threads waiting to start,
+   at most setup_workers of them at a time since each holds SETUP_SCRATCH_SIZE of buffers */
+class SetupScratch {
+    char* crypt_chunk;
+    char* plain_chunk;
+
+   public:
+    SetupScratch() : crypt_chunk(nullptr), plain_chunk(nullptr) {}
+    ~SetupScratch() {
+        delete[] crypt_chunk;
+        delete[] plain_chunk;
+    }
+    // ENCLAVE_READ_BUFFER_SIZE each, allocated by the first task that needs them
+    char* crypt() { return crypt_chunk ? crypt_chunk : (crypt_chunk = new char[ENCLAVE_READ_BUFFER_SIZE]); }
+    char* plain() { return plain_chunk ? plain_chunk : (plain_chunk = new char[ENCLAVE_READ_BUFFER_SIZE]); }
+};
+typedef std::function<void(SetupScratch&)> SetupTask;
+std::vector<SetupTask> setup_tasks;
+std::atomic<int> next_setup_task(0);
+std::atomic<int> finished_setup_tasks(0);
+int setup_workers = 0;
+int busy_setup_workers = 0;
+
+
+#define REDUCTION_SHARE_SIZE 32
+
+/* A reduction link's key is agreed on by the enclaves at its two ends. Each checks the
+   other's evidence shows this same enclave vouching for the rsa key it sent, then sends it
+   a random share encrypted to that key. The key hashes the child's share and the parent's,
+   so neither host learns it and a share swapped in by a host only breaks the link */
+static void setup_reduction_link(RSACrypto& rsa, const buffer_t& evidence, const int link) {
+    uint8_t peer_pub_key[RSA_PUB_KEY_SIZE];
+    std::vector<uint8_t> peer_evidence_buffer(MAX_EVIDENCE_SIZE);
+    int peer_evidence_size = 0;
+    bool rt = false;
+    while (!rt) {
+        getreductionpeer(&rt, link, peer_pub_key, &peer_evidence_buffer[0], &peer_evidence_size);
+    }
+    buffer_t peer_evidence = {&peer_evidence_buffer[0], (size_t)peer_evidence_size};
+    if (!rsa.verify_peer_evidence(evidence, peer_evidence, peer_pub_key)) {
+        std::cerr << "ERROR: failed to attest the enclave at reduction link " << link << std::endl;
+        exit(1);
+    }
 
-void mark_eof(const int thread_id) {
-    buffer_list[thread_id]->mark_eof();
+    uint8_t shares[2 * REDUCTION_SHARE_SIZE];
+    uint8_t* own_share = link == REDUCTION_PARENT_LINK ? shares : shares + REDUCTION_SHARE_SIZE;
+    uint8_t* peer_share = link == REDUCTION_PARENT_LINK ? shares + REDUCTION_SHARE_SIZE : shares;
+    unsigned char enc_share[256];
+    size_t share_size = sizeof(enc_share);
+    random_bytes(own_share, REDUCTION_SHARE_SIZE);
+    if (!rsa.encrypt(peer_pub_key, own_share, REDUCTION_SHARE_SIZE, enc_share, &share_size)) {
+        std::cerr << "ERROR: failed to encrypt the key share of reduction link " << link << std::endl;
+        exit(1);
+    }
+    sendreductionshare(link, enc_share);
+
+    rt = false;
+    while (!rt) {
+        getreductionshare(&rt, link, enc_share);
+    }
+    share_size = REDUCTION_SHARE_SIZE;
+    if (!rsa.decrypt(enc_share, sizeof(enc_share), peer_share, &share_size) || share_size != REDUCTION_SHARE_SIZE) {
+        std::cerr << "ERROR: failed to decrypt the key share of reduction link " << link << std::endl;
+        exit(1);
+    }
+    uint8_t link_key[32];
+    rsa.sha256(shares, sizeof(shares), link_key);
+    stats_store.set_link_key(link, link_key);
+    memset(shares, 0, sizeof(shares));
+    memset(link_key, 0, sizeof(link_key));
 }
 
 void setup_enclave_encryption(const int num_threads) {
@@ -64,6 +143,8 @@ void setup_enclave_encryption(const int num_threads) {
     dpi_info_list.resize(num_dpis);
     dpi_y_size.resize(num_dpis);
     buffer_list.resize(num_threads);
+    batch_rings.resize(num_threads);
+    output_rings.resize(num_threads);
 
     // We should store num_dpi number of aes keys/iv/contexts.
     for (DPIInfo& dpi: dpi_info_list) {
@@ -72,6 +153,8 @@ void setup_enclave_encryption(const int num_threads) {
             AESData aes;
             aes.aes_context = new mbedtls_aes_context();
             mbedtls_aes_init(aes.aes_context);
+            aes.row_iv_context = new mbedtls_aes_context();
+            mbedtls_aes_init(aes.row_iv_context);
             dpi.aes_list[thread_id] = aes;
         }
     }
@@ -96,19 +179,46 @@ void setup_enclave_encryption(const int num_threads) {
                 int ret = mbedtls_aes_setkey_dec(thread_aes_data.aes_context,
                                                  thread_aes_data.aes_key,
                                                  AES_KEY_LENGTH * 8);
+                ret |= mbedtls_aes_setkey_enc(thread_aes_data.row_iv_context,
+                                              thread_aes_data.aes_key,
+                                              AES_KEY_LENGTH * 8);
+                memcpy(thread_aes_data.row_iv_seed, thread_aes_data.aes_iv, AES_IV_LENGTH);
                 if (ret != 0) {
                     std::cout << "Set key failed." << std::endl;
                     exit(0);
                 }
             }
         }
-        delete aes_length;
         std::cout << "AES KEY and IV loaded" << std::endl;
+
+        // the children first, they wait on nothing but this node's welcome
+        if (stats_store.reduction()) {
+            for (int child = 0; child < stats_store.reduction_children(); ++child) {
+                setup_reduction_link(rsa, evidence, child);
+            }
+            if (stats_store.reduction_has_parent()) {
+                setup_reduction_link(rsa, evidence, REDUCTION_PARENT_LINK);
+            }
+            std::cout << "Reduction link keys agreed" << std::endl;
+        }
+        delete aes_length;
     } catch (ERROR_t& err) {
         std::cerr << "ERROR: fail to get AES KEY " << err.msg << std::endl;
     }
 }
 
+void setup_enclave_batch_ring(const int thread_id, void* ring, void* output_ring) {
+#ifndef NON_OE
+    // the rings are shared with the host, they must not alias enclave memory
+    if (!oe_is_outside_enclave(ring, sizeof(BatchRing)) || !oe_is_outside_enclave(output_ring, sizeof(BatchRing))) {
+        std::cerr << "ERROR: batch ring of thread " << thread_id << " is not in host memory" << std::endl;
+        exit(1);
+    }
+#endif
+    batch_rings[thread_id] = static_cast<BatchRing*>(ring);
+    output_rings[thread_id] = static_cast<BatchRing*>(output_ring);
+}
+
 void setup_num_patients() {
     // Read in number of patients at each institution
     char num_patients_buffer[ENCLAVE_SMALL_BUFFER_SIZE];
@@ -139,10 +249,170 @@ void setup_num_patients() {
     }
 }
 
-void setup_enclave_phenotypes(const int num_threads, EncAnalysis analysis_type, ImputePolicy impute_policy) {
-    char* buffer_decrypt = new char[ENCLAVE_READ_BUFFER_SIZE];
-    char* phenotype_buffer = new char[ENCLAVE_READ_BUFFER_SIZE];
+void setup_enclave_qc(QCPolicy qc_policy, double min_maf, double min_call_rate, double min_hwe_p) {
+    qc_filter = QCFilter(qc_policy, min_maf, min_call_rate, min_hwe_p);
+    if (qc_filter.enabled()) {
+        std::cout << "QC enabled: maf >= " << min_maf << ", call rate >= " << min_call_rate
+                  << ", hwe p >= " << min_hwe_p << std::endl;
+    }
+}
+
+void setup_enclave_conditional(const char* condition_loci, const int window) {
+    conditional.init(condition_loci, window);
+}
+
+void setup_enclave_stats(bool load_stats, bool export_stats) {
+    stats_store.init(load_stats, export_stats);
+}
+
+void setup_enclave_regions(const char* region_list) {
+    region_tests.init(region_list);
+}
+
+void setup_enclave_reduction(const int num_children, bool has_parent) {
+    stats_store.init_reduction(num_children, has_parent);
+    std::cout << "Reduction node with " << num_children << " children"
+              << (has_parent ? "" : ", reporting as root") << std::endl;
+}
+
+static void work_on_setup_tasks() {
+    SetupScratch scratch;
+    int task;
+    while ((task = next_setup_task++) < (int)setup_tasks.size()) {
+        setup_tasks[task](scratch);
+        finished_setup_tasks++;
+    }
+}
+
+// true if a regression thread holding start_thread_lock should help with setup
+static bool setup_tasks_waiting() {
+    return busy_setup_workers < setup_workers && next_setup_task < (int)setup_tasks.size();
+}
+
+// runs every task, returns once all are finished
+static void run_setup_tasks(std::vector<SetupTask>& tasks) {
+    {
+        std::lock_guard<std::mutex> raii(start_thread_lock);
+        setup_tasks.swap(tasks);
+        next_setup_task = 0;
+        finished_setup_tasks = 0;
+    }
+    start_thread_cv.notify_all();
+    work_on_setup_tasks();
+    std::unique_lock<std::mutex> raii(start_thread_lock);
+    while (finished_setup_tasks < (int)setup_tasks.size() || busy_setup_workers) {
+        start_thread_cv.wait(raii);
+    }
+    setup_tasks.clear();
+}
 
+// copies the y (cov_name empty) or covariant text of dpi from offset into chunk, returns the length of the whole text
+static int get_phenotype_chunk(const int dpi, const std::string& cov_name, const int offset, char* chunk) {
+    int size = 0;
+    while (!size) {
+        if (cov_name.empty()) {
+            gety(&size, dpi, offset, chunk);
+        } else {
+            getcov(&size, dpi, cov_name.c_str(), offset, chunk);
+        }
+    }
+    return size;
+}
+
+/* The y and covariant texts of a dpi are one CBC stream (after its patient count), so
+   each text starts from the last cipher block of the text before it. Finding those
+   blocks takes two small reads per text and lets every text be decrypted on its own. */
+struct PhenotypeText {
+    int dpi;
+    int column;
+    std::string cov_name;  // empty for y
+    unsigned char iv[AES_IV_LENGTH];
+};
+
+static void find_text_ivs(const int dpi, std::vector<PhenotypeText>& texts, SetupScratch& scratch) {
+    AESData& aes = dpi_info_list[dpi].aes_list.front();
+    for (PhenotypeText& text : texts) {
+        memcpy(text.iv, aes.aes_iv, AES_IV_LENGTH);
+        int total_size = get_phenotype_chunk(dpi, text.cov_name, 0, scratch.crypt());
+        if (total_size < AES_IV_LENGTH || total_size % AES_IV_LENGTH) {
+            std::cerr << "ERROR: phenotype text of dpi " << dpi << " is not whole AES blocks" << std::endl;
+            exit(1);
+        }
+        get_phenotype_chunk(dpi, text.cov_name, total_size - AES_IV_LENGTH, scratch.crypt());
+        memcpy(aes.aes_iv, scratch.crypt(), AES_IV_LENGTH);
+    }
+}
+
+/* Decrypts one dpi's y or covariant text into its column of phenotype_and_covars a chunk
+   at a time, so a dpi can have any number of patients. Returns the values read. */
+static int load_values(PhenotypeText& text, const int first_row, SetupScratch& scratch) {
+    const AESData& aes = dpi_info_list[text.dpi].aes_list.front();
+    CovarReader reader(gwas->phenotype_and_covars, text.column, first_row, dpi_y_size[text.dpi]);
+    char* crypt_chunk = scratch.crypt();
+    char* plain_chunk = scratch.plain();
+    int total_size = 0;
+    int offset = 0;
+    do {
+        int size = get_phenotype_chunk(text.dpi, text.cov_name, offset, crypt_chunk);
+        if (total_size && size != total_size) {
+            throw ReadtsvERROR("values of dpi " + std::to_string(text.dpi) + " changed size while read");
+        }
+        total_size = size;
+        int chunk_size = std::min(total_size - offset, ENCLAVE_READ_BUFFER_SIZE);
+        // CBC carries on from chunk to chunk, all but the last are whole blocks
+        aes_decrypt_data(aes.aes_context,
+                         text.iv,
+                         (const unsigned char*) crypt_chunk,
+                         chunk_size,
+                         (unsigned char*) plain_chunk);
+        offset += chunk_size;
+        int plain_size = chunk_size;
+        if (offset == total_size) {
+            // PKCS #7 padding of the last block
+            int padding = (unsigned char)plain_chunk[plain_size - 1];
+            if (padding > 0 && padding <= 16 && padding <= plain_size) {
+                plain_size -= padding;
+            }
+        }
+        reader.read_chunk(plain_chunk, plain_size);
+    } while (offset < total_size);
+    return reader.end_text();
+}
+
+// rows of the linear kernels start from the covariate products, summed over patient ranges in parallel
+static void setup_gram() {
+    const int dim = gwas->dim();
+    const int n = gwas->size();
+    const int num_ranges = std::max(1, std::min(n, 4 * (setup_workers + 1)));
+    std::vector<std::vector<double> > partial(num_ranges, std::vector<double>(dim * dim + dim, 0));
+    std::vector<SetupTask> tasks;
+    for (int range = 0; range < num_ranges; ++range) {
+        tasks.push_back([range, num_ranges, n, dim, &partial](SetupScratch&) {
+            int begin = (int)((long long)n * range / num_ranges);
+            int end = (int)((long long)n * (range + 1) / num_ranges);
+            gwas->add_gram(begin, end, &partial[range][0], &partial[range][dim * dim]);
+        });
+    }
+    run_setup_tasks(tasks);
+
+    gwas->XTX_og.assign(dim * dim, 0);
+    gwas->XTY_og.assign(dim, 0);
+    for (const std::vector<double>& sums : partial) {
+        for (int i = 0; i < dim * dim; ++i) {
+            gwas->XTX_og[i] += sums[i];
+        }
+        for (int i = 0; i < dim; ++i) {
+            gwas->XTY_og[i] += sums[dim * dim + i];
+        }
+    }
+    for (int j = 0; j < dim; j++) {
+        for (int k = j + 1; k < dim; ++k) {
+            gwas->XTX_og[j * dim + k] = gwas->XTX_og[k * dim + j];
+        }
+    }
+}
+
+void setup_enclave_phenotypes(const int num_threads, EncAnalysis analysis_type, ImputePolicy impute_policy) {
     // Read in covariants from each institution
     char covl[ENCLAVE_SMALL_BUFFER_SIZE];
     getcovlist(covl);
@@ -150,19 +420,9 @@ void setup_enclave_phenotypes(const int num_threads, EncAnalysis analysis_type,
     std::vector<std::string> covariant_names;
     split_delim(covlist.c_str(), covariant_names);
 
-    gwas = new GWAS(analysis_type, total_row_size, covariant_names.size() + 1);
-
-    try {
-        for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
-            // TODO: set buffer type accordingly
-            buffer_list[thread_id] = new Buffer(total_row_size, analysis_type, num_dpis, thread_id);
-        }
-    } catch (const std::exception &e) { 
-        std::cout << "Crash in buffer malloc with " << e.what() << std::endl;
-    }
-
     /* set up encrypted size and max batch line */
     int total_crypto_size = 0;
+    int total_data_size = 0;
     for (int dpi = 0; dpi < num_dpis; dpi++) {
         // Calculate compaction factor, ceil(plaintext size / 4) -> rounded up to nearest multiple of 16
         //int compacted_size = dpi_y_size[dpi];
@@ -176,88 +436,103 @@ void setup_enclave_phenotypes(const int num_threads, EncAnalysis analysis_type,
 
         // Add 2 for the tab delimiter and null terminating char
         total_crypto_size += compacted_size + 2;
+        total_data_size += dpi_info_list[dpi].size;
     }
-    // Add padding for Loci + Allele and list of dpis + 1 for new line at very end of sequence
-    total_crypto_size += MAX_LOCI_ALLELE_STR_SIZE + (num_dpis * 2) + 1;
-
-    int max_batch_lines = ENCLAVE_READ_BUFFER_SIZE / total_crypto_size;
-    if (!max_batch_lines) {
+    // Add the variant key, the list of dpis and 1 for new line at very end of sequence
+    total_crypto_size += VARIANT_KEY_SIZE + (num_dpis * 2) + 1;
+    // a line takes the larger of its encrypted text and its decrypted record in the batch buffers
+    size_t line_size = std::max((size_t)total_crypto_size, row_record_size(total_data_size));
+    if (line_size > ENCLAVE_READ_BUFFER_SIZE) {
         std::cerr << "Data is too long to fit into enclave read buffer" << std::endl;
         exit(1);
     }
-    setmaxbatchlines(max_batch_lines);
 
-    std::cout << "Init finished" << std::endl;
+    // size the batch buffers for what the covariates and the threads leave of the heap
+    MemoryPlan plan;
+    int thread_vectors = conditional.enabled() + region_tests.enabled();
+    bool plan_fits = plan_memory(total_row_size, covariant_names.size() + 1, num_threads,
+                                 line_size, thread_vectors, plan);
+    print_plan(plan, num_threads);
+    if (!plan_fits) {
+        std::cerr << "ERROR: " << total_row_size << " patients need an enclave heap of "
+                  << plan_heap_pages(plan) << " pages, set ENCLAVE_HEAP_PAGES and sign the enclave again" << std::endl;
+        exit(1);
+    }
+    int max_batch_lines = plan.batch_size / line_size;
 
-    // Read in y-vals from each institution
-    try {
-        for (int dpi = 0; dpi < num_dpis; ++dpi) {
-            int y_buffer_size = 0;
-            while (!y_buffer_size){
-                gety(&y_buffer_size, dpi, phenotype_buffer);
-            }
-            DPIInfo& info = dpi_info_list[dpi];
-            memset(buffer_decrypt, 0, ENCLAVE_READ_BUFFER_SIZE);
-            aes_decrypt_data(info.aes_list.front().aes_context,
-                             info.aes_list.front().aes_iv,
-                             (const unsigned char*) phenotype_buffer,
-                             y_buffer_size, 
-                             (unsigned char*) buffer_decrypt);
-            int read_size = gwas->phenotype_and_covars.read(buffer_decrypt, dpi_y_size[dpi]);
-            if (read_size != dpi_y_size[dpi]) {
-                throw ReadtsvERROR("y val size mismatch from dpi: " +
-                                    std::to_string(dpi) + " size expected: " + 
-                                    std::to_string(dpi_y_size[dpi]) + " got: " + 
-                                    std::to_string(read_size));
-            }
+    gwas = new GWAS(analysis_type, total_row_size, covariant_names.size() + 1);
+    setup_workers = plan.setup_workers;
+
+    /* y and covariates of every dpi are decrypted in parallel, before the batch buffers
+       are allocated so that their memory is free for the setup scratch */
+    std::vector<int> first_row(num_dpis, 0);
+    for (int dpi = 1; dpi < num_dpis; ++dpi) {
+        first_row[dpi] = first_row[dpi - 1] + dpi_y_size[dpi - 1];
+    }
+    std::vector<std::vector<PhenotypeText> > texts(num_dpis);
+    for (int dpi = 0; dpi < num_dpis; ++dpi) {
+        texts[dpi].push_back(PhenotypeText{dpi, 0, ""});
+        for (int i = 0; i < covariant_names.size(); ++i) {
+            if (covariant_names[i] == "1") continue;
+            texts[dpi].push_back(PhenotypeText{dpi, i + 1, covariant_names[i]});
         }
     }
-    catch (ERROR_t& err) {
-        std::cerr << "ERROR: fail to get correct y values " << err.msg << std::endl;
+    std::vector<SetupTask> tasks;
+    for (int dpi = 0; dpi < num_dpis; ++dpi) {
+        tasks.push_back([dpi, &texts](SetupScratch& scratch) { find_text_ivs(dpi, texts[dpi], scratch); });
     }
-    gwas->phenotype_and_covars.after_covar();
+    run_setup_tasks(tasks);
 
-    std::cout << "Y value loaded" << std::endl;
-    std::cout << "Starting Enclave: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "\n";
-    try{
-        for (int i = 0; i < covariant_names.size(); ++i) {
-            const std::string& cov_name = covariant_names[i];
-            if (cov_name == "1") {
-                gwas->phenotype_and_covars.init_1_covar(total_row_size);
-                gwas->phenotype_and_covars.after_covar();
-                continue;
-            }
-            for (int dpi = 0; dpi < num_dpis; ++dpi) {
-                int cov_buffer_size = 0;
-                while (!cov_buffer_size) {
-                    getcov(&cov_buffer_size, dpi, cov_name.c_str(), phenotype_buffer);
-                }
-                DPIInfo& info = dpi_info_list[dpi];
-                memset(buffer_decrypt, 0, ENCLAVE_READ_BUFFER_SIZE);
-                aes_decrypt_data(info.aes_list.front().aes_context,
-                                info.aes_list.front().aes_iv,
-                                (const unsigned char*) phenotype_buffer,
-                                cov_buffer_size, 
-                                (unsigned char*) buffer_decrypt);
-                int read_size = gwas->phenotype_and_covars.read(buffer_decrypt, dpi_y_size[dpi]);
-                if (read_size != dpi_y_size[dpi]) {
-                    throw ReadtsvERROR("covariant size mismatch from dpi: " +
-                                       std::to_string(dpi) + 
-                                       " size expected: " + std::to_string(dpi_y_size[dpi]) + 
-                                       " got: " + std::to_string(read_size));
+    for (int dpi = 0; dpi < num_dpis; ++dpi) {
+        for (PhenotypeText& text : texts[dpi]) {
+            tasks.push_back([&text, &first_row](SetupScratch& scratch) {
+                try {
+                    int read_size = load_values(text, first_row[text.dpi], scratch);
+                    if (read_size != dpi_y_size[text.dpi]) {
+                        throw ReadtsvERROR((text.column ? "covariant" : "y val") +
+                                           std::string(" size mismatch from dpi: ") + std::to_string(text.dpi) +
+                                           " size expected: " + std::to_string(dpi_y_size[text.dpi]) +
+                                           " got: " + std::to_string(read_size));
+                    }
+                } catch (ERROR_t& err) {
+                    std::cerr << "ERROR: fail to get correct " << (text.column ? "covariant" : "y")
+                              << " values: " << err.msg << std::endl;
+                } catch (const std::exception &e) {
+                    std::cout << "Crash in cov setup with " << e.what() << std::endl;
                 }
-            }
-            gwas->phenotype_and_covars.after_covar();
+            });
         }
-    } catch (ERROR_t& err) {
-        std::cerr << "ERROR: fail to get correct covariant values: " << err.msg << std::endl;
-    } catch (const std::exception &e) { 
-        std::cout << "Crash in cov setup with " << e.what() << std::endl;
     }
+    std::cout << "Starting Enclave: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "\n";
+    run_setup_tasks(tasks);
+    for (int i = 0; i < covariant_names.size(); ++i) {
+        if (covariant_names[i] == "1") {
+            gwas->phenotype_and_covars.init_1_covar(i + 1);
+        }
+    }
+    std::cout << "Y value loaded" << std::endl;
     std::cout << "Cov loaded" << std::endl;
 
-    delete[] phenotype_buffer;
-    delete[] buffer_decrypt;
+    if (analysis_type == EncAnalysis::linear || analysis_type == EncAnalysis::linear_dummy ||
+        analysis_type == EncAnalysis::linear_oblivious) {
+        setup_gram();
+    }
+
+    try {
+        for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
+            // TODO: set buffer type accordingly
+            buffer_list[thread_id] = new Buffer(total_row_size, analysis_type, num_dpis, thread_id, plan.batch_size);
+        }
+    } catch (const std::exception &e) { 
+        std::cout << "Crash in buffer malloc with " << e.what() << std::endl;
+    }
+
+    for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
+        buffer_list[thread_id]->set_batch_ring(batch_rings[thread_id], max_batch_lines);
+        buffer_list[thread_id]->set_output_ring(output_rings[thread_id]);
+    }
+
+    std::cout << "Init finished" << std::endl;
 
     // Padding to avoid false sharing - for some reason false sharing can still happen unless we make
     // this larger than a single cache block. Maybe prefetching/compiler optimizations cause invalidations?
@@ -277,11 +552,89 @@ void setup_enclave_phenotypes(const int num_threads, EncAnalysis analysis_type,
         std::cout << "Crash in add gwas with " << e.what() << std::endl;
     }
 
-    start_thread = true;
+    if (conditional.enabled()) {
+        if (analysis_type != EncAnalysis::linear) {
+            std::cerr << "ERROR: conditional analysis is only supported for linear regression" << std::endl;
+            exit(1);
+        }
+        conditional.setup(gwas, num_threads);
+    }
+
+    if (stats_store.enabled()) {
+        if (analysis_type != EncAnalysis::linear) {
+            std::cerr << "ERROR: the stats store is only supported for linear regression" << std::endl;
+            exit(1);
+        }
+        try {
+            stats_store.setup(gwas, num_threads, covlist, plan.store_budget);
+        } catch (MathError& err) {
+            std::cerr << "ERROR: stats store covariates are singular: " << err.msg << std::endl;
+            exit(1);
+        }
+    }
+
+    if (region_tests.enabled()) {
+        if (analysis_type != EncAnalysis::linear) {
+            std::cerr << "ERROR: region tests are only supported for linear regression" << std::endl;
+            exit(1);
+        }
+        try {
+            region_tests.setup(gwas, num_threads);
+        } catch (MathError& err) {
+            std::cerr << "ERROR: region test covariates are singular: " << err.msg << std::endl;
+            exit(1);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> raii(start_thread_lock);
+        start_thread = true;
+    }
     start_thread_cv.notify_all();
     std::cout << "Setup finished" << std::endl;
 }
 
+// conditional and stats store results print as linear ones, t is beta / se there too
+void conditional_result(VariantKey key, const uint8_t* data,
+                        std::vector<double>& g, std::vector<double>& WTg, ResultRecord& result) {
+    double results[3];
+    memset(&result, 0, sizeof(ResultRecord));
+    result.key = key;
+    result.type = RESULT_LINEAR;
+    if (conditional.score(data, dpi_y_size, g, WTg, results)) {
+        result.beta = results[0];
+        result.se = results[1];
+    } else {
+        result.flags = RESULT_NA;
+    }
+}
+
+void stats_result(VariantKey key, const StatsRecord& record, ResultRecord& result) {
+    double results[3];
+    memset(&result, 0, sizeof(ResultRecord));
+    result.key = key;
+    result.type = RESULT_LINEAR;
+    if (stats_store.solve(record, results)) {
+        result.beta = results[0];
+        result.se = results[1];
+    } else {
+        result.flags = RESULT_NA;
+    }
+}
+
+// variants only found in the loaded store have nothing but their text key
+void stats_output(const std::string& key, const StatsRecord& record, std::string& output_string) {
+    double results[3];
+    output_string += key;
+    if (stats_store.solve(record, results)) {
+        output_string += "\t" + std::to_string(results[0]) +
+                         "\t" + std::to_string(results[1]) +
+                         "\t" + std::to_string(results[2]) + "\n";
+    } else {
+        output_string += "\tNA\tNA\tNA\n";
+    }
+}
+
 void regression(const int thread_id, EncAnalysis analysis_type) {
     MXCSR mxcsr;
     mxcsr.set_mxcsr_flags();
@@ -292,19 +645,43 @@ void regression(const int thread_id, EncAnalysis analysis_type) {
     }
 
     std::string output_string;
-    std::string loci_string;
-    std::string alleles_string;
+    std::string variant_string;
+    QCReason qc_reason;
+    ResultRecord result;
+    const bool logistic = analysis_type == EncAnalysis::logistic || analysis_type == EncAnalysis::logistic_oblivious;
+
+    // conditional mode: region rows seen before all conditioning rows
+    std::vector<PendingRow> pending_rows;
+    std::vector<double> conditional_g;
+    std::vector<double> conditional_WTg;
+
+    // stats store mode: results come from this session's sums plus the loaded store
+    std::string stats_key;
+    StatsRecord stats_record;
+
+    // region tests: regions completed by this thread's position
+    std::vector<int> closed_regions;
+    std::vector<double> region_g;
     output_string.reserve(50);
-    loci_string.reserve(50);
-    alleles_string.reserve(20);
-
-    std::mutex useless_lock;
-    std::unique_lock<std::mutex> useless_lock_wrapper(useless_lock);
-    // experimental - checking to see if spinning up threads adds a noticable
-    // amount of overhead... need +1 TCS in config
-    while (!start_thread) {
-        // std::this_thread::yield();
-        start_thread_cv.wait(useless_lock_wrapper);
+    variant_string.reserve(50);
+
+    {
+        // experimental - checking to see if spinning up threads adds a noticable
+        // amount of overhead... need +1 TCS in config
+        // until then the thread helps decrypt phenotypes and sum the covariate products
+        std::unique_lock<std::mutex> raii(start_thread_lock);
+        while (!start_thread) {
+            if (setup_tasks_waiting()) {
+                busy_setup_workers++;
+                raii.unlock();
+                work_on_setup_tasks();
+                raii.lock();
+                busy_setup_workers--;
+                start_thread_cv.notify_all();
+                continue;
+            }
+            start_thread_cv.wait(raii);
+        }
     }
 
     Buffer* buffer = buffer_list[thread_id];
@@ -318,6 +695,36 @@ void regression(const int thread_id, EncAnalysis analysis_type) {
         }
         if (!batch) {
             // std::cout << "id " << thread_id << std::endl;
+            if (conditional.enabled()) {
+                conditional.finish_thread();
+                for (const PendingRow& pending : pending_rows) {
+                    conditional_result(pending.key, &pending.data[0], conditional_g, conditional_WTg, result);
+                    buffer->write(result);
+                }
+                pending_rows.clear();
+            }
+            if (stats_store.enabled()) {
+                std::vector<std::pair<std::string, StatsRecord> > unmatched;
+                if (stats_store.finish_thread(unmatched)) {
+                    for (const auto& entry : unmatched) {
+                        stats_store.append(thread_id, entry.first, entry.second);
+                        if (!stats_store.reports()) continue;
+                        stats_output(entry.first, entry.second, output_string);
+                        buffer->write(output_string);
+                        output_string.clear();
+                    }
+                }
+                stats_store.flush(thread_id);
+            }
+            if (region_tests.enabled()) {
+                region_tests.finish_thread(thread_id, closed_regions);
+                for (int region_id : closed_regions) {
+                    region_tests.output(region_id, dpi_y_size, output_string);
+                    buffer->write(output_string);
+                    output_string.clear();
+                }
+                closed_regions.clear();
+            }
             buffer->clean_up();
             break;
         }
@@ -352,29 +759,82 @@ void regression(const int thread_id, EncAnalysis analysis_type) {
             exit(0);
         }
         //stop_timer("parse_and_decrypt()");
-        //  compute results
-        loci_to_str(row->getloci(), loci_string);
-        alleles_to_str(row->getalleles(), alleles_string);
-        output_string += loci_string + "\t" + alleles_string;
+        // region results go to the thread's output buffer, a region can close on any row
+        if (region_tests.enabled()) {
+            region_tests.advance(thread_id, row->getloci(), closed_regions);
+            for (int region_id : closed_regions) {
+                region_tests.output(region_id, dpi_y_size, output_string);
+                buffer->write(output_string);
+                output_string.clear();
+            }
+            closed_regions.clear();
+        }
+        // only the region around the conditioning loci is re-scored, conditioning
+        // rows are collected before QC so a failing lead variant is still projected out
+        if (conditional.enabled()) {
+            if (!conditional.in_region(row->getloci())) continue;
+            conditional.add_condition(row->getloci(), row->get_data(), dpi_y_size);
+        }
+        // every row goes into the store, QC only decides what is reported this session
+        if (stats_store.enabled()) {
+            variant_key_str(row->getkey(), variant_string);
+            stats_key = variant_string;
+            stats_store.compute(row->get_data(), dpi_y_size, stats_record);
+            stats_store.merge_loaded(stats_key, stats_record);
+            stats_store.append(thread_id, stats_key, stats_record);
+        }
+        // variants failing QC never reach the kernel
+        if (qc_filter.enabled() && !qc_filter.check(row->get_data(), row->get_dpi_lengths(), qc_reason)) {
+            if (qc_filter.get_policy() == QCPolicy::FlagFailed) {
+                batch->write(qc_fail_result(row->getkey(), logistic ? RESULT_LOGISTIC : RESULT_LINEAR, qc_reason));
+            }
+            continue;
+        }
+        if (region_tests.enabled()) {
+            region_tests.add(row->getloci(), row->get_data(), dpi_y_size, row->get_data_size(), region_g);
+        }
+        if (conditional.enabled()) {
+            if (!conditional.is_ready()) {
+                pending_rows.push_back(PendingRow{row->getkey(),
+                                                  std::vector<uint8_t>(row->get_data(), row->get_data() + row->get_data_size())});
+                continue;
+            }
+            // pending rows go straight to the thread's output buffer, they may not fit in the batch
+            for (const PendingRow& pending : pending_rows) {
+                conditional_result(pending.key, &pending.data[0], conditional_g, conditional_WTg, result);
+                buffer->write(result);
+            }
+            pending_rows.clear();
+            conditional_result(row->getkey(), row->get_data(), conditional_g, conditional_WTg, result);
+            batch->write(result);
+            continue;
+        }
+        if (stats_store.enabled()) {
+            if (stats_store.reports()) {
+                stats_result(row->getkey(), stats_record, result);
+                batch->write(result);
+            }
+            continue;
+        }
+        //  compute results, formatted by the host
+        memset(&result, 0, sizeof(ResultRecord));
+        result.key = row->getkey();
+        result.type = logistic ? RESULT_LOGISTIC : RESULT_LINEAR;
         //start_timer("kernel()");
         bool converge;
         //std::cout << i++ << std::endl;
         try {
             converge = row->fit(thread_id);
-            row->get_outputs(thread_id, output_string);
+            row->get_outputs(thread_id, result);
 
-            if (analysis_type == EncAnalysis::logistic || analysis_type == EncAnalysis::logistic_oblivious) {
-                output_string += + "\t" + std::to_string(row->get_iterations()) + "\t";
-                // wanted to use a ternary, but the compiler doesn't like it?
+            if (logistic) {
+                result.iterations = row->get_iterations();
                 if (converge) {
-                    output_string += "true";
-                } else {
-                    output_string += "false";
+                    result.flags |= RESULT_CONVERGED;
                 }
             }
-            output_string += "\n";
         } catch (MathError& err) {
-            output_string += "\tNA\tNA\tNA\t1\tfalse\n";
+            result.flags = RESULT_MATH_ERROR;
             // cerr << "MathError while fiting " << ss.str() << ": " << err.msg
             //      << std::endl;
             // ss << "\tNA\tNA\tNA" << std::endl;
@@ -384,7 +844,6 @@ void regression(const int thread_id, EncAnalysis analysis_type) {
             exit(1);
         }
         //stop_timer("kernel()");
-        batch->write(output_string);
-        output_string.clear();
+        batch->write(result);
     }
 }
\ No newline at end of file
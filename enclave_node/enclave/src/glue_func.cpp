@@ -8,27 +8,40 @@ void getaes(bool* _retval, const int dpi_num, const int thread_id,
     *_retval = getaes(dpi_num, thread_id, key, iv);
 }
 
+void getreductionpeer(bool* _retval, const int link, uint8_t pub_key[RSA_PUB_KEY_SIZE],
+                      uint8_t evidence[MAX_EVIDENCE_SIZE], int* evidence_size) {
+    *_retval = getreductionpeer(link, pub_key, evidence, evidence_size);
+}
+
+void getreductionshare(bool* _retval, const int link, unsigned char share[256]) {
+    *_retval = getreductionshare(link, share);
+}
+
 void get_num_patients(int* _retval, const int dpi_num, 
                       char num_patients_buffer[ENCLAVE_SMALL_BUFFER_SIZE]) {
     *_retval = get_num_patients(dpi_num, num_patients_buffer);
 }
 
-void gety(int* _retval, const int dpi_num, 
+void gety(int* _retval, const int dpi_num, const int offset,
     char y[ENCLAVE_READ_BUFFER_SIZE]){
-    *_retval = gety(dpi_num, y);
+    *_retval = gety(dpi_num, offset, y);
 }
 
 void getcov(int* _retval, const int dpi_num,
             const char cov_name[MAX_DPINAME_LENGTH],
+            const int offset,
             char cov[ENCLAVE_READ_BUFFER_SIZE]){
-    *_retval = getcov(dpi_num, cov_name, cov);
+    *_retval = getcov(dpi_num, cov_name, offset, cov);
 }
 
-void getbatch(int* _retval, char batch[ENCLAVE_READ_BUFFER_SIZE],
-              const int thread_id){
-    *_retval = getbatch(batch, thread_id);
+void waitbatch(bool* _retval, const int thread_id) {
+    *_retval = waitbatch(thread_id);
 }
 
-void mark_eof_wrapper(const int thread_id) {
+void readstats(int* _retval, uint8_t chunk[ENCLAVE_READ_BUFFER_SIZE]) {
+    *_retval = readstats(chunk);
+}
 
-}
\ No newline at end of file
+void waitoutput(bool* _retval, const int thread_id, const int length) {
+    *_retval = waitoutput(thread_id, length);
+}
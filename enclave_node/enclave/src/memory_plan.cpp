@@ -0,0 +1,60 @@
+#include "memory_plan.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "enc_gwas.h"
+
+#define MB (1024.0 * 1024.0)
+
+static size_t align_down(size_t size) { return size / ROW_ALIGNMENT * ROW_ALIGNMENT; }
+static size_t align_up(size_t size) { return align_down(size + ROW_ALIGNMENT - 1); }
+
+bool plan_memory(int n, int dim, int num_threads, size_t min_batch_size, int thread_vectors, MemoryPlan& plan) {
+#ifdef NON_OE
+    plan.heap_size = 0;
+#else
+    plan.heap_size = (size_t)ENCLAVE_HEAP_PAGES * ENCLAVE_PAGE_SIZE;
+#endif
+    plan.covariate_size = (size_t)n * dim * sizeof(double);
+    // the six global per thread arrays, the row's dim x dim matrices and any n long vectors
+    plan.scratch_size = 6 * get_padded_buffer_len(dim) * sizeof(double) +
+                        4 * (size_t)dim * dim * sizeof(double) +
+                        (size_t)thread_vectors * n * sizeof(double);
+    plan.output_size = 2 * ENCLAVE_READ_BUFFER_SIZE;
+
+    size_t fixed_size = plan.covariate_size + MEMORY_PLAN_HEADROOM +
+                        num_threads * (plan.scratch_size + plan.output_size);
+    size_t min_size = align_up(min_batch_size);
+    plan.batch_size = align_down(ENCLAVE_READ_BUFFER_SIZE);
+    bool fits = true;
+    if (plan.heap_size) {
+        size_t available = plan.heap_size > fixed_size ? plan.heap_size - fixed_size : 0;
+        plan.batch_size = std::min(plan.batch_size, align_down(available / (3 * num_threads)));
+        fits = plan.batch_size >= min_size;
+    }
+    plan.batch_size = std::max(plan.batch_size, min_size);
+    plan.total_size = fixed_size + 3 * num_threads * plan.batch_size;
+    plan.store_budget = SIZE_MAX;
+    if (plan.heap_size) {
+        plan.store_budget = plan.heap_size > plan.total_size ? plan.heap_size - plan.total_size : 0;
+    }
+    // the setup thread always has its scratch, the headroom covers it
+    plan.setup_workers = std::min((size_t)num_threads, 3 * num_threads * plan.batch_size / SETUP_SCRATCH_SIZE);
+    return fits;
+}
+
+size_t plan_heap_pages(const MemoryPlan& plan) {
+    return (plan.total_size + ENCLAVE_PAGE_SIZE - 1) / ENCLAVE_PAGE_SIZE;
+}
+
+void print_plan(const MemoryPlan& plan, int num_threads) {
+    std::cout << "Memory plan: covariates " << plan.covariate_size / MB << " MB, "
+              << num_threads << " threads x (" << plan.scratch_size / MB << " MB scratch, "
+              << plan.output_size / MB << " MB output, 3 x " << plan.batch_size / MB << " MB batch), "
+              << plan.total_size / MB << " MB";
+    if (plan.heap_size) {
+        std::cout << " of a " << plan.heap_size / MB << " MB heap";
+    }
+    std::cout << ", " << plan.setup_workers << " setup workers" << std::endl;
+}
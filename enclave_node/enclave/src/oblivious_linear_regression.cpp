@@ -21,28 +21,11 @@ Oblivious_lin_row::Oblivious_lin_row(int _size, const std::vector<int>& sizes, G
 
     double **XTX_og = XTX_og_list[offset];
 
-    /* calculate XTX_og, XTY_og */
+    /* XTX_og, XTY_og are the same for every thread, computed once at setup */
     for (int i = 0; i < num_dimensions; i++) {
-        XTY_og[i] = 0;
+        XTY_og[i] = gwas->XTY_og[i];
         for (int j = 0; j < num_dimensions; j++) {
-            XTX_og[i][j] = 0;
-        }
-    }
-
-    for (int i = 0; i < n; ++i){
-        const std::vector<double>& patient_pnc = gwas->phenotype_and_covars.data[i];
-        double y = patient_pnc[0];
-        for (int j = 1; j < num_dimensions; ++j) {  // starting from second row
-            XTY_og[j] += patient_pnc[j] * y;
-            for (int k = 1; k <= j; ++k){
-                XTX_og[j][k] += patient_pnc[j] * patient_pnc[k];
-            }
-        }
-    }
-
-    for (int j = 0; j < num_dimensions; j++){
-        for (int k = j + 1; k < num_dimensions; ++k){
-            XTX_og[j][k] = XTX_og[k][j];
+            XTX_og[i][j] = gwas->XTX_og[i * num_dimensions + j];
         }
     }
 }
@@ -80,7 +63,7 @@ bool Oblivious_lin_row::fit(int thread_id, int max_iteration, double sig) {
     unsigned int data_idx = 0, dpi_offset = 0, dpi_idx = 0;
     bool is_NA;
     for (int i = 0; i < n; ++i) {
-        const std::vector<double>& patient_pnc = gwas->phenotype_and_covars.data[i];
+        const double* patient_pnc = gwas->phenotype_and_covars.row(i);
 
         double x = (data[(i + dpi_offset) / 4] >> (((i + dpi_offset) % 4) * 2) ) & 0b11;
         is_NA = is_NA_uint8(x);
@@ -119,7 +102,7 @@ bool Oblivious_lin_row::fit(int thread_id, int max_iteration, double sig) {
     dpi_idx = 0;
 
     for (int i = 0; i < n; ++i) {
-        const std::vector<double>& patient_pnc = gwas->phenotype_and_covars.data[i];
+        const double* patient_pnc = gwas->phenotype_and_covars.row(i);
 
         double x = (data[(i + dpi_offset) / 4] >> (((i + dpi_offset) % 4) * 2) ) & 0b11;
         is_NA = is_NA_uint8(x);
@@ -150,9 +133,8 @@ bool Oblivious_lin_row::fit(int thread_id, int max_iteration, double sig) {
     return true;
 }
 
-void Oblivious_lin_row::get_outputs(int thread_id, std::string& output_string) {
+void Oblivious_lin_row::get_outputs(int thread_id, ResultRecord& result) {
     int offset = thread_id * get_padded_buffer_len(num_dimensions);
-    output_string += "\t" + std::to_string((beta_g + offset)[0]) +
-                     "\t" + std::to_string((beta_g + offset)[1]) +
-                     "\t" + std::to_string((beta_g + offset)[0] / (beta_g + offset)[1]);
+    result.beta = (beta_g + offset)[0];
+    result.se = (beta_g + offset)[1];
 }
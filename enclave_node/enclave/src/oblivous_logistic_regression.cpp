@@ -99,7 +99,7 @@ void Oblivious_log_row::update_estimate() {
         is_NA = is_NA_uint8(x);
         x = predicated_assignment(is_NA, x, genotype_average);
 
-        const std::vector<double>& patient_pnc = gwas->phenotype_and_covars.data[i];
+        const double* patient_pnc = gwas->phenotype_and_covars.row(i);
 
         y_est = (beta_g + offset)[0] * x;
         for (int j = 1; j < num_dimensions; j++) {
@@ -125,7 +125,7 @@ void Oblivious_log_row::update_estimate() {
 }
 
 //Good!
-void Oblivious_log_row::update_upperH_and_Grad(double y_est, double x, const std::vector<double>& patient_pnc) {
+void Oblivious_log_row::update_upperH_and_Grad(double y_est, double x, const double* patient_pnc) {
     double y_est_1_y = y_est * (1 - y_est);
     double y_delta = patient_pnc[0] - y_est;
     (Grad_g + offset)[0] += y_delta * x;
@@ -143,14 +143,12 @@ void Oblivious_log_row::update_upperH_and_Grad(double y_est, double x, const std
     }
 }
 
-void Oblivious_log_row::get_outputs(int thread_id, std::string& output_string) {
+void Oblivious_log_row::get_outputs(int thread_id, ResultRecord& result) {
     if (!fitted) {
-        output_string += "\tNA\tNA\tNA";
+        result.flags |= RESULT_NA;
         fitted = true;
         return;
     }
-    output_string += "\t" + std::to_string((beta_g + offset)[0]) +
-                     "\t" + std::to_string(standard_error) +
-                     "\t" + std::to_string((beta_g + offset)[0] / standard_error);
-
+    result.beta = (beta_g + offset)[0];
+    result.se = standard_error;
 }
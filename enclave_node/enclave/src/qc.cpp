@@ -0,0 +1,127 @@
+#include "qc.h"
+
+#include <algorithm>
+#include <cstring>
+
+// low/high bit of every 2 bit genotype in a 64 bit word
+#define LOW_BITS_MASK 0x5555555555555555ULL
+
+// 0 -> hom ref, 1 -> het, 2 -> hom alt, 3 -> NA
+static inline void count_word(uint64_t word, GenotypeCounts& counts) {
+    uint64_t lo = word & LOW_BITS_MASK;
+    uint64_t hi = (word >> 1) & LOW_BITS_MASK;
+    counts.missing += __builtin_popcountll(lo & hi);
+    counts.het += __builtin_popcountll(lo & ~hi);
+    counts.hom_alt += __builtin_popcountll(hi & ~lo);
+}
+
+void count_genotypes(const uint8_t* data, const std::vector<int>& dpi_lengths, GenotypeCounts& counts) {
+    counts.het = 0;
+    counts.hom_alt = 0;
+    counts.missing = 0;
+    int total = 0;
+
+    const uint8_t* dpi_data = data;
+    for (int length : dpi_lengths) {
+        int full_bytes = length / 4;
+        int idx = 0;
+        uint64_t word;
+        for (; idx + (int)sizeof(uint64_t) <= full_bytes; idx += sizeof(uint64_t)) {
+            memcpy(&word, dpi_data + idx, sizeof(uint64_t));
+            count_word(word, counts);
+        }
+        // zero filled pairs count as hom ref, which is derived below
+        if (idx < full_bytes) {
+            word = 0;
+            memcpy(&word, dpi_data + idx, full_bytes - idx);
+            count_word(word, counts);
+        }
+        // missing dpis are filled with NA_byte, so mask out the padding pairs
+        int tail = length % 4;
+        if (tail) {
+            count_word(dpi_data[full_bytes] & ((1u << (tail * 2)) - 1), counts);
+        }
+        dpi_data += (length + 3) / 4;
+        total += length;
+    }
+    counts.hom_ref = total - counts.het - counts.hom_alt - counts.missing;
+}
+
+double hwe_exact_p(int obs_het, int obs_hom1, int obs_hom2) {
+    int obs_homc = std::max(obs_hom1, obs_hom2);
+    int obs_homr = std::min(obs_hom1, obs_hom2);
+
+    int rare_copies = 2 * obs_homr + obs_het;
+    int genotypes = obs_het + obs_homc + obs_homr;
+    if (genotypes == 0 || rare_copies == 0) {
+        return 1.0;
+    }
+
+    std::vector<double> het_probs(rare_copies + 1, 0.0);
+
+    // start at the most likely het count and walk out in both directions
+    int mid = (int)((long long)rare_copies * (2 * genotypes - rare_copies) / (2 * genotypes));
+    if ((rare_copies & 1) ^ (mid & 1)) {
+        mid++;
+    }
+
+    int curr_het = mid;
+    int curr_homr = (rare_copies - mid) / 2;
+    int curr_homc = genotypes - curr_het - curr_homr;
+
+    het_probs[mid] = 1.0;
+    double sum = het_probs[mid];
+    for (curr_het = mid; curr_het > 1; curr_het -= 2) {
+        het_probs[curr_het - 2] = het_probs[curr_het] * curr_het * (curr_het - 1.0) /
+                                  (4.0 * (curr_homr + 1.0) * (curr_homc + 1.0));
+        sum += het_probs[curr_het - 2];
+        curr_homr++;
+        curr_homc++;
+    }
+
+    curr_homr = (rare_copies - mid) / 2;
+    curr_homc = genotypes - mid - curr_homr;
+    for (curr_het = mid; curr_het <= rare_copies - 2; curr_het += 2) {
+        het_probs[curr_het + 2] = het_probs[curr_het] * 4.0 * curr_homr * curr_homc /
+                                  ((curr_het + 2.0) * (curr_het + 1.0));
+        sum += het_probs[curr_het + 2];
+        curr_homr--;
+        curr_homc--;
+    }
+
+    double obs_prob = het_probs[obs_het] / sum;
+    double p_hwe = 0.0;
+    for (int i = 0; i <= rare_copies; i++) {
+        double prob = het_probs[i] / sum;
+        if (prob <= obs_prob) {
+            p_hwe += prob;
+        }
+    }
+    return std::min(1.0, p_hwe);
+}
+
+bool QCFilter::check(const uint8_t* data, const std::vector<int>& dpi_lengths, QCReason& reason) const {
+    GenotypeCounts counts;
+    count_genotypes(data, dpi_lengths, counts);
+
+    int total = counts.called() + counts.missing;
+    int called = counts.called();
+    if (!called || (double)called / total < min_call_rate) {
+        reason = QC_CALL_RATE;
+        return false;
+    }
+
+    double alt_freq = (counts.het + 2.0 * counts.hom_alt) / (2.0 * called);
+    double maf = std::min(alt_freq, 1 - alt_freq);
+    // monomorphic sites always fail, they can't be fit
+    if (maf <= 0 || maf < min_maf) {
+        reason = QC_MAF;
+        return false;
+    }
+
+    if (min_hwe_p > 0 && hwe_exact_p(counts.het, counts.hom_ref, counts.hom_alt) < min_hwe_p) {
+        reason = QC_HWE;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,428 @@
+#include "region_test.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "conditional.h"
+
+RegionTests region_tests;
+
+#define LOW_BITS_MASK 0x5555555555555555ULL
+#define END_OF_DATA UINT64_MAX
+
+// Beta(1, 25) density of the maf, the SKAT default weight
+#define WEIGHT_BETA_B 25
+
+static inline uint64_t position_key(int chrom, int loc) {
+    return ((uint64_t)chrom << 32) | (uint32_t)loc;
+}
+
+/////////////////////////////////////////////////////////
+////////////////   Distributions    /////////////////////
+/////////////////////////////////////////////////////////
+
+// regularized upper incomplete gamma Q(a, x)
+static double gamma_q(double a, double x) {
+    if (x <= 0) {
+        return 1;
+    }
+    double log_prefix = -x + a * std::log(x) - std::lgamma(a);
+    if (x < a + 1) {
+        // series for P(a, x)
+        double ap = a;
+        double del = 1 / a;
+        double sum = del;
+        for (int i = 0; i < 1000; ++i) {
+            ap += 1;
+            del *= x / ap;
+            sum += del;
+            if (std::fabs(del) < std::fabs(sum) * 1e-15) break;
+        }
+        return std::max(0.0, 1 - sum * std::exp(log_prefix));
+    }
+    // continued fraction for Q(a, x), modified Lentz
+    const double tiny = 1e-300;
+    double b = x + 1 - a;
+    double c = 1 / tiny;
+    double d = 1 / b;
+    double h = d;
+    for (int i = 1; i < 1000; ++i) {
+        double an = -i * (i - a);
+        b += 2;
+        d = an * d + b;
+        if (std::fabs(d) < tiny) d = tiny;
+        c = b + an / c;
+        if (std::fabs(c) < tiny) c = tiny;
+        d = 1 / d;
+        double del = d * c;
+        h *= del;
+        if (std::fabs(del - 1) < 1e-15) break;
+    }
+    return std::exp(log_prefix) * h;
+}
+
+// Poisson mixture of central chi squares
+double noncentral_chisq_sf(double x, double df, double ncp) {
+    if (x <= 0) {
+        return 1;
+    }
+    if (ncp <= 0) {
+        return gamma_q(df / 2, x / 2);
+    }
+    double lambda = ncp / 2;
+    int k_max = (int)(lambda + 20 * std::sqrt(lambda) + 50);
+    double sf = 0;
+    for (int k = 0; k <= k_max; ++k) {
+        double log_weight = -lambda + k * std::log(lambda) - std::lgamma(k + 1.0);
+        sf += std::exp(log_weight) * gamma_q(df / 2 + k, x / 2);
+    }
+    return std::min(1.0, sf);
+}
+
+// Liu, Tang and Zhang (2009): match Q = sum lambda_j chi2_1 to a noncentral chi square
+// with c_k = tr(K^k), the sum of the k-th powers of the eigenvalues
+double liu_pvalue(double Q, double c1, double c2, double c3, double c4) {
+    double s1 = c3 / std::pow(c2, 1.5);
+    double s2 = c4 / (c2 * c2);
+    double a, ncp, df;
+    if (s1 * s1 > s2) {
+        a = 1 / (s1 - std::sqrt(s1 * s1 - s2));
+        ncp = s1 * a * a * a - a * a;
+        df = a * a - 2 * ncp;
+    } else {
+        a = 1 / s1;
+        ncp = 0;
+        df = 1 / (s1 * s1);
+    }
+    double t = (Q - c1) / std::sqrt(2 * c2);
+    return noncentral_chisq_sf(t * std::sqrt(2.0) * a + df + ncp, df, ncp);
+}
+
+/////////////////////////////////////////////////////////
+////////////////   Genotype products    /////////////////
+/////////////////////////////////////////////////////////
+
+// code 1 -> het, 2 -> hom alt, 3 -> NA, hom ref never contributes to a product
+static inline void count_word_pair(uint64_t word_a, uint64_t word_b, uint32_t counts[3][3]) {
+    uint64_t lo_a = word_a & LOW_BITS_MASK;
+    uint64_t hi_a = (word_a >> 1) & LOW_BITS_MASK;
+    uint64_t lo_b = word_b & LOW_BITS_MASK;
+    uint64_t hi_b = (word_b >> 1) & LOW_BITS_MASK;
+    uint64_t codes_a[3] = {lo_a & ~hi_a, hi_a & ~lo_a, lo_a & hi_a};
+    uint64_t codes_b[3] = {lo_b & ~hi_b, hi_b & ~lo_b, lo_b & hi_b};
+    for (int x = 0; x < 3; ++x) {
+        if (!codes_a[x]) continue;
+        for (int y = 0; y < 3; ++y) {
+            counts[x][y] += __builtin_popcountll(codes_a[x] & codes_b[y]);
+        }
+    }
+}
+
+void joint_genotype_counts(const uint8_t* a, const uint8_t* b, const std::vector<int>& dpi_lengths,
+                           uint32_t counts[3][3]) {
+    memset(counts, 0, sizeof(uint32_t) * 9);
+    for (int length : dpi_lengths) {
+        int full_bytes = length / 4;
+        int idx = 0;
+        uint64_t word_a, word_b;
+        for (; idx + (int)sizeof(uint64_t) <= full_bytes; idx += sizeof(uint64_t)) {
+            memcpy(&word_a, a + idx, sizeof(uint64_t));
+            memcpy(&word_b, b + idx, sizeof(uint64_t));
+            count_word_pair(word_a, word_b, counts);
+        }
+        if (idx < full_bytes) {
+            word_a = 0;
+            word_b = 0;
+            memcpy(&word_a, a + idx, full_bytes - idx);
+            memcpy(&word_b, b + idx, full_bytes - idx);
+            count_word_pair(word_a, word_b, counts);
+        }
+        // mask out the padding pairs, missing dpis are filled with NA_byte
+        int tail = length % 4;
+        if (tail) {
+            uint8_t mask = (1u << (tail * 2)) - 1;
+            count_word_pair(a[full_bytes] & mask, b[full_bytes] & mask, counts);
+        }
+        a += (length + 3) / 4;
+        b += (length + 3) / 4;
+    }
+}
+
+/////////////////////////////////////////////////////////
+////////////////   Regions    ///////////////////////////
+/////////////////////////////////////////////////////////
+
+void RegionTests::init(const std::string& region_list) {
+    std::vector<std::string> lines;
+    split_delim(region_list.c_str(), lines, '\n');
+    std::vector<std::string> fields;
+    for (const std::string& line : lines) {
+        fields.clear();
+        split_delim(line.c_str(), fields);
+        if (fields.size() < 4) continue;
+        Region region;
+        region.chrom = fields[0] == "X" ? LOCI_X : std::stoi(fields[0]);
+        region.start = std::stoi(fields[1]);
+        region.end = std::stoi(fields[2]);
+        region.name = fields[3];
+        region.closed = false;
+        regions.push_back(region);
+    }
+    std::sort(regions.begin(), regions.end(), [](const Region& a, const Region& b) {
+        return position_key(a.chrom, a.start) < position_key(b.chrom, b.start);
+    });
+
+    // regions may overlap, so lookups need the largest end before and the smallest end after each one
+    start_keys.resize(regions.size());
+    max_end_before.resize(regions.size());
+    min_end_after.resize(regions.size() + 1);
+    min_end_after[regions.size()] = END_OF_DATA;
+    uint64_t max_end = 0;
+    for (size_t i = 0; i < regions.size(); ++i) {
+        start_keys[i] = position_key(regions[i].chrom, regions[i].start);
+        max_end = std::max(max_end, position_key(regions[i].chrom, regions[i].end));
+        max_end_before[i] = max_end;
+    }
+    for (size_t i = regions.size(); i-- > 0;) {
+        min_end_after[i] = std::min(min_end_after[i + 1], position_key(regions[i].chrom, regions[i].end));
+    }
+}
+
+void RegionTests::setup(GWAS* _gwas, int _num_threads) {
+    gwas = _gwas;
+    n = gwas->size();
+    q = gwas->dim() - 1;
+    num_threads = _num_threads;
+
+    // null model y ~ covariates
+    std::vector<double> CTC(q * q, 0);
+    std::vector<double> CTy(q, 0);
+    for (int i = 0; i < n; ++i) {
+        const double* patient_pnc = gwas->phenotype_and_covars.row(i);
+        for (int j = 0; j < q; ++j) {
+            CTy[j] += patient_pnc[j + 1] * patient_pnc[0];
+            for (int k = 0; k < q; ++k) {
+                CTC[j * q + k] += patient_pnc[j + 1] * patient_pnc[k + 1];
+            }
+        }
+    }
+    CTC_inv.assign(q * q, 0);
+    if (q) {
+        SqrMatrix CTC_mat(q, 2);
+        for (int j = 0; j < q; ++j) {
+            for (int k = 0; k < q; ++k) {
+                CTC_mat.assign(j, k, CTC[j * q + k]);
+            }
+        }
+        CTC_mat.INV();
+        for (int j = 0; j < q; ++j) {
+            for (int k = 0; k < q; ++k) {
+                CTC_inv[j * q + k] = CTC_mat.t[j][k];
+            }
+        }
+    }
+    std::vector<double> beta(q, 0);
+    for (int j = 0; j < q; ++j) {
+        for (int k = 0; k < q; ++k) {
+            beta[j] += CTC_inv[j * q + k] * CTy[k];
+        }
+    }
+    residuals.resize(n);
+    rTr = 0;
+    for (int i = 0; i < n; ++i) {
+        const double* patient_pnc = gwas->phenotype_and_covars.row(i);
+        double r = patient_pnc[0];
+        for (int j = 0; j < q; ++j) {
+            r -= patient_pnc[j + 1] * beta[j];
+        }
+        residuals[i] = r;
+        rTr += r * r;
+    }
+    sigma2 = rTr / (n - q);
+
+    thread_pos.reset(new std::atomic<uint64_t>[num_threads]);
+    for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
+        thread_pos[thread_id] = 0;
+    }
+    std::vector<int> unused;
+    close_regions(unused);
+    std::cout << "Region tests on " << regions.size() << " regions" << std::endl;
+}
+
+// lock must be held
+void RegionTests::close_regions(std::vector<int>& closed) {
+    uint64_t min_pos = END_OF_DATA;
+    for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
+        min_pos = std::min(min_pos, thread_pos[thread_id].load());
+    }
+    uint64_t next = END_OF_DATA;
+    for (size_t i = first_open; i < regions.size(); ++i) {
+        Region& region = regions[i];
+        // regions are sorted by start, no later region can be complete yet
+        if (start_keys[i] >= min_pos) {
+            next = std::min(next, min_end_after[i]);
+            break;
+        }
+        if (region.closed) continue;
+        uint64_t end = position_key(region.chrom, region.end);
+        if (end < min_pos) {
+            region.closed = true;
+            closed.push_back(i);
+        } else {
+            next = std::min(next, end);
+        }
+    }
+    while (first_open < regions.size() && regions[first_open].closed) {
+        first_open++;
+    }
+    next_close = next;
+}
+
+void RegionTests::advance(int thread_id, const Loci& loci, std::vector<int>& closed) {
+    uint64_t pos = position_key(loci.chrom, loci.loc);
+    thread_pos[thread_id] = pos;
+    if (pos > next_close) {
+        std::lock_guard<std::mutex> raii(lock);
+        close_regions(closed);
+    }
+}
+
+void RegionTests::add(const Loci& loci, const uint8_t* data, const std::vector<int>& dpi_lengths, int data_size,
+                      std::vector<double>& g) {
+    // BED is 0 based half open, loci are 1 based
+    uint64_t pos = position_key(loci.chrom, loci.loc);
+    std::vector<int> covering;
+    int i = std::lower_bound(start_keys.begin(), start_keys.end(), pos) - start_keys.begin();
+    while (--i >= 0 && max_end_before[i] >= pos) {
+        if (pos <= position_key(regions[i].chrom, regions[i].end)) {
+            covering.push_back(i);
+        }
+    }
+    if (covering.empty()) {
+        return;
+    }
+
+    RegionVariant variant;
+    g.resize(n);
+    decode_genotypes(data, dpi_lengths, &g[0]);
+    double sum = 0;
+    variant.gr = 0;
+    variant.CTg.assign(q, 0);
+    for (int i = 0; i < n; ++i) {
+        const double* patient_pnc = gwas->phenotype_and_covars.row(i);
+        double x = g[i];
+        sum += x;
+        variant.gr += x * residuals[i];
+        for (int j = 0; j < q; ++j) {
+            variant.CTg[j] += patient_pnc[j + 1] * x;
+        }
+    }
+    // missing genotypes were imputed with the called average, so this is the called average
+    variant.mu = sum / n;
+    double maf = std::min(variant.mu / 2, 1 - variant.mu / 2);
+    variant.weight = WEIGHT_BETA_B * std::pow(1 - maf, WEIGHT_BETA_B - 1);
+    variant.data.assign(data, data + data_size);
+
+    std::lock_guard<std::mutex> raii(lock);
+    for (int i : covering) {
+        if (regions[i].closed) {
+            // rows of a thread arrived out of position order
+            late_variants++;
+            continue;
+        }
+        regions[i].variants.push_back(variant);
+    }
+}
+
+void RegionTests::finish_thread(int thread_id, std::vector<int>& closed) {
+    thread_pos[thread_id] = END_OF_DATA;
+    std::lock_guard<std::mutex> raii(lock);
+    close_regions(closed);
+    if (first_open == regions.size() && late_variants) {
+        std::cout << late_variants << " region variants arrived after their region closed and were left out" << std::endl;
+        late_variants = 0;
+    }
+}
+
+void RegionTests::output(int region_id, const std::vector<int>& dpi_lengths, std::string& output_string) {
+    Region& region = regions[region_id];
+    const std::vector<RegionVariant>& variants = region.variants;
+    int m = variants.size();
+    output_string += (region.chrom == LOCI_X ? std::string("X") : std::to_string(region.chrom)) + ":" +
+                     std::to_string(region.start) + "-" + std::to_string(region.end) + "\t" + region.name +
+                     "\t" + std::to_string(m);
+
+    // K = W G^T P G W with P the projection off the covariates
+    std::vector<double> K((size_t)m * m);
+    uint32_t counts[3][3];
+    for (int j = 0; j < m; ++j) {
+        const RegionVariant& a = variants[j];
+        double val_a[3] = {1, 2, a.mu};
+        std::vector<double> A_CTg(q, 0);
+        for (int l = 0; l < q; ++l) {
+            for (int k = 0; k < q; ++k) {
+                A_CTg[l] += CTC_inv[l * q + k] * a.CTg[k];
+            }
+        }
+        for (int k = j; k < m; ++k) {
+            const RegionVariant& b = variants[k];
+            double val_b[3] = {1, 2, b.mu};
+            joint_genotype_counts(&a.data[0], &b.data[0], dpi_lengths, counts);
+            double gg = 0;
+            for (int x = 0; x < 3; ++x) {
+                for (int y = 0; y < 3; ++y) {
+                    gg += counts[x][y] * val_a[x] * val_b[y];
+                }
+            }
+            for (int l = 0; l < q; ++l) {
+                gg -= A_CTg[l] * b.CTg[l];
+            }
+            K[(size_t)j * m + k] = K[(size_t)k * m + j] = a.weight * b.weight * gg;
+        }
+    }
+
+    // burden: regress y on the weighted genotype sum
+    double score = 0;
+    double info = 0;
+    double Q = 0;
+    for (int j = 0; j < m; ++j) {
+        double weighted_score = variants[j].weight * variants[j].gr;
+        score += weighted_score;
+        Q += weighted_score * weighted_score;
+        for (int k = 0; k < m; ++k) {
+            info += K[(size_t)j * m + k];
+        }
+    }
+    if (m && info > 0) {
+        // same degrees of freedom as Lin_row
+        double beta = score / info;
+        double sse = (rTr - beta * score) / (n - (q + 1) - 1);
+        double se = std::sqrt(sse / info);
+        output_string += "\t" + std::to_string(beta) + "\t" + std::to_string(se) + "\t" + std::to_string(beta / se);
+    } else {
+        output_string += "\tNA\tNA\tNA";
+    }
+
+    // SKAT: Q = sum (w_j g_j^T r)^2 / sigma^2 ~ sum lambda chi2_1, lambda the eigenvalues of K
+    double c1 = 0, c2 = 0, c3 = 0, c4 = 0;
+    for (int j = 0; j < m; ++j) {
+        c1 += K[(size_t)j * m + j];
+        for (int k = 0; k < m; ++k) {
+            double K2_jk = 0;
+            for (int l = 0; l < m; ++l) {
+                K2_jk += K[(size_t)j * m + l] * K[(size_t)l * m + k];
+            }
+            c2 += K[(size_t)j * m + k] * K[(size_t)j * m + k];
+            c3 += K2_jk * K[(size_t)k * m + j];
+            c4 += K2_jk * K2_jk;
+        }
+    }
+    if (m && c2 > 0) {
+        Q /= sigma2;
+        output_string += "\t" + std::to_string(Q) + "\t" + std::to_string(liu_pvalue(Q, c1, c2, c3, c4)) + "\n";
+    } else {
+        output_string += "\tNA\tNA\n";
+    }
+    std::vector<RegionVariant>().swap(region.variants);
+}
@@ -0,0 +1,579 @@
+#include "stats_store.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include "crypto.h"
+
+#ifdef NON_OE
+#include "enclave_glue.h"
+#else
+#include "gwas_t.h"
+#endif
+
+StatsStore stats_store;
+
+#define STATS_STORE_MAGIC "GWSS2"
+// next pointer, cached hash, bucket and allocator header of an unordered_map node
+#define STATS_MAP_NODE_OVERHEAD (4 * sizeof(void*))
+// store id | chunk index | chunk kind, in front of every chunk's payload
+#define STATS_CHUNK_PREFIX_SIZE (STATS_STORE_ID_SIZE + sizeof(uint32_t) + sizeof(uint8_t))
+// flush a thread's export buffer once it is half of the enclave read buffer,
+// a sealed chunk always fits in a single readstats call
+#define STATS_CHUNK_SIZE (ENCLAVE_READ_BUFFER_SIZE / 2)
+
+void StatsRecord::reset(int q) {
+    n_obs = 0;
+    sum_x = 0;
+    sum_xx = 0;
+    sum_xy = 0;
+    sum_miss_y = 0;
+    sum_xc.assign(q, 0);
+    sum_miss_c.assign(q, 0);
+    merged = false;
+}
+
+void StatsRecord::add(const StatsRecord& other) {
+    n_obs += other.n_obs;
+    sum_x += other.sum_x;
+    sum_xx += other.sum_xx;
+    sum_xy += other.sum_xy;
+    sum_miss_y += other.sum_miss_y;
+    for (size_t j = 0; j < sum_xc.size(); ++j) {
+        sum_xc[j] += other.sum_xc[j];
+        sum_miss_c[j] += other.sum_miss_c[j];
+    }
+}
+
+void StatsGlobal::reset(int q) {
+    n = 0;
+    CTC.assign(q * q, 0);
+    CTy.assign(q, 0);
+    sum_c.assign(q, 0);
+    yTy = 0;
+    sum_y = 0;
+}
+
+void StatsGlobal::add(const StatsGlobal& other) {
+    n += other.n;
+    for (size_t j = 0; j < CTC.size(); ++j) {
+        CTC[j] += other.CTC[j];
+    }
+    for (size_t j = 0; j < CTy.size(); ++j) {
+        CTy[j] += other.CTy[j];
+        sum_c[j] += other.sum_c[j];
+    }
+    yTy += other.yTy;
+    sum_y += other.sum_y;
+}
+
+/////////////////////////////////////////////////////////
+////////////////   Serialization    /////////////////////
+/////////////////////////////////////////////////////////
+
+template <typename T>
+static inline void put(std::string& out, const T& val) {
+    out.append((const char*)&val, sizeof(T));
+}
+
+static inline void put_doubles(std::string& out, const std::vector<double>& vals) {
+    out.append((const char*)&vals[0], vals.size() * sizeof(double));
+}
+
+template <typename T>
+static inline const char* get(const char* in, T& val) {
+    memcpy(&val, in, sizeof(T));
+    return in + sizeof(T);
+}
+
+static inline const char* get_doubles(const char* in, std::vector<double>& vals) {
+    memcpy(&vals[0], in, vals.size() * sizeof(double));
+    return in + vals.size() * sizeof(double);
+}
+
+// magic | q | covariate list | n | CTC | CTy | sum_c | yTy | sum_y | records | key bytes | chunks
+void StatsStore::serialize_global(const StatsGlobal& block, uint64_t num_records, uint64_t key_bytes,
+                                  uint32_t num_chunks, std::string& out) const {
+    out.append(STATS_STORE_MAGIC);
+    put(out, (uint32_t)q);
+    put(out, (uint32_t)covariate_list.size());
+    out.append(covariate_list);
+    put(out, block.n);
+    put_doubles(out, block.CTC);
+    put_doubles(out, block.CTy);
+    put_doubles(out, block.sum_c);
+    put(out, block.yTy);
+    put(out, block.sum_y);
+    put(out, num_records);
+    put(out, key_bytes);
+    put(out, num_chunks);
+}
+
+bool StatsStore::deserialize_global(const char* in, size_t size, StatsGlobal& block, uint64_t& num_records,
+                                    uint64_t& key_bytes, uint32_t& num_chunks) {
+    const size_t magic_len = strlen(STATS_STORE_MAGIC);
+    if (size < magic_len || memcmp(in, STATS_STORE_MAGIC, magic_len) != 0) {
+        std::cerr << "ERROR: stats store has an unknown format" << std::endl;
+        return false;
+    }
+    const char* head = in + magic_len;
+    uint32_t stored_q, list_size;
+    head = get(head, stored_q);
+    head = get(head, list_size);
+    std::string stored_list(head, list_size);
+    head += list_size;
+    if ((int)stored_q != q || stored_list != covariate_list) {
+        std::cerr << "ERROR: stats store was built with covariates \"" << stored_list
+                  << "\", this session uses \"" << covariate_list << "\"" << std::endl;
+        return false;
+    }
+    block.reset(q);
+    head = get(head, block.n);
+    head = get_doubles(head, block.CTC);
+    head = get_doubles(head, block.CTy);
+    head = get_doubles(head, block.sum_c);
+    head = get(head, block.yTy);
+    head = get(head, block.sum_y);
+    head = get(head, num_records);
+    head = get(head, key_bytes);
+    head = get(head, num_chunks);
+    return true;
+}
+
+// key length | key | n_obs | sum_x | sum_xx | sum_xy | sum_miss_y | sum_xc | sum_miss_c
+void StatsStore::serialize_record(const std::string& key, const StatsRecord& record, std::string& out) const {
+    put(out, (uint8_t)key.size());
+    out.append(key);
+    put(out, record.n_obs);
+    put(out, record.sum_x);
+    put(out, record.sum_xx);
+    put(out, record.sum_xy);
+    put(out, record.sum_miss_y);
+    put_doubles(out, record.sum_xc);
+    put_doubles(out, record.sum_miss_c);
+}
+
+size_t StatsStore::deserialize_record(const char* in, std::string& key, StatsRecord& record) const {
+    const char* head = in;
+    uint8_t key_size;
+    head = get(head, key_size);
+    key.assign(head, key_size);
+    head += key_size;
+    record.reset(q);
+    head = get(head, record.n_obs);
+    head = get(head, record.sum_x);
+    head = get(head, record.sum_xx);
+    head = get(head, record.sum_xy);
+    head = get(head, record.sum_miss_y);
+    head = get_doubles(head, record.sum_xc);
+    head = get_doubles(head, record.sum_miss_c);
+    return head - in;
+}
+
+/////////////////////////////////////////////////////////
+////////////////   Store    /////////////////////////////
+/////////////////////////////////////////////////////////
+
+void StatsStore::init(bool _load, bool _export) {
+    load_enabled = _load;
+    export_enabled = _export;
+}
+
+void StatsStore::init_reduction(int num_children, bool has_parent) {
+    reduction_enabled = true;
+    num_inputs = num_children;
+    load_enabled = num_children > 0;
+    export_enabled = has_parent;
+    report = !has_parent;
+    link_keys.assign((num_children + 1) * AES_KEY_LENGTH, 0);
+}
+
+const uint8_t* StatsStore::link_key(int link) const {
+    return &link_keys[(link == REDUCTION_PARENT_LINK ? num_inputs : link) * AES_KEY_LENGTH];
+}
+
+void StatsStore::set_link_key(int link, const uint8_t key[AES_KEY_LENGTH]) {
+    int index = link == REDUCTION_PARENT_LINK ? num_inputs : link;
+    memcpy(&link_keys[index * AES_KEY_LENGTH], key, AES_KEY_LENGTH);
+}
+
+// stores are sealed to this enclave, reduction links use the key of the link
+void StatsStore::write_chunk(StatsChunkKind kind, const std::string& payload) {
+    std::string chunk;
+    chunk.reserve(STATS_CHUNK_PREFIX_SIZE + payload.size());
+    chunk.append((const char*)store_id, STATS_STORE_ID_SIZE);
+    put(chunk, next_chunk.fetch_add(1));
+    put(chunk, (uint8_t)kind);
+    chunk.append(payload);
+    std::string sealed;
+    bool sealed_ok = reduction_enabled ? link_seal_data(link_key(REDUCTION_PARENT_LINK), (const uint8_t*)chunk.data(), chunk.size(), sealed)
+                                       : seal_data((const uint8_t*)chunk.data(), chunk.size(), sealed);
+    if (!sealed_ok) {
+        std::cerr << "ERROR: failed to seal stats store chunk" << std::endl;
+        exit(1);
+    }
+    writestats((const uint8_t*)sealed.data(), sealed.size());
+}
+
+bool StatsStore::open_chunk(const uint8_t* chunk, int chunk_size, int input, std::string& plain) const {
+    if (reduction_enabled) {
+        return link_unseal_data(link_key(input), chunk, chunk_size, plain);
+    }
+    return unseal_data(chunk, chunk_size, plain);
+}
+
+// variants of the store not seen before start from all missing sums of the stores
+// already loaded, old_block only grows once the whole store is in
+void StatsStore::merge_record(const std::string& key, const StatsRecord& record) {
+    auto it = loaded.find(key);
+    if (it == loaded.end()) {
+        StatsRecord missing;
+        all_missing(old_block, missing);
+        it = loaded.insert(std::make_pair(key, missing)).first;
+    }
+    it->second.add(record);
+    it->second.merged = true;
+}
+
+void StatsStore::finish_store(const StatsGlobal& block) {
+    for (auto& entry : loaded) {
+        if (!entry.second.merged) {
+            StatsRecord missing;
+            all_missing(block, missing);
+            entry.second.add(missing);
+        }
+        entry.second.merged = false;
+    }
+    old_block.add(block);
+}
+
+// heap a loaded variant takes besides its key: the map node with its bucket and the two sum vectors
+static size_t loaded_record_bytes(int q) {
+    return sizeof(std::pair<const std::string, StatsRecord>) + STATS_MAP_NODE_OVERHEAD + 2 * q * sizeof(double);
+}
+
+// the store's records chunks come in any order, the threads seal them concurrently
+static bool check_chunk(const std::string& plain, const std::string& id, std::vector<bool>& seen,
+                        uint32_t& index, uint8_t& kind) {
+    if (plain.size() < STATS_CHUNK_PREFIX_SIZE) {
+        std::cerr << "ERROR: stats store chunk is too short" << std::endl;
+        return false;
+    }
+    get(get(plain.data() + STATS_STORE_ID_SIZE, index), kind);
+    if (plain.compare(0, STATS_STORE_ID_SIZE, id) != 0) {
+        std::cerr << "ERROR: stats store chunk " << index << " belongs to another store" << std::endl;
+        return false;
+    }
+    if (index >= seen.size()) {
+        std::cerr << "ERROR: stats store chunk " << index << " is past the end of the store" << std::endl;
+        return false;
+    }
+    if (seen[index]) {
+        std::cerr << "ERROR: stats store chunk " << index << " received twice" << std::endl;
+        return false;
+    }
+    seen[index] = true;
+    return true;
+}
+
+// readstats returns 0 at the end of every store, reduction mode loads one per child in link order.
+// The header is sealed last and handed over first, so the store is sized before it is merged
+bool StatsStore::load() {
+    std::unique_ptr<uint8_t[]> chunk(new uint8_t[ENCLAVE_READ_BUFFER_SIZE]);
+    std::string plain;
+    std::string key;
+    StatsRecord record;
+    StatsGlobal block;
+    std::vector<std::string> loaded_ids;
+    uint64_t total_records = 0;
+    size_t loaded_bytes = 0;
+    for (int input = 0; input < num_inputs; ++input) {
+        std::string id;
+        std::vector<bool> seen;
+        uint64_t num_records = 0;
+        uint64_t records_merged = 0;
+        while (true) {
+            int chunk_size = 0;
+            readstats(&chunk_size, chunk.get());
+            if (chunk_size <= 0) {
+                break;
+            }
+            if (!open_chunk(chunk.get(), chunk_size, input, plain)) {
+                std::cerr << "ERROR: stats store chunk failed to unseal" << std::endl;
+                return false;
+            }
+            if (plain.size() < STATS_CHUNK_PREFIX_SIZE) {
+                std::cerr << "ERROR: stats store chunk is too short" << std::endl;
+                return false;
+            }
+            // the header names the store and says how many chunks and records it has
+            if (id.empty()) {
+                id = plain.substr(0, STATS_STORE_ID_SIZE);
+                if (std::find(loaded_ids.begin(), loaded_ids.end(), id) != loaded_ids.end()) {
+                    std::cerr << "ERROR: stats store loaded twice" << std::endl;
+                    return false;
+                }
+                loaded_ids.push_back(id);
+                uint32_t index;
+                uint8_t kind;
+                get(get(plain.data() + STATS_STORE_ID_SIZE, index), kind);
+                uint32_t num_chunks;
+                uint64_t key_bytes;
+                if (kind != STATS_CHUNK_HEADER) {
+                    std::cerr << "ERROR: stats store does not start with its header" << std::endl;
+                    return false;
+                }
+                if (!deserialize_global(plain.data() + STATS_CHUNK_PREFIX_SIZE, plain.size() - STATS_CHUNK_PREFIX_SIZE,
+                                        block, num_records, key_bytes, num_chunks)) {
+                    return false;
+                }
+                if (num_chunks != index + 1) {
+                    std::cerr << "ERROR: stats store header is not its last chunk" << std::endl;
+                    return false;
+                }
+                seen.assign(num_chunks, false);
+                seen[index] = true;
+                // every variant of the stores may be new to loaded, a key may need a buffer of its own
+                total_records += num_records;
+                loaded_bytes += num_records * loaded_record_bytes(q) + key_bytes + num_records;
+                if (loaded_bytes > memory_budget) {
+                    size_t pages = (loaded_bytes - memory_budget + ENCLAVE_PAGE_SIZE - 1) / ENCLAVE_PAGE_SIZE;
+                    std::cerr << "ERROR: stats stores of " << total_records << " variants need "
+                              << loaded_bytes / (1024 * 1024) << " MB of enclave heap, the memory plan leaves "
+                              << memory_budget / (1024 * 1024) << " MB; add " << pages
+                              << " pages to ENCLAVE_HEAP_PAGES and sign the enclave again" << std::endl;
+                    return false;
+                }
+                continue;
+            }
+            uint32_t index;
+            uint8_t kind;
+            if (!check_chunk(plain, id, seen, index, kind)) {
+                return false;
+            }
+            if (kind != STATS_CHUNK_RECORDS) {
+                std::cerr << "ERROR: stats store chunk " << index << " is not a records chunk" << std::endl;
+                return false;
+            }
+            const char* payload = plain.data() + STATS_CHUNK_PREFIX_SIZE;
+            const size_t payload_size = plain.size() - STATS_CHUNK_PREFIX_SIZE;
+            size_t pos = 0;
+            while (pos < payload_size) {
+                pos += deserialize_record(payload + pos, key, record);
+                merge_record(key, record);
+                records_merged++;
+            }
+        }
+        if (id.empty()) {
+            std::cerr << "ERROR: stats store is empty" << std::endl;
+            return false;
+        }
+        if (std::find(seen.begin(), seen.end(), false) != seen.end() || records_merged != num_records) {
+            std::cerr << "ERROR: stats store is truncated" << std::endl;
+            return false;
+        }
+        finish_store(block);
+    }
+    std::cout << "Stats store loaded: " << loaded.size() << " variants, " << old_block.n << " samples" << std::endl;
+    return true;
+}
+
+void StatsStore::setup(GWAS* _gwas, int _num_threads, const std::string& _covariate_list, size_t _memory_budget) {
+    gwas = _gwas;
+    memory_budget = _memory_budget;
+    num_threads = _num_threads;
+    q = gwas->dim() - 1;
+    covariate_list = _covariate_list;
+    export_buffers.resize(num_threads);
+
+    new_block.reset(q);
+    new_block.n = gwas->size();
+    for (int i = 0; i < gwas->size(); ++i) {
+        const double* patient_pnc = gwas->phenotype_and_covars.row(i);
+        double y = patient_pnc[0];
+        new_block.yTy += y * y;
+        new_block.sum_y += y;
+        for (int j = 0; j < q; ++j) {
+            new_block.CTy[j] += patient_pnc[j + 1] * y;
+            new_block.sum_c[j] += patient_pnc[j + 1];
+            for (int k = 0; k < q; ++k) {
+                new_block.CTC[j * q + k] += patient_pnc[j + 1] * patient_pnc[k + 1];
+            }
+        }
+    }
+
+    old_block.reset(q);
+    if (load_enabled && !load()) {
+        exit(1);
+    }
+    union_block = new_block;
+    union_block.add(old_block);
+
+    CTC_inv.assign(q * q, 0);
+    if (q) {
+        SqrMatrix CTC(q, 2);
+        for (int j = 0; j < q; ++j) {
+            for (int k = 0; k < q; ++k) {
+                CTC.assign(j, k, union_block.CTC[j * q + k]);
+            }
+        }
+        CTC.INV();
+        for (int j = 0; j < q; ++j) {
+            for (int k = 0; k < q; ++k) {
+                CTC_inv[j * q + k] = CTC.t[j][k];
+            }
+        }
+    }
+
+    // the header is sealed once the records are, see flush
+    if (export_enabled) {
+        random_bytes(store_id, STATS_STORE_ID_SIZE);
+    }
+}
+
+void StatsStore::compute(const uint8_t* data, const std::vector<int>& dpi_lengths, StatsRecord& record) const {
+    record.reset(q);
+    int i = 0;
+    const uint8_t* dpi_data = data;
+    for (int length : dpi_lengths) {
+        for (int d = 0; d < length; ++d, ++i) {
+            const double* patient_pnc = gwas->phenotype_and_covars.row(i);
+            uint8_t val = (dpi_data[d / 4] >> ((d % 4) * 2)) & 0b11;
+            double y = patient_pnc[0];
+            if (is_NA_uint8(val)) {
+                record.sum_miss_y += y;
+                for (int j = 0; j < q; ++j) {
+                    record.sum_miss_c[j] += patient_pnc[j + 1];
+                }
+            } else {
+                record.n_obs++;
+                record.sum_x += val;
+                record.sum_xx += val * val;
+                record.sum_xy += val * y;
+                for (int j = 0; j < q; ++j) {
+                    record.sum_xc[j] += patient_pnc[j + 1] * val;
+                }
+            }
+        }
+        dpi_data += (length + 3) / 4;
+    }
+}
+
+void StatsStore::all_missing(const StatsGlobal& block, StatsRecord& record) const {
+    record.reset(q);
+    record.sum_miss_y = block.sum_y;
+    record.sum_miss_c = block.sum_c;
+}
+
+void StatsStore::merge_loaded(const std::string& key, StatsRecord& record) {
+    if (!load_enabled) {
+        return;
+    }
+    // loaded is read only by now. Any thread can get a row and a key the dpis repeat can come
+    // in rows of several threads, so the flag is atomic; finish_thread reads the flags under
+    // the lock once every thread is done
+    auto it = loaded.find(key);
+    if (it != loaded.end()) {
+        record.add(it->second);
+        it->second.merged = true;
+    } else {
+        StatsRecord missing;
+        all_missing(old_block, missing);
+        record.add(missing);
+    }
+}
+
+bool StatsStore::solve(const StatsRecord& record, double results[3]) const {
+    if (!record.n_obs) {
+        return false;
+    }
+    // impute every missing sample with the union cohort's called average
+    double mu = record.sum_x / record.n_obs;
+    double n_miss = union_block.n - record.n_obs;
+    double gTg = record.sum_xx + n_miss * mu * mu;
+    double gTy = record.sum_xy + mu * record.sum_miss_y;
+
+    std::vector<double> CTg(q);
+    for (int j = 0; j < q; ++j) {
+        CTg[j] = record.sum_xc[j] + mu * record.sum_miss_c[j];
+    }
+
+    double gMg = gTg;
+    double gMy = gTy;
+    double yMy = union_block.yTy;
+    for (int j = 0; j < q; ++j) {
+        double Ag = 0;
+        double Ay = 0;
+        for (int k = 0; k < q; ++k) {
+            Ag += CTC_inv[j * q + k] * CTg[k];
+            Ay += CTC_inv[j * q + k] * union_block.CTy[k];
+        }
+        gMg -= CTg[j] * Ag;
+        gMy -= union_block.CTy[j] * Ag;
+        yMy -= union_block.CTy[j] * Ay;
+    }
+    if (gMg <= 0) {
+        return false;
+    }
+
+    // same degrees of freedom as Lin_row
+    double beta = gMy / gMg;
+    double sse = (yMy - beta * gMy) / ((double)union_block.n - (q + 1) - 1);
+    double se = std::sqrt(sse / gMg);
+    results[0] = beta;
+    results[1] = se;
+    results[2] = beta / se;
+    return true;
+}
+
+void StatsStore::append(int thread_id, const std::string& key, const StatsRecord& record) {
+    if (!export_enabled) {
+        return;
+    }
+    std::string& buffer = export_buffers[thread_id];
+    serialize_record(key, record, buffer);
+    records_exported.fetch_add(1, std::memory_order_relaxed);
+    key_bytes_exported.fetch_add(key.size(), std::memory_order_relaxed);
+    if (buffer.size() >= STATS_CHUNK_SIZE) {
+        write_chunk(STATS_CHUNK_RECORDS, buffer);
+        buffer.clear();
+    }
+}
+
+void StatsStore::flush(int thread_id) {
+    if (!export_enabled) {
+        return;
+    }
+    std::string& buffer = export_buffers[thread_id];
+    if (buffer.size()) {
+        write_chunk(STATS_CHUNK_RECORDS, buffer);
+        buffer.clear();
+    }
+    {
+        std::lock_guard<std::mutex> raii(lock);
+        if (++threads_flushed != num_threads) {
+            return;
+        }
+    }
+    // every records chunk is sealed by now, the header takes the last index
+    std::string header;
+    serialize_global(union_block, records_exported.load(), key_bytes_exported.load(), next_chunk.load() + 1, header);
+    write_chunk(STATS_CHUNK_HEADER, header);
+}
+
+bool StatsStore::finish_thread(std::vector<std::pair<std::string, StatsRecord> >& unmatched) {
+    std::lock_guard<std::mutex> raii(lock);
+    if (++threads_finished != num_threads) {
+        return false;
+    }
+    for (auto& entry : loaded) {
+        if (entry.second.merged) continue;
+        StatsRecord missing;
+        all_missing(new_block, missing);
+        missing.add(entry.second);
+        unmatched.push_back(std::make_pair(entry.first, missing));
+    }
+    return true;
+}
@@ -0,0 +1,106 @@
+#include "batch_ring.h"
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+static void write_length(BatchRing* ring, uint64_t pos, uint32_t length) {
+    batch_ring_copy_in(ring, pos, (const char*)&length, sizeof(uint32_t));
+}
+
+static void test_round_trip() {
+    unique_ptr<BatchRing> ring(new BatchRing());
+    // start near the end so records wrap around the ring
+    uint64_t start = BATCH_RING_SIZE - 10;
+    ring->head.store(start);
+    ring->tail.store(start);
+
+    vector<string> lines = {"a", "", string(37, 'x'), "1:904165\tAG\t0\t"};
+    for (const string& line : lines) {
+        check(batch_ring_push(ring.get(), line.data(), line.length()), "push " + line);
+    }
+    check(batch_ring_push(ring.get(), nullptr, BATCH_RING_EOF), "push EOF");
+
+    char out[128];
+    uint32_t line_lengths[4];
+    uint64_t out_length = 0;
+    // at most max_lines per pop
+    int num_lines = batch_ring_pop(ring.get(), out, sizeof(out), 2, &out_length, line_lengths);
+    check(num_lines == 2 && out_length == 1 && line_lengths[0] == 1 && line_lengths[1] == 0,
+          "pop of the first two lines");
+    num_lines = batch_ring_pop(ring.get(), out, sizeof(out), 4, &out_length, line_lengths);
+    check(num_lines == 2 && line_lengths[0] == 37 && line_lengths[1] == lines[3].length() &&
+              string(out, out_length) == lines[2] + lines[3],
+          "pop of the wrapped lines stops at EOF");
+    check(batch_ring_pop(ring.get(), out, sizeof(out), 4) == -1, "pop of EOF");
+    check(batch_ring_used(ring.get()) == 0, "ring drained");
+    check(batch_ring_pop(ring.get(), out, sizeof(out), 4) == 0, "pop of an empty ring");
+
+    // a line that does not fit what is left of out waits for the next pop
+    string line(100, 'y');
+    batch_ring_push(ring.get(), line.data(), line.length());
+    batch_ring_push(ring.get(), line.data(), line.length());
+    num_lines = batch_ring_pop(ring.get(), out, sizeof(out), 4, &out_length, line_lengths);
+    check(num_lines == 1 && out_length == 100, "pop stops at a line past out_size");
+    num_lines = batch_ring_pop(ring.get(), out, sizeof(out), 4, &out_length, line_lengths);
+    check(num_lines == 1 && line_lengths[0] == 100, "pop of the line left over");
+}
+
+// head and the lengths are written by the untrusted host
+static void test_corrupt() {
+    unique_ptr<BatchRing> ring(new BatchRing());
+    char out[64];
+    uint32_t line_lengths[4];
+
+    ring->head.store(BATCH_RING_SIZE + 1);
+    check(batch_ring_pop(ring.get(), out, sizeof(out), 4) == BATCH_RING_CORRUPT, "head more than a ring past tail");
+
+    ring->head.store(0);
+    ring->tail.store(8);
+    check(batch_ring_pop(ring.get(), out, sizeof(out), 4) == BATCH_RING_CORRUPT, "head behind tail");
+
+    // a length larger than out can ever hold
+    ring->tail.store(0);
+    write_length(ring.get(), 0, sizeof(out) + 1);
+    ring->head.store(sizeof(uint32_t) + sizeof(out) + 1);
+    check(batch_ring_pop(ring.get(), out, sizeof(out), 4, nullptr, line_lengths) == BATCH_RING_CORRUPT,
+          "length past out_size");
+
+    // a length running past head
+    write_length(ring.get(), 0, 10);
+    ring->head.store(sizeof(uint32_t) + 9);
+    check(batch_ring_pop(ring.get(), out, sizeof(out), 4, nullptr, line_lengths) == BATCH_RING_CORRUPT,
+          "length past head");
+
+    // a good line then a bad one: the good one isn't consumed either
+    write_length(ring.get(), 0, 2);
+    memcpy(ring->data + sizeof(uint32_t), "ok", 2);
+    write_length(ring.get(), sizeof(uint32_t) + 2, 1000);
+    ring->head.store(2 * sizeof(uint32_t) + 2 + 10);
+    check(batch_ring_pop(ring.get(), out, sizeof(out), 4, nullptr, line_lengths) == BATCH_RING_CORRUPT,
+          "length past head after a good line");
+    check(ring->tail.load() == 0, "tail kept on corruption");
+}
+
+int main() {
+    test_round_trip();
+    test_corrupt();
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "test_batch_ring passed" << endl;
+    return 0;
+}
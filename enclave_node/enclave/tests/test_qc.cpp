@@ -0,0 +1,106 @@
+#include "qc.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+// one genotype at a time, the reference for the word at a time count
+static void naive_counts(const vector<uint8_t>& data, const vector<int>& dpi_lengths, GenotypeCounts& counts) {
+    counts = GenotypeCounts{0, 0, 0, 0};
+    size_t offset = 0;
+    for (int length : dpi_lengths) {
+        for (int i = 0; i < length; ++i) {
+            int code = (data[offset + i / 4] >> (2 * (i % 4))) & 3;
+            if (code == 0) counts.hom_ref++;
+            if (code == 1) counts.het++;
+            if (code == 2) counts.hom_alt++;
+            if (code == 3) counts.missing++;
+        }
+        offset += (length + 3) / 4;
+    }
+}
+
+static void test_count_genotypes() {
+    mt19937 rng(7);
+    // lengths around the 8 byte word and the trailing partial byte
+    const vector<vector<int>> layouts = {{1}, {4}, {31}, {32}, {33}, {35}, {7, 100, 3}, {257, 1, 64}, {1000}};
+    for (const vector<int>& dpi_lengths : layouts) {
+        size_t bytes = 0;
+        for (int length : dpi_lengths) bytes += (length + 3) / 4;
+        for (int round = 0; round < 100; ++round) {
+            vector<uint8_t> data(bytes);
+            for (uint8_t& byte : data) byte = rng();
+            // padding pairs of the last byte are NA filled like a missing dpi
+            size_t offset = 0;
+            for (int length : dpi_lengths) {
+                offset += (length + 3) / 4;
+                if (length % 4) data[offset - 1] |= 0xff << (2 * (length % 4));
+            }
+            GenotypeCounts counts, expected;
+            count_genotypes(data.data(), dpi_lengths, counts);
+            naive_counts(data, dpi_lengths, expected);
+            check(counts.hom_ref == expected.hom_ref && counts.het == expected.het &&
+                      counts.hom_alt == expected.hom_alt && counts.missing == expected.missing,
+                  "count_genotypes of " + to_string(dpi_lengths.size()) + " dpis, first " +
+                      to_string(dpi_lengths[0]));
+        }
+    }
+}
+
+// P(het | rare copies, genotypes) enumerated from the closed form
+static double naive_hwe_p(int obs_het, int obs_hom1, int obs_hom2) {
+    int homr = min(obs_hom1, obs_hom2);
+    int n = obs_het + obs_hom1 + obs_hom2;
+    int rare = 2 * homr + obs_het;
+    if (!n || !rare) return 1;
+    auto log_prob = [&](int het) {
+        int hr = (rare - het) / 2;
+        int hc = n - het - hr;
+        return lgamma(n + 1.0) - lgamma(hr + 1.0) - lgamma(het + 1.0) - lgamma(hc + 1.0) + het * log(2.0) +
+               lgamma(rare + 1.0) + lgamma(2.0 * n - rare + 1.0) - lgamma(2.0 * n + 1.0);
+    };
+    double obs = log_prob(obs_het);
+    double p = 0;
+    for (int het = rare % 2; het <= rare && het <= n; het += 2) {
+        double prob = log_prob(het);
+        if (prob <= obs + 1e-9) p += exp(prob);
+    }
+    return min(1.0, p);
+}
+
+static void test_hwe() {
+    const int cases[][3] = {{0, 10, 0}, {10, 0, 0}, {0, 5, 5}, {57, 14, 50}, {100, 25, 25}, {2, 0, 98},
+                            {1, 0, 2000}, {200, 400, 400}, {500, 250, 250}, {3, 1, 996}};
+    for (const int* c : cases) {
+        double p = hwe_exact_p(c[0], c[1], c[2]);
+        double expected = naive_hwe_p(c[0], c[1], c[2]);
+        check(fabs(p - expected) <= 1e-9 + 1e-6 * expected,
+              "hwe_exact_p(" + to_string(c[0]) + ", " + to_string(c[1]) + ", " + to_string(c[2]) + ") = " +
+                  to_string(p) + ", expected " + to_string(expected));
+        check(hwe_exact_p(c[0], c[2], c[1]) == p, "hwe_exact_p symmetric in the homozygotes");
+    }
+    check(hwe_exact_p(0, 0, 0) == 1, "hwe_exact_p of no genotypes");
+}
+
+int main() {
+    test_count_genotypes();
+    test_hwe();
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "test_qc passed" << endl;
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include "region_test.h"
+
+#include <cmath>
+#include <iostream>
+#include <random>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+static bool close_to(double value, double expected) {
+    return fabs(value - expected) <= 1e-12 + 1e-7 * fabs(expected);
+}
+
+static void test_joint_genotype_counts() {
+    mt19937 rng(11);
+    const vector<vector<int>> layouts = {{1}, {3}, {32}, {35}, {64}, {67, 5}, {9, 250, 1}};
+    for (const vector<int>& dpi_lengths : layouts) {
+        size_t bytes = 0;
+        for (int length : dpi_lengths) bytes += (length + 3) / 4;
+        for (int round = 0; round < 100; ++round) {
+            vector<uint8_t> a(bytes), b(bytes);
+            for (size_t i = 0; i < bytes; ++i) {
+                a[i] = rng();
+                b[i] = rng();
+            }
+            uint32_t counts[3][3];
+            joint_genotype_counts(a.data(), b.data(), dpi_lengths, counts);
+
+            // one pair at a time, codes 1, 2, 3 map to rows 0, 1, 2 and hom ref is never counted
+            uint32_t expected[3][3] = {};
+            size_t offset = 0;
+            for (int length : dpi_lengths) {
+                for (int i = 0; i < length; ++i) {
+                    int code_a = (a[offset + i / 4] >> (2 * (i % 4))) & 3;
+                    int code_b = (b[offset + i / 4] >> (2 * (i % 4))) & 3;
+                    if (code_a && code_b) expected[code_a - 1][code_b - 1]++;
+                }
+                offset += (length + 3) / 4;
+            }
+            bool same = true;
+            for (int x = 0; x < 3; ++x) {
+                for (int y = 0; y < 3; ++y) {
+                    same = same && counts[x][y] == expected[x][y];
+                }
+            }
+            check(same, "joint_genotype_counts of " + to_string(dpi_lengths.size()) + " dpis, first " +
+                            to_string(dpi_lengths[0]));
+        }
+    }
+}
+
+// P(chi2_df > x) for even df, a finite Poisson sum
+static double chisq_sf_even(double x, int df) {
+    double term = exp(-x / 2);
+    double sf = term;
+    for (int i = 1; i < df / 2; ++i) {
+        term *= x / 2 / i;
+        sf += term;
+    }
+    return sf;
+}
+
+static void test_noncentral_chisq_sf() {
+    check(close_to(noncentral_chisq_sf(3.841458820694124, 1, 0), 0.05), "chi2_1 at its 95% quantile");
+    for (int df : {2, 4, 10}) {
+        for (double x : {0.5, 2.0, 7.5, 30.0}) {
+            check(close_to(noncentral_chisq_sf(x, df, 0), chisq_sf_even(x, df)),
+                  "central chi2_" + to_string(df) + " at " + to_string(x));
+            // Poisson(ncp / 2) mixture of central chi2_{df + 2k}
+            double ncp = 3;
+            double expected = 0;
+            for (int k = 0; k < 100; ++k) {
+                expected += exp(-ncp / 2 + k * log(ncp / 2) - lgamma(k + 1.0)) * chisq_sf_even(x, df + 2 * k);
+            }
+            check(close_to(noncentral_chisq_sf(x, df, ncp), expected),
+                  "noncentral chi2_" + to_string(df) + " at " + to_string(x));
+        }
+    }
+    check(noncentral_chisq_sf(0, 3, 1) == 1, "noncentral chi2 at 0");
+}
+
+static void test_liu_pvalue() {
+    // k equal weights lambda: Q / lambda ~ chi2_k, which the moment match reproduces exactly
+    for (int k : {1, 2, 6}) {
+        for (double lambda : {0.25, 1.0, 40.0}) {
+            double c1 = k * lambda, c2 = k * pow(lambda, 2), c3 = k * pow(lambda, 3), c4 = k * pow(lambda, 4);
+            for (double x : {0.3, 1.0, 5.0, 20.0}) {
+                double expected = k == 1 ? erfc(sqrt(x / 2)) : chisq_sf_even(x, k);
+                check(close_to(liu_pvalue(x * lambda, c1, c2, c3, c4), expected),
+                      "liu_pvalue of " + to_string(k) + " weights " + to_string(lambda) + " at " + to_string(x));
+            }
+        }
+    }
+    // unequal weights, p-values fall as Q grows and stay in [0, 1]
+    double c[4] = {0, 0, 0, 0};
+    for (double lambda : {3.0, 1.0, 0.5, 0.1}) {
+        for (int power = 0; power < 4; ++power) c[power] += pow(lambda, power + 1);
+    }
+    double last = 1;
+    for (double Q = 0.5; Q < 60; Q *= 1.5) {
+        double p = liu_pvalue(Q, c[0], c[1], c[2], c[3]);
+        check(p >= 0 && p <= last, "liu_pvalue monotone at " + to_string(Q));
+        last = p;
+    }
+}
+
+int main() {
+    test_joint_genotype_counts();
+    test_noncentral_chisq_sf();
+    test_liu_pvalue();
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "test_region_test passed" << endl;
+    return 0;
+}
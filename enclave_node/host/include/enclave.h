@@ -7,8 +7,6 @@
 #include "gwas_u.h"
 #endif
 
-void mark_eof_wrapper(const int thread_id);
-
 int start_enclave();
 
 #endif
\ No newline at end of file
@@ -10,6 +10,8 @@
 #define _SERVER_H_
 
 #include <unordered_map>
+#include <deque>
+#include <map>
 #include <string>
 #include <queue>
 #include <vector>
@@ -28,10 +30,46 @@
 #include "json.hpp"
 #include "aes-crypto.h"
 #include "buffer_size.h"
-#include "readerwriterqueue.h"
+#include "batch_ring.h"
+#include "reactor.h"
 
 enum EncMode { sgx, simulate, debug, NA };
 
+// a row of the line a matcher is forming
+struct LineRow {
+    int input;
+    Institution* inst;
+    DataBlock block;
+};
+
+// the node at the other end of a reduction link, its enclave's rsa key and evidence come with
+// its REDUCE_HELLO or REDUCE_WELCOME, then its key share for this node's enclave
+struct ReductionLink {
+    std::string name;
+    std::string hostname;
+    int port;
+    std::string pub_key;
+    std::string evidence;
+    std::string share;
+    bool greeted;  // this node's hello or welcome went out
+};
+
+// one matcher thread, it merges the rows of the keys hashing to it for its own enclave threads
+struct MatcherShard {
+    int id;
+    std::vector<BatchRing*> rings;
+    // the line being formed, its rows are left in their frames until it is written
+    std::vector<LineRow> line_rows;
+    // rows copied out of their frames because the matcher had to wait while holding them
+    std::deque<std::string> spilled;
+    // the ring the batch being formed is written to past its head, nullptr between batches
+    BatchRing* ring;
+    uint64_t batch_length;
+    // lines in the batch being formed, and how many make a full batch (0 until the enclave threads say)
+    uint32_t batch_line_count;
+    uint32_t dispatch_lines;
+};
+
 class EnclaveNode {
   private:
     nlohmann::json enclave_config;
@@ -40,7 +78,6 @@ class EnclaveNode {
     int num_threads;
 
     int global_id;
-    int max_batch_lines;
 
     bool server_eof;
 
@@ -48,15 +85,65 @@ class EnclaveNode {
     EncAnalysis enc_analysis;
     ImputePolicy impute_policy;
 
-    std::vector<bool> eof_read_list;
+    QCPolicy qc_policy;
+    double qc_min_maf;
+    double qc_min_call_rate;
+    double qc_min_hwe_p;
+
+    std::string conditional_loci;
+    int conditional_window;
+
+    bool load_stats;
+    bool export_stats;
+    std::ifstream stats_in;
+    // where each chunk of the loaded store starts, and how many the enclave took
+    std::vector<std::streampos> stats_in_offsets;
+    size_t stats_in_pos;
+    std::ofstream stats_out;
+    std::mutex stats_lock;
+
+    bool reduction_enabled;
+    int reduction_children;
+    bool reduction_has_parent;
+    std::string reduction_parent_hostname;
+    int reduction_parent_port;
+    // the children in the order their hellos came, then the parent
+    std::vector<ReductionLink> reduction_links;
+    int reduction_hellos;
+    int reduce_chunks_sent;
+    // child node id -> stats chunks by sequence number, and the chunk count once it sent REDUCE_EOF
+    std::unordered_map<std::string, std::map<int, std::string> > reduce_chunks;
+    std::unordered_map<std::string, int> reduce_chunk_counts;
+
+    // "chrom\tstart\tend\tname" lines read from the region BED file
+    std::string region_list;
+    std::unordered_set<std::string> reduce_consumed;
+    std::string reduce_current;
+    int reduce_current_pos;
+    std::condition_variable reduce_cv;
 
     std::unordered_set<std::string> expected_institutions;
     std::unordered_set<std::string> expected_covariants;
-    std::vector<bool> seen_fds;
 
     std::vector<std::string> institution_list;
-    std::vector<moodycamel::ReaderWriterQueue<std::string>> allele_queue_list;
-    std::queue<std::string> output_queue;
+    // allele text of the non-SNVs received, checks that every dpi hashed the same text
+    VariantTable non_snv_table;
+    // batches of matched lines for each enclave thread, read by the enclave directly
+    std::vector<BatchRing*> batch_rings;
+    // result records written by each enclave thread, drained by output_sender
+    std::vector<BatchRing*> output_rings;
+    // an eventcount output_sender blocks on while every output ring is empty
+    std::mutex output_signal_lock;
+    std::condition_variable output_signal_cv;
+    std::atomic<uint64_t> output_signals;
+    int num_matchers;
+    std::vector<MatcherShard> matcher_shards;
+    std::atomic<int> matchers_running;
+    std::once_flag first_line_once;
+    // an eventcount the matchers block on while all their enclave threads are a full batch behind
+    std::mutex ring_drain_lock;
+    std::condition_variable ring_drain_cv;
+    std::atomic<uint64_t> ring_drains;
     std::string covariant_list;
     std::string y_val_name;
     char* encrypted_aes_key;
@@ -80,9 +167,6 @@ class EnclaveNode {
 
     std::mutex institutions_lock;
 
-    std::mutex output_queue_lock;
-    std::condition_variable output_queue_cv;
-
     // set up Server data structures
     void init(const std::string& config_file);
     
@@ -94,22 +178,48 @@ class EnclaveNode {
     int send_msg(const std::string& hostname, const int port, const int mtype, const std::string& msg, int connFD=-1);
     int send_msg_output(const std::string& msg, CoordinationServerMessageType msg_type, int connFD=-1);
 
-    // start a thread that will handle a message and exit properly if it finds an error
-    bool start_thread(int connFD, char* body_buffer);
+    // handles one message the reactor read, false closes its connection
+    bool handle_body(int connFD, Frame& body);
+
+    // the registered institution name, throws for any other; the reactor's workers and the
+    // matchers look institutions up while REGISTER may still insert them
+    Institution* find_institution(const std::string& name);
 
     void check_in(const std::string& name);
 
-    void data_requester();
+    // link id's entry of reduction_links, stats_lock held
+    ReductionLink& reduction_link(int link);
+    // the child link name said hello on, -1 if it is not a child
+    int reduction_child(const std::string& name);
 
-    void data_listener(int connFD);
+    void data_requester();
 
-    void allele_matcher();
+    // the matcher thread merging key's rows
+    int matcher_of(VariantKey key) const;
+    // the institution's next block of the shard's keys, or its EOF block, waits for it to arrive
+    DataBlock* next_shard_block(Institution* inst, MatcherShard& shard);
+    // copies the line's rows out of their frames and lets the institutions free the batches
+    // passed since, a matcher waiting while it holds on to them could wait on itself
+    void spill_line(MatcherShard& shard);
+    void allele_matcher(int matcher_id);
+
+    // room for a line in the batch being formed, dispatches the batch first if the line doesn't fit;
+    // a new batch goes to the shard's enclave thread with the least queued, blocks while every one has a full batch queued
+    void reserve_batch_line(MatcherShard& shard, const uint32_t length);
+    void append_batch(MatcherShard& shard, const char* bytes, uint64_t length);
+    // hands the batch to its enclave thread
+    void dispatch_batch(MatcherShard& shard);
+    // sleeps until an enclave thread drains its ring after ring_drains was seen, or for nap,
+    // which doubles for the next wait
+    void wait_ring_drain(uint64_t seen, std::chrono::microseconds& nap);
 
     void output_sender();
+    // sends the whole lines of output_str while more than a message of them is pending
+    void send_output_lines(std::string& output_str);
 
-    void parse_header_enclave_node_header(const std::string& header, std::string& msg,
-                                            std::string& dpi_name, EnclaveNodeMessageType& mtype,
-                                            int connFD);
+    // a DATA body is moved into the batch its rows point into, any other is copied to msg
+    void parse_header_enclave_node_header(Frame& body, std::string& msg,
+                                            std::string& dpi_name, EnclaveNodeMessageType& mtype);
 
   public:
 
@@ -134,9 +244,55 @@ class EnclaveNode {
 
     static ImputePolicy get_impute_policy();
 
+    static QCPolicy get_qc_policy();
+
+    static double get_qc_min_maf();
+
+    static double get_qc_min_call_rate();
+
+    static double get_qc_min_hwe_p();
+
+    static std::string get_conditional_loci();
+
+    static int get_conditional_window();
+
+    static bool get_load_stats();
+
+    static bool get_export_stats();
+
+    static int read_stats_chunk(uint8_t* chunk);
+
+    static void write_stats_chunk(const uint8_t* chunk, const int size);
+
+    static void close_stats();
+
+    static bool get_reduction_enabled();
+
+    static int get_reduction_children();
+
+    static bool get_reduction_has_parent();
+
+    // a child's hello goes out on the first call for its parent link, a parent's welcome
+    // once the child's hello is in; true once the other end's key and evidence arrived
+    static bool get_reduction_peer(const int link, std::string& pub_key, std::string& evidence);
+
+    static void send_reduction_share(const int link, const std::string& share);
+
+    static std::string get_reduction_share(const int link);
+
+    static std::string get_region_list();
+
     static void finish_setup();
 
-    static void set_max_batch_lines(unsigned int lines);
+    static BatchRing* get_batch_ring(const int thread_id);
+
+    // an enclave thread ran out of lines, wakes the matchers waiting for room in a ring
+    static void signal_ring_drained();
+
+    static BatchRing* get_output_ring(const int thread_id);
+
+    // an enclave thread pushed output or the enclave is done, wakes output_sender
+    static void signal_output();
 
     static uint8_t* get_rsa_pub_key();
 
@@ -154,16 +310,17 @@ class EnclaveNode {
 
     static std::string get_num_patients(const int institution_num);
 
-    static std::string get_y_data(const int institution_num);
+    // the registered institution institution_num, nullptr until it registers; setup OCALLs
+    // run on several enclave threads while the reactor may still insert institutions
+    static Institution* find_institution(const int institution_num);
+
+    static size_t get_y_data(const int institution_num, size_t offset, char* chunk, size_t chunk_size);
 
-    static std::string get_covariant_data(const int institution_num, const std::string& covariant_name);
+    static size_t get_covariant_data(const int institution_num, const std::string& covariant_name,
+                                     size_t offset, char* chunk, size_t chunk_size);
     
     static int get_encrypted_allele_size(const int institution_num);
 
-    static int get_allele_data(char* batch_data, const int thread_id);
-
-    static void write_allele_data(char* output_data, const int buffer_size, const int thread_id);
-
     static void cleanup_output();
 };
 
@@ -4,8 +4,13 @@ int getdpinum();
 
 bool getaes(const int dpi_num, const int thread_id, unsigned char key[256],
             unsigned char iv[256]);
+bool getreductionpeer(const int link, uint8_t pub_key[RSA_PUB_KEY_SIZE], uint8_t evidence[MAX_EVIDENCE_SIZE],
+                      int* evidence_size);
+bool getreductionshare(const int link, unsigned char share[256]);
 int get_num_patients(const int dpi_num, char num_patients_buffer[ENCLAVE_SMALL_BUFFER_SIZE]);
-int gety(const int dpi_num, char y[ENCLAVE_READ_BUFFER_SIZE]);
-int getcov(const int dpi_num, const char cov_name[MAX_DPINAME_LENGTH],
+int gety(const int dpi_num, const int offset, char y[ENCLAVE_READ_BUFFER_SIZE]);
+int getcov(const int dpi_num, const char cov_name[MAX_DPINAME_LENGTH], const int offset,
            char cov[ENCLAVE_READ_BUFFER_SIZE]);
-int getbatch(char batch[ENCLAVE_READ_BUFFER_SIZE], const int thread_id);
\ No newline at end of file
+bool waitbatch(const int thread_id);
+int readstats(uint8_t chunk[ENCLAVE_READ_BUFFER_SIZE]);
+bool waitoutput(const int thread_id, const int length);
\ No newline at end of file
@@ -5,35 +5,66 @@
 #ifndef _INSTITUTION_H_
 #define _INSTITUTION_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
-#include <queue>
 #include <vector>
 #include <mutex>
 #include "parser.h"
-#include "readerwriterqueue.h"
-#include "concurrentqueue.h"
 
-struct BlockPointerBatchGT {
-  inline bool operator()(const DataBlockBatch* a, const DataBlockBatch* b) const {
-    return a->pos > b->pos;
-  }
+// DATA batches an institution can be ahead of the slowest matcher, each keeps the pooled
+// read buffer its frame is in
+#define REORDER_WINDOW 1024
+// the dpi may send REORDER_WINDOW batches ahead and is given credit for more as they are
+// freed, this many at once
+#define DATA_CREDIT_BATCH (REORDER_WINDOW / 8)
+
+// hands the dpi credit for this many more DATA batches
+typedef std::function<void(int credits)> CreditGrant;
+
+// one matcher thread's place in an institution's batches
+struct BatchCursor {
+    int pos;  // of the batch it reads
+    DataBlockBatch* batch;  // nullptr until that batch is taken from the window
+    size_t next_block;
+    // since a block was popped the batches passed are kept, in order, until it is released
+    bool holding;
+    std::vector<DataBlockBatch*> passed;
+};
+
+// encrypted y or covariant values, the dpi sends them in parts that can arrive in any order
+struct PhenotypeData {
+    std::string data;
+    size_t received = 0;
+
+    // false if the part doesn't fit the length given by the earlier parts
+    bool add_part(size_t offset, size_t total, const char* part, size_t length);
+    bool complete() const { return data.length() && received == data.length(); }
 };
 
 class Institution {
   private:
     std::mutex num_patients_lock;
-    std::mutex blocks_lock;
-    std::mutex eligible_blocks_lock;
     std::mutex covariant_data_lock;
     std::mutex y_val_data_lock;
     std::mutex aes_key_iv_lock;
-    moodycamel::ConcurrentQueue<DataBlockBatch*> unsorted_blocks;
-    std::priority_queue<DataBlockBatch*, std::vector<DataBlockBatch* >, BlockPointerBatchGT > blocks;
-    moodycamel::ReaderWriterQueue<DataBlock*> eligible_blocks;
-    // std::queue<DataBlock*> eligible_blocks;
-    std::unordered_map<std::string, std::string> covariant_data;
-    std::string y_val_data;
+    // batches slot in at their pos modulo REORDER_WINDOW in any order, every matcher reads
+    // them in order through its cursor, and the last one to leave a batch frees it and its
+    // slot and advances current_pos
+    std::unique_ptr<std::atomic<DataBlockBatch*>[]> reorder_window;
+    std::vector<BatchCursor> cursors;
+    std::mutex arrival_lock;
+    std::condition_variable arrival_cv;
+    std::atomic<uint64_t> arrivals;  // batches that arrived or were freed, under arrival_lock
+    int ungranted;  // batches freed since the last credit grant, under arrival_lock
+    CreditGrant grant_credits;
+
+    void release_batch(DataBlockBatch* batch);
+    std::unordered_map<std::string, PhenotypeData> covariant_data;
+    PhenotypeData y_val_data;
     std::string num_patients_encrypted;
 
     std::vector<std::string> aes_encrypted_key_list;
@@ -42,20 +73,21 @@ class Institution {
     int id;
 
   public:
-    Institution(std::string hostname, int port, int id, const int num_threads);
+    Institution(std::string hostname, int port, int id, const int num_threads, const int num_matchers, CreditGrant grant_credits);
     ~Institution();
 
     void set_key_and_iv(std::string aes_key, std::string aes_iv, const int thread_id);
 
+    // waits while block_batch is REORDER_WINDOW or more batches ahead of the slowest matcher,
+    // which a dpi keeping to its credits never is
     void add_block_batch(DataBlockBatch* block_batch);
 
-    void transfer_eligible_blocks();
-
     void set_num_patients(const std::string& num_patients);
 
-    void set_y_data(std::string& y_data);
+    // one part of the values, length bytes at offset of total
+    void set_y_data(size_t offset, size_t total, const char* part, size_t length);
 
-    void set_covariant_data(const std::string& covariant_name, const std::string& data);
+    void set_covariant_data(const std::string& covariant_name, size_t offset, size_t total, const char* part, size_t length);
 
     std::string get_aes_key(const int thread_id);
 
@@ -63,28 +95,42 @@ class Institution {
 
     std::string get_num_patients();
 
-    std::string get_y_data();
+    // copy up to chunk_size bytes of the encrypted values from offset,
+    // return their whole length, 0 until every part is received
+    size_t get_y_data(size_t offset, char* chunk, size_t chunk_size);
 
-    std::string get_covariant_data(const std::string& covariant_name);
+    size_t get_covariant_data(const std::string& covariant_name, size_t offset, char* chunk, size_t chunk_size);
 
     int get_id();
 
-    int get_blocks_size();
-
     int get_covariant_size();
 
-    DataBlock* get_top_block();
+    // the next block of matcher, nullptr until its batch arrived. Only the matcher's own
+    // thread may call these
+    DataBlock* get_top_block(int matcher);
+
+    // the popped block stays valid until release_popped, however far the matcher reads on.
+    // The batches passed meanwhile stay in the window, so a matcher must not wait for
+    // a batch while it holds on to them, see holds_passed
+    DataBlock* pop_top_block(int matcher);
+
+    void release_popped(int matcher);
+
+    // true once the matcher moved past a batch since its last pop
+    bool holds_passed(int matcher) const { return !cursors[matcher].passed.empty(); }
+
+    // moves past the next block, which is some other matcher's
+    void skip_top_block(int matcher);
 
-    DataBlock* pop_top_block();
+    // get_top_block that waits for the batch to arrive, or for the other matchers to free its slot
+    DataBlock* wait_top_block(int matcher);
 
     AESCrypto decoder;
     int port;
-    int request_conn;
 
-    int current_pos;
+    std::atomic<int> current_pos;
     bool requested_for_data;
     bool listener_running;
-    bool all_data_received;
 
     std::string hostname;
     
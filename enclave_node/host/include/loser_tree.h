@@ -0,0 +1,36 @@
+#ifndef LOSER_TREE_H
+#define LOSER_TREE_H
+/* Tournament over the current keys of k sorted inputs that keeps the loser of every match.
+   The winner holds the smallest key; once its input moves on only the matches on its path
+   to the root are replayed, log2(k) key comparisons per key merged. Equal keys come out in
+   input order, except that an input repeating its last key goes after the other inputs'
+   rows of that key, like a row of the next line. */
+
+#include <vector>
+
+#include "variant_key.h"
+
+class LoserTree {
+    int size;  // leaves, a power of 2, the ones past the inputs hold VARIANT_KEY_EOF
+    std::vector<VariantKey> keys;
+    std::vector<int> repeats;  // rows of its current key an input had before
+    std::vector<int> tree;  // tree[0] is the winner, tree[node] the loser of match node
+
+    bool beats(int a, int b) const {
+        if (keys[a] != keys[b]) return keys[a] < keys[b];
+        return repeats[a] < repeats[b] || (repeats[a] == repeats[b] && a < b);
+    }
+    // plays the matches below node, returns their winner
+    int play(int node);
+
+   public:
+    explicit LoserTree(const std::vector<VariantKey>& input_keys);
+
+    int winner() const { return tree[0]; }
+    VariantKey min_key() const { return keys[tree[0]]; }
+    int min_repeats() const { return repeats[tree[0]]; }
+    // the winner's input moved on to key
+    void replace_winner(VariantKey key);
+};
+
+#endif
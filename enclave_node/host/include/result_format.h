@@ -0,0 +1,22 @@
+/*
+ * Header file for formatting the enclave's binary result records.
+ */
+
+#ifndef _RESULT_FORMAT_H_
+#define _RESULT_FORMAT_H_
+
+#include <string>
+
+#include "result_record.h"
+
+#define FIXED_MAX_LENGTH 330  // "%f" of -DBL_MAX and the terminating null
+
+// Appends the result lines of the records in [records, records + length) to out,
+// throws if the last record is truncated.
+void format_results(const char* records, size_t length, std::string& out);
+
+// "%f" of value, what std::to_string printed in the enclave, written to out.
+// Returns the end of the written characters, out must hold FIXED_MAX_LENGTH.
+char* format_fixed(double value, char* out);
+
+#endif /* _RESULT_FORMAT_H_ */
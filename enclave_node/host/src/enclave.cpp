@@ -7,6 +7,7 @@
 
 #include <chrono>
 #include <cstring>
+#include <functional>
 #include <string>
 #include <thread>
 #include <vector>
@@ -17,6 +18,12 @@
 #define MAX_ATTEMPT_TIMES 10
 #define ATTEMPT_TIMEOUT 500  // in milliseconds
 
+// OCALLs waiting on the network block here instead of returning to a polling enclave
+#define WAIT_SPIN_TIME 50  // in microseconds
+#define WAIT_MAX_SLEEP 2000  // in microseconds
+#define SETUP_WAIT_TIMEOUT 1000  // in milliseconds
+#define BATCH_WAIT_TIMEOUT 100  // in milliseconds
+
 #ifdef NON_OE
 #include "host_glue.h"
 #include "../../enclave/include/enclave_glue.h"
@@ -25,6 +32,27 @@
 #endif
 
 
+// spin for WAIT_SPIN_TIME, then sleep with a doubling interval until ready() or the timeout
+static bool wait_until(const std::function<bool()>& ready, const int timeout) {
+    auto now = std::chrono::steady_clock::now();
+    const auto spin_end = now + std::chrono::microseconds(WAIT_SPIN_TIME);
+    const auto deadline = now + std::chrono::milliseconds(timeout);
+    std::chrono::microseconds sleep_time(1);
+    while (!ready()) {
+        now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            return false;
+        }
+        if (now < spin_end) {
+            std::this_thread::yield();
+            continue;
+        }
+        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(sleep_time, deadline - now));
+        sleep_time = std::min(sleep_time * 2, std::chrono::microseconds(WAIT_MAX_SLEEP));
+    }
+    return true;
+}
+
 void setrsapubkey(uint8_t enc_rsa_pub_key[RSA_PUB_KEY_SIZE]) {
     std::memcpy(EnclaveNode::get_rsa_pub_key(), enc_rsa_pub_key, RSA_PUB_KEY_SIZE);
     
@@ -40,10 +68,6 @@ void setevidence(uint8_t evidence[MAX_EVIDENCE_SIZE], const int size) {
 }
 
 
-void setmaxbatchlines(int lines) {
-    EnclaveNode::set_max_batch_lines(lines);
-}
-
 void start_timer(const char func_name[MAX_DPINAME_LENGTH]) {
     EnclaveNode::start_timer(func_name);
 }
@@ -65,9 +89,14 @@ bool getaes(const int dpi_num,
             const int thread_id,
             unsigned char key[256],
             unsigned char iv[256]) {
-    std::string encrypted_aes_key = EnclaveNode::get_aes_key(dpi_num, thread_id);
-    std::string encrypted_aes_iv = EnclaveNode::get_aes_iv(dpi_num, thread_id);
-    if (!encrypted_aes_key.length() || !encrypted_aes_iv.length()) {
+    std::string encrypted_aes_key;
+    std::string encrypted_aes_iv;
+    bool ready = wait_until([&]() {
+        encrypted_aes_key = EnclaveNode::get_aes_key(dpi_num, thread_id);
+        encrypted_aes_iv = EnclaveNode::get_aes_iv(dpi_num, thread_id);
+        return encrypted_aes_key.length() && encrypted_aes_iv.length();
+    }, SETUP_WAIT_TIMEOUT);
+    if (!ready) {
         return false;
     }
     std::memcpy(key, &encrypted_aes_key[0], 256);
@@ -75,9 +104,46 @@ bool getaes(const int dpi_num,
     return true;
 }
 
+bool getreductionpeer(const int link, uint8_t pub_key[RSA_PUB_KEY_SIZE], uint8_t evidence[MAX_EVIDENCE_SIZE],
+                      int* evidence_size) {
+    std::string peer_pub_key;
+    std::string peer_evidence;
+    bool ready = wait_until([&]() {
+        return EnclaveNode::get_reduction_peer(link, peer_pub_key, peer_evidence);
+    }, SETUP_WAIT_TIMEOUT);
+    if (!ready) {
+        return false;
+    }
+    std::memcpy(pub_key, &peer_pub_key[0], RSA_PUB_KEY_SIZE);
+    std::memcpy(evidence, &peer_evidence[0], peer_evidence.length());
+    *evidence_size = peer_evidence.length();
+    return true;
+}
+
+void sendreductionshare(const int link, unsigned char share[256]) {
+    EnclaveNode::send_reduction_share(link, std::string((const char*)share, 256));
+}
+
+bool getreductionshare(const int link, unsigned char share[256]) {
+    std::string peer_share;
+    bool ready = wait_until([&]() {
+        peer_share = EnclaveNode::get_reduction_share(link);
+        return peer_share.length() > 0;
+    }, SETUP_WAIT_TIMEOUT);
+    if (!ready) {
+        return false;
+    }
+    std::memcpy(share, &peer_share[0], 256);
+    return true;
+}
+
 int get_num_patients(const int dpi_num, char num_patients_buffer[ENCLAVE_SMALL_BUFFER_SIZE]) {
-    std::string num_patients_encrypted = EnclaveNode::get_num_patients(dpi_num);
-    if (!num_patients_encrypted.length()) {
+    std::string num_patients_encrypted;
+    bool ready = wait_until([&]() {
+        num_patients_encrypted = EnclaveNode::get_num_patients(dpi_num);
+        return num_patients_encrypted.length() > 0;
+    }, SETUP_WAIT_TIMEOUT);
+    if (!ready) {
         return 0;
     }
     std::memset(num_patients_buffer, 0, ENCLAVE_SMALL_BUFFER_SIZE);
@@ -85,44 +151,66 @@ int get_num_patients(const int dpi_num, char num_patients_buffer[ENCLAVE_SMALL_B
     return num_patients_encrypted.length();
 }
 
-int gety(const int dpi_num, char y[ENCLAVE_READ_BUFFER_SIZE]) {
-    std::string y_data = EnclaveNode::get_y_data(dpi_num);
-    if (!y_data.length()) {
+int gety(const int dpi_num, const int offset, char y[ENCLAVE_READ_BUFFER_SIZE]) {
+    size_t y_length = 0;
+    std::memset(y, 0, ENCLAVE_READ_BUFFER_SIZE);
+    bool ready = wait_until([&]() {
+        y_length = EnclaveNode::get_y_data(dpi_num, offset, y, ENCLAVE_READ_BUFFER_SIZE);
+        return y_length > 0;
+    }, SETUP_WAIT_TIMEOUT);
+    if (!ready) {
         return 0;
     }
-    std::memset(y, 0, ENCLAVE_READ_BUFFER_SIZE);
-    std::memcpy(y, &y_data[0], y_data.length());
-    return y_data.length();
+    return y_length;
 }
 
 int getcov(const int dpi_num,
            const char cov_name[MAX_DPINAME_LENGTH],
+           const int offset,
            char cov[ENCLAVE_READ_BUFFER_SIZE]) {
+    std::memset(cov, 0, ENCLAVE_READ_BUFFER_SIZE);
     if (strcmp(cov_name, "1") == 0) {
-        std::memset(cov, 0, ENCLAVE_READ_BUFFER_SIZE);
         strcpy(cov, "1");
         return 1;
     }
-    std::string cov_data = EnclaveNode::get_covariant_data(dpi_num, cov_name);
-    if (!cov_data.length()) {
+    size_t cov_length = 0;
+    bool ready = wait_until([&]() {
+        cov_length = EnclaveNode::get_covariant_data(dpi_num, cov_name, offset, cov, ENCLAVE_READ_BUFFER_SIZE);
+        return cov_length > 0;
+    }, SETUP_WAIT_TIMEOUT);
+    if (!ready) {
         return 0;
     }
-    std::memset(cov, 0, ENCLAVE_READ_BUFFER_SIZE);
-    if (cov_data.length() > ENCLAVE_READ_BUFFER_SIZE) {
-        std::cout << "cov data length " << ENCLAVE_READ_BUFFER_SIZE << std::endl;
-    }
-    std::memcpy(cov, &cov_data[0], cov_data.length());
+    return cov_length;
+}
+
+bool waitbatch(const int thread_id) {
+    // the ring is empty, so its matcher has room for a batch again
+    EnclaveNode::signal_ring_drained();
+    const BatchRing* ring = EnclaveNode::get_batch_ring(thread_id);
+    return wait_until([ring]() {
+        return ring->head.load(std::memory_order_acquire) != ring->tail.load(std::memory_order_acquire);
+    }, BATCH_WAIT_TIMEOUT);
+}
+
+int readstats(uint8_t chunk[ENCLAVE_READ_BUFFER_SIZE]) {
+    return EnclaveNode::read_stats_chunk(chunk);
+}
 
-    return cov_data.length();
+void writestats(const uint8_t* chunk, const int size) {
+    EnclaveNode::write_stats_chunk(chunk, size);
 }
 
-int getbatch(char batch[ENCLAVE_READ_BUFFER_SIZE], const int thread_id) {
-    int res = EnclaveNode::get_allele_data(batch, thread_id);
-    return res;
+void signaloutput() {
+    EnclaveNode::signal_output();
 }
 
-void writebatch(char buffer[ENCLAVE_READ_BUFFER_SIZE], const int buffer_size, const int thread_id) {
-    EnclaveNode::write_allele_data(buffer, buffer_size, thread_id);
+bool waitoutput(const int thread_id, const int length) {
+    const BatchRing* ring = EnclaveNode::get_output_ring(thread_id);
+    return wait_until([ring, length]() {
+        uint64_t used = ring->head.load(std::memory_order_acquire) - ring->tail.load(std::memory_order_acquire);
+        return BATCH_RING_SIZE - used >= sizeof(uint32_t) + length;
+    }, BATCH_WAIT_TIMEOUT);
 }
 
 bool check_simulate_opt(int* argc, const char* argv[]) {
@@ -153,10 +241,6 @@ bool check_debug_opt(int* argc, const char* argv[]) {
 
 oe_enclave_t* enclave;
 
-void mark_eof_wrapper(const int thread_id) {
-    mark_eof(enclave, thread_id);
-}
-
 int start_enclave() {
     oe_result_t result;
     int ret = 1;
@@ -187,6 +271,18 @@ int start_enclave() {
             boost::thread* enclave_thread = new boost::thread(regression, enclave, thread_id, enc_analysis_type);
             thread_group.add_thread(enclave_thread);
         }
+        // from here until the regression threads start, they help with the end of it
+        auto setup_start = std::chrono::high_resolution_clock::now();
+
+        if (EnclaveNode::get_reduction_enabled()) {
+            result = setup_enclave_reduction(enclave, EnclaveNode::get_reduction_children(), EnclaveNode::get_reduction_has_parent());
+            if (result != OE_OK) {
+                fprintf(stderr,
+                        "calling into enclave_gwas failed: result=%u (%s)\n",
+                        result, oe_result_str(result));
+                goto exit;
+            }
+        }
 
         result = setup_enclave_encryption(enclave, num_threads);
         if (result != OE_OK) {
@@ -195,6 +291,17 @@ int start_enclave() {
                     result, oe_result_str(result));
             goto exit;
         }
+
+        for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
+            result = setup_enclave_batch_ring(enclave, thread_id, EnclaveNode::get_batch_ring(thread_id),
+                                              EnclaveNode::get_output_ring(thread_id));
+            if (result != OE_OK) {
+                fprintf(stderr,
+                        "calling into enclave_gwas failed: result=%u (%s)\n",
+                        result, oe_result_str(result));
+                goto exit;
+            }
+        }
         
         result = setup_num_patients(enclave);
         if (result != OE_OK) {
@@ -204,6 +311,40 @@ int start_enclave() {
             goto exit;
         }
 
+        result = setup_enclave_qc(enclave, EnclaveNode::get_qc_policy(), EnclaveNode::get_qc_min_maf(),
+                                  EnclaveNode::get_qc_min_call_rate(), EnclaveNode::get_qc_min_hwe_p());
+        if (result != OE_OK) {
+            fprintf(stderr,
+                    "calling into enclave_gwas failed: result=%u (%s)\n",
+                    result, oe_result_str(result));
+            goto exit;
+        }
+
+        result = setup_enclave_conditional(enclave, EnclaveNode::get_conditional_loci().c_str(),
+                                           EnclaveNode::get_conditional_window());
+        if (result != OE_OK) {
+            fprintf(stderr,
+                    "calling into enclave_gwas failed: result=%u (%s)\n",
+                    result, oe_result_str(result));
+            goto exit;
+        }
+
+        result = setup_enclave_stats(enclave, EnclaveNode::get_load_stats(), EnclaveNode::get_export_stats());
+        if (result != OE_OK) {
+            fprintf(stderr,
+                    "calling into enclave_gwas failed: result=%u (%s)\n",
+                    result, oe_result_str(result));
+            goto exit;
+        }
+
+        result = setup_enclave_regions(enclave, EnclaveNode::get_region_list().c_str());
+        if (result != OE_OK) {
+            fprintf(stderr,
+                    "calling into enclave_gwas failed: result=%u (%s)\n",
+                    result, oe_result_str(result));
+            goto exit;
+        }
+
         result = setup_enclave_phenotypes(enclave, num_threads, enc_analysis_type, EnclaveNode::get_impute_policy());
         if (result != OE_OK) {
             fprintf(stderr,
@@ -212,6 +353,8 @@ int start_enclave() {
             goto exit;
         }
         auto start = std::chrono::high_resolution_clock::now();
+        std::cout << "Enclave setup time total: "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(start - setup_start).count() << std::endl;
         thread_group.join_all();
         auto stop = std::chrono::high_resolution_clock::now();
 
@@ -220,6 +363,7 @@ int start_enclave() {
         std::cout << "Enclave time total: " << duration.count() << std::endl;
 
         EnclaveNode::print_timings();
+        EnclaveNode::close_stats();
         EnclaveNode::cleanup_output();
     } catch (ERROR_t& err) {
         std::cerr << "ERROR: " << err.msg << std::endl << std::flush;
@@ -251,17 +395,33 @@ int start_enclave() {
             boost::thread* enclave_thread = new boost::thread(regression, thread_id, enc_analysis_type);
             thread_group.add_thread(enclave_thread);
         }
+        // from here until the regression threads start, they help with the end of it
+        auto setup_start = std::chrono::high_resolution_clock::now();
 
+        if (EnclaveNode::get_reduction_enabled()) {
+            setup_enclave_reduction(EnclaveNode::get_reduction_children(), EnclaveNode::get_reduction_has_parent());
+        }
         setup_enclave_encryption(num_threads);
+        for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
+            setup_enclave_batch_ring(thread_id, EnclaveNode::get_batch_ring(thread_id), EnclaveNode::get_output_ring(thread_id));
+        }
         setup_num_patients();
+        setup_enclave_qc(EnclaveNode::get_qc_policy(), EnclaveNode::get_qc_min_maf(),
+                         EnclaveNode::get_qc_min_call_rate(), EnclaveNode::get_qc_min_hwe_p());
+        setup_enclave_conditional(EnclaveNode::get_conditional_loci().c_str(), EnclaveNode::get_conditional_window());
+        setup_enclave_stats(EnclaveNode::get_load_stats(), EnclaveNode::get_export_stats());
+        setup_enclave_regions(EnclaveNode::get_region_list().c_str());
         setup_enclave_phenotypes(num_threads, enc_analysis_type, EnclaveNode::get_impute_policy());
         auto start = std::chrono::high_resolution_clock::now();
+        std::cout << "Enclave setup time total: "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(start - setup_start).count() << std::endl;
         thread_group.join_all();
         auto stop = std::chrono::high_resolution_clock::now();
 
         auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
         std::cout << "Enclave time total: " << duration.count() << std::endl;
         EnclaveNode::print_timings();
+        EnclaveNode::close_stats();
         EnclaveNode::cleanup_output();
     } catch (ERROR_t& err) {
         std::cerr << "ERROR: " << err.msg << std::endl << std::flush;
@@ -4,18 +4,21 @@
 
 #include "enclave_node.h"
 #include "socket_send.h"
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <assert.h>
+#include <memory>
 #include <stdexcept>
 #include <chrono>
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <future>
 #include <netdb.h>
 #include "enclave.h"
-#include "hashing.h"
+#include "result_format.h"
+#include "loser_tree.h"
 #include "errno.h"
 
 #ifdef NON_OE
@@ -26,9 +29,56 @@
 
 std::mutex cout_lock;
 
-bool terminating = false;
+// set once every enclave thread has returned, output_sender exits when the rings are empty
+std::atomic<bool> terminating(false);
 
-const int MIN_BLOCK_COUNT = 50;
+// a thread with this many bytes of lines queued is given no more batches, so when the
+// data runs out no thread is more than about a batch behind the others
+#define DISPATCH_QUEUE_LIMIT ENCLAVE_READ_BUFFER_SIZE
+
+// enclave threads per matcher thread unless "matcher_threads" is set
+#define MATCHER_THREAD_RATIO 8
+
+// B of result text per OUTPUT message, what MAX_MESSAGE_SIZE leaves past the header
+#define OUTPUT_MESSAGE_SIZE (MAX_MESSAGE_SIZE - 64)
+
+// longest nap of a matcher while its enclave threads are a full batch behind, they only
+// wake it when they run dry, so this covers rings that drain without leaving the enclave
+#define DISPATCH_MAX_SLEEP 2000  // in microseconds
+
+// "offset total " ahead of the bytes of a y or covariant part, from start
+static void parse_phenotype_part(const std::string& msg, size_t start, size_t& offset, size_t& total, size_t& part_start) {
+    size_t offset_end = msg.find(' ', start);
+    size_t total_end = offset_end == std::string::npos ? offset_end : msg.find(' ', offset_end + 1);
+    if (total_end == std::string::npos) {
+        throw std::runtime_error("Malformed phenotype part");
+    }
+    offset = std::stoull(msg.substr(start, offset_end - start));
+    total = std::stoull(msg.substr(offset_end + 1, total_end - offset_end - 1));
+    part_start = total_end + 1;
+}
+
+// the digits of a decimal number from start, within end; a frame isn't null terminated, so
+// strtol could run past it. nullptr if there are none or too many to be a length or position
+static const char* parse_decimal(const char* start, const char* end, unsigned long& value) {
+    value = 0;
+    const char* digit = start;
+    for (; digit < end && *digit >= '0' && *digit <= '9'; ++digit) {
+        if (digit - start == 9) {
+            return nullptr;
+        }
+        value = value * 10 + (*digit - '0');
+    }
+    return digit == start ? nullptr : digit;
+}
+
+// the address other nodes reach this one at
+static std::string own_hostname() {
+    std::string hostname;
+    std::ifstream ipfile("ip.txt");
+    std::getline(ipfile, hostname);
+    return hostname;
+}
 
 EnclaveNode::EnclaveNode(const std::string& config_file) {
     init(config_file);
@@ -103,22 +153,171 @@ void EnclaveNode::init(const std::string& config_file) {
         }
     }
 
+    // optional QC run on every variant before regression, e.g.
+    // "qc": {"policy": "skip", "min_maf": 0.01, "min_call_rate": 0.95, "min_hwe_p": 1e-6}
+    qc_policy = QCPolicy::NoQC;
+    qc_min_maf = 0;
+    qc_min_call_rate = 0;
+    qc_min_hwe_p = 0;
+    if (enclave_config.count("qc")) {
+        nlohmann::json qc_config = enclave_config["qc"];
+        if (!qc_config.count("policy") || qc_config["policy"] == "skip") {
+            qc_policy = QCPolicy::SkipFailed;
+        } else if (qc_config["policy"] == "flag") {
+            qc_policy = QCPolicy::FlagFailed;
+        } else {
+            throw std::runtime_error("Config \"qc\" policy is unknown.");
+        }
+        if (qc_config.count("min_maf")) qc_min_maf = qc_config["min_maf"];
+        if (qc_config.count("min_call_rate")) qc_min_call_rate = qc_config["min_call_rate"];
+        if (qc_config.count("min_hwe_p")) qc_min_hwe_p = qc_config["min_hwe_p"];
+    }
+
+    // optional conditional re-scan of the region around lead variants, e.g.
+    // "conditional": {"loci": ["1:904165", "1:905373"], "window": 500000}
+    conditional_window = 0;
+    if (enclave_config.count("conditional")) {
+        if (enc_analysis != EncAnalysis::linear) {
+            throw std::runtime_error("Config \"conditional\" requires \"analysis_type\": \"linear\".");
+        }
+        nlohmann::json conditional_config = enclave_config["conditional"];
+        for (int i = 0; i < conditional_config["loci"].size(); ++i) {
+            std::string locus = conditional_config["loci"][i];
+            conditional_loci.append(locus + "\t");
+        }
+        if (conditional_config.count("window")) conditional_window = conditional_config["window"];
+    }
+
+    // optional sealed sufficient statistics store for linear regression, e.g.
+    // "stats_store": {"load": "cohort_a.stats", "export": "cohort_ab.stats"}
+    // loading a store adds this session's dpis to the cohort it was built from
+    load_stats = false;
+    export_stats = false;
+    if (enclave_config.count("stats_store")) {
+        if (enc_analysis != EncAnalysis::linear) {
+            throw std::runtime_error("Config \"stats_store\" requires \"analysis_type\": \"linear\".");
+        }
+        if (enclave_config.count("conditional")) {
+            throw std::runtime_error("Config \"stats_store\" can't be combined with \"conditional\".");
+        }
+        nlohmann::json stats_config = enclave_config["stats_store"];
+        if (stats_config.count("load")) {
+            std::string stats_load_file = stats_config["load"];
+            stats_in.open(stats_load_file, std::ios::binary);
+            if (!stats_in.is_open()) {
+                throw std::runtime_error("Couldn't open stats store " + stats_load_file);
+            }
+            // only the chunk sizes are read here, read_stats_chunk starts from the last chunk
+            uint32_t chunk_size;
+            while (stats_in.read((char*)&chunk_size, sizeof(uint32_t))) {
+                if (chunk_size > ENCLAVE_READ_BUFFER_SIZE) {
+                    throw std::runtime_error("Stats store chunk is larger than the enclave read buffer");
+                }
+                stats_in_offsets.push_back(stats_in.tellg());
+                stats_in.seekg(chunk_size, std::ios::cur);
+            }
+            stats_in.clear();
+            stats_in_pos = 0;
+            load_stats = true;
+        }
+        if (stats_config.count("export")) {
+            std::string stats_export_file = stats_config["export"];
+            stats_out.open(stats_export_file, std::ios::binary | std::ios::trunc);
+            if (!stats_out.is_open()) {
+                throw std::runtime_error("Couldn't open stats store " + stats_export_file);
+            }
+            export_stats = true;
+        }
+    }
+
+    // optional vertical scaling: every enclave node owns whole dpis and its partial sums are
+    // reduced up a tree of nodes to the root, the only one reporting results, e.g.
+    // "reduction": {"children": 2, "parent": {"hostname": "10.0.0.1", "port": 16701}}
+    reduction_enabled = false;
+    reduction_children = 0;
+    reduction_has_parent = false;
+    reduction_parent_port = 0;
+    reduction_hellos = 0;
+    reduce_chunks_sent = 0;
+    reduce_current_pos = 0;
+    if (enclave_config.count("reduction")) {
+        if (enc_analysis != EncAnalysis::linear) {
+            throw std::runtime_error("Config \"reduction\" requires \"analysis_type\": \"linear\".");
+        }
+        if (enclave_config.count("stats_store") || enclave_config.count("conditional") || enclave_config.count("qc")) {
+            throw std::runtime_error("Config \"reduction\" can't be combined with \"stats_store\", \"conditional\" or \"qc\".");
+        }
+        nlohmann::json reduction_config = enclave_config["reduction"];
+        reduction_enabled = true;
+        if (reduction_config.count("children")) reduction_children = reduction_config["children"];
+        if (reduction_config.count("parent")) {
+            reduction_has_parent = true;
+            reduction_parent_hostname = reduction_config["parent"]["hostname"];
+            reduction_parent_port = reduction_config["parent"]["port"];
+        }
+        // a child's address comes with its hello, the parent's is known
+        reduction_links.assign(reduction_children + 1, ReductionLink{"", "", 0, "", "", "", false});
+        reduction_links.back().hostname = reduction_parent_hostname;
+        reduction_links.back().port = reduction_parent_port;
+    }
+
+    // optional gene/region burden and SKAT tests over the variants of each BED region, e.g.
+    // "region_tests": {"bed": "genes.bed"}
+    if (enclave_config.count("region_tests")) {
+        if (enc_analysis != EncAnalysis::linear) {
+            throw std::runtime_error("Config \"region_tests\" requires \"analysis_type\": \"linear\".");
+        }
+        if (enclave_config.count("stats_store") || enclave_config.count("conditional") || enclave_config.count("reduction")) {
+            throw std::runtime_error("Config \"region_tests\" can't be combined with \"stats_store\", \"conditional\" or \"reduction\".");
+        }
+        std::string bed_file = enclave_config["region_tests"]["bed"];
+        std::ifstream bed_in(bed_file);
+        if (!bed_in.is_open()) {
+            throw std::runtime_error("Couldn't open region file " + bed_file);
+        }
+        std::string line;
+        while (std::getline(bed_in, line)) {
+            if (line.empty() || line[0] == '#' || line.compare(0, 5, "track") == 0 || line.compare(0, 7, "browser") == 0) {
+                continue;
+            }
+            std::istringstream fields(line);
+            std::string chrom, start, end, name;
+            if (!(fields >> chrom >> start >> end)) {
+                throw std::runtime_error("Malformed region line: " + line);
+            }
+            if (chrom.compare(0, 3, "chr") == 0) chrom = chrom.substr(3);
+            // only the autosomes and X are ever streamed
+            if (chrom != "X" && chrom.find_first_not_of("0123456789") != std::string::npos) continue;
+            if (!(fields >> name)) name = chrom + ":" + start + "-" + end;
+            region_list += chrom + "\t" + start + "\t" + end + "\t" + name + "\n";
+        }
+    }
+
     server_eof = false;
-    max_batch_lines = 0;
     global_id = -1;
 
-    // Make a bucket for each possible port number. This is not very space
-    // efficient but I couldn't find a good lock free unordered_set
-    // so this will do just fine. All race conditions are basically benign.
-    seen_fds.resize(65354);
-    std::fill(seen_fds.begin(), seen_fds.end(), false);
-
-    allele_queue_list.resize(num_threads);
-    eof_read_list.resize(num_threads);
+    batch_rings.resize(num_threads);
+    output_rings.resize(num_threads);
+    for (int id = 0; id < num_threads; ++id) {
+        batch_rings[id] = new BatchRing();
+        output_rings[id] = new BatchRing();
+    }
 
+    // keys are hashed across the matcher threads, each feeds every num_matchers-th enclave thread
+    num_matchers = std::max(1, num_threads / MATCHER_THREAD_RATIO);
+    if (enclave_config.count("matcher_threads")) {
+        num_matchers = enclave_config["matcher_threads"];
+    }
+    num_matchers = std::min(std::max(num_matchers, 1), num_threads);
+    matcher_shards.resize(num_matchers);
+    for (int id = 0; id < num_matchers; ++id) {
+        matcher_shards[id].id = id;
+    }
     for (int id = 0; id < num_threads; ++id) {
-        eof_read_list[id] = false;
+        matcher_shards[id % num_matchers].rings.push_back(batch_rings[id]);
     }
+    ring_drains = 0;
+    output_signals = 0;
 
     // Also start the enclave thread.
     boost::thread enclave_thread(start_enclave);
@@ -128,144 +327,30 @@ void EnclaveNode::init(const std::string& config_file) {
 void EnclaveNode::run() {
     // set up the server to do nothing when it receives a broken pipe error
     //signal(SIGPIPE, signal_handler);
-    // create a master socket to listen for requests on
-    // (1) Create socket
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-    // (2) Set the "reuse port" socket option
-	int yesval = 1;
-	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yesval, sizeof(yesval));
-
-    // (3) Create a sockaddr_in struct for the proper port and bind() to it.
-	struct sockaddr_in addr;
-    socklen_t addrSize = sizeof(addr);
-    memset(&addr, 0, addrSize);
-
-    // specify socket family (Internet)
-	addr.sin_family = AF_INET;
-
-	// specify socket hostname
-	// The socket will be a server, so it will only be listening.
-	// Let the OS map it to the correct address.
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
-
-    // bind to our given port, or randomly get one if port = 0
-	if (bind(sockfd, (struct sockaddr*) &addr, addrSize) < 0) {
-        guarded_cout("bind failure: " + std::to_string(errno), cout_lock);
-    }
-
-    // update our member variable to the port we just assigned
-    if (getsockname(sockfd, (struct sockaddr*) &addr, &addrSize) < 0) {
-        guarded_cout("getsockname failure: " + std::to_string(errno), cout_lock);
-    }
-
-    // (4) Begin listening for incoming connections.
-	if (listen(sockfd, 4096) < 0) {
-        guarded_cout("listen: " + std::to_string(errno), cout_lock);
-    }
-
-    port = ntohs(addr.sin_port);
+    // a worker per dpi may wait on its full reorder window if the dpi outruns its credits, the others keep serving
+    Reactor reactor(std::thread::hardware_concurrency() + institution_list.size(),
+                    [this](int connFD, Frame& body) { return handle_body(connFD, body); });
+    port = reactor.listen(port);
     guarded_cout("\n Running on port " + std::to_string(port), cout_lock);
+    reactor.run();
+}
 
-
-    // (5) Serve incoming connections one by one forever (a lonely fate).
-	while (true) {
-        // accept connection from dpi
-        int connFD = accept(sockfd, (struct sockaddr*) &addr, &addrSize);
-
-        // spin up a new thread to handle this message
-        boost::thread msg_thread(&EnclaveNode::start_thread, this, connFD, nullptr);
-        msg_thread.detach();
-    }
-}
-
-bool EnclaveNode::start_thread(int connFD, char* body_buffer) {
-    // if we catch any errors we will throw an error to catch and close the connection
-    bool buffer_given = body_buffer != nullptr;
-    if (!buffer_given) {
-        body_buffer = new char[MAX_MESSAGE_SIZE]();
-    }
-    try {
-        char header_buffer[128];
-        // receive header, byte by byte until we hit deliminating char
-        memset(header_buffer, 0, sizeof(header_buffer));
-
-        int header_size = 0;
-        bool found_delim = false;
-        while (header_size < 128) {
-            // Receive exactly one byte
-            int rval = recv(connFD, header_buffer + header_size, 1, MSG_WAITALL);
-            if (rval == -1) {
-                char buffer[ 256 ];
-                char * errorMsg = strerror_r( errno, buffer, 256 ); // GNU-specific version, Linux default
-                printf("Error %s\n", errorMsg); //return value has to be used since buffer might not be modified
-                throw std::runtime_error("Socket recv failed\n");
-            } else if (rval == 0) {
-                std::cout << "rval was 0" << std::endl;
-                return false;
-            }
-            // Stop if we received a deliminating character
-            if (header_buffer[header_size] == '\n') {
-                found_delim = true;
-                break;
-            }
-            header_size++;
-        }
-        if (!found_delim) {
-            std::cout << "Recieved message without null terminating char" << std::endl;
-            std::cout << header_buffer << std::endl;
-            return true;
-            //throw std::runtime_error("Didn't read in a null terminating char");
-        }
-        std::string header(header_buffer, header_size);
-        if (header.find("GET / HTTP/1.1") != std::string::npos) {
-            std::cout << "Strange get request? Ignoring for now." << std::endl;
-            delete[] body_buffer;
-            return true;
-        }
-
-        unsigned int body_size;
-        try {
-            body_size = std::stoi(header);
-        } catch(const std::invalid_argument& e) {
-            std::cout << "Failed to read in body size" << std::endl;
-            std::cout << header << std::endl;
-            return true;
-        }
-        if (body_size != 0) {
-            // read in encrypted body
-            int rval = recv(connFD, body_buffer, body_size, MSG_WAITALL);
-            if (rval == -1) {
-                throw std::runtime_error("Error reading request body");
-            }
-        }
-        std::string body(body_buffer, body_size);
-
-        std::string msg;
-        std::string dpi_name;
-        EnclaveNodeMessageType mtype = DATA;
-        if (!body.length()) {
-            std::cout << "No body? " << header << " ! " << body << std::endl;
-            return true;
-        }
-        parse_header_enclave_node_header(body, msg, dpi_name, mtype, connFD);
-
-        // if (mtype != EnclaveNodeMessageType::DATA) {
-        //     guarded_cout("Msg type: " + std::to_string(mtype) + " dpi: " + dpi_name, cout_lock);
-        // }
-
-        handle_message(connFD, dpi_name, mtype, msg);
-    }
-    catch (const std::runtime_error e)  {
-        guarded_cout("Exception " + std::string(e.what()) + "\n", cout_lock);
-        close(connFD);
+bool EnclaveNode::handle_body(int connFD, Frame& body) {
+    std::string msg;
+    std::string dpi_name;
+    EnclaveNodeMessageType mtype = DATA;
+    if (!body.size()) {
+        std::cout << "No body?" << std::endl;
         return false;
     }
-    if (!buffer_given) {
-        delete[] body_buffer;
-    }
-    return true;
+    parse_header_enclave_node_header(body, msg, dpi_name, mtype);
+
+    // if (mtype != EnclaveNodeMessageType::DATA) {
+    //     guarded_cout("Msg type: " + std::to_string(mtype) + " dpi: " + dpi_name, cout_lock);
+    // }
+
+    // a dpi's DATA messages share one connection, everything else comes on pooled ones
+    return handle_message(connFD, dpi_name, mtype, msg);
 }
 
 bool EnclaveNode::handle_message(int connFD, const std::string& name, EnclaveNodeMessageType mtype, std::string& msg) {
@@ -297,13 +382,23 @@ bool EnclaveNode::handle_message(int connFD, const std::string& name, EnclaveNod
                 if (institution_list[id] == name) {
                     found = true;
                     
-                    institutions[name] = new Institution(hostname_and_port[0], 
-                                                         std::stoi(hostname_and_port[1]),
+                    std::string hostname = hostname_and_port[0];
+                    int port = std::stoi(hostname_and_port[1]);
+                    institutions[name] = new Institution(hostname, 
+                                                         port,
                                                          id,
-                                                         num_threads);
+                                                         num_threads,
+                                                         num_matchers,
+                                                         [this, hostname, port](int credits) {
+                                                             send_msg(hostname, port, DATA_CREDIT, std::to_string(credits));
+                                                         });
                 }
             }
             if (!found) {
+                // every dpi registers with every node of a reduction tree, only its owner takes it
+                if (reduction_enabled) {
+                    return true;
+                }
                 throw std::runtime_error("No institution with that name was found");
             }
 
@@ -326,50 +421,132 @@ bool EnclaveNode::handle_message(int connFD, const std::string& name, EnclaveNod
             if (thread_id == 0) {
                 check_in(name);
             }
-            institutions_lock.lock();
-            institutions[name]->set_key_and_iv(
+            find_institution(name)->set_key_and_iv(
                                     aes_info[0], // encrypted key
                                     aes_info[1], // encrypted iv
                                     thread_id); // thread id    
-            institutions_lock.unlock();
+            break;
+        }
+        case REDUCE_HELLO:
+        {
+            // hostname, a tab, port, a tab, then the child enclave's rsa key and evidence
+            size_t host_end = msg.find('\t');
+            size_t port_end = host_end == std::string::npos ? host_end : msg.find('\t', host_end + 1);
+            if (port_end == std::string::npos || msg.length() - port_end - 1 <= RSA_PUB_KEY_SIZE ||
+                msg.length() - port_end - 1 > RSA_PUB_KEY_SIZE + MAX_EVIDENCE_SIZE) {
+                throw std::runtime_error("Invalid reduce hello");
+            }
+            std::lock_guard<std::mutex> raii(stats_lock);
+            if (reduction_child(name) >= 0 || reduction_hellos == reduction_children) {
+                throw std::runtime_error("Reduce hello from an unexpected child node " + name);
+            }
+            ReductionLink& child = reduction_links[reduction_hellos++];
+            child.name = name;
+            child.hostname = msg.substr(0, host_end);
+            child.port = std::stoi(msg.substr(host_end + 1, port_end - host_end - 1));
+            child.pub_key = msg.substr(port_end + 1, RSA_PUB_KEY_SIZE);
+            child.evidence = msg.substr(port_end + 1 + RSA_PUB_KEY_SIZE);
+            break;
+        }
+        case REDUCE_WELCOME:
+        {
+            // the parent enclave's rsa key and evidence
+            if (msg.length() <= RSA_PUB_KEY_SIZE || msg.length() > RSA_PUB_KEY_SIZE + MAX_EVIDENCE_SIZE) {
+                throw std::runtime_error("Invalid reduce welcome");
+            }
+            std::lock_guard<std::mutex> raii(stats_lock);
+            if (!reduction_has_parent || reduction_links.back().pub_key.length()) {
+                throw std::runtime_error("Unexpected reduce welcome from " + name);
+            }
+            ReductionLink& parent = reduction_links.back();
+            parent.name = name;
+            parent.pub_key = msg.substr(0, RSA_PUB_KEY_SIZE);
+            parent.evidence = msg.substr(RSA_PUB_KEY_SIZE);
+            break;
+        }
+        case REDUCE_SHARE:
+        {
+            // a child only sends its share after its hello, the parent's may overtake its welcome
+            std::lock_guard<std::mutex> raii(stats_lock);
+            int child = reduction_child(name);
+            if (child < 0 && !reduction_has_parent) {
+                throw std::runtime_error("Reduce share from an unexpected node " + name);
+            }
+            ReductionLink& peer = reduction_link(child >= 0 ? child : REDUCTION_PARENT_LINK);
+            if (peer.share.length() || msg.length() != 256 || (child < 0 && peer.name.length() && peer.name != name)) {
+                throw std::runtime_error("Invalid reduce share from " + name);
+            }
+            peer.share = msg;
+            break;
+        }
+        case REDUCE_STATS:
+        {
+            // seq number, a space, then a sealed chunk exactly as the child enclave wrote it
+            size_t split = msg.find(' ');
+            if (split == std::string::npos) {
+                throw std::runtime_error("Invalid reduce message");
+            }
+            int seq = std::stoi(msg.substr(0, split));
+            std::lock_guard<std::mutex> raii(stats_lock);
+            if (reduction_child(name) < 0) {
+                throw std::runtime_error("Reduce stats from an unexpected child node " + name);
+            }
+            reduce_chunks[name][seq] = msg.substr(split + 1);
+            reduce_cv.notify_all();
+            break;
+        }
+        case REDUCE_EOF:
+        {
+            std::lock_guard<std::mutex> raii(stats_lock);
+            if (reduction_child(name) < 0) {
+                throw std::runtime_error("Reduce stats from an unexpected child node " + name);
+            }
+            reduce_chunks[name];
+            reduce_chunk_counts[name] = std::stoi(msg);
+            reduce_cv.notify_all();
             break;
         }
         case PATIENT_COUNT:
         {
-            institutions_lock.lock();
-            institutions[name]->set_num_patients(msg);
-            institutions_lock.unlock();
+            find_institution(name)->set_num_patients(msg);
             break;
         }
         case Y_VAL:
         {
-            institutions[name]->set_y_data(msg);
+            size_t offset, total, part_start;
+            parse_phenotype_part(msg, 0, offset, total, part_start);
+            find_institution(name)->set_y_data(offset, total, &msg[part_start], msg.length() - part_start);
             break;
         }
         case COVARIANT:
         {
-            std::vector<std::string> name_data_split;
-            Parser::split(name_data_split, msg, ' ', 1);
-            std::string covariant_name = name_data_split.front();
+            size_t name_end = msg.find(' ');
+            if (name_end == std::string::npos) {
+                throw std::runtime_error("Malformed covariant part");
+            }
+            std::string covariant_name = msg.substr(0, name_end);
 
             if (!expected_covariants.count(covariant_name)) {
                 throw std::runtime_error("Unexpected covariant received.");
             }
-            institutions[name]->set_covariant_data(covariant_name, name_data_split.back());
+            size_t offset, total, part_start;
+            parse_phenotype_part(msg, name_end + 1, offset, total, part_start);
+            find_institution(name)->set_covariant_data(covariant_name, offset, total, &msg[part_start], msg.length() - part_start);
             break;
         }
         case EOF_DATA:
         {
+            Institution* institution = find_institution(name);
             DataBlockBatch* batch = new DataBlockBatch;
             batch->pos = std::stoi(msg);
-            DataBlock* block = new DataBlock;
+            batch->blocks_batch.resize(1);
+            DataBlock& block = batch->blocks_batch.back();
 
-            block->locus = EOFSeperator;
-            block->data = EOFSeperator;
+            block.key = VARIANT_KEY_EOF;
+            block.data = EOFSeperator;
+            block.length = strlen(EOFSeperator);
 
-            batch->blocks_batch.push_back(block);
-            institutions[name]->add_block_batch(batch);
-            //institutions[name]->transfer_eligible_blocks();
+            institution->add_block_batch(batch);
             break;
         }
         case DATA:
@@ -389,29 +566,23 @@ bool EnclaveNode::handle_message(int connFD, const std::string& name, EnclaveNod
     if (response.length()) {
         send_msg(name, response_mtype, response);
     }
-    if (mtype != DATA && mtype != EOF_DATA) {
-        // cool, well handled!
-        //guarded_cout("\nClosing connection", cout_lock);
-        close(connFD);
-        //guarded_cout("\n--------------", cout_lock);
-        return false;
-    } 
+    // cool, well handled! senders keep their connections for their next messages
     return true;  
 }
 
 int EnclaveNode::send_msg(const std::string& hostname, const int port, const int mtype, const std::string& msg, int connFD) {
-    std::string message = std::to_string(global_id) + " " + std::to_string(mtype) + " ";
-    message = std::to_string(message.length() + msg.length()) + "\n" + message + msg;
+    std::string header = std::to_string(global_id) + " " + std::to_string(mtype) + " ";
     return send_message(hostname.c_str(), 
                         port, 
-                        message.c_str(), 
-                        message.length(), 
+                        header, 
+                        msg, 
                         connFD);
 }
 
 int EnclaveNode::send_msg(const std::string& name, const int mtype, const std::string& msg, int connFD) {
-    return send_msg(institutions[name]->hostname, 
-                    institutions[name]->port, 
+    Institution* institution = find_institution(name);
+    return send_msg(institution->hostname, 
+                    institution->port, 
                     mtype, 
                     msg, 
                     connFD);
@@ -425,6 +596,15 @@ int EnclaveNode::send_msg_output(const std::string& msg, CoordinationServerMessa
                     connFD);
 }
 
+Institution* EnclaveNode::find_institution(const std::string& name) {
+    std::lock_guard<std::mutex> raii(institutions_lock);
+    auto it = institutions.find(name);
+    if (it == institutions.end()) {
+        throw std::runtime_error("Message from an unregistered institution " + name);
+    }
+    return it->second;
+}
+
 void EnclaveNode::check_in(const std::string& name) {
     std::lock_guard<std::mutex> raii(expected_lock);
     // for (std::string inst : expected_institutions)
@@ -436,15 +616,20 @@ void EnclaveNode::check_in(const std::string& name) {
     if (!expected_institutions.size()) {
         // request y, cov, and data
         for (const auto& it : institutions) {
-            send_msg(it.first, Y_AND_COV, covariant_list + y_val_name);
+            // in a reduction tree this node owns its dpis, they send it every row
+            send_msg(it.first, reduction_enabled ? OWNER_Y_AND_COV : Y_AND_COV, covariant_list + y_val_name);
 
-            institutions[it.first]->request_conn = send_msg(it.first, DATA_REQUEST, std::to_string(MIN_BLOCK_COUNT), institutions[it.first]->request_conn);
+            // the dpi starts with credit for a full reorder window of DATA batches
+            send_msg(it.first, DATA_REQUEST, std::to_string(REORDER_WINDOW));
         }
 
 
-        // Now that all institutions are registered, start up the allele matching thread.
-        boost::thread msg_thread(&EnclaveNode::allele_matcher, this);
-        msg_thread.detach();
+        // Now that all institutions are registered, start up the allele matching threads.
+        matchers_running = num_matchers;
+        for (int matcher_id = 0; matcher_id < num_matchers; ++matcher_id) {
+            boost::thread msg_thread(&EnclaveNode::allele_matcher, this, matcher_id);
+            msg_thread.detach();
+        }
 
         // And now start up the thread to send out our results to the register server.
         boost::thread output_thread(&EnclaveNode::output_sender, this);
@@ -452,234 +637,315 @@ void EnclaveNode::check_in(const std::string& name) {
     }
 }
 
-void EnclaveNode::data_listener(int connFD) {
-    // We need a serial listener for this agreed upon connection!
-    char* body_buffer = new char[MAX_MESSAGE_SIZE]();
-    while(start_thread(connFD, body_buffer)) {}
-    delete[] body_buffer;
+int EnclaveNode::matcher_of(VariantKey key) const {
+    // fibonacci hashing, neighbouring keys land on different matchers
+    return (int)(((key * 0x9E3779B97F4A7C15ULL) >> 32) % num_matchers);
 }
 
-void EnclaveNode::allele_matcher() {
-    //auto start = std::chrono::high_resolution_clock::now();
-
-    bool first = true;
-    while(true) {
-    loop_start:
-        // transfer all blocks to eligible queue, making sure they are in order
-        for (const auto& it : institutions) {
-            Institution* inst = it.second;
-            inst->transfer_eligible_blocks();
-        }
-        // match as many alleles together as possible
-        while(true) {
-            // arbitary "high" string, all real loci should be smaller than this string.
-            std::string min_locus = "~";
-            for (const auto& it : institutions) {
-                Institution* inst = it.second;
-                DataBlock* block = inst->get_top_block();
-                // check if the institution has data
-                if (!block) {
-                    // if we've already received an <EOF> notice and emptied the blocks pq, skip this block
-                    if (inst->all_data_received && !inst->get_blocks_size()) {
-                        continue;
-                    }
-                    // otherwise, we need to wait for all institutions to send their data!
-                    else {
-                        std::this_thread::yield();
-                        goto loop_start;
-                    }
-                }
-                // test if block->locus < min_locus
-                if (min_locus.compare(block->locus) > 0) {
-                    min_locus = block->locus;
-                }
-            }
-            // if we did not find a min locus, all data has been received and we have processed all of it.
-            // enqueue EOF for all enclave threads then shut down the matcher, its work is done.
-            if (min_locus == "~") {
-                std::cout << "received last message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << std::endl;
-                for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
-                    allele_queue_list[thread_id].enqueue(EOFSeperator);
-                }
-                // auto stop = std::chrono::high_resolution_clock::now();
-                // auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-                // guarded_cout("Matcher time total: " + std::to_string(duration.count()), cout_lock);
-                return;
+DataBlock* EnclaveNode::next_shard_block(Institution* inst, MatcherShard& shard) {
+    while (true) {
+        DataBlock* block = inst->get_top_block(shard.id);
+        if (!block) {
+            // we need to wait for the institution to send its data!
+            // the threads shouldn't idle on a half formed batch meanwhile
+            if (shard.ring) {
+                dispatch_batch(shard);
             }
+            spill_line(shard);
+            block = inst->wait_top_block(shard.id);
+        }
+        // every matcher sees the EOF block, it is never popped
+        if (block->key == VARIANT_KEY_EOF || matcher_of(block->key) == shard.id) {
+            return block;
+        }
+        inst->skip_top_block(shard.id);
+    }
+}
 
-            std::string allele_line = min_locus + "\t";
-            std::string data;
+void EnclaveNode::spill_line(MatcherShard& shard) {
+    bool holding = false;
+    for (const LineRow& row : shard.line_rows) {
+        holding |= row.inst->holds_passed(shard.id);
+    }
+    if (!holding) {
+        return;
+    }
+    for (LineRow& row : shard.line_rows) {
+        shard.spilled.emplace_back(row.block.data, row.block.length);
+        row.block.data = shard.spilled.back().data();
+    }
+    for (const LineRow& row : shard.line_rows) {
+        row.inst->release_popped(shard.id);
+    }
+}
 
-            int locus_hash_thread = hash_string(allele_line, num_threads, true); 
+void EnclaveNode::allele_matcher(int matcher_id) {
+    //auto start = std::chrono::high_resolution_clock::now();
 
-            for (int institutions_idx = 0; institutions_idx < institution_list.size(); ++institutions_idx) {
-                Institution* inst = institutions[institution_list[institutions_idx]];
-                DataBlock* block = inst->get_top_block();
-                // if this institution is <EOF>, skip it.
-                if (!block) continue;
+    // lines are batched here and each batch goes to whichever of this matcher's enclave threads
+    // is least busy, a thread's rows keep their key order and any thread can decrypt any row
+    MatcherShard& shard = matcher_shards[matcher_id];
+    shard.ring = nullptr;
+    shard.batch_length = 0;
+    shard.batch_line_count = 0;
+    shard.dispatch_lines = 0;
+
+    // merge the institutions' rows of this matcher's keys, an institution that sent all of its
+    // rows stays at its EOF block, which sorts after every variant
+    std::vector<Institution*> inputs;
+    std::vector<std::string> input_ids;
+    std::vector<VariantKey> keys;
+    for (const std::string& name : institution_list) {
+        inputs.push_back(find_institution(name));
+        input_ids.push_back(std::to_string(inputs.back()->get_id()));
+        keys.push_back(next_shard_block(inputs.back(), shard)->key);
+    }
+    LoserTree tree(keys);
+
+    std::vector<LineRow>& line_rows = shard.line_rows;
+    char key_bytes[VARIANT_KEY_SIZE];
+    while (tree.min_key() != VARIANT_KEY_EOF) {
+        VariantKey min_key = tree.min_key();
+        int min_repeats = tree.min_repeats();
+        line_rows.clear();
+        // equal keys leave the tree in institution order, a dpi's repeated key starts the next line
+        do {
+            int input = tree.winner();
+            line_rows.push_back(LineRow{input, inputs[input], *inputs[input]->pop_top_block(shard.id)});
+            tree.replace_winner(next_shard_block(inputs[input], shard)->key);
+        } while (tree.min_key() == min_key && tree.min_repeats() == min_repeats);
+
+        // line format: key, dpi ids (tab delimited), space, each dpi's encrypted genotypes
+        uint32_t length = VARIANT_KEY_SIZE;
+        for (const LineRow& row : line_rows) {
+            length += input_ids[row.input].length() + 1 + row.block.length;
+        }
+        // written straight into the enclave thread's ring, the one copy of the row on the host
+        reserve_batch_line(shard, length);
+        append_batch(shard, (const char*)&length, sizeof(uint32_t));
+        variant_key_write(min_key, key_bytes);
+        append_batch(shard, key_bytes, VARIANT_KEY_SIZE);
+        for (size_t idx = 0; idx < line_rows.size(); ++idx) {
+            const std::string& id = input_ids[line_rows[idx].input];
+            append_batch(shard, id.data(), id.length());
+            // a space after the last id so that we know where the data starts
+            append_batch(shard, idx + 1 < line_rows.size() ? "\t" : " ", 1);
+        }
+        for (const LineRow& row : line_rows) {
+            append_batch(shard, row.block.data, row.block.length);
+            row.inst->release_popped(shard.id);
+        }
+        shard.spilled.clear();
+        shard.batch_line_count++;
+
+        // For the first line we want to calculate the max number of lines per batch
+        std::call_once(first_line_once, [] {
+            std::cout << "received first message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "\n";
+            // start = std::chrono::high_resolution_clock::now();
+        });
+    }
 
-                if (block->locus == min_locus) {
-                    block = inst->pop_top_block();
-                    allele_line.append(std::to_string(inst->get_id()) + "\t");
-                    data.append(block->data);
-                    delete block;
-                }
+    // all data has been received and we have processed all of it.
+    // enqueue EOF for this matcher's enclave threads then shut down the matcher, its work is done.
+    if (shard.ring) {
+        dispatch_batch(shard);
+    }
+    for (BatchRing* ring : shard.rings) {
+        std::chrono::microseconds nap(1);
+        while (true) {
+            uint64_t seen = ring_drains.load(std::memory_order_acquire);
+            if (batch_ring_push(ring, nullptr, BATCH_RING_EOF)) {
+                break;
             }
-            // replace last tab with a space so that we know where the data starts
-            allele_line.pop_back();
-            allele_line.push_back(' ');
-
-            allele_line.append(data);
+            wait_ring_drain(seen, nap);
+        }
+    }
+    if (matchers_running.fetch_sub(1) == 1) {
+        std::cout << "received last message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << std::endl;
+    }
+    // auto stop = std::chrono::high_resolution_clock::now();
+    // auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+    // guarded_cout("Matcher time total: " + std::to_string(duration.count()), cout_lock);
+}
 
-            // For the first line we want to calculate the max number of lines per batch
-            if (first) {
-                std::cout << "received first message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "\n";
-                // start = std::chrono::high_resolution_clock::now();
-                first = false;
+void EnclaveNode::reserve_batch_line(MatcherShard& shard, const uint32_t length) {
+    // a line that can't fit into one enclave batch would never be read
+    if (length > ENCLAVE_READ_BUFFER_SIZE - sizeof(uint32_t)) {
+        throw std::runtime_error("Line larger than enclave read buffer");
+    }
+    if (shard.ring && (shard.batch_length + sizeof(uint32_t) + length > ENCLAVE_READ_BUFFER_SIZE ||
+                       (shard.dispatch_lines && shard.batch_line_count >= shard.dispatch_lines))) {
+        dispatch_batch(shard);
+    }
+    if (shard.ring) {
+        return;
+    }
+    std::chrono::microseconds nap(1);
+    while (true) {
+        uint64_t seen = ring_drains.load(std::memory_order_acquire);
+        BatchRing* least_loaded = shard.rings[0];
+        uint64_t least_used = batch_ring_used(least_loaded);
+        for (BatchRing* ring : shard.rings) {
+            uint64_t used = batch_ring_used(ring);
+            if (used < least_used) {
+                least_loaded = ring;
+                least_used = used;
             }
-            
-            // thread-safe enqueue
-            allele_queue_list[locus_hash_thread].enqueue(allele_line);
         }
+        // below the limit the ring always has room for a whole batch
+        if (least_used < DISPATCH_QUEUE_LIMIT) {
+            shard.ring = least_loaded;
+            break;
+        }
+        // every enclave thread is behind, wait for one to free up space
+        wait_ring_drain(seen, nap);
+    }
+}
+
+void EnclaveNode::wait_ring_drain(uint64_t seen, std::chrono::microseconds& nap) {
+    std::unique_lock<std::mutex> raii(ring_drain_lock);
+    ring_drain_cv.wait_for(raii, nap, [this, seen] { return ring_drains.load(std::memory_order_relaxed) != seen; });
+    nap = std::min(nap * 2, std::chrono::microseconds(DISPATCH_MAX_SLEEP));
+}
+
+void EnclaveNode::append_batch(MatcherShard& shard, const char* bytes, uint64_t length) {
+    batch_ring_copy_in(shard.ring, shard.ring->head.load(std::memory_order_relaxed) + shard.batch_length, bytes, length);
+    shard.batch_length += length;
+}
+
+void EnclaveNode::dispatch_batch(MatcherShard& shard) {
+    batch_ring_publish(shard.ring, shard.batch_length);
+    shard.ring = nullptr;
+    shard.batch_length = 0;
+    shard.batch_line_count = 0;
+    // each enclave thread tunes how many lines it takes at once, a batch that is smaller
+    // than that would leave the thread short of a full batch
+    shard.dispatch_lines = 0;
+    for (BatchRing* ring : shard.rings) {
+        shard.dispatch_lines = std::max(shard.dispatch_lines, ring->batch_lines.load(std::memory_order_relaxed));
     }
 }
 
 void EnclaveNode::output_sender() {
+    // chunks of result records, one enclave output buffer each
+    std::vector<char> chunk(ENCLAVE_READ_BUFFER_SIZE);
+    // formatted lines not sent yet, what is left at the end goes out as EOF_OUTPUT
     std::string output_str;
-    std::unique_lock<std::mutex> lk(get_instance()->output_queue_lock);
-    bool eof_sent = false;
-    while(!terminating || output_queue.size()) {
-        // This wait -> signal system seriously improves performance as it reduces busy waiting
-        if (!terminating && !output_queue.size())
-            output_queue_cv.wait(lk);
-
-        while (output_queue.size()) {
-            output_str = output_queue.front();
-            output_queue.pop();
-            if (terminating && !output_queue.size()) {
-                get_instance()->send_msg_output(output_str, CoordinationServerMessageType::EOF_OUTPUT);
-                eof_sent = true;
-            } else {
-                get_instance()->send_msg_output(output_str, CoordinationServerMessageType::OUTPUT);
+    while (true) {
+        // an eventcount: a push or terminating after the count is read bumps it and wakes the wait
+        uint64_t seen = output_signals.load(std::memory_order_acquire);
+        // every push happens before terminating is set, so a pass that starts
+        // after it and finds all rings empty has seen all the output
+        bool done = terminating.load();
+        bool popped = false;
+        for (BatchRing* ring : output_rings) {
+            uint64_t length;
+            int num_chunks = batch_ring_pop(ring, &chunk[0], chunk.size(), 1, &length);
+            if (num_chunks == BATCH_RING_CORRUPT) {
+                throw std::runtime_error("Output ring is corrupt");
             }
-            
+            if (num_chunks <= 0) continue;
+            popped = true;
+            format_results(&chunk[0], length, output_str);
+            send_output_lines(output_str);
         }
+        if (popped) continue;
+        if (done) break;
+        std::unique_lock<std::mutex> raii(output_signal_lock);
+        output_signal_cv.wait(raii, [this, seen] { return output_signals.load(std::memory_order_relaxed) != seen; });
     }
-    lk.unlock();
-    if (!eof_sent) {
-        get_instance()->send_msg_output(EOFSeperator, EOF_OUTPUT);
-    }
-} 
+    send_msg_output(output_str.length() ? output_str : EOFSeperator, CoordinationServerMessageType::EOF_OUTPUT);
+}
 
-void EnclaveNode::parse_header_enclave_node_header(const std::string& header, std::string& msg, 
-                                                       std::string& dpi_name, EnclaveNodeMessageType& mtype,
-                                                       int connFD) {
-    int header_idx = 0;
-    // Parse dpi name
-    while(header[header_idx] != ' ') {
-        dpi_name.push_back(header[header_idx++]);
-        if (header_idx >= header.length()) {
-            std::cout << "1 Invalid header? " << header << std::endl;
+void EnclaveNode::send_output_lines(std::string& output_str) {
+    // a chunk's text can be longer than a message, the coordination server splits each message
+    // at line ends so it is cut at the last one that fits
+    size_t start = 0;
+    while (output_str.length() - start > OUTPUT_MESSAGE_SIZE) {
+        size_t end = output_str.rfind('\n', start + OUTPUT_MESSAGE_SIZE - 1);
+        if (end == std::string::npos || end < start) {
+            throw std::runtime_error("Result line longer than a message");
         }
+        send_msg_output(output_str.substr(start, end + 1 - start), CoordinationServerMessageType::OUTPUT);
+        start = end + 1;
     }
-    header_idx++;
-    // Parse mtype
-    std::string mtype_str;
+    output_str.erase(0, start);
+}
 
-    while(header[header_idx] != ' ') {
-        mtype_str.push_back(header[header_idx++]);
-        if (header_idx >= header.length()) {
-            std::cout << "2 Invalid header? " << header << std::endl;
-        }
+void EnclaveNode::parse_header_enclave_node_header(Frame& body, std::string& msg, 
+                                                       std::string& dpi_name, EnclaveNodeMessageType& mtype) {
+    // header format: dpi name, space, mtype, space, then the message
+    const char* body_end = body.data() + body.size();
+    const char* name_end = (const char*)memchr(body.data(), ' ', body.size());
+    const char* mtype_end = name_end ? (const char*)memchr(name_end + 1, ' ', body_end - name_end - 1) : nullptr;
+    if (!mtype_end) {
+        throw std::runtime_error("Invalid header: " + std::string(body.data(), std::min(body.size(), (size_t)64)));
     }
-    header_idx++;
-    try {
-        mtype = static_cast<EnclaveNodeMessageType>(std::stoi(mtype_str));
-    } catch(const std::invalid_argument& e) {
-        std::cout << "Failed to read in mtype" << std::endl;
-        std::cout << "header " << header << "\n msg " << msg << std::endl;
-        return;
+    unsigned long value;
+    const char* parsed = parse_decimal(name_end + 1, mtype_end, value);
+    mtype = static_cast<EnclaveNodeMessageType>(value);
+    if (parsed != mtype_end) {
+        throw std::runtime_error("Failed to read in mtype: " + std::string(body.data(), std::min(body.size(), (size_t)64)));
     }
+    dpi_name.assign(body.data(), name_end - body.data());
+    size_t msg_start = mtype_end + 1 - body.data();
 
     if (mtype != EnclaveNodeMessageType::DATA) {
-        for (; header_idx < header.length(); ++header_idx) {
-            msg.push_back(header[header_idx]);
-        }
+        msg.assign(mtype_end + 1, body_end);
         return;
     }
 
-    if (connFD > 65353 || connFD < 0) {
-        throw std::runtime_error("ConnFD out of range " + std::to_string(connFD));
-    }
-    if (!seen_fds[connFD]) {
-        seen_fds[connFD] = true;
-        boost::thread data_listener_thread(&EnclaveNode::data_listener, this, connFD);
-        data_listener_thread.detach();
-    }
+    Institution* institution = find_institution(dpi_name);
+    // the rows stay in the pooled buffer they were read into, which the batch keeps so they can point into it
+    std::unique_ptr<DataBlockBatch> batch(new DataBlockBatch);
+    batch->frame = std::move(body);
+    const char* frame = batch->frame.data();
+    const char* frame_end = frame + batch->frame.size();
 
-    DataBlockBatch* batch = new DataBlockBatch;
-    std::string pos_str;
-    // Parse batch position
-    while(header[header_idx++] != '\t') {
-        pos_str.push_back(header[header_idx - 1]);
-        if (header_idx > header.length()) {
-            std::cout << "3 Invalid header? " << header << std::endl;
-        }
+    // msg format: blocks sent \t lengths (tab delimited) \n (terminating char) blocks of data w no delimiters
+    const char* lengths_end = (const char*)memchr(frame + msg_start, '\n', frame_end - frame - msg_start);
+    if (!lengths_end) {
+        throw std::runtime_error("Invalid data header from " + dpi_name);
     }
-
-    try {
-        batch->pos = std::stoi(pos_str);
-    } catch(const std::invalid_argument& e) {
-        std::cout << "Failed to read in pos" << std::endl;
-        std::cout << "header " << header << "\n msg " << msg << std::endl;
-        return;
+    parsed = parse_decimal(frame + msg_start, lengths_end, value);
+    if (!parsed) {
+        throw std::runtime_error("Invalid data position from " + dpi_name);
     }
-
-    
-
-    // msg format: blocks sent \t lengths (tab delimited) \n (terminating char) blocks of data w no delimiters
-    std::vector<int> lengths;
-    std::string length_str;
-    try {
-        while(header[header_idx++] != '\n') {
-            if (header[header_idx - 1] == '\t') {
-                lengths.push_back(std::stoi(length_str));
-                length_str.clear();
-                continue;
-            }
-            length_str.push_back(header[header_idx - 1]);
-            if (header_idx > header.length()) {
-                std::cout << "4 Invalid header? " << header << std::endl;
-            }
+    batch->pos = value;
+    batch->blocks_batch.reserve(std::count(parsed, lengths_end, '\t'));
+
+    const char* record = lengths_end + 1;
+    while (parsed != lengths_end) {
+        unsigned long length;
+        if (*parsed != '\t' || !(parsed = parse_decimal(parsed + 1, lengths_end, length))) {
+            throw std::runtime_error("Invalid data lengths from " + dpi_name);
         }
-        lengths.push_back(std::stoi(length_str));
-    } catch (const std::exception& e) {
-        std::cout << "Failed header parse with error " << e.what() << std::endl;
-    }
-
-    for (int length : lengths) {
-        const std::string substr = header.substr(header_idx, length);
-        header_idx += length;
-        int num_delims = 0;
-        DataBlock* block = new DataBlock;
-
-        for (char c : substr) {
-            if (c == '\t') {
-                // Throw out this tab char!
-                if (++num_delims == 2) {
-                    continue;
-                }
+        // block format: key, non-SNV allele text \t, encrypted genotypes
+        if (length < VARIANT_KEY_SIZE || length > (unsigned long)(frame_end - record)) {
+            throw std::runtime_error("Invalid data block from " + dpi_name);
+        }
+        const char* end_of_record = record + length;
+        batch->blocks_batch.emplace_back();
+        DataBlock& block = batch->blocks_batch.back();
+        block.key = variant_key_read(record);
+
+        const char* data = record + VARIANT_KEY_SIZE;
+        if (!variant_key_is_snv(block.key)) {
+            const char* end_of_alleles = (const char*)memchr(data, '\t', end_of_record - data);
+            if (!end_of_alleles) {
+                throw std::runtime_error("Invalid data block from " + dpi_name);
             }
-            if (num_delims < 2) {
-                    block->locus.push_back(c);
-            } else {
-                block->data.push_back(c);
+            if (!non_snv_table.add(block.key, std::string(data, end_of_alleles - data))) {
+                throw std::runtime_error("Allele hash collision at " + non_snv_table.str(block.key));
             }
+            data = end_of_alleles + 1;
         }
-        batch->blocks_batch.push_back(block);
+        block.data = data;
+        block.length = end_of_record - data;
+        record = end_of_record;
     }
 
-    institutions[dpi_name]->add_block_batch(batch);
+    institution->add_block_batch(batch.release());
 }
 
 EnclaveNode* EnclaveNode::get_instance(const std::string& config_file) {
@@ -699,13 +965,201 @@ ImputePolicy EnclaveNode::get_impute_policy() {
     return get_instance()->impute_policy;
 }
 
+QCPolicy EnclaveNode::get_qc_policy() {
+    return get_instance()->qc_policy;
+}
+
+double EnclaveNode::get_qc_min_maf() {
+    return get_instance()->qc_min_maf;
+}
+
+double EnclaveNode::get_qc_min_call_rate() {
+    return get_instance()->qc_min_call_rate;
+}
+
+double EnclaveNode::get_qc_min_hwe_p() {
+    return get_instance()->qc_min_hwe_p;
+}
+
+std::string EnclaveNode::get_conditional_loci() {
+    return get_instance()->conditional_loci;
+}
+
+int EnclaveNode::get_conditional_window() {
+    return get_instance()->conditional_window;
+}
+
+bool EnclaveNode::get_load_stats() {
+    return get_instance()->load_stats;
+}
+
+bool EnclaveNode::get_export_stats() {
+    return get_instance()->export_stats;
+}
+
+// the store is a sequence of sealed chunks, each prefixed by its size. In reduction mode
+// every child streams its own store, they are handed over whole in the order the children
+// said hello, the order of the enclave's link keys. A store's header is its last chunk and
+// the enclave takes it first
+static size_t stats_chunk_order(size_t pos, size_t num_chunks) {
+    return pos == 0 ? num_chunks - 1 : pos - 1;
+}
+
+int EnclaveNode::read_stats_chunk(uint8_t* chunk) {
+    EnclaveNode* instance = get_instance();
+    if (instance->reduction_enabled) {
+        std::unique_lock<std::mutex> lk(instance->stats_lock);
+        while (instance->reduce_current.empty()) {
+            if (instance->reduce_consumed.size() == (size_t)instance->reduction_children) {
+                return 0;
+            }
+            const std::string& child = instance->reduction_links[instance->reduce_consumed.size()].name;
+            auto count = instance->reduce_chunk_counts.find(child);
+            if (count != instance->reduce_chunk_counts.end() &&
+                instance->reduce_chunks[child].size() == (size_t)count->second) {
+                instance->reduce_current = child;
+                instance->reduce_current_pos = 0;
+            } else {
+                instance->reduce_cv.wait(lk);
+            }
+        }
+        std::map<int, std::string>& chunks = instance->reduce_chunks[instance->reduce_current];
+        if (instance->reduce_current_pos == instance->reduce_chunk_counts[instance->reduce_current]) {
+            chunks.clear();
+            instance->reduce_consumed.insert(instance->reduce_current);
+            instance->reduce_current.clear();
+            return 0;
+        }
+        std::string& data = chunks[stats_chunk_order(instance->reduce_current_pos++,
+                                                     instance->reduce_chunk_counts[instance->reduce_current])];
+        if (data.length() > ENCLAVE_READ_BUFFER_SIZE) {
+            throw std::runtime_error("Reduce stats chunk is larger than the enclave read buffer");
+        }
+        std::memcpy(chunk, &data[0], data.length());
+        int chunk_size = data.length();
+        std::string().swap(data);
+        return chunk_size;
+    }
+
+    std::lock_guard<std::mutex> raii(instance->stats_lock);
+    if (instance->stats_in_pos == instance->stats_in_offsets.size()) {
+        return 0;
+    }
+    std::streampos offset = instance->stats_in_offsets[stats_chunk_order(instance->stats_in_pos++,
+                                                                         instance->stats_in_offsets.size())];
+    uint32_t chunk_size;
+    instance->stats_in.seekg(offset - (std::streamoff)sizeof(uint32_t));
+    if (!instance->stats_in.read((char*)&chunk_size, sizeof(uint32_t)) ||
+        !instance->stats_in.read((char*)chunk, chunk_size)) {
+        throw std::runtime_error("Stats store is truncated");
+    }
+    return chunk_size;
+}
+
+void EnclaveNode::write_stats_chunk(const uint8_t* chunk, const int size) {
+    EnclaveNode* instance = get_instance();
+    std::lock_guard<std::mutex> raii(instance->stats_lock);
+    if (instance->reduction_has_parent) {
+        std::string msg = std::to_string(instance->reduce_chunks_sent++) + " " + std::string((const char*)chunk, size);
+        instance->send_msg(instance->reduction_parent_hostname, instance->reduction_parent_port, REDUCE_STATS, msg);
+        return;
+    }
+    uint32_t chunk_size = size;
+    instance->stats_out.write((const char*)&chunk_size, sizeof(uint32_t));
+    instance->stats_out.write((const char*)chunk, size);
+}
+
+void EnclaveNode::close_stats() {
+    EnclaveNode* instance = get_instance();
+    std::lock_guard<std::mutex> raii(instance->stats_lock);
+    if (instance->reduction_has_parent) {
+        instance->send_msg(instance->reduction_parent_hostname, instance->reduction_parent_port,
+                           REDUCE_EOF, std::to_string(instance->reduce_chunks_sent));
+    }
+    if (instance->stats_in.is_open()) instance->stats_in.close();
+    if (instance->stats_out.is_open()) instance->stats_out.close();
+}
+
+bool EnclaveNode::get_reduction_enabled() {
+    return get_instance()->reduction_enabled;
+}
+
+int EnclaveNode::get_reduction_children() {
+    return get_instance()->reduction_children;
+}
+
+bool EnclaveNode::get_reduction_has_parent() {
+    return get_instance()->reduction_has_parent;
+}
+
+ReductionLink& EnclaveNode::reduction_link(int link) {
+    if (link == REDUCTION_PARENT_LINK && reduction_has_parent) {
+        return reduction_links.back();
+    }
+    if (link < 0 || link >= reduction_hellos) {
+        throw std::runtime_error("No reduction link " + std::to_string(link));
+    }
+    return reduction_links[link];
+}
+
+int EnclaveNode::reduction_child(const std::string& name) {
+    for (int child = 0; child < reduction_hellos; ++child) {
+        if (reduction_links[child].name == name) {
+            return child;
+        }
+    }
+    return -1;
+}
+
+bool EnclaveNode::get_reduction_peer(const int link, std::string& pub_key, std::string& evidence) {
+    EnclaveNode* instance = get_instance();
+    // the hello is sent under this node's global id
+    if (instance->global_id < 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> raii(instance->stats_lock);
+    if (link != REDUCTION_PARENT_LINK && link >= instance->reduction_hellos) {
+        return false;
+    }
+    ReductionLink& peer = instance->reduction_link(link);
+    if (!peer.greeted) {
+        std::string own = std::string((const char*)instance->rsa_public_key, RSA_PUB_KEY_SIZE) +
+                          std::string((const char*)instance->evidence, instance->evidence_size);
+        if (link == REDUCTION_PARENT_LINK) {
+            own = own_hostname() + "\t" + std::to_string(instance->port) + "\t" + own;
+        }
+        instance->send_msg(peer.hostname, peer.port, link == REDUCTION_PARENT_LINK ? REDUCE_HELLO : REDUCE_WELCOME, own);
+        peer.greeted = true;
+    }
+    if (!peer.pub_key.length()) {
+        return false;
+    }
+    pub_key = peer.pub_key;
+    evidence = peer.evidence;
+    return true;
+}
+
+void EnclaveNode::send_reduction_share(const int link, const std::string& share) {
+    EnclaveNode* instance = get_instance();
+    std::lock_guard<std::mutex> raii(instance->stats_lock);
+    ReductionLink& peer = instance->reduction_link(link);
+    instance->send_msg(peer.hostname, peer.port, REDUCE_SHARE, share);
+}
+
+std::string EnclaveNode::get_reduction_share(const int link) {
+    EnclaveNode* instance = get_instance();
+    std::lock_guard<std::mutex> raii(instance->stats_lock);
+    return instance->reduction_link(link).share;
+}
+
+std::string EnclaveNode::get_region_list() {
+    return get_instance()->region_list;
+}
+
 void EnclaveNode::finish_setup() {
     // Register with the register server!
     const nlohmann::json config = get_instance()->enclave_config;
-    std::string enclave_node_hostname;
-    std::ifstream ipfile("ip.txt");
-    std::getline(ipfile, enclave_node_hostname);
-    std::string msg = enclave_node_hostname + "\t" + std::to_string(get_instance()->port) + "\t" + std::to_string(get_instance()->num_threads);
+    std::string msg = own_hostname() + "\t" + std::to_string(get_instance()->port) + "\t" + std::to_string(get_instance()->num_threads);
     get_instance()->send_msg(config["coordination_server_info"]["hostname"], 
                             config["coordination_server_info"]["port"],
                             CoordinationServerMessageType::ENCLAVE_REGISTER,
@@ -731,10 +1185,37 @@ void EnclaveNode::print_timings() {
     for (auto it : inst->enclave_total_times) {
         guarded_cout(it.first + "\t" + std::to_string(it.second - (inst->enclave_total_calls[it.first] * AVERAGE_OCALL_OVERHEAD_MICROSECONDS)), cout_lock);
     }
+    // lines per batch each enclave thread settled on
+    for (int thread_id = 0; thread_id < inst->num_threads; ++thread_id) {
+        guarded_cout("batch lines thread " + std::to_string(thread_id) + "\t" +
+                     std::to_string(inst->batch_rings[thread_id]->batch_lines.load()), cout_lock);
+    }
 }
 
-void EnclaveNode::set_max_batch_lines(unsigned int lines) {
-    get_instance()->max_batch_lines = lines;
+BatchRing* EnclaveNode::get_batch_ring(const int thread_id) {
+    return get_instance()->batch_rings[thread_id];
+}
+
+void EnclaveNode::signal_ring_drained() {
+    EnclaveNode* instance = get_instance();
+    {
+        std::lock_guard<std::mutex> raii(instance->ring_drain_lock);
+        instance->ring_drains.fetch_add(1, std::memory_order_release);
+    }
+    instance->ring_drain_cv.notify_all();
+}
+
+BatchRing* EnclaveNode::get_output_ring(const int thread_id) {
+    return get_instance()->output_rings[thread_id];
+}
+
+void EnclaveNode::signal_output() {
+    EnclaveNode* instance = get_instance();
+    {
+        std::lock_guard<std::mutex> raii(instance->output_signal_lock);
+        instance->output_signals.fetch_add(1, std::memory_order_release);
+    }
+    instance->output_signal_cv.notify_all();
 }
 
 uint8_t* EnclaveNode::get_rsa_pub_key() {
@@ -794,71 +1275,35 @@ std::string EnclaveNode::get_num_patients(const int institution_num) {
     return get_instance()->institutions[institution_name]->get_num_patients();;
 }
 
-std::string EnclaveNode::get_y_data(const int institution_num) {
+Institution* EnclaveNode::find_institution(const int institution_num) {
     const std::string institution_name = get_instance()->institution_list[institution_num];
-    if (!get_instance()->institutions.count(institution_name)) {
-        return "";
-    }
-
-    std::string y_vals = get_instance()->institutions[institution_name]->get_y_data();
-    return y_vals;
+    std::lock_guard<std::mutex> raii(get_instance()->institutions_lock);
+    auto it = get_instance()->institutions.find(institution_name);
+    return it == get_instance()->institutions.end() ? nullptr : it->second;
 }
 
-std::string EnclaveNode::get_covariant_data(const int institution_num, const std::string& covariant_name) {
-    const std::string institution_name = get_instance()->institution_list[institution_num];
-    if (!get_instance()->institutions.count(institution_name)) {
-        return "";
+size_t EnclaveNode::get_y_data(const int institution_num, size_t offset, char* chunk, size_t chunk_size) {
+    // the copy runs outside institutions_lock, the institution has a lock of its own
+    Institution* institution = find_institution(institution_num);
+    if (!institution) {
+        return 0;
     }
 
-    std::string cov_vals = get_instance()->institutions[institution_name]->get_covariant_data(covariant_name);
-    return cov_vals;
+    return institution->get_y_data(offset, chunk, chunk_size);
 }
 
-int EnclaveNode::get_allele_data(char* batch_data, const int thread_id) {
-    std::string batch_data_str;
-    std::string tmp;
-    // Currently the enclave expects the ~EOF~ to be by itself (not in a batch).
-    // This is not very clean code, but searching for ~EOF~ in the enclave is slow!
-    if (get_instance()->eof_read_list[thread_id]) {
-        // Why do I use async here? Good question! The mark_eof ECall can't be triggered by the same context of the OCall or else it gives me a "re-entrant" error
-        // so here's a workaround that calls mark_eof not in this function and without the need for threads
-        std::async(mark_eof_wrapper, thread_id);
-
-        return -1;
-    }
-
-    int num_lines = 0;
-    moodycamel::ReaderWriterQueue<std::string>& allele_queue = get_instance()->allele_queue_list[thread_id];
-    while (num_lines < get_instance()->max_batch_lines && allele_queue.try_dequeue(tmp)) {
-        if (strcmp(EOFSeperator, tmp.c_str()) == 0) {
-            get_instance()->eof_read_list[thread_id] = true;
-            break;
-        }
-        num_lines++;
-        batch_data_str += tmp;
-    }
-    if (num_lines) {
-        if (batch_data_str.length() > ENCLAVE_READ_BUFFER_SIZE) {
-            throw std::runtime_error("Batch larger than buffer");
-        }
-        memset(batch_data, 0, ENCLAVE_READ_BUFFER_SIZE);
-        memcpy(batch_data, &batch_data_str[0], batch_data_str.length());
-        batch_data[batch_data_str.length()] = '\0';
+size_t EnclaveNode::get_covariant_data(const int institution_num, const std::string& covariant_name,
+                                       size_t offset, char* chunk, size_t chunk_size) {
+    Institution* institution = find_institution(institution_num);
+    if (!institution) {
+        return 0;
     }
-    return num_lines;
-}
 
-void EnclaveNode::write_allele_data(char* output_data, const int buffer_size, const int thread_id) {
-    std::unique_lock<std::mutex> lk(get_instance()->output_queue_lock);
-    get_instance()->output_queue.push(std::string(output_data));
-    lk.unlock();
-    get_instance()->output_queue_cv.notify_all();
+    return institution->get_covariant_data(covariant_name, offset, chunk, chunk_size);
 }
 
 void EnclaveNode::cleanup_output() {
-    std::unique_lock<std::mutex> lk(get_instance()->output_queue_lock);
     terminating = true;
-    lk.unlock();
-    get_instance()->output_queue_cv.notify_all();
+    signal_output();
     std::cout << "Sending EOF message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << std::endl;
 }
\ No newline at end of file
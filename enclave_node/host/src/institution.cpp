@@ -3,11 +3,20 @@
  */
 
 
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
 #include "institution.h"
 
-Institution::Institution(std::string hostname, int port, int id, const int num_threads) 
+Institution::Institution(std::string hostname, int port, int id, const int num_threads, const int num_matchers, CreditGrant grant_credits) 
         : hostname(hostname), port(port), requested_for_data(false), listener_running(false), 
-          request_conn(-1), current_pos(0), all_data_received(false), id(id) {
+          current_pos(0), reorder_window(new std::atomic<DataBlockBatch*>[REORDER_WINDOW]),
+          cursors(num_matchers, BatchCursor{0, nullptr, 0, false, {}}), arrivals(0),
+          ungranted(0), grant_credits(grant_credits), id(id) {
+    for (int slot = 0; slot < REORDER_WINDOW; ++slot) {
+        reorder_window[slot].store(nullptr, std::memory_order_relaxed);
+    }
     aes_encrypted_key_list.resize(num_threads);
     aes_encrypted_iv_list.resize(num_threads);
     for (int i = 0; i < num_threads; ++i) {
@@ -21,13 +30,43 @@ Institution::~Institution() {
 }
 
 void Institution::add_block_batch(DataBlockBatch* block_batch) {
-    // std::lock_guard<std::mutex> raii(blocks_lock);
-    // blocks.push(block_batch);
-    unsorted_blocks.enqueue(block_batch);
+    if (block_batch->pos < current_pos.load(std::memory_order_relaxed)) {
+        throw std::runtime_error("Data batch " + std::to_string(block_batch->pos) + " received twice");
+    }
+    block_batch->remaining.store(cursors.size(), std::memory_order_relaxed);
+    {
+        std::unique_lock<std::mutex> raii(arrival_lock);
+        // a dpi's rows come on one connection, so this holds back only that dpi's stream
+        arrival_cv.wait(raii, [this, block_batch] {
+            return block_batch->pos - current_pos.load(std::memory_order_acquire) < REORDER_WINDOW;
+        });
+        reorder_window[block_batch->pos % REORDER_WINDOW].store(block_batch, std::memory_order_release);
+        arrivals.fetch_add(1, std::memory_order_release);
+    }
+    arrival_cv.notify_all();
 }
 
-int Institution::get_blocks_size() {
-    return blocks.size();
+void Institution::release_batch(DataBlockBatch* batch) {
+    if (batch->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    // every matcher leaves the batches in order, so the last ones to leave them do too
+    int credits = 0;
+    {
+        std::lock_guard<std::mutex> raii(arrival_lock);
+        reorder_window[batch->pos % REORDER_WINDOW].store(nullptr, std::memory_order_relaxed);
+        current_pos.store(batch->pos + 1, std::memory_order_release);
+        arrivals.fetch_add(1, std::memory_order_release);
+        if (++ungranted == DATA_CREDIT_BATCH) {
+            credits = ungranted;
+            ungranted = 0;
+        }
+    }
+    arrival_cv.notify_all();
+    delete batch;
+    if (credits) {
+        grant_credits(credits);
+    }
 }
 
 int Institution::get_covariant_size() {
@@ -50,20 +89,31 @@ void Institution::set_num_patients(const std::string& num_patients) {
     num_patients_encrypted = num_patients;
 }
 
-void Institution::set_y_data(std::string& y_data) {
+bool PhenotypeData::add_part(size_t offset, size_t total, const char* part, size_t length) {
+    if (!data.length()) {
+        data.resize(total);
+    }
+    if (total != data.length() || offset > total || length > total - offset || received + length > total) {
+        return false;
+    }
+    std::memcpy(&data[offset], part, length);
+    received += length;
+    return true;
+}
+
+void Institution::set_y_data(size_t offset, size_t total, const char* part, size_t length) {
     std::lock_guard<std::mutex> raii(y_val_data_lock);
-    y_val_data = y_data;
+    if (!y_val_data.add_part(offset, total, part, length)) {
+        throw std::runtime_error("Invalid y value part received.");
+    }
 }
 
-void Institution::set_covariant_data(const std::string& covariant_name, const std::string& data) {
+void Institution::set_covariant_data(const std::string& covariant_name, size_t offset, size_t total, const char* part, size_t length) {
     std::lock_guard<std::mutex> raii(covariant_data_lock);
-    if (covariant_data.count(covariant_name)) {
+    // a covariant sent twice overflows its length
+    if (!covariant_data[covariant_name].add_part(offset, total, part, length)) {
         throw std::runtime_error("Duplicate covariant received.");
     }
-    if (data.length() >= ENCLAVE_READ_BUFFER_SIZE) {
-        throw std::runtime_error("Covariant too large for enclave: " + std::to_string(data.length()));
-    }
-    covariant_data[covariant_name] = data;
 }
 
 std::string Institution::get_aes_key(const int thread_id) {
@@ -81,62 +131,88 @@ std::string Institution::get_num_patients() {
     return num_patients_encrypted;
 }
 
-std::string Institution::get_y_data() {
+static size_t copy_chunk(const PhenotypeData& values, size_t offset, char* chunk, size_t chunk_size) {
+    if (!values.complete()) {
+        return 0;
+    }
+    if (offset < values.data.length()) {
+        std::memcpy(chunk, &values.data[offset], std::min(chunk_size, values.data.length() - offset));
+    }
+    return values.data.length();
+}
+
+size_t Institution::get_y_data(size_t offset, char* chunk, size_t chunk_size) {
     std::lock_guard<std::mutex> raii(y_val_data_lock);
-    return y_val_data;
+    return copy_chunk(y_val_data, offset, chunk, chunk_size);
 }
 
-std::string Institution::get_covariant_data(const std::string& covariant_name) {
+size_t Institution::get_covariant_data(const std::string& covariant_name, size_t offset, char* chunk, size_t chunk_size) {
     std::lock_guard<std::mutex> raii(covariant_data_lock);
-    if (!covariant_data.count(covariant_name)) {
-        return "";
+    auto it = covariant_data.find(covariant_name);
+    if (it == covariant_data.end()) {
+        return 0;
+    }
+    return copy_chunk(it->second, offset, chunk, chunk_size);
+}
+
+DataBlock* Institution::get_top_block(int matcher) {
+    BatchCursor& cursor = cursors[matcher];
+    while (!cursor.batch || cursor.next_block == cursor.batch->blocks_batch.size()) {
+        if (cursor.batch) {
+            if (cursor.holding) {
+                cursor.passed.push_back(cursor.batch);
+            } else {
+                release_batch(cursor.batch);
+            }
+            cursor.batch = nullptr;
+            cursor.pos++;
+        }
+        // the slot holds the batch REORDER_WINDOW before until the other matchers leave it
+        if (cursor.pos - current_pos.load(std::memory_order_acquire) >= REORDER_WINDOW) {
+            return nullptr;
+        }
+        cursor.batch = reorder_window[cursor.pos % REORDER_WINDOW].load(std::memory_order_acquire);
+        if (!cursor.batch) {
+            return nullptr;
+        }
+        cursor.next_block = 0;
     }
-    std::string data = covariant_data[covariant_name];
-    return data;
+    return &cursor.batch->blocks_batch[cursor.next_block];
 }
 
-void Institution::transfer_eligible_blocks() {
-    // std::lock_guard<std::mutex> raii(blocks_lock);
-    DataBlockBatch *unsorted_batch;
-    while (unsorted_blocks.try_dequeue(unsorted_batch)) {
-        blocks.push(unsorted_batch);
+DataBlock* Institution::pop_top_block(int matcher) {
+    DataBlock* ret = get_top_block(matcher);
+    if (ret) {
+        cursors[matcher].next_block++;
+        cursors[matcher].holding = true;
     }
-    while (!blocks.empty()) {
-        DataBlockBatch* batch = blocks.top();
-        if (batch->pos != current_pos) {
-            return;
-        }
-        blocks.pop();
+    return ret;
+}
 
-        // std::lock_guard<std::mutex> raii2(eligible_blocks_lock);
-        for (DataBlock* parsed_block : batch->blocks_batch) {
-            eligible_blocks.enqueue(parsed_block);
+void Institution::release_popped(int matcher) {
+    BatchCursor& cursor = cursors[matcher];
+    for (DataBlockBatch* batch : cursor.passed) {
+        release_batch(batch);
+    }
+    cursor.passed.clear();
+    cursor.holding = false;
+}
+
+void Institution::skip_top_block(int matcher) {
+    if (get_top_block(matcher)) {
+        cursors[matcher].next_block++;
+    }
+}
+
+DataBlock* Institution::wait_top_block(int matcher) {
+    while (true) {
+        // an eventcount: whatever arrives after the count is read bumps it and wakes the wait
+        uint64_t seen = arrivals.load(std::memory_order_acquire);
+        DataBlock* block = get_top_block(matcher);
+        if (block) {
+            return block;
         }
-        // Clean up block batch!
-        delete batch;
-        current_pos++;
-    }
-}
-
-DataBlock* Institution::get_top_block() {
-    //std::lock_guard<std::mutex> raii(eligible_blocks_lock);
-    // DataBlock *ret;
-    // bool success = eligible_blocks.try_dequeue(ret);
-    // if (!success) {
-    //     return nullptr;
-    // }
-    // return ret;
-    // if (eligible_blocks.empty()) return nullptr;
-    // return eligible_blocks.front();
-    DataBlock **ret = eligible_blocks.peek();
-    if (!ret) return nullptr;
-    return *ret;
-}
-
-DataBlock* Institution::pop_top_block() {
-    //std::lock_guard<std::mutex> raii(eligible_blocks_lock);
-    // eligible_blocks.pop();
-    DataBlock *ret;
-    eligible_blocks.try_dequeue(ret);
-    return ret;
+        std::unique_lock<std::mutex> raii(arrival_lock);
+        arrival_cv.wait(raii, [this, seen] { return arrivals.load(std::memory_order_relaxed) != seen; });
+    }
 }
\ No newline at end of file
@@ -0,0 +1,40 @@
+#include "loser_tree.h"
+
+#include <utility>
+
+LoserTree::LoserTree(const std::vector<VariantKey>& input_keys) : size(1) {
+    while (size < (int)input_keys.size()) {
+        size *= 2;
+    }
+    keys = input_keys;
+    keys.resize(size, VARIANT_KEY_EOF);
+    repeats.resize(size, 0);
+    tree.resize(size);
+    tree[0] = play(1);
+}
+
+int LoserTree::play(int node) {
+    if (node >= size) {
+        return node - size;
+    }
+    int left = play(2 * node);
+    int right = play(2 * node + 1);
+    if (beats(left, right)) {
+        tree[node] = right;
+        return left;
+    }
+    tree[node] = left;
+    return right;
+}
+
+void LoserTree::replace_winner(VariantKey key) {
+    int winner = tree[0];
+    repeats[winner] = key == keys[winner] ? repeats[winner] + 1 : 0;
+    keys[winner] = key;
+    for (int node = (winner + size) / 2; node > 0; node /= 2) {
+        if (beats(tree[node], winner)) {
+            std::swap(tree[node], winner);
+        }
+    }
+    tree[0] = winner;
+}
@@ -0,0 +1,127 @@
+/*
+ * Implementation of the result record formatter.
+ */
+
+#include "result_format.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+static char* format_uint(uint64_t value, char* out) {
+    char digits[20];
+    int num_digits = 0;
+    do {
+        digits[num_digits++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (num_digits) {
+        *out++ = digits[--num_digits];
+    }
+    return out;
+}
+
+static char* format_str(const char* str, char* out) {
+    while (*str) {
+        *out++ = *str++;
+    }
+    return out;
+}
+
+static const char* qc_reason_str(uint32_t reason) {
+    switch (reason) {
+        case QC_CALL_RATE:
+            return "\tqc_fail:call_rate";
+        case QC_MAF:
+            return "\tqc_fail:maf";
+        case QC_HWE:
+            return "\tqc_fail:hwe";
+        default:
+            throw std::runtime_error("Unknown QC reason " + std::to_string(reason));
+    }
+}
+
+char* format_fixed(double value, char* out) {
+    // value * 10^6 is rounded to an integer, unless the product is too close to a tie
+    // to know which way the exact value rounds; those and huge values go to snprintf
+    double scaled = std::fabs(value) * 1e6;
+    if (std::isfinite(value) && scaled < 1e15) {
+        double whole = std::floor(scaled);
+        double fraction = scaled - whole;
+        if (std::fabs(fraction - 0.5) > scaled * DBL_EPSILON) {
+            uint64_t rounded = (uint64_t)whole + (fraction > 0.5);
+            if (std::signbit(value)) {
+                *out++ = '-';
+            }
+            out = format_uint(rounded / 1000000, out);
+            *out++ = '.';
+            uint64_t decimals = rounded % 1000000;
+            for (uint64_t digit = 100000; digit; digit /= 10) {
+                *out++ = '0' + decimals / digit % 10;
+            }
+            return out;
+        }
+    }
+    return out + snprintf(out, FIXED_MAX_LENGTH, "%f", value);
+}
+
+void format_results(const char* records, size_t length, std::string& out) {
+    // one line is at most the variant, 3 values, iterations, converged and a QC reason
+    char line[96 + 3 * FIXED_MAX_LENGTH];
+    const char* end = records + length;
+    out.reserve(out.size() + length * 2);
+    while (records < end) {
+        ResultRecord record;
+        if ((size_t)(end - records) < sizeof(ResultRecord)) {
+            throw std::runtime_error("Truncated result record");
+        }
+        memcpy(&record, records, sizeof(ResultRecord));
+        records += sizeof(ResultRecord);
+        if (record.type == RESULT_TEXT) {
+            if ((size_t)(end - records) < record.text_length) {
+                throw std::runtime_error("Truncated result record");
+            }
+            out.append(records, record.text_length);
+            records += record.text_length;
+            continue;
+        }
+
+        char* head = line;
+        int chrom = variant_key_chrom(record.key);
+        head = chrom == VARIANT_KEY_CHROM_X ? format_str("X", head) : format_uint(chrom, head);
+        *head++ = ':';
+        head = format_uint(variant_key_pos(record.key), head);
+        head = format_str("\t[\"", head);
+        *head++ = variant_key_a1(record.key);
+        head = format_str("\",\"", head);
+        *head++ = variant_key_a2(record.key);
+        head = format_str("\"]", head);
+
+        if (record.flags & RESULT_MATH_ERROR) {
+            head = format_str("\tNA\tNA\tNA\t1\tfalse\n", head);
+            out.append(line, head - line);
+            continue;
+        }
+        if (record.flags & RESULT_NA) {
+            head = format_str("\tNA\tNA\tNA", head);
+        } else {
+            *head++ = '\t';
+            head = format_fixed(record.beta, head);
+            *head++ = '\t';
+            head = format_fixed(record.se, head);
+            *head++ = '\t';
+            head = format_fixed(record.beta / record.se, head);
+        }
+        if (record.type == RESULT_LOGISTIC) {
+            *head++ = '\t';
+            head = format_uint(record.iterations, head);
+            head = format_str(record.flags & RESULT_CONVERGED ? "\ttrue" : "\tfalse", head);
+        }
+        if (record.flags & RESULT_QC_FAIL) {
+            head = format_str(qc_reason_str(record.qc_reason), head);
+        }
+        *head++ = '\n';
+        out.append(line, head - line);
+    }
+}
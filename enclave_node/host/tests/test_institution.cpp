@@ -0,0 +1,126 @@
+#include "institution.h"
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+// a batch of num_blocks rows, each tagged with pos * 100 + its index in length
+static DataBlockBatch* make_batch(int pos, int num_blocks) {
+    DataBlockBatch* batch = new DataBlockBatch();
+    batch->pos = pos;
+    for (int i = 0; i < num_blocks; ++i) {
+        batch->blocks_batch.push_back(DataBlock{VariantKey(), nullptr, (uint32_t)(pos * 100 + i)});
+    }
+    return batch;
+}
+
+// batches arriving in any order are read in order by every matcher
+static void test_reorder() {
+    vector<int> grants;
+    Institution inst("localhost", 0, 0, 1, 2, [&grants](int credits) { grants.push_back(credits); });
+    inst.add_block_batch(make_batch(2, 1));
+    check(!inst.get_top_block(0), "no block before batch 0 arrived");
+    inst.add_block_batch(make_batch(0, 2));
+    inst.add_block_batch(make_batch(1, 1));
+    for (int matcher = 0; matcher < 2; ++matcher) {
+        vector<uint32_t> read;
+        while (DataBlock* block = inst.get_top_block(matcher)) {
+            read.push_back(block->length);
+            inst.skip_top_block(matcher);
+        }
+        check(read == vector<uint32_t>({0, 1, 100, 200}), "matcher " + to_string(matcher) + " reads in order");
+    }
+    // looking for batch 3 took both matchers past batch 2
+    check(inst.current_pos == 3, "batches freed once every matcher left them");
+    check(grants.empty(), "no credit before DATA_CREDIT_BATCH batches are freed");
+
+    bool threw = false;
+    DataBlockBatch* again = make_batch(1, 1);
+    try {
+        inst.add_block_batch(again);
+    } catch (std::runtime_error&) {
+        threw = true;
+        delete again;
+    }
+    check(threw, "a freed batch received twice");
+}
+
+// a popped block keeps the batches passed after it until it is released
+static void test_pop_holds_batches() {
+    Institution inst("localhost", 0, 0, 1, 1, [](int) {});
+    for (int pos = 0; pos < 3; ++pos) {
+        inst.add_block_batch(make_batch(pos, 1));
+    }
+    DataBlock* popped = inst.pop_top_block(0);
+    check(popped && popped->length == 0, "pop of the first block");
+    check(!inst.holds_passed(0), "nothing passed right after the pop");
+    inst.skip_top_block(0);
+    check(inst.get_top_block(0) && inst.get_top_block(0)->length == 200, "read past the popped batch");
+    check(inst.holds_passed(0) && inst.current_pos == 0, "passed batches held");
+    check(popped->length == 0, "popped block valid while held");
+    inst.release_popped(0);
+    check(!inst.holds_passed(0) && inst.current_pos == 2, "held batches freed on release");
+}
+
+// the dpi is granted credit in DATA_CREDIT_BATCH steps and can't run past the window
+static void test_credit_window() {
+    atomic<int> granted(0);
+    int grant_count = 0;
+    Institution inst("localhost", 0, 0, 1, 1, [&](int credits) {
+        check(credits == DATA_CREDIT_BATCH, "credits granted " + to_string(DATA_CREDIT_BATCH) + " at a time");
+        granted += credits;
+        grant_count++;
+    });
+    for (int pos = 0; pos < REORDER_WINDOW; ++pos) {
+        inst.add_block_batch(make_batch(pos, 1));
+    }
+    // one batch past the window waits for the slowest matcher
+    atomic<bool> added(false);
+    thread sender([&] {
+        inst.add_block_batch(make_batch(REORDER_WINDOW, 1));
+        added = true;
+    });
+    this_thread::sleep_for(chrono::milliseconds(50));
+    check(!added, "batch past the window held back");
+
+    int read = 0;
+    for (; read < 2 * DATA_CREDIT_BATCH + 1; ++read) {
+        check(inst.wait_top_block(0)->length == (uint32_t)read * 100, "block " + to_string(read) + " in order");
+        inst.skip_top_block(0);
+    }
+    sender.join();
+    check(added, "batch past the window added once the first was freed");
+    // the batch the matcher is in isn't freed yet
+    check(granted == 2 * DATA_CREDIT_BATCH && grant_count == 2, "credit for every batch freed");
+
+    while (read <= REORDER_WINDOW) {
+        check(inst.wait_top_block(0)->length == (uint32_t)read * 100, "block " + to_string(read) + " in order");
+        inst.skip_top_block(0);
+        read++;
+    }
+    check(granted == REORDER_WINDOW, "credit for the whole window");
+}
+
+int main() {
+    test_reorder();
+    test_pop_holds_batches();
+    test_credit_window();
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "test_institution passed" << endl;
+    return 0;
+}
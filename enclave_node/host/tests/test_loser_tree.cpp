@@ -0,0 +1,103 @@
+#include "loser_tree.h"
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+// merges sorted inputs through the tree, as (input, key, repeats) in the order they come out
+static vector<tuple<int, VariantKey, int> > merge(const vector<vector<VariantKey> >& inputs) {
+    vector<size_t> next(inputs.size(), 0);
+    vector<VariantKey> keys;
+    for (const vector<VariantKey>& input : inputs) {
+        keys.push_back(input.empty() ? VARIANT_KEY_EOF : input[0]);
+    }
+    LoserTree tree(keys);
+    vector<tuple<int, VariantKey, int> > merged;
+    while (tree.min_key() != VARIANT_KEY_EOF) {
+        int input = tree.winner();
+        merged.emplace_back(input, tree.min_key(), tree.min_repeats());
+        size_t pos = ++next[input];
+        tree.replace_winner(pos < inputs[input].size() ? inputs[input][pos] : VARIANT_KEY_EOF);
+    }
+    return merged;
+}
+
+// equal keys come out in input order, the n-th repeat of a key in an input after every
+// input's (n - 1)-th: sorted by (key, repeat, input)
+static vector<tuple<int, VariantKey, int> > expected_merge(const vector<vector<VariantKey> >& inputs) {
+    vector<tuple<VariantKey, int, int> > rows;
+    for (size_t input = 0; input < inputs.size(); ++input) {
+        for (size_t pos = 0; pos < inputs[input].size(); ++pos) {
+            int repeat = pos && inputs[input][pos - 1] == inputs[input][pos] ? get<1>(rows.back()) + 1 : 0;
+            rows.emplace_back(inputs[input][pos], repeat, (int)input);
+        }
+    }
+    sort(rows.begin(), rows.end());
+    vector<tuple<int, VariantKey, int> > expected;
+    for (const auto& row : rows) {
+        expected.emplace_back(get<2>(row), get<0>(row), get<1>(row));
+    }
+    return expected;
+}
+
+static void test_equal_keys() {
+    // every input at the same key, one input left empty
+    vector<vector<VariantKey> > inputs = {{5, 9}, {5}, {}, {5, 9}, {5}};
+    vector<tuple<int, VariantKey, int> > merged = merge(inputs);
+    check(merged == expected_merge(inputs), "equal keys in input order");
+    check(get<0>(merged[0]) == 0 && get<0>(merged[3]) == 4 && get<0>(merged[4]) == 0, "input order of key 5");
+
+    // an input repeating its key goes after the others' rows of it
+    inputs = {{7, 7, 7}, {7}, {3, 7, 7}};
+    merged = merge(inputs);
+    check(merged == expected_merge(inputs), "repeated keys");
+    vector<int> order;
+    for (const auto& row : merged) order.push_back(get<0>(row));
+    check(order == vector<int>({2, 0, 1, 2, 0, 2, 0}), "repeats after the other inputs' rows");
+
+    inputs = {{}, {}};
+    check(merge(inputs).empty(), "empty inputs");
+}
+
+static void test_random() {
+    mt19937 rng(48);
+    for (int num_inputs : {1, 2, 3, 5, 8, 13, 33}) {
+        for (int round = 0; round < 50; ++round) {
+            // few distinct keys, so many are equal across inputs and repeated within one
+            uniform_int_distribution<VariantKey> key(0, 1 + round % 20);
+            vector<vector<VariantKey> > inputs(num_inputs);
+            for (vector<VariantKey>& input : inputs) {
+                input.resize(rng() % 30);
+                for (VariantKey& k : input) k = key(rng);
+                sort(input.begin(), input.end());
+            }
+            check(merge(inputs) == expected_merge(inputs),
+                  "merge of " + to_string(num_inputs) + " inputs, round " + to_string(round));
+        }
+    }
+}
+
+int main() {
+    test_equal_keys();
+    test_random();
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "test_loser_tree passed" << endl;
+    return 0;
+}
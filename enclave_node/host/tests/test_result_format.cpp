@@ -0,0 +1,116 @@
+#include "result_format.h"
+
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check_fixed(double value) {
+    char out[FIXED_MAX_LENGTH];
+    string formatted(out, format_fixed(value, out));
+    string expected = to_string(value);
+    if (formatted != expected) {
+        cerr << "FAIL: format_fixed(" << expected << ") gave " << formatted << endl;
+        failures++;
+    }
+}
+
+// format_fixed must print exactly what std::to_string printed in the enclave
+static void test_format_fixed() {
+    const double edge_cases[] = {0.0, -0.0, 1.0, -1.0, 0.5, 1e-7, -1e-7, 5e-7, -5e-7, 4.9999995e-7, 0.0000005,
+                                 0.0000015, 0.0000025, 1.0000005, 2.5e-6, 123456.7890125, 999999.9999995,
+                                 1e9 - 5e-7, 999999999.9999995, 1e15, 1e16, -1e300, DBL_MAX, -DBL_MAX, DBL_MIN,
+                                 4.9e-324, INFINITY, -INFINITY, NAN};
+    for (double value : edge_cases) {
+        check_fixed(value);
+    }
+
+    mt19937_64 rng(36);
+    // beta, se and z values: spread over the magnitudes a regression prints
+    uniform_real_distribution<double> exponent(-10, 12);
+    for (int i = 0; i < 2000000; ++i) {
+        double value = pow(10.0, exponent(rng));
+        check_fixed(rng() & 1 ? value : -value);
+    }
+    // values right at a rounding tie of the 6th decimal and their neighbours
+    uniform_int_distribution<int64_t> micros(-2000000000000LL, 2000000000000LL);
+    for (int i = 0; i < 2000000; ++i) {
+        double tie = (micros(rng) + 0.5) / 1e6;
+        check_fixed(i & 1 ? tie : nextafter(tie, i & 2 ? INFINITY : -INFINITY));
+    }
+}
+
+static void test_format_results() {
+    ResultRecord record = text_result(4);
+    string records((const char*)&record, sizeof(record));
+    records += "ab\n";
+    string out;
+    bool threw = false;
+    try {
+        format_results(records.data(), records.length(), out);
+    } catch (std::runtime_error&) {
+        threw = true;
+    }
+    if (!threw) {
+        cerr << "FAIL: truncated text record accepted" << endl;
+        failures++;
+    }
+    records += "c";
+    out.clear();
+    format_results(records.data(), records.length(), out);
+    if (out != "ab\nc") {
+        cerr << "FAIL: text record gave " << out << endl;
+        failures++;
+    }
+
+    // QC failures and NA results, as the enclave printed them
+    VariantKey key = variant_key_pack(VARIANT_KEY_CHROM_X, 1234, (1 << 2) | 3);
+    ResultRecord na;
+    memset(&na, 0, sizeof(na));
+    na.key = key;
+    na.type = RESULT_LINEAR;
+    na.flags = RESULT_NA;
+    ResultRecord linear = qc_fail_result(key, RESULT_LINEAR, QC_MAF);
+    ResultRecord logistic = qc_fail_result(variant_key_pack(22, 5, 0), RESULT_LOGISTIC, QC_HWE);
+    records.assign((const char*)&na, sizeof(na));
+    records.append((const char*)&linear, sizeof(linear));
+    records.append((const char*)&logistic, sizeof(logistic));
+    out.clear();
+    format_results(records.data(), records.length(), out);
+    string expected = "X:1234\t[\"C\",\"T\"]\tNA\tNA\tNA\n"
+                      "X:1234\t[\"C\",\"T\"]\tNA\tNA\tNA\tqc_fail:maf\n"
+                      "22:5\t[\"A\",\"A\"]\tNA\tNA\tNA\t0\tfalse\tqc_fail:hwe\n";
+    if (out != expected) {
+        cerr << "FAIL: NA and QC records gave " << out << endl;
+        failures++;
+    }
+
+    linear.qc_reason = 0;
+    threw = false;
+    try {
+        format_results((const char*)&linear, sizeof(linear), out);
+    } catch (std::runtime_error&) {
+        threw = true;
+    }
+    if (!threw) {
+        cerr << "FAIL: unknown QC reason accepted" << endl;
+        failures++;
+    }
+}
+
+int main() {
+    test_format_fixed();
+    test_format_results();
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "test_result_format passed" << endl;
+    return 0;
+}
@@ -10,6 +10,7 @@
 #include <cryptopp/rsa.h>
 
 #include <iostream>
+#include <stdint.h>
 #include <string>
 
 class AESCrypto {
@@ -18,6 +19,11 @@ class AESCrypto {
 
         std::string encrypt_line(const byte* line, int line_size);
 
+        /* genotype rows are not chained, each row's IV is AES_k(iv ^ row_nonce) with the
+           nonce xored into the first 8 bytes, so any enclave thread holding the key can
+           decrypt any row. row_nonce is the variant key, unique per row. */
+        std::string encrypt_row(const byte* row, int row_size, uint64_t row_nonce);
+
         std::string encode(const byte* data, int data_size);
 
         std::string decode(const std::string& encoded_data);
@@ -31,6 +37,8 @@ class AESCrypto {
         CryptoPP::SecByteBlock key;
         CryptoPP::SecByteBlock iv;
         CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption encryptor;
+        CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption row_encryptor;
+        CryptoPP::AES::Encryption row_iv_cipher;
 };
 
 
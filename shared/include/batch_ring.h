@@ -0,0 +1,125 @@
+#ifndef BATCH_RING_H
+#define BATCH_RING_H
+/* Single producer, single consumer byte ring in untrusted memory, two per enclave thread.
+   The host's allele matcher writes batches of matched lines in place past the head and
+   publishes each whole batch at once, and the enclave thread copies whole batches of them
+   straight into enclave memory, so nothing crosses the enclave boundary while rows are
+   flowing and each row is copied once on either side. In the other
+   direction the enclave thread appends full output buffers of result records, which the
+   host's output sender drains.
+   Every record is a uint32_t length followed by that many bytes, BATCH_RING_EOF as the
+   length marks the end of the data. */
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#include "buffer_size.h"
+
+#define BATCH_RING_SIZE (2 * ENCLAVE_READ_BUFFER_SIZE)  // in B, holds at least one full batch
+#define BATCH_RING_EOF UINT32_MAX
+#define BATCH_RING_CORRUPT -2
+
+struct BatchRing {
+    std::atomic<uint64_t> head;  // bytes written, only moved by the host
+    char head_pad[64 - sizeof(uint64_t)];
+    std::atomic<uint64_t> tail;  // bytes read, only moved by the enclave
+    // lines per batch the enclave thread takes, 0 until it is set; the host sizes its batches by it
+    std::atomic<uint32_t> batch_lines;
+    char tail_pad[64 - sizeof(uint64_t) - sizeof(uint32_t)];
+    char data[BATCH_RING_SIZE];
+
+    BatchRing() : head(0), tail(0), batch_lines(0) {}
+};
+
+inline void batch_ring_copy_in(BatchRing* ring, uint64_t pos, const char* src, uint64_t length) {
+    uint64_t offset = pos % BATCH_RING_SIZE;
+    uint64_t first = BATCH_RING_SIZE - offset < length ? BATCH_RING_SIZE - offset : length;
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, src + first, length - first);
+}
+
+inline void batch_ring_copy_out(const BatchRing* ring, uint64_t pos, char* dst, uint64_t length) {
+    uint64_t offset = pos % BATCH_RING_SIZE;
+    uint64_t first = BATCH_RING_SIZE - offset < length ? BATCH_RING_SIZE - offset : length;
+    memcpy(dst, ring->data + offset, first);
+    memcpy(dst + first, ring->data, length - first);
+}
+
+/* producer side, false while the ring is too full for the record */
+inline bool batch_ring_push(BatchRing* ring, const char* bytes, uint32_t length) {
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    uint64_t record_size = sizeof(uint32_t) + (length == BATCH_RING_EOF ? 0 : length);
+    if (BATCH_RING_SIZE - (head - tail) < record_size) {
+        return false;
+    }
+    batch_ring_copy_in(ring, head, (const char*)&length, sizeof(uint32_t));
+    if (length != BATCH_RING_EOF) {
+        batch_ring_copy_in(ring, head + sizeof(uint32_t), bytes, length);
+    }
+    ring->head.store(head + record_size, std::memory_order_release);
+    return true;
+}
+
+/* producer side, length bytes of records already framed as above,
+   false while the ring is too full for all of them */
+inline bool batch_ring_push_records(BatchRing* ring, const char* records, uint64_t length) {
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    if (BATCH_RING_SIZE - (head - tail) < length) {
+        return false;
+    }
+    batch_ring_copy_in(ring, head, records, length);
+    ring->head.store(head + length, std::memory_order_release);
+    return true;
+}
+
+/* producer side, length bytes of records written with batch_ring_copy_in from head on,
+   within the room batch_ring_used left, become readable */
+inline void batch_ring_publish(BatchRing* ring, uint64_t length) {
+    ring->head.store(ring->head.load(std::memory_order_relaxed) + length, std::memory_order_release);
+}
+
+/* bytes pushed but not popped yet */
+inline uint64_t batch_ring_used(const BatchRing* ring) {
+    return ring->head.load(std::memory_order_acquire) - ring->tail.load(std::memory_order_acquire);
+}
+
+/* consumer side: appends whole records to out, at most max_lines of them and out_size bytes,
+   their total length goes to out_length and each record's length to line_lengths if given.
+   Returns the number of lines, 0 if the ring is empty, -1 at the end of the data.
+   head and every length live in untrusted memory, so each is read once and checked. */
+inline int batch_ring_pop(BatchRing* ring, char* out, uint64_t out_size, int max_lines,
+                          uint64_t* out_length = nullptr, uint32_t* line_lengths = nullptr) {
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    if (head - tail > BATCH_RING_SIZE) {
+        return BATCH_RING_CORRUPT;
+    }
+    int num_lines = 0;
+    uint64_t out_tail = 0;
+    while (num_lines < max_lines && head - tail >= sizeof(uint32_t)) {
+        uint32_t length;
+        batch_ring_copy_out(ring, tail, (char*)&length, sizeof(uint32_t));
+        if (length == BATCH_RING_EOF) {
+            if (num_lines) break;
+            ring->tail.store(tail + sizeof(uint32_t), std::memory_order_release);
+            return -1;
+        }
+        if (length > out_size || length > head - tail - sizeof(uint32_t)) {
+            return BATCH_RING_CORRUPT;
+        }
+        if (out_tail + length > out_size) break;
+        batch_ring_copy_out(ring, tail + sizeof(uint32_t), out + out_tail, length);
+        if (line_lengths) line_lengths[num_lines] = length;
+        out_tail += length;
+        tail += sizeof(uint32_t) + length;
+        num_lines++;
+    }
+    ring->tail.store(tail, std::memory_order_release);
+    if (out_length) *out_length = out_tail;
+    return num_lines;
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+/* Receive buffers shared by every connection of a server. Sizes come in classes doubling
+   from BUFFER_POOL_MIN_SIZE up to the largest frame, so a buffer is at most twice what was
+   asked for, and a freed one is reused as is: no allocation, page faults or zeroing once a
+   server has seen its largest messages. What stays cached is capped per class. */
+
+#include <stddef.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define BUFFER_POOL_MIN_SIZE (1 << 16)
+#define BUFFER_POOL_IDLE_BYTES (1 << 25)  // cached per size class, the rest is freed
+
+class BufferPool {
+    struct SizeClass {
+        size_t size;
+        std::mutex lock;
+        std::vector<char*> idle;
+    };
+    std::vector<std::unique_ptr<SizeClass> > classes;
+
+    BufferPool();
+    SizeClass& size_class(size_t size);
+
+   public:
+    static BufferPool& get_instance();
+    ~BufferPool();
+
+    // a buffer of at least size B, size is set to all it holds
+    char* acquire(size_t& size);
+    // size as acquire returned it
+    void release(char* buffer, size_t size);
+};
+
+#endif
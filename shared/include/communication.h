@@ -1,16 +1,24 @@
 #ifndef _COMMUNICATION_H_
 #define _COMMUNICATION_H_
 
+#include <stdint.h>
+
+#include <atomic>
 #include <string>
 #include <vector>
 
+#include "frame_reader.h"
+#include "variant_key.h"
+
 enum DPIMessageType {
   DPI_INFO,
   ENCLAVE_INFO,
   EVIDENCE,
   RSA_PUB_KEY,
   Y_AND_COV,
+  OWNER_Y_AND_COV,
   DATA_REQUEST,
+  DATA_CREDIT,
   DPI_SYNC,
   END_DPI
 };
@@ -24,7 +32,12 @@ enum EnclaveNodeMessageType {
   Y_VAL,
   DATA,
   EOF_DATA,
-  END_ENCLAVE
+  END_ENCLAVE,
+  REDUCE_HELLO,
+  REDUCE_WELCOME,
+  REDUCE_SHARE,
+  REDUCE_STATS,
+  REDUCE_EOF
 };
 
 enum CoordinationServerMessageType {
@@ -40,14 +53,19 @@ struct ConnectionInfo {
   unsigned int num_threads; // only for enclave node
 };
 
+// one row of a DATA frame, its genotypes are left where they arrived in the frame
 struct DataBlock {
-  std::string locus;
-  std::string data;
+  VariantKey key;
+  const char* data;
+  uint32_t length;
 };
 
+// a received DATA frame and the rows in it, freed once every matcher thread is past them
 struct DataBlockBatch {
-  std::vector<DataBlock*> blocks_batch;
+  Frame frame;
+  std::vector<DataBlock> blocks_batch;
   int pos;
+  std::atomic<int> remaining;  // matcher threads still reading it
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,65 @@
+#ifndef FRAME_READER_H
+#define FRAME_READER_H
+/* Framing of every message between the DPI, the enclave node and the coordination server:
+   a 4 B body length in network byte order followed by the body. send_message writes frames,
+   FrameReader buffers a non-blocking connection and splits what it reads back into bodies,
+   which are left where they were read: a handler keeps one by holding on to its Frame. */
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#define FRAME_PREFIX_SIZE sizeof(uint32_t)
+#define FRAME_READ_SIZE (1 << 16)  // read at once, and a connection's buffer until a longer frame shows up
+
+enum ReadStatus { READ_DRAINED, READ_FULL, READ_CLOSED };
+
+// the body of a received frame in the pooled buffer it was read into, which goes back
+// to the pool once the reader and every frame kept from it let go of it
+class Frame {
+    std::shared_ptr<char> buffer;
+    const char* body;
+    size_t length;
+
+    friend class FrameReader;
+
+   public:
+    Frame() : body(nullptr), length(0) {}
+    const char* data() const { return body; }
+    size_t size() const { return length; }
+    std::string str() const { return std::string(body, length); }
+    void reset() {
+        buffer.reset();
+        body = nullptr;
+        length = 0;
+    }
+};
+
+class FrameReader {
+    int fd;
+    std::shared_ptr<char> pooled;  // from the BufferPool, only while a frame is partly read or kept
+    char* buffer;
+    size_t capacity;
+    size_t head;  // start of the next frame
+    size_t tail;  // end of the bytes read
+
+    // room for size bytes from head on
+    void reserve(size_t size);
+    // true if no frame kept from the buffer is still read, so the bytes before head may be reused
+    bool exclusive() const;
+
+   public:
+    explicit FrameReader(int _fd);
+    FrameReader(const FrameReader&) = delete;
+    FrameReader& operator=(const FrameReader&) = delete;
+    int get_fd() const { return fd; }
+    // reads what the socket has, READ_FULL if there may be more than fit in one read
+    ReadStatus fill();
+    // the body of the next frame if all of it was read, throws on an oversized length
+    bool next(Frame& frame);
+    // hands the buffer back to the pool unless it holds part of a frame, for an idle connection
+    void shrink();
+};
+
+#endif
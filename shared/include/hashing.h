@@ -1,16 +1,34 @@
 #ifndef HASHING_H
 #define HASHING_H
+/* Header only so the enclave, which does not link the shared library, computes
+   the same AES key id as the DPI */
 
-#include <string>
-#include <stdexcept>
+#include <stdint.h>
 
 #define prime_a 533122189
 #define prime_b 4156559549
 #define prime_init_thread 59
 #define prime_init_machine 71
 
-unsigned int jump_hash(uint64_t key, uint32_t mod);
+inline unsigned int jump_hash(uint64_t key, uint32_t mod) {
+    int64_t b = -1, j=0;
+    while (j < mod) {
+        b =  j;
+        key = (key * 2862933555777941757ULL) + 1;
+        j = (b + 1) * (double(1LL << 31) / double((key >> 33) + 1));
+    }
+    return b;
+}
 
-unsigned int hash_string(const std::string& input, uint32_t mod, bool thread_hash);
+// enclave node (machine) owning a variant key, or with thread_hash the AES key
+// it is encrypted with there, the DPI and the enclave node must agree on both
+inline unsigned int hash_key(uint64_t key, uint32_t mod, bool thread_hash) {
+    // keys of neighbouring variants differ in few bits, mix them before jump_hash
+    uint64_t hash = (key ^ (thread_hash ? prime_init_thread : prime_init_machine)) * prime_a;
+    hash ^= hash >> 31;
+    hash *= prime_b;
+    hash ^= hash >> 29;
+    return jump_hash(hash, mod);
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -16,6 +16,7 @@
 #include "aes-crypto.h"
 #include "buffer_size.h"
 #include "communication.h"
+#include "variant_key.h"
 
 class Parser {
   private:
@@ -36,13 +37,12 @@ class Parser {
 
     static int parse_nth_int(const std::string& str, const int n, const char delim='\t');
 
-    // parse message body into the relevant arguments we need
-    static void parse_data_body(std::vector<DataBlock*>& blocks, const std::string& message_body, AESCrypto& decoder);
+    // key of a "chrom:pos\talleles\tvalues" line, the allele text of non-SNVs goes into non_snv_table
+    static VariantKey parse_variant_key(const std::string& line, VariantTable& non_snv_table);
 
-    static int parse_hash(const std::string& line, const int encryptor_list_size);
-
-    // Returns the enclave node we should send this allele to
+    // Replaces line with its key, the allele text for non-SNVs and the encrypted genotypes
     static void parse_allele_line(std::string& line, 
+                                  const VariantKey key,
                                   std::vector<uint8_t>& vals, 
                                   std::vector<uint8_t>& compressed_vals, 
                                   std::vector<std::vector<AESCrypto> >& encryptor_list, 
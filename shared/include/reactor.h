@@ -0,0 +1,51 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+/* Event loop server shared by the DPI, the enclave node and the coordination server.
+   One thread accepts connections and waits on epoll for all of them, a fixed pool of
+   workers reads whichever connection is ready into its FrameReader and hands each complete
+   message body to the handler.
+   Connections are armed with EPOLLONESHOT, so a connection belongs to one worker at a time
+   and its messages are handled in the order they were sent. The reactor closes a connection
+   when the peer does, or when the handler returns false or throws; handlers never close it.
+   A handler that moves the Frame out keeps the body without a copy, see frame_reader.h. */
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_reader.h"
+
+#define REACTOR_MIN_WORKERS 4    // handlers may wait on a message another worker handles
+
+class Reactor {
+   public:
+    // true keeps the connection open for its next message
+    typedef std::function<bool(int connFD, Frame& body)> MessageHandler;
+
+   private:
+    MessageHandler handler;
+    int listen_fd;
+    int epoll_fd;
+    std::vector<std::thread> workers;
+    std::queue<FrameReader*> ready;
+    std::mutex ready_lock;
+    std::condition_variable ready_cv;
+
+    void work();
+    void serve(FrameReader* conn);
+    void close_connection(FrameReader* conn);
+
+   public:
+    Reactor(int num_workers, MessageHandler _handler);
+    // binds port, 0 for any free one, and returns the port bound
+    int listen(int port);
+    // accepts and dispatches connections forever
+    void run();
+};
+
+#endif
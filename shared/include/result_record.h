@@ -0,0 +1,55 @@
+#ifndef RESULT_RECORD_H
+#define RESULT_RECORD_H
+/* Results leave the enclave as fixed size binary records and are formatted by the
+   enclave node's host. Results without a fixed shape (region results, and stats
+   store variants only found in the loaded store) are a RESULT_TEXT record followed
+   by text_length bytes of finished lines. Records are never split across two output
+   chunks. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "variant_key.h"
+
+enum ResultType : uint8_t { RESULT_TEXT, RESULT_LINEAR, RESULT_LOGISTIC };
+
+// the first QC check a variant failed
+enum QCReason : uint8_t { QC_CALL_RATE = 1, QC_MAF, QC_HWE };
+
+#define RESULT_CONVERGED 1
+#define RESULT_NA 2          // beta, se and t are NA
+#define RESULT_MATH_ERROR 4  // the fit threw: NA, 1 iteration, not converged
+#define RESULT_QC_FAIL 8     // NA, 0 iterations, not converged, then qc_fail:<reason>
+
+struct ResultRecord {
+    VariantKey key;
+    double beta;
+    double se;  // t is beta / se, exactly what the kernels used to divide
+    union {
+        uint32_t text_length;  // RESULT_TEXT
+        uint32_t qc_reason;    // RESULT_QC_FAIL, a QCReason
+    };
+    uint16_t iterations;
+    uint8_t type;
+    uint8_t flags;
+};
+
+inline ResultRecord text_result(uint32_t text_length) {
+    ResultRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = RESULT_TEXT;
+    record.text_length = text_length;
+    return record;
+}
+
+inline ResultRecord qc_fail_result(VariantKey key, ResultType type, QCReason reason) {
+    ResultRecord record;
+    memset(&record, 0, sizeof(record));
+    record.key = key;
+    record.type = type;
+    record.flags = RESULT_NA | RESULT_QC_FAIL;
+    record.qc_reason = reason;
+    return record;
+}
+
+#endif
@@ -11,6 +11,7 @@
 #define _HELPERS_H_
 
 const int MAX_MESSAGE_SIZE = 1 << 22;
+const size_t CONNECTION_POOL_MAX_IDLE = 16;  // per server, more are closed once sent on
 
 /**
  * Make a server sockaddr given a port.
@@ -51,16 +52,30 @@ int make_client_sockaddr(struct sockaddr_in *addr, const char *hostname, int por
  int get_port_number(int sockfd);
 
  /**
- * Sends a string message to the server.
+ * Opens a connection of its own to the server, resolving hostname only the first time.
  *
  * Parameters:
  *		hostname: 	Remote hostname of the server.
  *		port: 		Remote port of the server.
- * 		message: 	The message to send, as a C-string.
  * Returns:
- *		0 on success, -1 on failure.
+ *		The connected socket, for the caller to close.
+ */
+int open_connection(const char *hostname, int port);
+
+ /**
+ * Sends a message to the server as one frame, see frame_reader.h.
+ *
+ * Parameters:
+ *		hostname: 	Remote hostname of the server.
+ *		port: 		Remote port of the server.
+ * 		header: 	The start of the body, who sent it and the message type.
+ * 		body: 		The rest of the body.
+ *		sock: 		A connection from open_connection, or -1 to send on one of the
+ *				process's pooled connections to the server.
+ * Returns:
+ *		sock, -1 when the frame went on a pooled connection.
  */
-int send_message(const char *hostname, int port, const char *message, const int message_length, int sock = -1);
+int send_message(const char *hostname, int port, const std::string &header, const std::string &body, int sock = -1);
 
 std::string get_hostname_str();
 
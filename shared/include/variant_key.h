@@ -0,0 +1,156 @@
+#ifndef VARIANT_KEY_H
+#define VARIANT_KEY_H
+/* Packed 64-bit variant key. The DPI parses "chrom:pos\t[\"A\",\"G\"]" once and every later
+   hop (routing, matching, the enclave's row records, sorting at the CS) works on the key.
+   Keys compare in (chrom, position, alleles) order:
+     bits 56-63  chromosome, X is LOCI_X
+     bits 24-55  position
+     bit  23     set for non-SNVs
+     bits  0-22  SNV: a1 << 2 | a2 with A, C, G, T = 0..3
+                 non-SNV: hash of the allele text, the text itself lives in a VariantTable */
+
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+
+typedef uint64_t VariantKey;
+
+#define VARIANT_KEY_SIZE sizeof(VariantKey)
+#define VARIANT_KEY_CHROM_X 23  // LOCI_X
+#define VARIANT_KEY_NON_SNV (1ULL << 23)
+#define VARIANT_KEY_ALLELE_MASK ((1ULL << 23) - 1)
+#define VARIANT_KEY_EOF UINT64_MAX  // sorts after every variant, chromosome 255 is never parsed
+
+inline VariantKey variant_key_pack(uint32_t chrom, uint32_t pos, uint32_t allele_code) {
+    return ((uint64_t)chrom << 56) | ((uint64_t)pos << 24) | (allele_code & (VARIANT_KEY_NON_SNV | VARIANT_KEY_ALLELE_MASK));
+}
+
+inline int variant_key_chrom(VariantKey key) { return (int)(key >> 56); }
+inline uint32_t variant_key_pos(VariantKey key) { return (uint32_t)(key >> 24); }
+inline bool variant_key_is_snv(VariantKey key) { return !(key & VARIANT_KEY_NON_SNV); }
+inline char variant_key_a1(VariantKey key) { return "ACGT"[(key >> 2) & 0b11]; }
+inline char variant_key_a2(VariantKey key) { return "ACGT"[key & 0b11]; }
+
+inline int nucleotide_code(char c) {
+    switch (c) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default: return -1;
+    }
+}
+
+// FNV-1a folded into the 23 allele bits
+inline uint32_t non_snv_code(const char* alleles, const char* end_of_alleles) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = alleles; c < end_of_alleles; ++c) {
+        hash = (hash ^ (uint8_t)*c) * 1099511628211ULL;
+    }
+    return (uint32_t)((hash ^ (hash >> 23) ^ (hash >> 46)) & VARIANT_KEY_ALLELE_MASK);
+}
+
+inline bool parse_key_uint(const char* begin, const char* end, uint64_t max, uint64_t* out) {
+    if (begin == end || end - begin > 10) return false;
+    uint64_t value = 0;
+    for (const char* c = begin; c < end; ++c) {
+        if (*c < '0' || *c > '9') return false;
+        value = value * 10 + (*c - '0');
+    }
+    if (value > max) return false;
+    *out = value;
+    return true;
+}
+
+// "chrom:pos", false if malformed
+inline bool variant_key_parse_locus(const char* locus, const char* end_of_locus, uint64_t* chrom, uint64_t* pos) {
+    const char* colon = (const char*)memchr(locus, ':', end_of_locus - locus);
+    if (!colon) return false;
+    if (colon - locus == 1 && *locus == 'X') {
+        *chrom = VARIANT_KEY_CHROM_X;
+    } else if (!parse_key_uint(locus, colon, 254, chrom) || !*chrom) {
+        return false;
+    }
+    return parse_key_uint(colon + 1, end_of_locus, UINT32_MAX, pos);
+}
+
+// "chrom:pos" and the allele list, false if either is malformed
+inline bool variant_key_parse(const char* locus, const char* end_of_locus,
+                              const char* alleles, const char* end_of_alleles, VariantKey* key) {
+    uint64_t chrom, pos;
+    if (alleles == end_of_alleles || !variant_key_parse_locus(locus, end_of_locus, &chrom, &pos)) return false;
+    // ["A","G"]
+    bool snv_length = end_of_alleles - alleles == 9;
+    int a1 = snv_length ? nucleotide_code(alleles[2]) : -1;
+    int a2 = snv_length ? nucleotide_code(alleles[6]) : -1;
+    if (a1 >= 0 && a2 >= 0) {
+        *key = variant_key_pack(chrom, pos, (a1 << 2) | a2);
+    } else {
+        *key = variant_key_pack(chrom, pos, VARIANT_KEY_NON_SNV | non_snv_code(alleles, end_of_alleles));
+    }
+    return true;
+}
+
+inline void variant_key_write(VariantKey key, char* out) { memcpy(out, &key, VARIANT_KEY_SIZE); }
+
+inline VariantKey variant_key_read(const char* in) {
+    VariantKey key;
+    memcpy(&key, in, VARIANT_KEY_SIZE);
+    return key;
+}
+
+inline void variant_key_locus_str(VariantKey key, std::string& locus) {
+    int chrom = variant_key_chrom(key);
+    locus = chrom == VARIANT_KEY_CHROM_X ? "X" : std::to_string(chrom);
+    locus += ":" + std::to_string(variant_key_pos(key));
+}
+
+// SNVs only, non-SNV allele text has to come from a VariantTable
+inline void variant_key_alleles_str(VariantKey key, std::string& alleles) {
+    alleles = "[\"";
+    alleles.push_back(variant_key_a1(key));
+    alleles += "\",\"";
+    alleles.push_back(variant_key_a2(key));
+    alleles += "\"]";
+}
+
+// "chrom:pos\t[\"A\",\"G\"]" of an SNV key
+inline void variant_key_str(VariantKey key, std::string& variant) {
+    std::string alleles;
+    variant_key_locus_str(key, variant);
+    variant_key_alleles_str(key, alleles);
+    variant += "\t" + alleles;
+}
+
+/* Text fallback for non-SNVs, their keys only hold a hash of the allele text.
+   Two texts hashing to the same key at the same position would be merged as one
+   variant, so add refuses them. */
+class VariantTable {
+    std::unordered_map<VariantKey, std::string> alleles;
+    std::mutex lock;
+
+   public:
+    // false if key already names different allele text
+    bool add(VariantKey key, const std::string& allele_text) {
+        std::lock_guard<std::mutex> raii(lock);
+        auto it = alleles.emplace(key, allele_text).first;
+        return it->second == allele_text;
+    }
+
+    // "chrom:pos\talleles"
+    std::string str(VariantKey key) {
+        std::string variant;
+        if (variant_key_is_snv(key)) {
+            variant_key_str(key, variant);
+            return variant;
+        }
+        variant_key_locus_str(key, variant);
+        std::lock_guard<std::mutex> raii(lock);
+        auto it = alleles.find(key);
+        return variant + "\t" + (it == alleles.end() ? "[?]" : it->second);
+    }
+};
+
+#endif
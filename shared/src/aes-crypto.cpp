@@ -1,4 +1,5 @@
 #include "aes-crypto.h"
+#include <string.h>
 
 AESCrypto::AESCrypto() {
     key = CryptoPP::SecByteBlock(CryptoPP::AES::DEFAULT_KEYLENGTH);
@@ -7,6 +8,8 @@ AESCrypto::AESCrypto() {
     prng.GenerateBlock(iv, CryptoPP::AES::BLOCKSIZE);
 
     encryptor.SetKeyWithIV(key, key.size(), iv);
+    row_encryptor.SetKeyWithIV(key, key.size(), iv);
+    row_iv_cipher.SetKey(key, key.size());
 }
 
 std::string AESCrypto::encrypt_line(const byte* line, int line_size) {
@@ -20,6 +23,24 @@ std::string AESCrypto::encrypt_line(const byte* line, int line_size) {
     return cipher;//encode((const byte*)&cipher[0], cipher.size());
 }
 
+std::string AESCrypto::encrypt_row(const byte* row, int row_size, uint64_t row_nonce) {
+    byte row_iv[CryptoPP::AES::BLOCKSIZE];
+    memcpy(row_iv, iv, CryptoPP::AES::BLOCKSIZE);
+    for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+        row_iv[i] ^= (byte)(row_nonce >> (8 * i));
+    }
+    row_iv_cipher.ProcessBlock(row_iv);
+    row_encryptor.Resynchronize(row_iv, CryptoPP::AES::BLOCKSIZE);
+
+    std::string cipher;
+    CryptoPP::StringSource ss(row, row_size, true /*pumpAll*/, 
+                    new CryptoPP::StreamTransformationFilter(row_encryptor,
+                        new CryptoPP::StringSink(cipher)
+                    ) // StreamTransformationFilter
+                );
+    return cipher;
+}
+
 std::string AESCrypto::encode(const byte* data, int data_size) {
     CryptoPP::Base64Encoder encoder;
     std::string encoded;
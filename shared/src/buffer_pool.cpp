@@ -0,0 +1,66 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "frame_reader.h"
+#include "socket_send.h"
+
+BufferPool::BufferPool() {
+    const size_t max_size = MAX_MESSAGE_SIZE + FRAME_PREFIX_SIZE;
+    for (size_t size = BUFFER_POOL_MIN_SIZE; ; size *= 2) {
+        classes.emplace_back(new SizeClass);
+        classes.back()->size = std::min(size, max_size);
+        if (size >= max_size) break;
+    }
+}
+
+BufferPool::~BufferPool() {
+    for (auto& size_class : classes) {
+        for (char* buffer : size_class->idle) {
+            delete[] buffer;
+        }
+    }
+}
+
+BufferPool& BufferPool::get_instance() {
+    static BufferPool instance;
+    return instance;
+}
+
+BufferPool::SizeClass& BufferPool::size_class(size_t size) {
+    for (auto& size_class : classes) {
+        if (size_class->size >= size) {
+            return *size_class;
+        }
+    }
+    throw std::runtime_error("Buffer larger than any frame: " + std::to_string(size));
+}
+
+char* BufferPool::acquire(size_t& size) {
+    SizeClass& pooled = size_class(size);
+    size = pooled.size;
+    {
+        std::lock_guard<std::mutex> raii(pooled.lock);
+        if (!pooled.idle.empty()) {
+            char* buffer = pooled.idle.back();
+            pooled.idle.pop_back();
+            return buffer;
+        }
+    }
+    return new char[size];
+}
+
+void BufferPool::release(char* buffer, size_t size) {
+    if (!buffer) return;
+    SizeClass& pooled = size_class(size);
+    {
+        std::lock_guard<std::mutex> raii(pooled.lock);
+        if ((pooled.idle.size() + 1) * pooled.size <= BUFFER_POOL_IDLE_BYTES) {
+            pooled.idle.push_back(buffer);
+            return;
+        }
+    }
+    delete[] buffer;
+}
@@ -0,0 +1,126 @@
+#include "frame_reader.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+#include "buffer_pool.h"
+#include "socket_send.h"
+
+// a pool buffer of at least size B, released by whichever of its holders lets go last
+static std::shared_ptr<char> acquire_pooled(size_t& size) {
+    char* buffer = BufferPool::get_instance().acquire(size);
+    size_t capacity = size;
+    return std::shared_ptr<char>(buffer, [capacity](char* pooled) {
+        BufferPool::get_instance().release(pooled, capacity);
+    });
+}
+
+FrameReader::FrameReader(int _fd) : fd(_fd), buffer(nullptr), capacity(0), head(0), tail(0) {}
+
+bool FrameReader::exclusive() const {
+    if (pooled.use_count() > 1) {
+        return false;
+    }
+    // pairs with the release of the last kept frame, whose reads come before our writes
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return true;
+}
+
+void FrameReader::reserve(size_t size) {
+    if (capacity - head >= size) return;
+    if (capacity >= size && exclusive()) {
+        memmove(buffer, buffer + head, tail - head);
+    } else {
+        // the frames kept from a shared buffer stay where they are, the partial one moves
+        size_t larger_size = size;
+        std::shared_ptr<char> larger = acquire_pooled(larger_size);
+        if (tail > head) {
+            memcpy(larger.get(), buffer + head, tail - head);
+        }
+        pooled = std::move(larger);
+        buffer = pooled.get();
+        capacity = larger_size;
+    }
+    tail -= head;
+    head = 0;
+}
+
+void FrameReader::shrink() {
+    if (head != tail) return;
+    pooled.reset();
+    buffer = nullptr;
+    capacity = head = tail = 0;
+}
+
+ReadStatus FrameReader::fill() {
+    // whatever does not fit in the buffer spills into the worker's spare and is copied over,
+    // so one readv takes all the socket has without every buffer being as large as a read.
+    // The spare takes no more than moving the bytes from head to the front frees: what
+    // spilled fits a buffer of the same size, which next() already made room for the frame
+    // at head, so a buffer never grows past its frame
+    static thread_local char spare[FRAME_READ_SIZE];
+    if (head == tail) {
+        if (!exclusive()) {
+            shrink();
+        }
+        head = tail = 0;
+    }
+    if (!buffer) {
+        reserve(FRAME_READ_SIZE);
+    }
+    struct iovec iov[2];
+    iov[0].iov_base = buffer + tail;
+    iov[0].iov_len = capacity - tail;
+    iov[1].iov_base = spare;
+    iov[1].iov_len = std::min(sizeof(spare), head);
+    while (true) {
+        ssize_t rval = readv(fd, iov, 2);
+        if (rval > 0) {
+            size_t in_buffer = std::min((size_t)rval, iov[0].iov_len);
+            tail += in_buffer;
+            if (in_buffer < (size_t)rval) {
+                size_t spilled = rval - in_buffer;
+                reserve(tail - head + spilled);
+                memcpy(buffer + tail, spare, spilled);
+                tail += spilled;
+            }
+            // a short read emptied the socket, the reactor waits for more rather than recv again
+            return (size_t)rval < iov[0].iov_len + iov[1].iov_len ? READ_DRAINED : READ_FULL;
+        } else if (rval == 0) {
+            return READ_CLOSED;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return READ_DRAINED;
+        } else if (errno != EINTR) {
+            throw std::runtime_error("Socket recv failed: " + std::string(strerror(errno)));
+        }
+    }
+}
+
+bool FrameReader::next(Frame& frame) {
+    size_t available = tail - head;
+    if (available < FRAME_PREFIX_SIZE) {
+        return false;
+    }
+    uint32_t body_size;
+    memcpy(&body_size, buffer + head, FRAME_PREFIX_SIZE);
+    body_size = ntohl(body_size);
+    if (body_size > MAX_MESSAGE_SIZE) {
+        throw std::runtime_error("Message exceeds maximum length: " + std::to_string(body_size));
+    }
+    size_t frame_size = FRAME_PREFIX_SIZE + body_size;
+    if (available < frame_size) {
+        reserve(frame_size);
+        return false;
+    }
+    frame.buffer = pooled;
+    frame.body = buffer + head + FRAME_PREFIX_SIZE;
+    frame.length = body_size;
+    head += frame_size;
+    return true;
+}
@@ -69,46 +69,39 @@ int Parser::parse_nth_int(const std::string& str, const int n, const char delim)
     return std::stoi(parsed_int);
 }
 
-void Parser::parse_data_body(std::vector<DataBlock*>& blocks, const std::string& message_body, AESCrypto& decoder) {
-    // TODO: optimize this... super inefficient currently
-
-    std::vector<std::string> split_msg;
-    Parser::split(split_msg, message_body, '\t');
-
-    // Start idx at 1 to skip over the block id
-    for (long unsigned int msg_idx = 1; msg_idx < split_msg.size(); msg_idx += 3) {
-        DataBlock* block = new DataBlock;
-
-        block->locus = split_msg[msg_idx] + "\t" + split_msg[msg_idx + 1];
-        block->data = split_msg[msg_idx + 2];
-        blocks.push_back(block);
+VariantKey Parser::parse_variant_key(const std::string& line, VariantTable& non_snv_table) {
+    size_t end_of_locus = line.find('\t');
+    size_t end_of_alleles = end_of_locus == std::string::npos ? end_of_locus : line.find('\t', end_of_locus + 1);
+    if (end_of_alleles == std::string::npos) {
+        throw std::runtime_error("Invalid alleles file!");
     }
-}
-
-int Parser::parse_hash(const std::string& line, const int encryptor_list_size) {
-    std::vector<std::string> line_split;
-    Parser::split(line_split, line, '\t', 2);
-    std::string locus_and_allele = line_split[0] + '\t' + line_split[1] + '\t';
-    return hash_string(locus_and_allele, encryptor_list_size, false);
+    VariantKey key;
+    if (!variant_key_parse(&line[0], &line[end_of_locus], &line[end_of_locus + 1], &line[end_of_alleles], &key)) {
+        throw std::runtime_error("Invalid variant: " + line.substr(0, end_of_alleles));
+    }
+    if (!variant_key_is_snv(key) && 
+        !non_snv_table.add(key, line.substr(end_of_locus + 1, end_of_alleles - end_of_locus - 1))) {
+        throw std::runtime_error("Allele hash collision at " + line.substr(0, end_of_alleles));
+    }
+    return key;
 }
 
 void Parser::parse_allele_line(std::string& line, 
+                              const VariantKey key,
                               std::vector<uint8_t>& vals, 
                               std::vector<uint8_t>& compressed_vals, 
                               std::vector<std::vector<AESCrypto> >& encryptor_list, 
                               const int enclave_node_hash) {
-    std::vector<std::string> line_split;
-    Parser::split(line_split, line, '\t', 2);
-    std::string locus_and_allele = line_split[0] + '\t' + line_split[1] + '\t';
+    size_t end_of_locus = line.find('\t');
+    size_t end_of_alleles = line.find('\t', end_of_locus + 1);
 
-    // Use the AES encryptor that corresponds to the appropriate thread on the server end
+    // Use the AES key of the thread the variant hashes to, any enclave thread can decrypt it
     std::vector<AESCrypto>& aes_list = encryptor_list[enclave_node_hash];
-    AESCrypto& encryptor = aes_list[hash_string(locus_and_allele, aes_list.size(), true)];
+    AESCrypto& encryptor = aes_list[hash_key(key, aes_list.size(), true)];
 
-    std::string line_vals = line_split.back();
     int val_idx = 0;
-    for (std::size_t line_idx = 0; line_idx < line_vals.length(); line_idx += 2) {
-        switch(line_vals[line_idx]) {
+    for (std::size_t line_idx = end_of_alleles + 1; line_idx < line.length(); line_idx += 2) {
+        switch(line[line_idx]) {
             case '0':
                 vals[val_idx++] = static_cast<char>(0);
                 break;
@@ -131,8 +124,15 @@ void Parser::parse_allele_line(std::string& line,
         }
     }
     two_bit_compress(&vals[0], &compressed_vals[0], vals.size());
-    const std::string enc = encryptor.encrypt_line((byte *)&compressed_vals[0], compressed_vals.size());
-    line = locus_and_allele + enc + "\n";
+    const std::string enc = encryptor.encrypt_row((byte *)&compressed_vals[0], compressed_vals.size(), key);
+
+    // msg format: key, non-SNV allele text \t, encrypted genotypes \n
+    std::string record(VARIANT_KEY_SIZE, '\0');
+    variant_key_write(key, &record[0]);
+    if (!variant_key_is_snv(key)) {
+        record.append(line, end_of_locus + 1, end_of_alleles - end_of_locus);
+    }
+    line = record + enc + "\n";
 }
 
 unsigned int Parser::convert_to_num(const std::string& str) {
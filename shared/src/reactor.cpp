@@ -0,0 +1,141 @@
+#include "reactor.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "output.h"
+#include "socket_send.h"
+
+#define REACTOR_MAX_EVENTS 256
+
+static std::mutex reactor_cout_lock;
+
+Reactor::Reactor(int num_workers, MessageHandler _handler)
+    : handler(_handler), listen_fd(-1) {
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        throw std::runtime_error("epoll_create1 failed: " + std::string(strerror(errno)));
+    }
+    num_workers = std::max(num_workers, REACTOR_MIN_WORKERS);
+    for (int id = 0; id < num_workers; ++id) {
+        workers.emplace_back(&Reactor::work, this);
+        workers.back().detach();
+    }
+}
+
+int Reactor::listen(int port) {
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    int yesval = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yesval, sizeof(yesval));
+
+    struct sockaddr_in addr;
+    socklen_t addrSize = sizeof(addr);
+    memset(&addr, 0, addrSize);
+    make_server_sockaddr(&addr, port);
+
+    // bind to our given port, or randomly get one if port = 0
+    if (bind(listen_fd, (struct sockaddr*) &addr, addrSize) < 0) {
+        guarded_cout("bind failure: " + std::to_string(errno), reactor_cout_lock);
+    }
+    if (getsockname(listen_fd, (struct sockaddr*) &addr, &addrSize) < 0) {
+        guarded_cout("getsockname failure: " + std::to_string(errno), reactor_cout_lock);
+    }
+    if (::listen(listen_fd, 4096) < 0) {
+        guarded_cout("listen: " + std::to_string(errno), reactor_cout_lock);
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    return ntohs(addr.sin_port);
+}
+
+void Reactor::run() {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    while (true) {
+        int num_events = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (num_events < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("epoll_wait failed: " + std::string(strerror(errno)));
+        }
+        for (int i = 0; i < num_events; ++i) {
+            FrameReader* conn = static_cast<FrameReader*>(events[i].data.ptr);
+            if (conn) {
+                std::lock_guard<std::mutex> raii(ready_lock);
+                ready.push(conn);
+                ready_cv.notify_one();
+                continue;
+            }
+            // the listening socket, accept everything that is waiting
+            int connFD;
+            while ((connFD = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLONESHOT;
+                event.data.ptr = new FrameReader(connFD);
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connFD, &event);
+            }
+        }
+    }
+}
+
+void Reactor::work() {
+    while (true) {
+        FrameReader* conn;
+        {
+            std::unique_lock<std::mutex> raii(ready_lock);
+            ready_cv.wait(raii, [this] { return !ready.empty(); });
+            conn = ready.front();
+            ready.pop();
+        }
+        serve(conn);
+    }
+}
+
+void Reactor::serve(FrameReader* conn) {
+    Frame body;
+    try {
+        while (true) {
+            ReadStatus status = conn->fill();
+            while (conn->next(body)) {
+                bool keep_open = handler(conn->get_fd(), body);
+                // unless the handler kept the body, the reader may reuse its bytes
+                body.reset();
+                if (!keep_open) {
+                    close_connection(conn);
+                    return;
+                }
+            }
+            if (status == READ_CLOSED) {
+                close_connection(conn);
+                return;
+            }
+            if (status == READ_DRAINED) break;
+        }
+    } catch (const std::exception& e) {
+        guarded_cout("Exception " + std::string(e.what()) + "\n", reactor_cout_lock);
+        close_connection(conn);
+        return;
+    }
+    // nothing more to read for now, wait for the next bytes without holding a buffer
+    conn->shrink();
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = conn;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->get_fd(), &event);
+}
+
+void Reactor::close_connection(FrameReader* conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->get_fd(), nullptr);
+    close(conn->get_fd());
+    delete conn;
+}
@@ -1,5 +1,9 @@
 #include "socket_send.h"
+#include <sys/uio.h>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
 #include <curl/curl.h>
 #include "errno.h"
 
@@ -54,64 +58,189 @@ int get_port_number(int sockfd) {
 	return ntohs(addr.sin_port);
  }
 
-int send_message(const char *hostname, int port, const char *message, const int message_length, int sock) {
-	if (message_length > MAX_MESSAGE_SIZE) {
-		throw std::runtime_error("Message exceeds maximum length: " + std::to_string(message_length));
-		return -1;
+// Connections and resolved addresses of every (hostname, port) this process sent to.
+// A connection is checked out for one message at a time, so concurrent senders to the
+// same host each get their own, and sequential ones reuse it whatever the message type.
+struct PooledHost {
+	struct sockaddr_storage addr;
+	socklen_t addr_len = 0;  // 0 until resolved
+	std::vector<int> idle;
+};
+static std::mutex pool_lock;
+static std::map<std::pair<std::string, int>, PooledHost> pool;
+
+// connects to the first address hostname resolves to that accepts, and returns it in addr
+static int resolve_and_connect(const char *hostname, int port, struct sockaddr_storage &addr, socklen_t &addr_len) {
+	struct addrinfo hints = {}, *addrs;
+	char port_str[16] = {};
+
+	hints.ai_family = AF_INET; 
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	sprintf(port_str, "%d", port);
+
+	if (getaddrinfo(hostname, port_str, &hints, &addrs) != 0) {
+		throw std::runtime_error("Failed to get addr info");
+	}
+	int sock = -1;
+	for (struct addrinfo *ai = addrs; ai != NULL; ai = ai->ai_next) {
+		if (!ai->ai_addr || !ai->ai_addrlen) {
+			continue;
+		}
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock == -1)
+			break;
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+			memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+			addr_len = ai->ai_addrlen;
+			break;
+		}
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(addrs);
+	return sock;
+}
+
+int open_connection(const char *hostname, int port) {
+	const std::pair<std::string, int> key(hostname, port);
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	{
+		std::lock_guard<std::mutex> raii(pool_lock);
+		addr = pool[key].addr;
+		addr_len = pool[key].addr_len;
+	}
+	int sock = -1;
+	if (addr_len) {
+		sock = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+		if (sock != -1 && connect(sock, (struct sockaddr *)&addr, addr_len) != 0) {
+			close(sock);
+			sock = -1;
+		}
+	}
+	if (sock == -1) {
+		// not resolved yet, or the host moved since
+		sock = resolve_and_connect(hostname, port, addr, addr_len);
+		if (sock != -1) {
+			std::lock_guard<std::mutex> raii(pool_lock);
+			pool[key].addr = addr;
+			pool[key].addr_len = addr_len;
+		}
 	}
-	// Connect to remote server
 	if (sock == -1) {
-		struct addrinfo hints = {}, *addrs;
-		char port_str[16] = {};
+		char buffer[ 256 ];
+		char * errorMsg = strerror_r( errno, buffer, 256 ); // GNU-specific version, Linux default
+		printf("Error %s\n", errorMsg); //return value has to be used since buffer might not be modified
+		throw std::runtime_error("Failed to connect\n");
+	}
+	int yesval = 1;
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &yesval, sizeof(yesval));
+	return sock;
+}
 
-		hints.ai_family = AF_INET; 
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_TCP;
-		sprintf(port_str, "%d", port);
+// an idle connection the receiver closed or reset reads as ready, ours never get replies
+static bool still_open(int sock) {
+	char byte;
+	ssize_t rval = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	return rval < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
 
-		if (getaddrinfo(hostname, port_str, &hints, &addrs) != 0) {
-			throw std::runtime_error("Failed to get addr info");
+// a connection to hostname:port no other thread is sending on, and whether it was reused
+static int checkout(const char *hostname, int port, bool &reused) {
+	{
+		std::lock_guard<std::mutex> raii(pool_lock);
+		std::vector<int> &idle = pool[std::make_pair(std::string(hostname), port)].idle;
+		while (!idle.empty()) {
+			int sock = idle.back();
+			idle.pop_back();
+			if (still_open(sock)) {
+				reused = true;
+				return sock;
+			}
+			close(sock);
 		}
+	}
+	reused = false;
+	return open_connection(hostname, port);
+}
 
-		for (struct addrinfo *addr = addrs; addr != NULL; addr = addr->ai_next) {
-			sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-			if (sock == -1)
-				break;
-			
-			if (!addr->ai_addr) {
-				std::cout << "addr ai was null, go to next?" << std::endl;
-				sock = -1;
-				continue;
-			}
-			if (!addr->ai_addrlen) {
-				std::cout << "addr ai len was 0, go to next?" << std::endl;
-				sock = -1;
-				continue;
-			}
-			if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0) {
-				break;
-			}
+static void checkin(const char *hostname, int port, int sock) {
+	std::lock_guard<std::mutex> raii(pool_lock);
+	std::vector<int> &idle = pool[std::make_pair(std::string(hostname), port)].idle;
+	if (idle.size() < CONNECTION_POOL_MAX_IDLE) {
+		idle.push_back(sock);
+	} else {
+		close(sock);
+	}
+}
 
-			close(sock);
-			sock = -1;
+// writes all of iov, picking up where the socket took only part of it
+static void send_all(int sock, struct iovec *iov, int iovcnt) {
+	struct msghdr header = {};
+	header.msg_iov = iov;
+	header.msg_iovlen = iovcnt;
+	while (header.msg_iovlen) {
+		// a peer that went away is an error here, not a SIGPIPE killing the process
+		ssize_t sent = sendmsg(sock, &header, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR) continue;
+			throw std::runtime_error("error sending on stream socket: " + std::string(strerror(errno)));
+		}
+		while (header.msg_iovlen && (size_t)sent >= header.msg_iov->iov_len) {
+			sent -= header.msg_iov->iov_len;
+			++header.msg_iov;
+			--header.msg_iovlen;
 		}
-		freeaddrinfo(addrs);
-		if (sock == -1) {
-			char buffer[ 256 ];
-			char * errorMsg = strerror_r( errno, buffer, 256 ); // GNU-specific version, Linux default
-			printf("Error %s\n", errorMsg); //return value has to be used since buffer might not be modified
-			throw std::runtime_error("Failed to connect\n");
+		if (header.msg_iovlen) {
+			header.msg_iov->iov_base = (char *)header.msg_iov->iov_base + sent;
+			header.msg_iov->iov_len -= sent;
 		}
 	}
-	if (sock == -1 || !message || !message_length) {
+}
+
+static void send_frame(int sock, const std::string &header, const std::string &body) {
+	// Send the length prefix, header and body to remote server in one frame
+	uint32_t prefix = htonl(header.length() + body.length());
+	struct iovec iov[3];
+	iov[0].iov_base = &prefix;
+	iov[0].iov_len = sizeof(prefix);
+	iov[1].iov_base = (void *)header.data();
+	iov[1].iov_len = header.length();
+	iov[2].iov_base = (void *)body.data();
+	iov[2].iov_len = body.length();
+	send_all(sock, iov, 3);
+}
+
+int send_message(const char *hostname, int port, const std::string &header, const std::string &body, int sock) {
+	size_t message_length = header.length() + body.length();
+	if (message_length > MAX_MESSAGE_SIZE) {
+		throw std::runtime_error("Message exceeds maximum length: " + std::to_string(message_length));
+	}
+	if (!message_length) {
 		throw std::runtime_error("Missed something on send.");
 	}
-	// Send message to remote server
-	if (send(sock, message, message_length, 0) == -1) {
-		throw std::runtime_error("Hostname: " + std::string(hostname) + " error sending on stream socket");
+	try {
+		if (sock != -1) {
+			send_frame(sock, header, body);
+			return sock;
+		}
+		bool reused;
+		sock = checkout(hostname, port, reused);
+		try {
+			send_frame(sock, header, body);
+		} catch (const std::exception &e) {
+			close(sock);
+			if (!reused) throw;
+			// closed by the receiver since it was checked in, the whole frame goes on a new one
+			sock = open_connection(hostname, port);
+			send_frame(sock, header, body);
+		}
+		checkin(hostname, port, sock);
+		return -1;
+	} catch (const std::exception &e) {
+		throw std::runtime_error("Hostname: " + std::string(hostname) + " " + e.what());
 	}
-
-	return sock;
 }
 
 size_t writefunc(void *ptr, size_t size, size_t nmemb, std::string *s) 
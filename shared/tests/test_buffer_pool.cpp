@@ -0,0 +1,109 @@
+#include "buffer_pool.h"
+
+#include <string.h>
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_reader.h"
+#include "socket_send.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+// sizes round up to a class, at most twice what was asked for, up to the largest frame
+static void test_size_classes() {
+    BufferPool& pool = BufferPool::get_instance();
+    const size_t max_size = MAX_MESSAGE_SIZE + FRAME_PREFIX_SIZE;
+    for (size_t asked : {(size_t)1, (size_t)BUFFER_POOL_MIN_SIZE, (size_t)BUFFER_POOL_MIN_SIZE + 1, (size_t)1 << 21,
+                         ((size_t)1 << 21) + 100, (size_t)MAX_MESSAGE_SIZE, max_size}) {
+        size_t size = asked;
+        char* buffer = pool.acquire(size);
+        check(size >= asked && (size <= 2 * asked || size == BUFFER_POOL_MIN_SIZE) && size <= max_size,
+              "class of " + to_string(asked) + " is " + to_string(size));
+        // all of it is usable
+        memset(buffer, 1, size);
+        pool.release(buffer, size);
+    }
+    size_t size = max_size + 1;
+    bool threw = false;
+    try {
+        pool.acquire(size);
+    } catch (std::runtime_error&) {
+        threw = true;
+    }
+    check(threw, "buffer larger than the largest frame");
+}
+
+// a released buffer is handed out again as is, and only for its own class
+static void test_reuse() {
+    BufferPool& pool = BufferPool::get_instance();
+    size_t size = 3 * BUFFER_POOL_MIN_SIZE;
+    char* buffer = pool.acquire(size);
+    memcpy(buffer, "kept", 4);
+    pool.release(buffer, size);
+
+    size_t smaller = BUFFER_POOL_MIN_SIZE;
+    char* other = pool.acquire(smaller);
+    check(other != buffer, "buffer handed out for a smaller class");
+    size_t same = 2 * BUFFER_POOL_MIN_SIZE + 1;
+    char* again = pool.acquire(same);
+    check(again == buffer && same == size, "released buffer reused for its class");
+    check(memcmp(again, "kept", 4) == 0, "reused buffer left as it was");
+    pool.release(other, smaller);
+    pool.release(again, same);
+}
+
+// every buffer has one holder at a time, however many threads share the pool
+static void test_threads() {
+    vector<thread> threads;
+    vector<int> corrupted(8, 0);
+    for (int id = 0; id < 8; ++id) {
+        threads.emplace_back([id, &corrupted] {
+            BufferPool& pool = BufferPool::get_instance();
+            for (int round = 0; round < 20000; ++round) {
+                size_t size = (size_t)BUFFER_POOL_MIN_SIZE << ((id + round) % 3);
+                char* buffer = pool.acquire(size);
+                memset(buffer, id, 64);
+                memset(buffer + size - 64, id, 64);
+                this_thread::yield();
+                for (size_t i = 0; i < 64; ++i) {
+                    if (buffer[i] != id || buffer[size - 64 + i] != id) {
+                        corrupted[id]++;
+                        break;
+                    }
+                }
+                pool.release(buffer, size);
+            }
+        });
+    }
+    for (thread& worker : threads) {
+        worker.join();
+    }
+    for (int id = 0; id < 8; ++id) {
+        check(!corrupted[id], "thread " + to_string(id) + " shared a buffer " + to_string(corrupted[id]) + " times");
+    }
+}
+
+int main() {
+    test_size_classes();
+    test_reuse();
+    test_threads();
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "test_buffer_pool passed" << endl;
+    return 0;
+}
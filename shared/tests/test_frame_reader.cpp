@@ -0,0 +1,186 @@
+#include "frame_reader.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "socket_send.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+// a body of length B that tells which frame it is and where each of its bytes belongs
+static string make_body(uint32_t seq, size_t length) {
+    string body(length, '\0');
+    for (size_t i = 0; i < length; ++i) {
+        body[i] = (char)(seq * 131 + i);
+    }
+    if (length >= sizeof(seq)) {
+        memcpy(&body[0], &seq, sizeof(seq));
+    }
+    return body;
+}
+
+static string make_frame(uint32_t seq, size_t length) {
+    uint32_t prefix = htonl(length);
+    return string((const char*)&prefix, FRAME_PREFIX_SIZE) + make_body(seq, length);
+}
+
+static bool same_body(const Frame& frame, uint32_t seq, size_t length) {
+    return frame.size() == length && frame.str() == make_body(seq, length);
+}
+
+static void write_all(int fd, const string& bytes, size_t chunk) {
+    for (size_t sent = 0; sent < bytes.length();) {
+        ssize_t rval = send(fd, bytes.data() + sent, min(chunk, bytes.length() - sent), MSG_NOSIGNAL);
+        if (rval <= 0) return;
+        sent += rval;
+    }
+}
+
+static void socket_pair(int fds[2]) {
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+}
+
+// reads frames of lengths as the reactor does, keeps every keep_every-th of them until the
+// end, so later reads must leave their buffers alone, and checks every body
+static void read_frames(int fd, const vector<size_t>& lengths, size_t keep_every, const string& what) {
+    FrameReader reader(fd);
+    vector<Frame> kept;
+    Frame frame;
+    size_t seq = 0;
+    try {
+        while (seq < lengths.size()) {
+            ReadStatus status = reader.fill();
+            while (seq < lengths.size() && reader.next(frame)) {
+                check(same_body(frame, seq, lengths[seq]), what + ": frame " + to_string(seq));
+                if (seq % keep_every == 0) {
+                    kept.push_back(frame);
+                }
+                frame.reset();
+                seq++;
+            }
+            if (status == READ_CLOSED) break;
+            if (status == READ_DRAINED && seq < lengths.size()) {
+                struct pollfd ready = {fd, POLLIN, 0};
+                poll(&ready, 1, -1);
+            }
+        }
+    } catch (const std::exception& e) {
+        check(false, what + ": " + e.what());
+    }
+    check(seq == lengths.size(), what + ": " + to_string(seq) + " of " + to_string(lengths.size()) + " frames read");
+    for (size_t i = 0; i < kept.size(); ++i) {
+        check(same_body(kept[i], i * keep_every, lengths[i * keep_every]), what + ": kept frame " + to_string(i * keep_every));
+    }
+}
+
+static void stream_frames(const vector<size_t>& lengths, size_t chunk, size_t keep_every, const string& what) {
+    int fds[2];
+    socket_pair(fds);
+    string bytes;
+    for (size_t seq = 0; seq < lengths.size(); ++seq) {
+        bytes += make_frame(seq, lengths[seq]);
+    }
+    thread writer(write_all, fds[1], cref(bytes), chunk);
+    read_frames(fds[0], lengths, keep_every, what);
+    // a reader that gave up fails the writer's sends
+    close(fds[0]);
+    writer.join();
+    close(fds[1]);
+}
+
+// a frame is only handed out once all of it was read, however it trickles in
+static void test_partial_frames() {
+    int fds[2];
+    socket_pair(fds);
+    FrameReader reader(fds[0]);
+    Frame frame;
+    string bytes = make_frame(0, 5) + make_frame(1, 0);
+    for (size_t i = 0; i + 1 < FRAME_PREFIX_SIZE + 5; ++i) {
+        write_all(fds[1], bytes.substr(i, 1), 1);
+        reader.fill();
+        check(!reader.next(frame), "frame handed out after " + to_string(i + 1) + " bytes");
+    }
+    write_all(fds[1], bytes.substr(FRAME_PREFIX_SIZE + 4), 1);
+    check(reader.fill() == READ_DRAINED, "short read drains the socket");
+    check(reader.next(frame) && same_body(frame, 0, 5), "frame read byte by byte");
+    check(reader.next(frame) && frame.size() == 0, "empty frame");
+    check(!reader.next(frame), "nothing past the last frame");
+
+    // a frame longer than the first buffer, in pieces across its growth
+    size_t length = 3 * FRAME_READ_SIZE + 17;
+    bytes = make_frame(2, length);
+    for (size_t sent = 0; sent < bytes.length(); sent += 50001) {
+        write_all(fds[1], bytes.substr(sent, 50001), bytes.length());
+        reader.fill();
+        check(reader.next(frame) == (sent + 50001 >= bytes.length()), "long frame at " + to_string(sent));
+    }
+    check(same_body(frame, 2, length), "long frame");
+
+    uint32_t oversized = htonl(MAX_MESSAGE_SIZE + 1);
+    write_all(fds[1], string((const char*)&oversized, FRAME_PREFIX_SIZE), FRAME_PREFIX_SIZE);
+    reader.fill();
+    bool threw = false;
+    try {
+        reader.next(frame);
+    } catch (std::runtime_error&) {
+        threw = true;
+    }
+    check(threw, "frame longer than MAX_MESSAGE_SIZE");
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// more than a buffer of small frames at once spills into the spare
+static void test_spill() {
+    vector<size_t> lengths;
+    for (size_t seq = 0; seq < 2000; ++seq) {
+        lengths.push_back(seq * 7919 % 9000);
+    }
+    stream_frames(lengths, 1 << 20, 1000000, "small frames");
+    // frames kept by the handler pin the buffer they are in, the partial frame moves out of it
+    stream_frames(lengths, 1 << 20, 3, "small frames kept");
+    stream_frames(lengths, 4099, 5, "small frames kept, written in pieces");
+}
+
+// back to back frames of 2 MB and more: whatever spills past one is never read into a buffer
+// larger than the largest frame
+static void test_large_frames() {
+    const size_t two_mb = 1 << 21;
+    vector<size_t> lengths = {two_mb, two_mb + 100, two_mb + 100, MAX_MESSAGE_SIZE, 10, two_mb + 100,
+                              MAX_MESSAGE_SIZE, MAX_MESSAGE_SIZE, two_mb, 3 * FRAME_READ_SIZE};
+    stream_frames(lengths, 1 << 20, 1000000, "large frames");
+    stream_frames(lengths, 1 << 20, 2, "large frames kept");
+    stream_frames(lengths, 65539, 3, "large frames kept, written in pieces");
+}
+
+int main() {
+    test_partial_frames();
+    test_spill();
+    test_large_frames();
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "test_frame_reader passed" << endl;
+    return 0;
+}